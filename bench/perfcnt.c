@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * perfcnt.c: hardware performance counters via perf_event_open(2)
+ *
+ * Each event is opened as its own counter rather than as a group
+ * so that a missing event (e.g. no dTLB event in a VM) does not
+ * take the others down with it.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include "perfcnt.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+const char* perfCntName[PERFCNT_MAX] = {
+    "instructions", "cacheMisses", "dtlbMisses", "branchMisses",
+};
+
+#ifdef __linux__
+
+static int
+openEvent (u32 type, u64 config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = type;
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                          PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int
+perfCntOpen (perfCnt* p)
+{
+    int i;
+    int n = 0;
+
+    assert(p);
+
+    memset(p, 0, sizeof(*p));
+    p->fd[PERFCNT_INSTRUCTIONS] =
+        openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    p->fd[PERFCNT_CACHE_MISSES] =
+        openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    p->fd[PERFCNT_DTLB_MISSES] =
+        openEvent(PERF_TYPE_HW_CACHE,
+                  PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    p->fd[PERFCNT_BRANCH_MISSES] =
+        openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+    for (i = 0; i < PERFCNT_MAX; ++i) {
+        if (p->fd[i] >= 0) {
+            ++n;
+        } else {
+            p->fd[i] = -1;
+        }
+    }
+    return n;
+}
+
+void
+perfCntClose (perfCnt* p)
+{
+    int i;
+
+    assert(p);
+
+    for (i = 0; i < PERFCNT_MAX; ++i) {
+        if (p->fd[i] >= 0) {
+            close(p->fd[i]);
+            p->fd[i] = -1;
+        }
+    }
+}
+
+void
+perfCntStart (perfCnt* p)
+{
+    int i;
+
+    for (i = 0; i < PERFCNT_MAX; ++i) {
+        if (p->fd[i] >= 0) {
+            ioctl(p->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(p->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void
+perfCntStop (perfCnt* p)
+{
+    u64 buf[3];                 /* value, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERFCNT_MAX; ++i) {
+        if (p->fd[i] >= 0) {
+            ioctl(p->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (i = 0; i < PERFCNT_MAX; ++i) {
+        p->val[i] = 0;
+        if ((p->fd[i] < 0) ||
+            (read(p->fd[i], buf, sizeof(buf)) != sizeof(buf))) {
+            continue;
+        }
+        if ((buf[2] != 0) && (buf[2] < buf[1])) {
+            buf[0] = (u64)((double)buf[0] * buf[1] / buf[2]);
+        }
+        p->val[i] = buf[0];
+    }
+}
+
+#else /* !__linux__ */
+
+int
+perfCntOpen (perfCnt* p)
+{
+    int i;
+
+    memset(p, 0, sizeof(*p));
+    for (i = 0; i < PERFCNT_MAX; ++i) {
+        p->fd[i] = -1;
+    }
+    return 0;
+}
+
+void
+perfCntClose (perfCnt* p)
+{
+}
+
+void
+perfCntStart (perfCnt* p)
+{
+}
+
+void
+perfCntStop (perfCnt* p)
+{
+    memset(p->val, 0, sizeof(p->val));
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,91 @@
+#ifndef __PERFCNT_H__
+#define __PERFCNT_H__
+
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * perfcnt.h: hardware performance counters for the benchmarks
+ */
+
+#include "local_types.h"
+
+/*
+ * Counted events. A counter that cannot be opened (no PMU, not
+ * permitted by perf_event_paranoid, no such event on the CPU,
+ * or not Linux) stays unavailable and the others keep working.
+ */
+enum {
+    PERFCNT_INSTRUCTIONS  = 0,
+    PERFCNT_CACHE_MISSES  = 1,  /* last level cache */
+    PERFCNT_DTLB_MISSES   = 2,  /* data TLB load misses */
+    PERFCNT_BRANCH_MISSES = 3,
+    PERFCNT_MAX           = 4,
+};
+
+typedef struct perfCnt_ {
+    int fd[PERFCNT_MAX];        /* -1: unavailable */
+    u64 val[PERFCNT_MAX];       /* last measurement (scaled) */
+} perfCnt;
+
+/*
+ * Function prototypes
+ */
+int  perfCntOpen (perfCnt* p);
+void perfCntClose (perfCnt* p);
+void perfCntStart (perfCnt* p);
+void perfCntStop (perfCnt* p);
+
+static inline bool
+perfCntValid (perfCnt* p, int i)
+{
+    return (p->fd[i] >= 0);
+}
+
+extern const char* perfCntName[PERFCNT_MAX];
+
+/*
+ * int perfCntOpen (perfCnt* p);
+ *
+ *  Open the counters of the calling thread (user space only).
+ *
+ *  Return value:
+ *    Number of counters available (0 - PERFCNT_MAX)
+ *
+ *
+ * void perfCntClose (perfCnt* p);
+ *
+ *  Close the counters.
+ *
+ *
+ * void perfCntStart (perfCnt* p);
+ * void perfCntStop (perfCnt* p);
+ *
+ *  Reset and enable the counters / disable them and read the counts
+ *  into p->val[]. The counts are scaled by time enabled / time
+ *  running if the kernel multiplexed the counters. p->val[i] is 0
+ *  if counter i is unavailable.
+ */
+
+#endif /* __PERFCNT_H__ */
@@ -0,0 +1,624 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-bench.c: make a command to measure tBitMap and mtrie3l
+ *
+ * For each geometry (bit length of the max bit position, i.e. a row
+ * of Strides[] in tbitmap.c; tBitMapKeepTrie() keeps the trie from
+ * being flattened, so "tbitmap" rows always measure the trie), density
+ * of set bits and access pattern, the command measures
+ * tBitMapIsSet(), tBitMapSet(), tBitMapReset(), tBitMapSetBlock(),
+ * tBitMapResetBlock(), mtrie3lInsert(), mtrie3lFind(),
+ * mtrie3lFindMany() and mtrie3lFindNext(), and the same bit
+ * operations of a flat bit vector and a hash set as baselines. The results are
+ * written to stdout as a JSON array of objects:
+ *
+ *  {"op": "IsSet", "impl": "tbitmap", "bits": 20, "strides": [6,5,4],
+ *   "density": 0.01, "pattern": "random", "elements": 10485,
+ *   "ops": 1048576, "nsPerOp": 12.3, "bytesPerElement": 4.5,
+ *   "llcRatio": 0.02, "instructionsPerOp": 35.2,
+ *   "cacheMissesPerOp": 0.41, "dtlbMissesPerOp": 0.12,
+ *   "branchMissesPerOp": 0.03}
+ *
+ * elements is the number of bits set (entries inserted), and
+ * llcRatio is the size of the data structure divided by the size
+ * of the last level cache. The hardware counters (see perfcnt.c)
+ * are null if they are not available, e.g. perf_event_paranoid
+ * is too high or the command runs in a VM without a virtual PMU.
+ *
+ * Usage: tbitmap-bench [-b min-max] [-n ops] [-p] [-q]
+ *   -b: bit lengths to measure (default: 12, 16, 20 and 24)
+ *   -n: number of lookups per measurement (default: 2^20)
+ *   -p: do not use the hardware counters
+ *   -q: quick run (2 densities, bit lengths 16 and 20)
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tbitmap.h"
+#include "tbitmap-private.h"
+#include "perfcnt.h"
+
+enum {
+    PAT_SEQ     = 0,            /* ascending, evenly spaced */
+    PAT_RANDOM  = 1,            /* uniformly random */
+    PAT_CLUSTER = 2,            /* random runs of CLUSTER_LEN bits */
+    PAT_MAX     = 3,
+    CLUSTER_LEN = 64,
+    BLOCK_LEN   = 256,          /* bits per SetBlock()/ResetBlock() */
+    MAX_BLOCKS  = 1 << 16,      /* max # of blocks per measurement */
+    MIN_BITS    = 12,
+    MAX_BITS    = 29,
+};
+
+static const char* PatName[PAT_MAX] = { "seq", "random", "clustered" };
+static const double Density[] = { 1e-6, 1e-4, 1e-2, 0.1, 0.5, 0.9 };
+static const double QuickDensity[] = { 1e-4, 0.1 };
+
+typedef struct benchCfg_ {
+    u32    bits;                /* max bit position: 2^bits - 1 */
+    u8     len[3];              /* stride lengths */
+    double density;
+    u32    pattern;
+    u32    nElm;                /* # of positions */
+    u32*   pos;                 /* positions in the order of access */
+    u32*   probe;               /* positions to look up */
+    u32    nProbe;
+    u64    llc;                 /* bytes of the last level cache */
+} benchCfg;
+
+static bool    First = TRUE;
+static u64     Seed  = 0x9e3779b97f4a7c15ULL;
+static perfCnt Pc;              /* hardware counters */
+static u64     T0;              /* start of the measurement */
+
+
+static inline u32
+rnd (void)
+{
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 7;
+    Seed ^= Seed << 17;
+    return (u32)(Seed >> 16);
+}
+
+static inline u64
+nsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static inline void
+sampleStart (void)
+{
+    perfCntStart(&Pc);
+    T0 = nsec();
+}
+
+/*
+ * Return the elapsed time in ns. The counts are in Pc.val[].
+ */
+static inline u64
+sampleStop (void)
+{
+    u64 t = nsec() - T0;
+
+    perfCntStop(&Pc);
+    return t;
+}
+
+/*
+ * Bytes of the last level cache; 0 if unknown
+ */
+static u64
+llcSize (void)
+{
+    FILE* fp;
+    long  n = 0;
+    char  unit = 0;
+    char  path[64];
+    int   i;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    n = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (n > 0) {
+        return n;
+    }
+#endif
+    for (i = 3; i > 0; --i) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        fp = fopen(path, "r");
+        if (fp) {
+            n = 0;
+            if (fscanf(fp, "%ld%c", &n, &unit) < 1) {
+                n = 0;
+            }
+            fclose(fp);
+            if (n > 0) {
+                return (unit == 'M') ? (u64)n << 20 :
+                       (unit == 'K') ? (u64)n << 10 : (u64)n;
+            }
+        }
+    }
+    return 0;
+}
+
+static void
+report (benchCfg* c, const char* op, const char* impl, u64 ops, u64 ns,
+        u64 nBytes)
+{
+    int i;
+
+    printf("%s\n  {\"op\": \"%s\", \"impl\": \"%s\", \"bits\": %u, "
+           "\"strides\": [%u,%u,%u], \"density\": %g, \"pattern\": \"%s\", "
+           "\"elements\": %u, \"ops\": %llu, \"nsPerOp\": %.2f, "
+           "\"bytesPerElement\": %.3f, \"llcRatio\": %.4f",
+           (First) ? "" : ",", op, impl, c->bits,
+           c->len[0], c->len[1], c->len[2], c->density, PatName[c->pattern],
+           c->nElm, (unsigned long long)ops,
+           (ops) ? (double)ns / ops : 0.0,
+           (c->nElm) ? (double)nBytes / c->nElm : 0.0,
+           (c->llc) ? (double)nBytes / c->llc : 0.0);
+    for (i = 0; i < PERFCNT_MAX; ++i) {
+        if (!perfCntValid(&Pc, i)) {
+            printf(", \"%sPerOp\": null", perfCntName[i]);
+        } else {
+            printf(", \"%sPerOp\": %.3f", perfCntName[i],
+                   (ops) ? (double)Pc.val[i] / ops : 0.0);
+        }
+    }
+    printf("}");
+    First = FALSE;
+    fflush(stdout);
+}
+
+/*
+ * Generate the positions to set and the positions to look up
+ * (half of them set, in the access order of the pattern).
+ */
+static void
+genPositions (benchCfg* c)
+{
+    u32    i, j;
+    u32    maxPos = (1U << c->bits) - 1;
+    u32    n = c->nElm;
+    double step;
+
+    switch (c->pattern) {
+    case PAT_SEQ:
+        step = (double)(maxPos + 1) / n;
+        for (i = 0; i < n; ++i) {
+            c->pos[i] = (u32)(i * step);
+        }
+        break;
+    case PAT_RANDOM:
+        for (i = 0; i < n; ++i) {
+            c->pos[i] = rnd() & maxPos;
+        }
+        break;
+    default:
+        for (i = 0; i < n; i += CLUSTER_LEN) {
+            u32 base = rnd() & maxPos & ~(CLUSTER_LEN - 1);
+
+            for (j = 0; (j < CLUSTER_LEN) && (i + j < n); ++j) {
+                c->pos[i + j] = base + j;
+            }
+        }
+        break;
+    }
+    for (i = 0; i < c->nProbe; ++i) {
+        c->probe[i] = (i & 1) ? (rnd() & maxPos) : c->pos[i % n];
+    }
+    if (c->pattern == PAT_SEQ) {
+        for (i = 0; i < c->nProbe; ++i) {
+            c->probe[i] = (u32)(((u64)i * (maxPos + 1)) / c->nProbe);
+        }
+    }
+}
+
+static void
+benchTbitmap (benchCfg* c)
+{
+    tBitMap*     p;
+    tBitMapUsage u;
+    u32          i, n, end;
+    u32          hits = 0;
+    u64          t;
+
+    p = tBitMapAllocStrides(c->len[0], c->len[1], c->len[2]);
+    assert(p);
+    tBitMapKeepTrie(p, TRUE);
+
+    sampleStart();
+    for (i = 0; i < c->nElm; ++i) {
+        tBitMapSet(p, c->pos[i]);
+    }
+    t = sampleStop();
+    tBitMapStats(p, &u);
+    report(c, "Set", "tbitmap", c->nElm, t, u.nBytes);
+
+    sampleStart();
+    for (i = 0; i < c->nProbe; ++i) {
+        hits += tBitMapIsSet(p, c->probe[i]);
+    }
+    t = sampleStop();
+    report(c, "IsSet", "tbitmap", c->nProbe, t, u.nBytes);
+
+    sampleStart();
+    for (i = 0; i < c->nElm; ++i) {
+        tBitMapReset(p, c->pos[i]);
+    }
+    t = sampleStop();
+    report(c, "Reset", "tbitmap", c->nElm, t, u.nBytes);
+
+    n = (c->nElm < MAX_BLOCKS) ? c->nElm : MAX_BLOCKS;
+    sampleStart();
+    for (i = 0; i < n; ++i) {
+        end = c->pos[i] + BLOCK_LEN - 1;
+        tBitMapSetBlock(p, c->pos[i], (end > p->maxPos) ? p->maxPos : end);
+    }
+    t = sampleStop();
+    tBitMapStats(p, &u);
+    report(c, "SetBlock", "tbitmap", n, t, u.nBytes);
+
+    sampleStart();
+    for (i = 0; i < n; ++i) {
+        end = c->pos[i] + BLOCK_LEN - 1;
+        tBitMapResetBlock(p, c->pos[i], (end > p->maxPos) ? p->maxPos : end);
+    }
+    t = sampleStop();
+    report(c, "ResetBlock", "tbitmap", n, t, u.nBytes);
+
+    assert((p->flags & TBITMAP_IS_FLAT) == 0);
+    tBitMapFree(p);
+    if (hits == ~0U) {
+        printf(" ");            /* keep the lookups */
+    }
+}
+
+static void
+benchFlat (benchCfg* c)
+{
+    u32* pw;
+    u32  i;
+    u32  hits = 0;
+    u64  t;
+    u64  nBytes = ((u64)1 << c->bits) >> 3;
+
+    pw = calloc(1, nBytes);
+    assert(pw);
+
+    sampleStart();
+    for (i = 0; i < c->nElm; ++i) {
+        pw[c->pos[i] >> 5] |= 1U << (c->pos[i] & 31);
+    }
+    t = sampleStop();
+    report(c, "Set", "flat", c->nElm, t, nBytes);
+
+    sampleStart();
+    for (i = 0; i < c->nProbe; ++i) {
+        hits += (pw[c->probe[i] >> 5] >> (c->probe[i] & 31)) & 1;
+    }
+    t = sampleStop();
+    report(c, "IsSet", "flat", c->nProbe, t, nBytes);
+
+    sampleStart();
+    for (i = 0; i < c->nElm; ++i) {
+        pw[c->pos[i] >> 5] &= ~(1U << (c->pos[i] & 31));
+    }
+    t = sampleStop();
+    report(c, "Reset", "flat", c->nElm, t, nBytes);
+
+    free(pw);
+    if (hits == ~0U) {
+        printf(" ");
+    }
+}
+
+/*
+ * Open addressing hash set of bit positions with linear probing.
+ * Slots hold position + 1; 0 is empty.
+ */
+static inline u32
+hashSlot (u32 pos, u32 mask)
+{
+    return (pos * 0x9e3779b1U) & mask;
+}
+
+static void
+hashInsert (u32* tbl, u32 mask, u32 pos)
+{
+    u32 i;
+
+    for (i = hashSlot(pos, mask); tbl[i]; i = (i + 1) & mask) {
+        if (tbl[i] == pos + 1) {
+            return;
+        }
+    }
+    tbl[i] = pos + 1;
+}
+
+static bool
+hashFind (u32* tbl, u32 mask, u32 pos)
+{
+    u32 i;
+
+    for (i = hashSlot(pos, mask); tbl[i]; i = (i + 1) & mask) {
+        if (tbl[i] == pos + 1) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void
+hashErase (u32* tbl, u32 mask, u32 pos)
+{
+    u32 i, j, k;
+
+    for (i = hashSlot(pos, mask); tbl[i] != pos + 1; i = (i + 1) & mask) {
+        if (tbl[i] == 0) {
+            return;
+        }
+    }
+    /*
+     * Backward shift deletion
+     */
+    for (j = i; ; ) {
+        tbl[i] = 0;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (tbl[j] == 0) {
+                return;
+            }
+            k = hashSlot(tbl[j] - 1, mask);
+            if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) {
+                continue;
+            }
+            break;
+        }
+        tbl[i] = tbl[j];
+        i = j;
+    }
+}
+
+static void
+benchHash (benchCfg* c)
+{
+    u32* tbl;
+    u32  mask;
+    u32  i;
+    u32  hits = 0;
+    u64  t;
+    u64  nBytes;
+
+    for (mask = 15; mask < 2 * c->nElm; mask = (mask << 1) | 1) {
+        ;
+    }
+    nBytes = ((u64)mask + 1) * sizeof(u32);
+    tbl = calloc(1, nBytes);
+    assert(tbl);
+
+    sampleStart();
+    for (i = 0; i < c->nElm; ++i) {
+        hashInsert(tbl, mask, c->pos[i]);
+    }
+    t = sampleStop();
+    report(c, "Set", "hash", c->nElm, t, nBytes);
+
+    sampleStart();
+    for (i = 0; i < c->nProbe; ++i) {
+        hits += hashFind(tbl, mask, c->probe[i]);
+    }
+    t = sampleStop();
+    report(c, "IsSet", "hash", c->nProbe, t, nBytes);
+
+    sampleStart();
+    for (i = 0; i < c->nElm; ++i) {
+        hashErase(tbl, mask, c->pos[i]);
+    }
+    t = sampleStop();
+    report(c, "Reset", "hash", c->nElm, t, nBytes);
+
+    free(tbl);
+    if (hits == ~0U) {
+        printf(" ");
+    }
+}
+
+/*
+ * mtrie3l with the strides of the bitmap: index = bit position / 32
+ */
+static void
+benchMtrie3l (benchCfg* c)
+{
+    mtrie3l* p;
+    u32      i, j, n;
+    u32      idx;
+    u32      key[256];
+    void*    out[256];
+    u32      nEnt;
+    u32      hits = 0;
+    u64      t;
+    u64      nBytes;
+
+    p = mtrie3lAlloc(c->len[0], c->len[1], c->len[2]);
+    assert(p);
+
+    sampleStart();
+    for (i = 0; i < c->nElm; ++i) {
+        mtrie3lInsert(p, c->pos[i] >> 5,
+                      (void*)(uintptr_t)((c->pos[i] >> 5) + 1));
+    }
+    t = sampleStop();
+    nBytes = mtrie3lNbytesL0(p) + mtrie3lNbytesL1(p) + mtrie3lNbytesL2(p);
+    nEnt   = mtrie3lNumEntries(p);
+    report(c, "Insert", "mtrie3l", c->nElm, t, nBytes);
+
+    sampleStart();
+    for (i = 0; i < c->nProbe; ++i) {
+        hits += (mtrie3lFind(p, c->probe[i] >> 5) != NULL);
+    }
+    t = sampleStop();
+    report(c, "Find", "mtrie3l", c->nProbe, t, nBytes);
+
+    sampleStart();
+    for (i = 0; i < c->nProbe; i += elementsOf(out)) {
+        n = (c->nProbe - i < elementsOf(out)) ?
+            c->nProbe - i : elementsOf(out);
+        for (j = 0; j < n; ++j) {
+            key[j] = c->probe[i + j] >> 5;
+        }
+        hits += mtrie3lFindMany(p, key, out, n);
+    }
+    t = sampleStop();
+    report(c, "FindMany", "mtrie3l", c->nProbe, t, nBytes);
+
+    sampleStart();
+    for (i = 0, idx = 0; mtrie3lFindNext(p, &idx); ++idx) {
+        ++i;
+        if (idx == mtrie3lGetMaxIndex(p)) {
+            break;
+        }
+    }
+    t = sampleStop();
+    assert(i == nEnt);
+    report(c, "FindNext", "mtrie3l", nEnt, t, nBytes);
+
+    mtrie3lDeleteAll(p, NULL);
+    mtrie3lFree(p);
+    if (hits == ~0U) {
+        printf(" ");
+    }
+}
+
+int
+main (int argc, char* argv[])
+{
+    benchCfg      c;
+    u32           bits, minBits = 0, maxBits = 0;
+    u32           nProbe = 1 << 20;
+    u32           d, nDensity = elementsOf(Density);
+    const double* pDensity = Density;
+    bool          quick = FALSE;
+    bool          usePc = TRUE;
+    int           opt;
+
+    while ((opt = getopt(argc, argv, "b:n:pq")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (sscanf(optarg, "%u-%u", &minBits, &maxBits) == 1) {
+                maxBits = minBits;
+            }
+            break;
+        case 'n':
+            nProbe = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            usePc = FALSE;
+            break;
+        case 'q':
+            quick = TRUE;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b min-max] [-n ops] [-p] [-q]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if ((minBits && (minBits < MIN_BITS)) || (maxBits > MAX_BITS) ||
+        (minBits > maxBits) || (nProbe == 0)) {
+        fprintf(stderr, "%s: bad argument\n", argv[0]);
+        return 1;
+    }
+    if (quick) {
+        pDensity = QuickDensity;
+        nDensity = elementsOf(QuickDensity);
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.llc    = llcSize();
+    if (usePc) {
+        if (perfCntOpen(&Pc) < PERFCNT_MAX) {
+            fprintf(stderr, "%s: some hardware counters are not "
+                    "available\n", argv[0]);
+        }
+    } else {
+        perfCntOpen(&Pc);
+        perfCntClose(&Pc);      /* all unavailable */
+    }
+    c.nProbe = nProbe;
+    c.probe  = malloc(nProbe * sizeof(u32));
+    assert(c.probe);
+
+    printf("[");
+    for (bits = MIN_BITS; bits <= MAX_BITS; ++bits) {
+        if (minBits) {
+            if ((bits < minBits) || (bits > maxBits)) {
+                continue;
+            }
+        } else if (quick) {
+            if ((bits != 16) && (bits != 20)) {
+                continue;
+            }
+        } else if ((bits % 4) != 0) {
+            continue;           /* 12, 16, 20 and 24 */
+        } else if (bits > 24) {
+            continue;
+        }
+        tBitMapStrideLens((1U << bits) - 1, c.len);
+        c.bits = bits;
+        for (d = 0; d < nDensity; ++d) {
+            c.density = pDensity[d];
+            c.nElm = (u32)(c.density * (1U << bits));
+            if (c.nElm == 0) {
+                continue;       /* too sparse for this size */
+            }
+            c.pos = malloc(c.nElm * sizeof(u32));
+            assert(c.pos);
+            for (c.pattern = 0; c.pattern < PAT_MAX; ++c.pattern) {
+                genPositions(&c);
+                benchTbitmap(&c);
+                benchFlat(&c);
+                benchHash(&c);
+                benchMtrie3l(&c);
+            }
+            free(c.pos);
+        }
+    }
+    printf("\n]\n");
+    perfCntClose(&Pc);
+    free(c.probe);
+
+    return 0;
+}
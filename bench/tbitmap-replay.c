@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-replay.c: replay a trace of tBitMap API calls
+ *
+ * Re-executes a trace recorded with tBitMapTraceStart() (a library
+ * built with -DTBITMAP_TRACE) as fast as possible against this build
+ * and writes the throughput and the latency percentiles of each
+ * operation to stdout as JSON:
+ *
+ *  {"trace": "x.trc", "ops": 1000000, "bitmaps": 2,
+ *   "recordedSeconds": 12.5, "seconds": 0.08, "opsPerSec": 12500000,
+ *   "mismatches": 0,
+ *   "latency": [{"op": "IsSet", "count": 800000, "p50": 15, "p90": 21,
+ *                "p99": 40, "p999": 95, "max": 2100}, ...]}
+ *
+ * ops counts the calls replayed (all the records but
+ * TBITMAP_TRACE_NEW) and seconds is the sum of their latencies,
+ * which are in ns and include the overhead of clock_gettime().
+ * mismatches counts the calls whose result (the bit for IsSet,
+ * success for the others) differs from the recorded one, which is
+ * expected if the traced bitmaps were not empty when the trace
+ * started.
+ *
+ * Usage: tbitmap-replay [-g sl0,sl1,sl2] [-c] [-s nStripes] [-n loops] trace
+ *   -g: allocate all the bitmaps with these stride lengths
+ *       (default: tBitMapAlloc() of the recorded max bit position)
+ *   -c: allocate concurrent bitmaps
+ *   -s: allocate striped bitmaps
+ *   -n: replay the trace `loops' times (default: 1)
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tbitmap.h"
+
+enum {
+    MODE_DEFAULT    = 0,
+    MODE_STRIDES    = 1,
+    MODE_CONCURRENT = 2,
+    MODE_STRIPED    = 3,
+};
+
+static const char* OpName[TBITMAP_TRACE_OP_MAX] = {
+    "New", "Free", "IsSet", "Set", "Reset", "SetBlock", "ResetBlock",
+    "SetAll", "ResetAll",
+};
+
+typedef struct replayCfg_ {
+    u32 mode;
+    u8  len[3];                 /* MODE_STRIDES */
+    u32 nStripes;               /* MODE_STRIPED */
+} replayCfg;
+
+typedef struct latency_ {
+    u32* ns;
+    u64  n;
+    u64  size;
+} latency;
+
+
+static inline u64
+nsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void*
+readFile (const char* path, u64* pSize)
+{
+    FILE* fp;
+    u8*   buf = NULL;
+    u64   size = 0;
+    u64   len = 0;
+    size_t n;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    do {
+        if (len == size) {
+            size = (size) ? 2 * size : 1 << 20;
+            buf  = realloc(buf, size);
+            assert(buf);
+        }
+        n = fread(buf + len, 1, size - len, fp);
+        len += n;
+    } while (n > 0);
+    fclose(fp);
+    *pSize = len;
+    return buf;
+}
+
+static tBitMap*
+allocMap (replayCfg* cfg, tBitMapTraceRec* r)
+{
+    switch (cfg->mode) {
+    case MODE_STRIDES:
+        return tBitMapAllocStrides(cfg->len[0], cfg->len[1], cfg->len[2]);
+    case MODE_CONCURRENT:
+        return tBitMapAllocConcurrent(r->a);
+    case MODE_STRIPED:
+        return tBitMapAllocStriped(r->a, cfg->nStripes);
+    default:
+        return tBitMapAlloc(r->a);
+    }
+}
+
+/*
+ * Execute one record. Return TRUE if the result is the recorded one.
+ */
+static bool
+execute (tBitMap* p, tBitMapTraceRec* r)
+{
+    int rt;
+
+    switch (r->op) {
+    case TBITMAP_TRACE_ISSET:
+        return tBitMapIsSet(p, r->a) == r->result;
+    case TBITMAP_TRACE_SET:
+    case TBITMAP_TRACE_RESET:
+        rt = tBitMapSetReset(p, r->a, r->op == TBITMAP_TRACE_SET);
+        break;
+    case TBITMAP_TRACE_SET_BLOCK:
+    case TBITMAP_TRACE_RESET_BLOCK:
+        rt = tBitMapSetResetBlock(p, r->a, r->b,
+                                  r->op == TBITMAP_TRACE_SET_BLOCK);
+        break;
+    case TBITMAP_TRACE_SET_ALL:
+    case TBITMAP_TRACE_RESET_ALL:
+        rt = tBitMapSetResetAll(p, r->op == TBITMAP_TRACE_SET_ALL);
+        break;
+    default:
+        return FALSE;
+    }
+    return (rt == TBITMAP_SUCCESS) == r->result;
+}
+
+static int
+cmpU32 (const void* a, const void* b)
+{
+    u32 x = *(const u32*)a;
+    u32 y = *(const u32*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+addLatency (latency* l, u64 ns)
+{
+    if (l->n == l->size) {
+        l->size = (l->size) ? 2 * l->size : 1024;
+        l->ns   = realloc(l->ns, l->size * sizeof(u32));
+        assert(l->ns);
+    }
+    l->ns[l->n++] = (ns > ~0U) ? ~0U : (u32)ns;
+}
+
+static u32
+percentile (latency* l, double pct)
+{
+    u64 i = (u64)(pct * (l->n - 1) / 100.0 + 0.5);
+
+    return l->ns[i];
+}
+
+int
+main (int argc, char* argv[])
+{
+    replayCfg       cfg;
+    tBitMapTraceRec rec;
+    tBitMapTraceRec* pRec = NULL;
+    tBitMap**       pMaps;
+    latency         lat[TBITMAP_TRACE_OP_MAX];
+    u8*             buf;
+    u64             size, off;
+    u64             n, nRec = 0, nAlloc = 0, nOps = 0;
+    u64             nMismatch = 0;
+    u64             t, t0, total = 0;
+    u32             i, maxId = 0;
+    u32             loop, nLoops = 1;
+    u32             sl[3];
+    bool            first;
+    int             opt;
+
+    memset(&cfg, 0, sizeof(cfg));
+    while ((opt = getopt(argc, argv, "g:cs:n:")) != -1) {
+        switch (opt) {
+        case 'g':
+            if (sscanf(optarg, "%u,%u,%u", &sl[0], &sl[1], &sl[2]) != 3) {
+                goto usage;
+            }
+            cfg.mode = MODE_STRIDES;
+            for (i = 0; i < 3; ++i) {
+                cfg.len[i] = sl[i];
+            }
+            break;
+        case 'c':
+            cfg.mode = MODE_CONCURRENT;
+            break;
+        case 's':
+            cfg.mode = MODE_STRIPED;
+            cfg.nStripes = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nLoops = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if ((optind != argc - 1) || (nLoops == 0)) {
+        goto usage;
+    }
+
+    buf = readFile(argv[optind], &size);
+    if (!buf) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    /*
+     * Decode the whole trace first to keep decoding out of the timing
+     */
+    off = 0;
+    while (tBitMapTraceNext(buf, size, &off, &rec)) {
+        if (nRec == nAlloc) {
+            nAlloc = (nAlloc) ? 2 * nAlloc : 1 << 16;
+            pRec = realloc(pRec, nAlloc * sizeof(*pRec));
+            assert(pRec);
+        }
+        pRec[nRec++] = rec;
+        if (rec.id > maxId) {
+            maxId = rec.id;
+        }
+    }
+    if (off == 0) {
+        fprintf(stderr, "%s: %s: not a trace\n", argv[0], argv[optind]);
+        return 1;
+    }
+    if (off < size) {
+        fprintf(stderr, "%s: ignored %llu bytes at the end\n", argv[0],
+                (unsigned long long)(size - off));
+    }
+    free(buf);
+
+    pMaps = calloc(maxId + 1, sizeof(tBitMap*));
+    assert(pMaps);
+    memset(lat, 0, sizeof(lat));
+    for (loop = 0; loop < nLoops; ++loop) {
+        for (n = 0; n < nRec; ++n) {
+            tBitMapTraceRec* r = &pRec[n];
+
+            if (r->op == TBITMAP_TRACE_NEW) {
+                if (pMaps[r->id]) {
+                    tBitMapFree(pMaps[r->id]);
+                }
+                pMaps[r->id] = allocMap(&cfg, r);
+                if (!pMaps[r->id]) {
+                    fprintf(stderr, "%s: cannot allocate a bitmap of max "
+                            "bit position %u\n", argv[0], r->a);
+                    return 1;
+                }
+                continue;
+            }
+            if (!pMaps[r->id]) {
+                ++nMismatch;    /* broken trace */
+                continue;
+            }
+            if (r->op == TBITMAP_TRACE_FREE) {
+                t0 = nsec();
+                tBitMapFree(pMaps[r->id]);
+                t = nsec() - t0;
+                pMaps[r->id] = NULL;
+            } else {
+                t0 = nsec();
+                if (!execute(pMaps[r->id], r)) {
+                    ++nMismatch;
+                }
+                t = nsec() - t0;
+            }
+            total += t;
+            ++nOps;
+            addLatency(&lat[r->op], t);
+        }
+    }
+
+    printf("{\"trace\": \"%s\", \"ops\": %llu, \"bitmaps\": %u, "
+           "\"recordedSeconds\": %.6f, \"seconds\": %.6f, "
+           "\"opsPerSec\": %.0f, \"mismatches\": %llu,\n \"latency\": [",
+           argv[optind], (unsigned long long)nOps, maxId,
+           (nRec) ? pRec[nRec - 1].ns / 1e9 : 0.0, total / 1e9,
+           (total) ? nOps * 1e9 / total : 0.0,
+           (unsigned long long)nMismatch);
+    first = TRUE;
+    for (i = 0; i < TBITMAP_TRACE_OP_MAX; ++i) {
+        if (lat[i].n == 0) {
+            continue;
+        }
+        qsort(lat[i].ns, lat[i].n, sizeof(u32), cmpU32);
+        printf("%s\n  {\"op\": \"%s\", \"count\": %llu, \"p50\": %u, "
+               "\"p90\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}",
+               (first) ? "" : ",", OpName[i], (unsigned long long)lat[i].n,
+               percentile(&lat[i], 50), percentile(&lat[i], 90),
+               percentile(&lat[i], 99), percentile(&lat[i], 99.9),
+               lat[i].ns[lat[i].n - 1]);
+        free(lat[i].ns);
+        first = FALSE;
+    }
+    printf("]}\n");
+
+    for (i = 0; i <= maxId; ++i) {
+        if (pMaps[i]) {
+            tBitMapFree(pMaps[i]);
+        }
+    }
+    free(pMaps);
+    free(pRec);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-g sl0,sl1,sl2] [-c] [-s nStripes] "
+            "[-n loops] trace\n", argv[0]);
+    return 1;
+}
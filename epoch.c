@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * epoch.c: epoch based memory reclamation
+ *
+ * EpochGlobal only moves from `e' to `e + 1' when every thread
+ * in a read-side critical section has announced `e'. An object
+ * retired at epoch `e' was unlinked before any thread announced
+ * `e + 1', so it can be released once EpochGlobal reaches `e + 2'.
+ */
+
+#include <assert.h>
+#include <sched.h>
+#include <string.h>
+#include "epoch.h"
+
+#define ALLOC_MEM(_arg0_, _size_) malloc((_size_))
+#define FREE_MEM(_arg0_, _ptr_)   free((_ptr_))
+#define EPOCH_ASSERT(_exp_)       assert((_exp_))
+
+enum {
+    EPOCH_RECLAIM_INTERVAL = 64, /* # of retired objects between tries */
+};
+
+typedef struct epochRetired_ {
+    struct epochRetired_* next;
+    u64   epoch;                /* EpochGlobal when retired */
+    void* ptr;                  /* retired object */
+    void  (*freeFn)(void*);     /* function to release `ptr' */
+} epochRetired;
+
+typedef struct epochThread_ {
+    struct epochThread_* next;  /* list of all the thread records */
+    u64           epoch;        /* announced epoch. 0: not reading */
+    u32           nest;         /* nesting level of epochReadLock() */
+    u32           inUse;        /* 1 if owned by a thread */
+    u32           nRetired;     /* # of objects in `retired' */
+    epochRetired* retired;      /* objects waiting for a grace period */
+} epochThread;
+
+static u64                   EpochGlobal = 1;
+static epochThread*          EpochThreads;
+static __thread epochThread* EpochSelf;
+
+
+/*
+ * Return the calling thread's record. Reuse a record released by
+ * epochThreadExit() or push a new one to EpochThreads.
+ */
+static epochThread*
+epochSelf (void)
+{
+    epochThread* t;
+    u32          unused;
+
+    if (EpochSelf) {
+        return EpochSelf;
+    }
+    t = __atomic_load_n(&EpochThreads, __ATOMIC_ACQUIRE);
+    for (; t; t = t->next) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&t->inUse, &unused, 1, FALSE,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            EpochSelf = t;
+            return t;
+        }
+    }
+    t = ALLOC_MEM(MEM_EPOCH, sizeof(*t));
+    if (!t) {
+        panic(("no memory for an epoch thread record"));
+    }
+    memset(t, 0, sizeof(*t));
+    t->inUse = 1;
+    t->next  = __atomic_load_n(&EpochThreads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&EpochThreads, &t->next, t, FALSE,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+        ;
+    }
+    EpochSelf = t;
+    return t;
+}
+
+/*
+ * Move EpochGlobal forward if all the threads in read-side
+ * critical sections have announced the current epoch.
+ */
+static bool
+epochTryAdvance (void)
+{
+    epochThread* t;
+    u64          e;
+    u64          te;
+
+    e = __atomic_load_n(&EpochGlobal, __ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&EpochThreads, __ATOMIC_ACQUIRE);
+    for (; t; t = t->next) {
+        te = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+        if (te && (te != e)) {
+            return FALSE;
+        }
+    }
+    return __atomic_compare_exchange_n(&EpochGlobal, &e, e + 1, FALSE,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Release the objects `t' retired two or more epochs ago.
+ */
+static void
+epochReclaim (epochThread* t)
+{
+    epochRetired** pp;
+    epochRetired*  r;
+    u64            e;
+
+    e  = __atomic_load_n(&EpochGlobal, __ATOMIC_SEQ_CST);
+    pp = &t->retired;
+    while ((r = *pp)) {
+        if (r->epoch + 2 <= e) {
+            *pp = r->next;
+            (*r->freeFn)(r->ptr);
+            FREE_MEM(MEM_EPOCH, r);
+            --t->nRetired;
+        } else {
+            pp = &r->next;
+        }
+    }
+}
+
+void
+epochReadLock (void)
+{
+    epochThread* t = epochSelf();
+
+    if (t->nest++ == 0) {
+        __atomic_store_n(&t->epoch,
+                         __atomic_load_n(&EpochGlobal, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void
+epochReadUnlock (void)
+{
+    epochThread* t = EpochSelf;
+
+    EPOCH_ASSERT(t && t->nest);
+    if (--t->nest == 0) {
+        __atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void
+epochRetire (void* ptr, void (*freeFn)(void* ptr))
+{
+    epochThread*  t = epochSelf();
+    epochRetired* r;
+
+    r = ALLOC_MEM(MEM_EPOCH, sizeof(*r));
+    if (!r) {
+        return;                 /* leak `ptr' */
+    }
+    r->epoch  = __atomic_load_n(&EpochGlobal, __ATOMIC_SEQ_CST);
+    r->ptr    = ptr;
+    r->freeFn = freeFn;
+    r->next   = t->retired;
+    t->retired = r;
+    if ((++t->nRetired % EPOCH_RECLAIM_INTERVAL) == 0) {
+        epochTryAdvance();
+        epochReclaim(t);
+    }
+}
+
+void
+epochSynchronize (void)
+{
+    epochThread* t = epochSelf();
+    u64          target;
+
+    EPOCH_ASSERT(t->nest == 0);
+    target = __atomic_load_n(&EpochGlobal, __ATOMIC_SEQ_CST) + 2;
+    while (__atomic_load_n(&EpochGlobal, __ATOMIC_SEQ_CST) < target) {
+        if (!epochTryAdvance()) {
+            sched_yield();
+        }
+    }
+    epochReclaim(t);
+}
+
+void
+epochThreadExit (void)
+{
+    epochThread* t = EpochSelf;
+
+    if (!t) {
+        return;
+    }
+    EPOCH_ASSERT(t->nest == 0);
+    if (t->retired) {
+        epochSynchronize();
+    }
+    EPOCH_ASSERT(t->retired == NULL);
+    EpochSelf = NULL;
+    __atomic_store_n(&t->inUse, 0, __ATOMIC_RELEASE);
+}
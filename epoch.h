@@ -0,0 +1,104 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * epoch.h: epoch based memory reclamation
+ */
+
+#include "local_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Function prototypes
+ */
+void epochReadLock    (void);
+void epochReadUnlock  (void);
+void epochRetire      (void* ptr, void (*freeFn)(void* ptr));
+void epochSynchronize (void);
+void epochThreadExit  (void);
+
+
+/*
+ * epoch
+ *
+ * A process-wide epoch counter protects nodes that are unlinked
+ * from a shared data structure while other threads may still
+ * be reading them. A thread is registered on its first call.
+ *
+ * 1. Read-side critical section
+ *
+ * void epochReadLock (void);
+ * void epochReadUnlock (void);
+ *
+ *  Pointers loaded from a shared data structure between
+ *  epochReadLock() and epochReadUnlock() stay valid until
+ *  epochReadUnlock(). epochReadLock() announces the current
+ *  epoch with one store and a full memory barrier.
+ *  Read-side critical sections may be nested.
+ *
+ *
+ * 2. Deferred release
+ *
+ * void epochRetire (void* ptr, void (*freeFn)(void* ptr));
+ *
+ *  input:
+ *    ptr:    pointer to an object already unlinked from the
+ *            shared data structure.
+ *    freeFn: function called with ptr once no thread can hold
+ *            a reference to it.
+ *
+ *  May be called inside a read-side critical section.
+ *  The object is leaked if there is no memory to record it.
+ *
+ *
+ * 3. Grace period
+ *
+ * void epochSynchronize (void);
+ *
+ *  Wait until all the threads have left the read-side critical
+ *  sections they were in, then release the objects the calling
+ *  thread retired. Must not be called in a read-side critical
+ *  section.
+ *
+ *
+ * 4. Thread exit
+ *
+ * void epochThreadExit (void);
+ *
+ *  Release all the objects the calling thread retired and
+ *  unregister the thread. Its record is reused by the next
+ *  new thread.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __EPOCH_H__ */
@@ -91,6 +91,10 @@ typedef enum bool_e {
     TRUE  = 1,
     FALSE = 0
 } bool, boolean;
+#else  /* __cplusplus */
+typedef bool boolean;
+#define TRUE  true
+#define FALSE false
 #endif /* __cplusplus */
 
 typedef struct revNum_ {
@@ -105,6 +109,7 @@ typedef struct revNum_ {
 enum {
     MEM_MTRIE3L = 0,
     MEM_TBITMAP,
+    MEM_EPOCH,
 };
 
 /*
@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * mtrie3l-lpm.c: IPv4 longest prefix match with a 16/8/8 multibit
+ *                trie
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "mtrie3l-lpm.h"
+
+enum {
+    LPM_NODE_ENT   = 256,
+    LPM_HASH_INIT  = 64,        /* initial # of hash slots */
+    LPM_EMPTY      = 0xff,      /* mtrie3lLpmPfx.len of an empty slot */
+};
+
+#define ALLOC_MEM(_arg0, _size) (malloc ((_size)))
+#define FREE_MEM(_arg0, _ptr)   (free ((_ptr)))
+#define REALLOC_MEM(_arg0, _ptr, _size) (realloc ((_ptr), (_size)))
+
+static inline u32
+lpmMask (u8 len)
+{
+    return (len == 0) ? 0 : ~0U << (32 - len);
+}
+
+static inline mtrie3lLpmNode*
+lpmNode (mtrie3lLpm* t, u32 e)
+{
+    return &t->pNodes[e & ~MTRIE3L_LPM_CHILD];
+}
+
+
+/*
+ * Prefix hash table (control plane)
+ */
+static inline u32
+lpmHash (mtrie3lLpm* t, ipv4a prefix, u8 len)
+{
+    return (((prefix ^ (len * 0x9e3779b9U)) * 0x85ebca6bU) >> 7) & t->pfxMask;
+}
+
+static mtrie3lLpmPfx*
+lpmPfxFind (mtrie3lLpm* t, ipv4a prefix, u8 len)
+{
+    u32            i;
+    mtrie3lLpmPfx* pp;
+
+    for (i = lpmHash(t, prefix, len); ; i = (i + 1) & t->pfxMask) {
+        pp = &t->pPfx[i];
+        if (pp->len == LPM_EMPTY) {
+            return NULL;
+        }
+        if ((pp->len == len) && (pp->prefix == prefix)) {
+            return pp;
+        }
+    }
+}
+
+/*
+ * Store a prefix not in the table. The table must have
+ * an empty slot.
+ */
+static void
+lpmPfxPut (mtrie3lLpm* t, ipv4a prefix, u8 len, u32 nh)
+{
+    u32 i;
+
+    for (i = lpmHash(t, prefix, len); t->pPfx[i].len != LPM_EMPTY;
+         i = (i + 1) & t->pfxMask) {
+        ;
+    }
+    t->pPfx[i].prefix = prefix;
+    t->pPfx[i].len    = len;
+    t->pPfx[i].nh     = nh;
+}
+
+static int
+lpmPfxGrow (mtrie3lLpm* t)
+{
+    u32            i, nOld;
+    mtrie3lLpmPfx* pOld = t->pPfx;
+    mtrie3lLpmPfx* pNew;
+
+    nOld = t->pfxMask + 1;
+    pNew = ALLOC_MEM(0, 2 * nOld * sizeof(mtrie3lLpmPfx));
+    if (!pNew) {
+        return MTRIE3L_ENOMEM;
+    }
+    memset(pNew, LPM_EMPTY, 2 * nOld * sizeof(mtrie3lLpmPfx));
+    t->pPfx    = pNew;
+    t->pfxMask = (2 * nOld) - 1;
+    for (i = 0; i < nOld; ++i) {
+        if (pOld[i].len != LPM_EMPTY) {
+            lpmPfxPut(t, pOld[i].prefix, pOld[i].len, pOld[i].nh);
+        }
+    }
+    FREE_MEM(0, pOld);
+    return MTRIE3L_SUCCESS;
+}
+
+/*
+ * Remove the prefix at `pp', moving back the following entries
+ * of its cluster (no tombstones).
+ */
+static void
+lpmPfxRemove (mtrie3lLpm* t, mtrie3lLpmPfx* pp)
+{
+    u32 i, j, h;
+
+    i = pp - t->pPfx;
+    for (j = (i + 1) & t->pfxMask; t->pPfx[j].len != LPM_EMPTY;
+         j = (j + 1) & t->pfxMask) {
+        h = lpmHash(t, t->pPfx[j].prefix, t->pPfx[j].len);
+        /*
+         * Move j to i unless its home slot h is in (i, j]
+         */
+        if (((j > i) && ((h <= i) || (h > j))) ||
+            ((j < i) && ((h <= i) && (h > j)))) {
+            t->pPfx[i] = t->pPfx[j];
+            i = j;
+        }
+    }
+    t->pPfx[i].len = LPM_EMPTY;
+}
+
+
+/*
+ * Nodes
+ */
+
+/*
+ * Allocate a node whose entries are all `e' for prefix length
+ * `len'. Return its number, or 0 if there is no memory. Moves
+ * t->pNodes.
+ */
+static u32
+lpmNodeAlloc (mtrie3lLpm* t, u32 e, u8 len)
+{
+    u32             i, n;
+    mtrie3lLpmNode* pNode;
+
+    if (t->freeNode) {
+        i = t->freeNode;
+        t->freeNode = t->pNodes[i].ent[0];
+    } else {
+        if (t->nUsed + 1 >= t->nNodes) {
+            n = (t->nNodes) ? t->nNodes * 2 : 16;
+            pNode = REALLOC_MEM(0, t->pNodes, n * sizeof(mtrie3lLpmNode));
+            if (!pNode) {
+                return 0;
+            }
+            t->pNodes = pNode;
+            t->nNodes = n;
+        }
+        i = t->nUsed + 1;       /* node 0 is never used */
+    }
+    ++t->nUsed;
+    pNode = &t->pNodes[i];
+    for (n = 0; n < LPM_NODE_ENT; ++n) {
+        pNode->ent[n] = e;
+    }
+    memset(pNode->len, len, sizeof(pNode->len));
+    return i;
+}
+
+static void
+lpmNodeFree (mtrie3lLpm* t, u32 i)
+{
+    t->pNodes[i].ent[0] = t->freeNode;
+    t->freeNode = i;
+    --t->nUsed;
+}
+
+/*
+ * Return the number of the node the entry `idx' of node `in'
+ * (0: level 0) points to, expanding the next hop of the entry into
+ * a new node if needed, or 0 if there is no memory. The entry is
+ * given by numbers since t->pNodes may move.
+ */
+static u32
+lpmChild (mtrie3lLpm* t, u32 in, u32 idx)
+{
+    u32  e, i;
+    u8   len;
+
+    e   = (in) ? t->pNodes[in].ent[idx] : t->l0[idx];
+    len = (in) ? t->pNodes[in].len[idx] : t->l0len[idx];
+    if (e & MTRIE3L_LPM_CHILD) {
+        return e & ~MTRIE3L_LPM_CHILD;
+    }
+    i = lpmNodeAlloc(t, e, len);
+    if (i == 0) {
+        return 0;
+    }
+    if (in) {
+        t->pNodes[in].ent[idx] = i | MTRIE3L_LPM_CHILD;
+    } else {
+        t->l0[idx] = i | MTRIE3L_LPM_CHILD;
+    }
+    return i;
+}
+
+/*
+ * Replace the node at `*pe' by a next hop if no prefix longer
+ * than the bits above it (`bits') covers its entries.
+ */
+static void
+lpmCollapse (mtrie3lLpm* t, u32* pe, u8* pLen, u8 bits)
+{
+    u32             i, e = *pe;
+    mtrie3lLpmNode* pNode;
+
+    if (!(e & MTRIE3L_LPM_CHILD)) {
+        return;
+    }
+    pNode = lpmNode(t, e);
+    for (i = 0; i < LPM_NODE_ENT; ++i) {
+        if ((pNode->ent[i] & MTRIE3L_LPM_CHILD) || (pNode->len[i] > bits)) {
+            return;
+        }
+    }
+    *pe   = pNode->ent[0];
+    *pLen = pNode->len[0];
+    lpmNodeFree(t, e & ~MTRIE3L_LPM_CHILD);
+}
+
+/*
+ * Store next hop `nh' of prefix length `len' in the entry and in
+ * its subnodes where the entry belongs to a prefix matching `match':
+ * a prefix not longer than `len' when inserting, or of length
+ * `match' when deleting (`match' >= 0).
+ */
+static void
+lpmPaint (mtrie3lLpm* t, u32* pe, u8* pLen, u32 nh, u8 len, s32 match)
+{
+    u32             i;
+    mtrie3lLpmNode* pNode;
+
+    if (*pe & MTRIE3L_LPM_CHILD) {
+        pNode = lpmNode(t, *pe);
+        for (i = 0; i < LPM_NODE_ENT; ++i) {
+            lpmPaint(t, &pNode->ent[i], &pNode->len[i], nh, len, match);
+        }
+        return;
+    }
+    if ((match < 0) ? (*pLen <= len) : (*pLen == match)) {
+        *pe   = nh;
+        *pLen = len;
+    }
+}
+
+/*
+ * Paint the entries of prefix/len. Return MTRIE3L_ENOMEM if
+ * a node cannot be allocated.
+ */
+static int
+lpmPaintPrefix (mtrie3lLpm* t, ipv4a prefix, u8 len,
+                u32 nh, u8 nhLen, s32 match)
+{
+    u32 i, n, start;
+    u32 n1, n2;
+    u32 i0 = prefix >> 16;
+    u32 i1 = (prefix >> 8) & 0xff;
+
+    if (len <= 16) {
+        n = 1 << (16 - len);
+        for (i = i0; i < i0 + n; ++i) {
+            lpmPaint(t, &t->l0[i], &t->l0len[i], nh, nhLen, match);
+        }
+        return MTRIE3L_SUCCESS;
+    }
+    n1 = lpmChild(t, 0, i0);
+    if (n1 == 0) {
+        return MTRIE3L_ENOMEM;
+    }
+    if (len <= 24) {
+        n = 1 << (24 - len);
+        start = i1;
+    } else {
+        n2 = lpmChild(t, n1, i1);
+        if (n2 == 0) {
+            return MTRIE3L_ENOMEM;
+        }
+        n1 = n2;
+        n = 1 << (32 - len);
+        start = prefix & 0xff;
+    }
+    for (i = start; i < start + n; ++i) {
+        lpmPaint(t, &t->pNodes[n1].ent[i], &t->pNodes[n1].len[i],
+                 nh, nhLen, match);
+    }
+    return MTRIE3L_SUCCESS;
+}
+
+
+mtrie3lLpm*
+mtrie3lLpmAlloc (void)
+{
+    u32         i;
+    mtrie3lLpm* t;
+
+    t = ALLOC_MEM(0, sizeof(*t));
+    if (!t) {
+        return NULL;
+    }
+    memset(t, 0, sizeof(*t));
+    t->pPfx = ALLOC_MEM(0, LPM_HASH_INIT * sizeof(mtrie3lLpmPfx));
+    if (!t->pPfx) {
+        FREE_MEM(0, t);
+        return NULL;
+    }
+    memset(t->pPfx, LPM_EMPTY, LPM_HASH_INIT * sizeof(mtrie3lLpmPfx));
+    t->pfxMask = LPM_HASH_INIT - 1;
+    for (i = 0; i < elementsOf(t->l0); ++i) {
+        t->l0[i] = MTRIE3L_LPM_NO_ROUTE;
+    }
+    return t;
+}
+
+void
+mtrie3lLpmFree (mtrie3lLpm* t)
+{
+    if (t) {
+        FREE_MEM(0, t->pNodes);
+        FREE_MEM(0, t->pPfx);
+        FREE_MEM(0, t);
+    }
+}
+
+/*
+ * Add prefix/len with next hop `nh', or change the next hop
+ * of the prefix if it exists.
+ */
+int
+mtrie3lLpmInsert (mtrie3lLpm* t, ipv4a prefix, u8 len, u32 nh)
+{
+    int            rt;
+    mtrie3lLpmPfx* pp;
+
+    if (!t) {
+        return MTRIE3L_ERR;
+    }
+    if ((len > 32) || (nh >= MTRIE3L_LPM_NO_ROUTE)) {
+        return MTRIE3L_EINDEX;
+    }
+    prefix &= lpmMask(len);
+    pp = lpmPfxFind(t, prefix, len);
+    if (!pp && (2 * (t->nPfx + 1) > t->pfxMask + 1)) {
+        rt = lpmPfxGrow(t);
+        if (rt != MTRIE3L_SUCCESS) {
+            return rt;
+        }
+    }
+    /*
+     * Entries of a prefix of the same length are those of
+     * this prefix, and are overwritten.
+     */
+    rt = lpmPaintPrefix(t, prefix, len, nh, len, -1);
+    if (rt != MTRIE3L_SUCCESS) {
+        return rt;
+    }
+    if (pp) {
+        pp->nh = nh;
+    } else {
+        lpmPfxPut(t, prefix, len, nh);
+        ++t->nPfx;
+    }
+    return MTRIE3L_SUCCESS;
+}
+
+int
+mtrie3lLpmDelete (mtrie3lLpm* t, ipv4a prefix, u8 len)
+{
+    u32            nh = MTRIE3L_LPM_NO_ROUTE;
+    u32            i0, n1;
+    s32            l;
+    u8             nhLen = 0;
+    mtrie3lLpmPfx* pp;
+    mtrie3lLpmPfx* pCover;
+
+    if (!t) {
+        return MTRIE3L_ERR;
+    }
+    if (len > 32) {
+        return MTRIE3L_EINDEX;
+    }
+    prefix &= lpmMask(len);
+    pp = lpmPfxFind(t, prefix, len);
+    if (!pp) {
+        return MTRIE3L_ERR;
+    }
+    lpmPfxRemove(t, pp);
+    --t->nPfx;
+
+    /*
+     * The entries go to the longest prefix covering this one
+     */
+    for (l = len - 1; l >= 0; --l) {
+        pCover = lpmPfxFind(t, prefix & lpmMask(l), l);
+        if (pCover) {
+            nh    = pCover->nh;
+            nhLen = l;
+            break;
+        }
+    }
+    /*
+     * The nodes on the path exist as the prefix was there
+     */
+    lpmPaintPrefix(t, prefix, len, nh, nhLen, len);
+    if (len > 16) {
+        i0 = prefix >> 16;
+        n1 = t->l0[i0] & ~MTRIE3L_LPM_CHILD;
+        if (len > 24) {
+            i0 = (prefix >> 8) & 0xff;
+            lpmCollapse(t, &t->pNodes[n1].ent[i0],
+                        &t->pNodes[n1].len[i0], 24);
+            i0 = prefix >> 16;
+        }
+        lpmCollapse(t, &t->l0[i0], &t->l0len[i0], 16);
+    }
+    return MTRIE3L_SUCCESS;
+}
+
+/*
+ * Get the next hop of the prefix/len (exact match)
+ */
+int
+mtrie3lLpmFind (mtrie3lLpm* t, ipv4a prefix, u8 len, u32* pNh)
+{
+    mtrie3lLpmPfx* pp;
+
+    if (!t || (len > 32)) {
+        return MTRIE3L_ERR;
+    }
+    pp = lpmPfxFind(t, prefix & lpmMask(len), len);
+    if (!pp) {
+        return MTRIE3L_ERR;
+    }
+    if (pNh) {
+        *pNh = pp->nh;
+    }
+    return MTRIE3L_SUCCESS;
+}
+
+/*
+ * Look up `n' addresses, storing the next hops in `nh', and return
+ * the number of addresses matching a prefix. The lookups do not
+ * depend on each other, so the core overlaps their cache misses by
+ * itself; prefetching groups of addresses a level at a time was
+ * slower here.
+ */
+u32
+mtrie3lLpmLookupMany (mtrie3lLpm* t, const ipv4a* addr, u32* nh, u32 n)
+{
+    u32 i;
+    u32 found = 0;
+
+    for (i = 0; i < n; ++i) {
+        nh[i] = mtrie3lLpmLookup(t, addr[i]);
+        found += (nh[i] != MTRIE3L_LPM_NO_ROUTE);
+    }
+    return found;
+}
@@ -0,0 +1,130 @@
+#ifndef __MTRIE3L_LPM_H__
+#define __MTRIE3L_LPM_H__
+
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * mtrie3l-lpm.h: IPv4 longest prefix match with a 16/8/8 multibit
+ *                trie
+ */
+
+#include "mtrie3l.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * IPv4 longest prefix match
+ *
+ * The prefixes are expanded (controlled prefix expansion) into a
+ * level 0 array of 2^16 entries indexed by the upper 16 bits of an
+ * address, and level 1 and level 2 nodes of 256 entries indexed by
+ * the next 8 bits and the last 8 bits. An entry holds either a next
+ * hop or, with MTRIE3L_LPM_CHILD set, the number of the node at the
+ * next level. The next hop of a prefix is pushed down to every
+ * entry it covers unless a longer prefix covers the entry too (leaf
+ * pushing), so a lookup reads one entry per level and stops at the
+ * first next hop: three entries and the node array at most.
+ *
+ * The prefixes themselves are kept in a hash table to find the
+ * prefix covering a deleted one. Next hops are numbers less than
+ * MTRIE3L_LPM_NO_ROUTE, which mtrie3lLpmLookup() returns if no
+ * prefix matches. Updates and lookups must be serialized by the
+ * caller.
+ */
+enum {
+    MTRIE3L_LPM_CHILD    = 0x80000000,  /* entry is a node number */
+    MTRIE3L_LPM_NO_ROUTE = 0x7fffffff,
+};
+
+typedef struct mtrie3lLpmNode_ {
+    u32 ent[256];               /* next hops or node numbers */
+    u8  len[256];               /* prefix length of the next hops */
+} mtrie3lLpmNode;
+
+typedef struct mtrie3lLpmPfx_ {
+    ipv4a prefix;
+    u8    len;                  /* 0xff: empty slot */
+    u32   nh;
+} mtrie3lLpmPfx;
+
+typedef struct mtrie3lLpm_ {
+    mtrie3lLpmNode* pNodes;     /* level 1 and level 2 nodes */
+    u32             nNodes;     /* # of nodes allocated in pNodes */
+    u32             nUsed;      /* # of nodes in use */
+    u32             freeNode;   /* first free node, or 0 */
+    u32             nPfx;       /* # of prefixes */
+    u32             pfxMask;    /* # of hash slots - 1 */
+    mtrie3lLpmPfx*  pPfx;       /* prefix hash table */
+    u32             l0[1 << 16];
+    u8              l0len[1 << 16];
+} mtrie3lLpm;
+
+mtrie3lLpm* mtrie3lLpmAlloc (void);
+void mtrie3lLpmFree   (mtrie3lLpm* t);
+int  mtrie3lLpmInsert (mtrie3lLpm* t, ipv4a prefix, u8 len, u32 nh);
+int  mtrie3lLpmDelete (mtrie3lLpm* t, ipv4a prefix, u8 len);
+int  mtrie3lLpmFind   (mtrie3lLpm* t, ipv4a prefix, u8 len, u32* pNh);
+u32  mtrie3lLpmLookupMany (mtrie3lLpm* t, const ipv4a* addr, u32* nh,
+                           u32 n);
+
+/*
+ * Return the next hop of the longest prefix matching `addr',
+ * or MTRIE3L_LPM_NO_ROUTE.
+ */
+static inline u32
+mtrie3lLpmLookup (mtrie3lLpm* t, ipv4a addr)
+{
+    u32 e;
+
+    e = t->l0[addr >> 16];
+    if (e & MTRIE3L_LPM_CHILD) {
+        e = t->pNodes[e & ~MTRIE3L_LPM_CHILD].ent[(addr >> 8) & 0xff];
+        if (e & MTRIE3L_LPM_CHILD) {
+            e = t->pNodes[e & ~MTRIE3L_LPM_CHILD].ent[addr & 0xff];
+        }
+    }
+    return e;
+}
+
+static inline u32
+mtrie3lLpmNumPrefixes (mtrie3lLpm* t)
+{
+    return t->nPfx;
+}
+
+static inline u32
+mtrie3lLpmNumNodes (mtrie3lLpm* t)
+{
+    return t->nUsed;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MTRIE3L_LPM_H__ */
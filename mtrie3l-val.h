@@ -0,0 +1,164 @@
+#ifndef __MTRIE3L_VAL_H__
+#define __MTRIE3L_VAL_H__
+
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * mtrie3l-val.h: 3 level multibit trie storing fixed-size values
+ *                in the leaves
+ */
+
+#include "mtrie3l.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Value leaves
+ *
+ * MTRIE3L_VAL_DEFINE(name, type) defines functions handling a trie
+ * whose L2 nodes hold values of `type' (up to 8 byte alignment)
+ * in place of leaf pointers, with an occupancy bitmap telling which
+ * values are present. The L0 and L1 nodes are those of mtrie3l.
+ * For example, MTRIE3L_VAL_DEFINE(ifTbl, u32) defines:
+ *
+ *   mtrie3l* ifTblAlloc     (u8 sl0, u8 sl1, u8 sl2);
+ *   int      ifTblFree      (mtrie3l* p);
+ *   int      ifTblInsert    (mtrie3l* p, u32 index, u32 val);
+ *   int      ifTblSet       (mtrie3l* p, u32 index, u32 val);
+ *   u32*     ifTblFind      (mtrie3l* p, u32 index);
+ *   u32*     ifTblFindNext  (mtrie3l* p, u32* pIndex);
+ *   int      ifTblDelete    (mtrie3l* p, u32 index, u32* pVal);
+ *   int      ifTblDeleteAll (mtrie3l* p);
+ *
+ * Insert() fails with MTRIE3L_EOCCUPIED if `index' has a value;
+ * Set() overwrites it. Find() and FindNext() return a pointer to
+ * the value in the L2 node, which is valid until the value is
+ * deleted. Delete() copies the value to `pVal' unless it is NULL.
+ * The value tries are not RCU tries: readers and writers must be
+ * serialized by the caller. The functions of mtrie3l.h taking
+ * leaf pointers must not be used with them, except for the
+ * mtrie3lNum*() and mtrie3lGetMaxIndex().
+ */
+typedef struct mtrie3l_vl2_ {
+    u16 cnt;                    /* number of values in this node */
+    u16 pad;
+    u32 occ[0];                 /* occupancy bitmap, then values */
+} mtrie3l_vl2;
+
+int   mtrie3lValSlot      (mtrie3l* p, u32 index, u32 size, void** ppVal);
+void* mtrie3lValFind      (mtrie3l* p, u32 index, u32 size);
+void* mtrie3lValFindNext  (mtrie3l* p, u32* pIndex, u32 size);
+int   mtrie3lValDelete    (mtrie3l* p, u32 index, u32 size, void* pVal);
+int   mtrie3lValDeleteAll (mtrie3l* p);
+
+/*
+ * Offset of the values in an L2 node
+ */
+static inline u32
+mtrie3lValOffset (mtrie3l* p)
+{
+    return (sizeof(mtrie3l_vl2) +
+            (mtrie3lOccWords(p->len[2]) * sizeof(u32)) + 7) & ~7;
+}
+
+static inline u32
+mtrie3lValL2nodeSize (mtrie3l* p, u32 size)
+{
+    return mtrie3lValOffset(p) + ((1 << p->len[2]) * size);
+}
+
+#define MTRIE3L_VAL_DEFINE(_name_, _type_)                              \
+                                                                        \
+static inline mtrie3l*                                                  \
+_name_##Alloc (u8 sl0, u8 sl1, u8 sl2)                                  \
+{                                                                       \
+    return mtrie3lAlloc(sl0, sl1, sl2);                                 \
+}                                                                       \
+                                                                        \
+static inline int                                                       \
+_name_##Free (mtrie3l* p)                                               \
+{                                                                       \
+    return mtrie3lFree(p);                                              \
+}                                                                       \
+                                                                        \
+static inline int                                                       \
+_name_##Insert (mtrie3l* p, u32 index, _type_ val)                      \
+{                                                                       \
+    void* pVal;                                                         \
+    int   rt;                                                           \
+                                                                        \
+    rt = mtrie3lValSlot(p, index, sizeof(_type_), &pVal);               \
+    if (rt == MTRIE3L_SUCCESS) {                                        \
+        *(_type_*)pVal = val;                                           \
+    }                                                                   \
+    return rt;                                                          \
+}                                                                       \
+                                                                        \
+static inline int                                                       \
+_name_##Set (mtrie3l* p, u32 index, _type_ val)                         \
+{                                                                       \
+    void* pVal;                                                         \
+    int   rt;                                                           \
+                                                                        \
+    rt = mtrie3lValSlot(p, index, sizeof(_type_), &pVal);               \
+    if ((rt == MTRIE3L_SUCCESS) || (rt == MTRIE3L_EOCCUPIED)) {         \
+        *(_type_*)pVal = val;                                           \
+        rt = MTRIE3L_SUCCESS;                                           \
+    }                                                                   \
+    return rt;                                                          \
+}                                                                       \
+                                                                        \
+static inline _type_*                                                   \
+_name_##Find (mtrie3l* p, u32 index)                                    \
+{                                                                       \
+    return (_type_*)mtrie3lValFind(p, index, sizeof(_type_));           \
+}                                                                       \
+                                                                        \
+static inline _type_*                                                   \
+_name_##FindNext (mtrie3l* p, u32* pIndex)                              \
+{                                                                       \
+    return (_type_*)mtrie3lValFindNext(p, pIndex, sizeof(_type_));      \
+}                                                                       \
+                                                                        \
+static inline int                                                       \
+_name_##Delete (mtrie3l* p, u32 index, _type_* pVal)                    \
+{                                                                       \
+    return mtrie3lValDelete(p, index, sizeof(_type_), pVal);            \
+}                                                                       \
+                                                                        \
+static inline int                                                       \
+_name_##DeleteAll (mtrie3l* p)                                          \
+{                                                                       \
+    return mtrie3lValDeleteAll(p);                                      \
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MTRIE3L_VAL_H__ */
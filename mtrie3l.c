@@ -27,17 +27,169 @@
 #include <assert.h>
 #include <string.h>
 #include "mtrie3l.h"
+#include "mtrie3l-val.h"
 
 enum {
     MTRIE3L_KEEP_ENT = 0,
     MTRIE3L_DEL_ENT  = 1,
     MTRIE3L_MAX_STRIDE_LEN = sizeof(((mtrie3l*)0)->cnt) << 3,
+    MTRIE3L_FIND_GROUP = 16,    /* # of lookups interleaved */
+    MTRIE3L_FROZEN = 0xffff,    /* cnt of an empty concurrent node */
 };
 
 #define ALLOC_MEM(_arg0, _size) (malloc ((_size)))
 #define FREE_MEM(_arg0, _ptr)   (free ((_ptr)))
 #define MTRIE3L_ASSERT(_exp_)   assert((_exp_))
 
+/*
+ * Node pointers and leaves are read with MTRIE3L_LOAD() and
+ * written with MTRIE3L_PUBLISH() so that a reader of an RCU trie
+ * never sees a node before its contents. Both are plain moves
+ * on x86.
+ */
+#define MTRIE3L_LOAD(_v_)           __atomic_load_n(&(_v_), __ATOMIC_ACQUIRE)
+#define MTRIE3L_PUBLISH(_v_, _val_) \
+    __atomic_store_n(&(_v_), (_val_), __ATOMIC_RELEASE)
+
+
+static void
+mtrie3lFreeMem (void* ptr)
+{
+    FREE_MEM(0, ptr);
+}
+
+/*
+ * Release an unlinked node. Readers of an RCU trie may still
+ * hold it, so it is released after a grace period.
+ */
+static inline void
+mtrie3lFreeNode (mtrie3l* p, void* pNode)
+{
+    if (p->flags & MTRIE3L_RCU) {
+        epochRetire(pNode, mtrie3lFreeMem);
+    } else {
+        FREE_MEM(0, pNode);
+    }
+}
+
+/*
+ * Occupancy bitmaps following the arrays of the nodes
+ */
+static inline u32*
+mtrie3lOccL0 (mtrie3l* p)
+{
+    return (u32*)&p->l0[1 << p->len[0]];
+}
+
+static inline u32*
+mtrie3lOccL1 (mtrie3l* p, mtrie3l_l1* pl1)
+{
+    return (u32*)&pl1->l1[1 << p->len[1]];
+}
+
+static inline u32*
+mtrie3lOccL2 (mtrie3l* p, mtrie3l_l2* pl2)
+{
+    return (u32*)&pl2->l2[1 << p->len[2]];
+}
+
+/*
+ * A reader of an RCU trie may read a bitmap while it is updated.
+ * The bits of the nodes are set after the nodes are published,
+ * those of the leaves when their slots are allocated, and all of
+ * them are cleared before the element is unlinked, so such a reader
+ * may find a bit set for a NULL element, which it skips.
+ */
+static inline void
+mtrie3lOccSet (u32* pOcc, u32 i)
+{
+    __atomic_store_n(&pOcc[i >> 5], pOcc[i >> 5] | (1U << (i & 31)),
+                     __ATOMIC_RELEASE);
+}
+
+static inline void
+mtrie3lOccClear (u32* pOcc, u32 i)
+{
+    __atomic_store_n(&pOcc[i >> 5], pOcc[i >> 5] & ~(1U << (i & 31)),
+                     __ATOMIC_RELEASE);
+}
+
+/*
+ * Writers of a concurrent trie share the bitmap words. A bit is
+ * set after its element is installed, and cleared after the element
+ * is removed and set again if another writer has filled it since.
+ */
+static inline void
+mtrie3lOccSetAtomic (u32* pOcc, u32 i)
+{
+    __atomic_fetch_or(&pOcc[i >> 5], 1U << (i & 31), __ATOMIC_SEQ_CST);
+}
+
+#define MTRIE3L_OCC_UNSET(_pOcc_, _i_, _v_) \
+do {\
+    __atomic_fetch_and(&(_pOcc_)[(_i_) >> 5], ~(1U << ((_i_) & 31)),\
+                       __ATOMIC_SEQ_CST);\
+    if (__atomic_load_n(&(_v_), __ATOMIC_SEQ_CST)) {\
+        mtrie3lOccSetAtomic((_pOcc_), (_i_));\
+    }\
+} while (0)
+
+static inline bool
+mtrie3lOccIsSet (u32* pOcc, u32 i)
+{
+    return (pOcc[i >> 5] & (1U << (i & 31))) ? TRUE : FALSE;
+}
+
+/*
+ * Return the first element at or after `i' whose bit is set,
+ * or `n' (number of elements) if none.
+ */
+static inline u32
+mtrie3lOccNext (u32* pOcc, u32 i, u32 n)
+{
+    u32 w;
+
+    if (i >= n) {
+        return n;
+    }
+    w = MTRIE3L_LOAD(pOcc[i >> 5]) & (~0U << (i & 31));
+    for (;;) {
+        if (w) {
+            return (i & ~31) + __builtin_ctz(w);
+        }
+        i = (i | 31) + 1;
+        if (i >= n) {
+            return n;
+        }
+        w = MTRIE3L_LOAD(pOcc[i >> 5]);
+    }
+}
+
+/*
+ * Return the last element at or before `i' whose bit is set,
+ * or -1 if none.
+ */
+static inline s32
+mtrie3lOccPrev (u32* pOcc, s32 i)
+{
+    u32 w;
+
+    if (i < 0) {
+        return -1;
+    }
+    w = MTRIE3L_LOAD(pOcc[i >> 5]) & (~0U >> (31 - (i & 31)));
+    for (;;) {
+        if (w) {
+            return (i & ~31) + 31 - __builtin_clz(w);
+        }
+        i = (i & ~31) - 1;
+        if (i < 0) {
+            return -1;
+        }
+        w = MTRIE3L_LOAD(pOcc[i >> 5]);
+    }
+}
+
 
 mtrie3l*
 mtrie3lAlloc (u8 sl0,           /* level 0 stride length */
@@ -64,7 +216,8 @@ mtrie3lAlloc (u8 sl0,           /* level 0 stride length */
     if (sl2 > MTRIE3L_MAX_STRIDE_LEN) {
         return NULL;
     }
-    len = sizeof(mtrie3l) + ((1 << sl0) * sizeof(mtrie3l_l1*));
+    len = sizeof(mtrie3l) + ((1 << sl0) * sizeof(mtrie3l_l1*)) +
+        (mtrie3lOccWords(sl0) * sizeof(u32));
     p = ALLOC_MEM(0, len);
     if (!p) {
         return p;
@@ -78,6 +231,36 @@ mtrie3lAlloc (u8 sl0,           /* level 0 stride length */
     return p;
 }
 
+mtrie3l*
+mtrie3lAllocRcu (u8 sl0, u8 sl1, u8 sl2)
+{
+    mtrie3l* p = mtrie3lAlloc(sl0, sl1, sl2);
+
+    if (p) {
+        p->flags |= MTRIE3L_RCU;
+    }
+    return p;
+}
+
+mtrie3l*
+mtrie3lAllocConcurrent (u8 sl0, u8 sl1, u8 sl2)
+{
+    mtrie3l* p;
+
+    /*
+     * A node never has MTRIE3L_FROZEN elements
+     */
+    if ((sl0 >= MTRIE3L_MAX_STRIDE_LEN) || (sl1 >= MTRIE3L_MAX_STRIDE_LEN) ||
+        (sl2 >= MTRIE3L_MAX_STRIDE_LEN)) {
+        return NULL;
+    }
+    p = mtrie3lAlloc(sl0, sl1, sl2);
+    if (p) {
+        p->flags |= MTRIE3L_RCU | MTRIE3L_CONCURRENT;
+    }
+    return p;
+}
+
 int
 mtrie3lFree (mtrie3l* p)
 {
@@ -91,35 +274,267 @@ mtrie3lFree (mtrie3l* p)
     return MTRIE3L_SUCCESS;
 }
 
-int
-mtrie3lInsert (mtrie3l* p, u32 index, void* pEnt)
+/*
+ * Concurrent trie
+ *
+ * `cnt' of an L1 or L2 node counts its elements plus the writers
+ * holding a reservation on it. A writer reserves a node before
+ * installing anything in it, so a node can only be emptied while
+ * nobody is about to fill it. The writer that brings `cnt' to 0
+ * freezes the node (MTRIE3L_FROZEN) and unlinks it; a writer
+ * finding a frozen node helps unlink it and starts over. The writer
+ * whose compare-and-swap unlinks a node retires it and drops the
+ * parent's count for it. All of them run in a read-side critical
+ * section so that no node is released under them.
+ */
+static bool
+mtrie3lReserve (u16* pCnt)
+{
+    u16 cnt = __atomic_load_n(pCnt, __ATOMIC_ACQUIRE);
+
+    do {
+        if (cnt == MTRIE3L_FROZEN) {
+            return FALSE;
+        }
+    } while (!__atomic_compare_exchange_n(pCnt, &cnt, cnt + 1, FALSE,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+    return TRUE;
+}
+
+/*
+ * Drop an element or a reservation. TRUE if the node is frozen.
+ */
+static bool
+mtrie3lUnreserve (u16* pCnt)
+{
+    u16 cnt = 0;
+
+    if (__atomic_sub_fetch(pCnt, 1, __ATOMIC_ACQ_REL) != 0) {
+        return FALSE;
+    }
+    return __atomic_compare_exchange_n(pCnt, &cnt, MTRIE3L_FROZEN, FALSE,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static void
+mtrie3lUnlinkL1 (mtrie3l* p, u16 l0i, mtrie3l_l1* pl1)
+{
+    if (!__atomic_compare_exchange_n(&p->l0[l0i], &pl1, NULL, FALSE,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;                 /* somebody else did */
+    }
+    MTRIE3L_OCC_UNSET(mtrie3lOccL0(p), l0i, p->l0[l0i]);
+    epochRetire(pl1, mtrie3lFreeMem);
+    __atomic_sub_fetch(&p->cnt, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&p->nL1, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+mtrie3lReleaseL1 (mtrie3l* p, u16 l0i, mtrie3l_l1* pl1)
+{
+    if (mtrie3lUnreserve(&pl1->cnt)) {
+        mtrie3lUnlinkL1(p, l0i, pl1);
+    }
+}
+
+static void
+mtrie3lUnlinkL2 (mtrie3l* p, mtrie3l_l1* pl1, u16 l0i, u16 l1i,
+                 mtrie3l_l2* pl2)
+{
+    if (!__atomic_compare_exchange_n(&pl1->l1[l1i], &pl2, NULL, FALSE,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    MTRIE3L_OCC_UNSET(mtrie3lOccL1(p, pl1), l1i, pl1->l1[l1i]);
+    epochRetire(pl2, mtrie3lFreeMem);
+    __atomic_sub_fetch(&p->nL2, 1, __ATOMIC_RELAXED);
+    mtrie3lReleaseL1(p, l0i, pl1);
+}
+
+static inline void
+mtrie3lReleaseL2 (mtrie3l* p, mtrie3l_l1* pl1, u16 l0i, u16 l1i,
+                  mtrie3l_l2* pl2)
+{
+    if (mtrie3lUnreserve(&pl2->cnt)) {
+        mtrie3lUnlinkL2(p, pl1, l0i, l1i, pl2);
+    }
+}
+
+/*
+ * Allocate a node holding the caller's reservation
+ */
+static void*
+mtrie3lNewNode (int len)
+{
+    mtrie3l_l2* pNode = ALLOC_MEM(0, len);
+
+    if (pNode) {
+        memset(pNode, 0, len);
+        pNode->cnt = 1;         /* same place in mtrie3l_l1 */
+    }
+    return pNode;
+}
+
+static int
+mtrie3lInsertConcurrent (mtrie3l* p, u32 index, void* pEnt)
 {
     u16         l0i;
     u16         l1i;
     u16         l2i;
-    int         len;
-    int         do_free = 0;
+    int         rt = MTRIE3L_SUCCESS;
     mtrie3l_l1* pl1;
     mtrie3l_l2* pl2;
+    void*       pOld;
 
-    if (!p) {
-        return MTRIE3L_ERR;
+    MTRIE3L_GET_INDICES;
+
+    epochReadLock();
+    /*
+     * Reserve the L1 node, installing a new one if there is none
+     */
+    for (;;) {
+        pl1 = MTRIE3L_LOAD(p->l0[l0i]);
+        if (pl1) {
+            if (mtrie3lReserve(&pl1->cnt)) {
+                break;
+            }
+            mtrie3lUnlinkL1(p, l0i, pl1);
+            continue;
+        }
+        pl1 = mtrie3lNewNode(mtrie3lL1nodeSize(p));
+        if (!pl1) {
+            rt = MTRIE3L_ENOMEM;
+            goto out;
+        }
+        pOld = NULL;
+        if (__atomic_compare_exchange_n(&p->l0[l0i], &pOld, pl1, FALSE,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+            mtrie3lOccSetAtomic(mtrie3lOccL0(p), l0i);
+            __atomic_add_fetch(&p->cnt, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&p->nL1, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        FREE_MEM(0, pl1);       /* never published */
     }
-    if (index > mtrie3lGetMaxIndex(p)) {
-        return MTRIE3L_EINDEX;
+    /*
+     * Reserve the L2 node. A new L2 node takes over the reservation
+     * of the L1 node as its count.
+     */
+    for (;;) {
+        pl2 = MTRIE3L_LOAD(pl1->l1[l1i]);
+        if (pl2) {
+            if (mtrie3lReserve(&pl2->cnt)) {
+                mtrie3lReleaseL1(p, l0i, pl1);
+                break;
+            }
+            mtrie3lUnlinkL2(p, pl1, l0i, l1i, pl2);
+            continue;
+        }
+        pl2 = mtrie3lNewNode(mtrie3lL2nodeSize(p));
+        if (!pl2) {
+            mtrie3lReleaseL1(p, l0i, pl1);
+            rt = MTRIE3L_ENOMEM;
+            goto out;
+        }
+        pOld = NULL;
+        if (__atomic_compare_exchange_n(&pl1->l1[l1i], &pOld, pl2, FALSE,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+            mtrie3lOccSetAtomic(mtrie3lOccL1(p, pl1), l1i);
+            __atomic_add_fetch(&p->nL2, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        FREE_MEM(0, pl2);
+    }
+    /*
+     * The reservation of the L2 node becomes the count of the leaf
+     */
+    pOld = NULL;
+    if (__atomic_compare_exchange_n(&pl2->l2[l2i], &pOld, pEnt, FALSE,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        mtrie3lOccSetAtomic(mtrie3lOccL2(p, pl2), l2i);
+        __atomic_add_fetch(&p->num, 1, __ATOMIC_RELAXED);
+    } else {
+        mtrie3lReleaseL2(p, pl1, l0i, l1i, pl2);
+        rt = MTRIE3L_EOCCUPIED;
+    }
+out:
+    epochReadUnlock();
+    return rt;
+}
+
+static void*
+mtrie3lDeleteConcurrent (mtrie3l* p, u32 index)
+{
+    u16         l0i;
+    u16         l1i;
+    u16         l2i;
+    mtrie3l_l1* pl1;
+    mtrie3l_l2* pl2;
+    void*       pEnt = NULL;
+
+    MTRIE3L_GET_INDICES;
+
+    epochReadLock();
+    pl1 = MTRIE3L_LOAD(p->l0[l0i]);
+    if (!pl1) {
+        goto out;
+    }
+    pl2 = MTRIE3L_LOAD(pl1->l1[l1i]);
+    if (!pl2) {
+        goto out;
     }
+    /*
+     * A frozen node has no leaves, so the leaf keeps `pl2' linked
+     */
+    pEnt = MTRIE3L_LOAD(pl2->l2[l2i]);
+    while (pEnt &&
+           !__atomic_compare_exchange_n(&pl2->l2[l2i], &pEnt, NULL, FALSE,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+        ;
+    }
+    if (pEnt) {
+        MTRIE3L_OCC_UNSET(mtrie3lOccL2(p, pl2), l2i, pl2->l2[l2i]);
+        __atomic_sub_fetch(&p->num, 1, __ATOMIC_RELAXED);
+        mtrie3lReleaseL2(p, pl1, l0i, l1i, pl2);
+    }
+out:
+    epochReadUnlock();
+    return pEnt;
+}
+
+/*
+ * Return the leaf slot of `index', allocating the L1 and L2 nodes
+ * on the path if needed, or NULL if there is no memory. An empty
+ * slot is counted as a leaf, and `*pCreated' is set.
+ */
+static void**
+mtrie3lSlot (mtrie3l* p, u32 index, bool* pCreated)
+{
+    u16         l0i;
+    u16         l1i;
+    u16         l2i;
+    int         len;
+    int         do_free = 0;
+    mtrie3l_l1* pl1;
+    mtrie3l_l2* pl2;
 
     MTRIE3L_GET_INDICES;
 
+    *pCreated = FALSE;
     pl1 = p->l0[l0i];           /* level 1 node pointer */
     if (!pl1) {
-        len = sizeof(mtrie3l_l1) + ((1 << p->len[1]) * sizeof(mtrie3l_l2*));
+        len = mtrie3lL1nodeSize(p);
         pl1 = ALLOC_MEM(0, len);
         if (!pl1) {
-            return MTRIE3L_ENOMEM;
+            return NULL;
         }
         memset(pl1, 0, len);
-        p->l0[l0i] = pl1;
+        MTRIE3L_PUBLISH(p->l0[l0i], pl1);
+        mtrie3lOccSet(mtrie3lOccL0(p), l0i);
         ++p->cnt;
         ++p->nL1;
         do_free = 1;
@@ -127,84 +542,132 @@ mtrie3lInsert (mtrie3l* p, u32 index, void* pEnt)
     pl2 = pl1->l1[l1i];         /* level 2 node pointer */
     if (pl2) {
         if (pl2->l2[l2i]) {
-            return MTRIE3L_EOCCUPIED; /* already occupied */
+            return &pl2->l2[l2i]; /* already occupied */
         }
     } else {
-        len = sizeof(mtrie3l_l2) + ((1 << p->len[2]) * sizeof(void*));
+        len = mtrie3lL2nodeSize(p);
         pl2 = ALLOC_MEM(0, len);
         if (!pl2) {
             if (do_free) {
-                FREE_MEM(0, pl1);
-                p->l0[l0i] = NULL;
+                mtrie3lOccClear(mtrie3lOccL0(p), l0i);
+                MTRIE3L_PUBLISH(p->l0[l0i], NULL);
+                mtrie3lFreeNode(p, pl1);
                 --p->cnt;
                 --p->nL1;
             }
-            return MTRIE3L_ENOMEM;
+            return NULL;
         }
         memset(pl2, 0, len);
-        pl1->l1[l1i] = pl2;
+        MTRIE3L_PUBLISH(pl1->l1[l1i], pl2);
+        mtrie3lOccSet(mtrie3lOccL1(p, pl1), l1i);
         ++pl1->cnt;
         ++p->nL2;
     }
-    pl2->l2[l2i] = pEnt;
+    mtrie3lOccSet(mtrie3lOccL2(p, pl2), l2i);
     ++pl2->cnt;
     ++p->num;
+    *pCreated = TRUE;
+    return &pl2->l2[l2i];
+}
+
+int
+mtrie3lInsert (mtrie3l* p, u32 index, void* pEnt)
+{
+    void** ppEnt;
+    bool   created;
+
+    if (!p) {
+        return MTRIE3L_ERR;
+    }
+    if (index > mtrie3lGetMaxIndex(p)) {
+        return MTRIE3L_EINDEX;
+    }
+    if (p->flags & MTRIE3L_CONCURRENT) {
+        return mtrie3lInsertConcurrent(p, index, pEnt);
+    }
+    ppEnt = mtrie3lSlot(p, index, &created);
+    if (!ppEnt) {
+        return MTRIE3L_ENOMEM;
+    }
+    if (!created) {
+        return MTRIE3L_EOCCUPIED; /* already occupied */
+    }
+    MTRIE3L_PUBLISH(*ppEnt, pEnt);
     return MTRIE3L_SUCCESS;
 }
 
-void*
-mtrie3lDelete (mtrie3l* p, u32 index)
+/*
+ * Return the leaf slot of `index' for an update in place, with one
+ * descent. If the slot was empty, `*pCreated' is set and the slot,
+ * now counted as a leaf, must be filled with a non-NULL leaf (with
+ * __atomic_store_n(..., __ATOMIC_RELEASE) in an RCU trie) or freed
+ * with mtrie3lDeleteSlot(). NULL if `index' is too big or there
+ * is no memory.
+ */
+void**
+mtrie3lFindOrInsertSlot (mtrie3l* p, u32 index, bool* pCreated)
 {
     u16         l0i;
     u16         l1i;
     u16         l2i;
     mtrie3l_l1* pl1;
     mtrie3l_l2* pl2;
-    void*       pEnt;
 
-    if (!p) {
-        return NULL;
-    }
-    if (index > mtrie3lGetMaxIndex(p)) {
+    if (!p || !pCreated || (index > mtrie3lGetMaxIndex(p))) {
         return NULL;
     }
 
     MTRIE3L_GET_INDICES;
 
+    /*
+     * Keep the path of an existing leaf as short as that of
+     * mtrie3lFind()
+     */
     pl1 = p->l0[l0i];
-    if (!pl1) {
-        return NULL;
-    }
-    pl2 = pl1->l1[l1i];
-    if (!pl2) {
-        return NULL;
-    }
-    pEnt = pl2->l2[l2i];
-    if (!pEnt) {
-        return NULL;
+    if (pl1) {
+        pl2 = pl1->l1[l1i];
+        if (pl2 && pl2->l2[l2i]) {
+            *pCreated = FALSE;
+            return &pl2->l2[l2i];
+        }
     }
+    return mtrie3lSlot(p, index, pCreated);
+}
+
+/*
+ * Clear the leaf slot `l2i' of `pl2' and free the nodes becoming
+ * empty. Return the leaf.
+ */
+static void*
+mtrie3lClearSlot (mtrie3l* p, mtrie3l_l1* pl1, mtrie3l_l2* pl2,
+                  u16 l0i, u16 l1i, u16 l2i)
+{
+    void* pEnt = pl2->l2[l2i];
+
     /*
-     * Found an enty to delete.
      *  1. Decrement total # of entries
      *  2. Decrement # of entries in the level 2 node
-     *  3. If no entries in the level 2 node, free it, then
+     *  3. If no entries in the level 2 node, unlink and free it, then
      *  4.  Decrement # of entries in the level 1 node
-     *  5.  If no entries in the level 1 node, free it, then
+     *  5.  If no entries in the level 1 node, unlink and free it, then
      *  6.   Decrement # of entries in the level 0 node
      *  7. Return the entry pointer
      */
     --p->num;
-    pl2->l2[l2i] = NULL;
+    mtrie3lOccClear(mtrie3lOccL2(p, pl2), l2i);
+    MTRIE3L_PUBLISH(pl2->l2[l2i], NULL);
     --pl2->cnt;
     if (pl2->cnt == 0) {
-        FREE_MEM(0, pl2);
-        pl1->l1[l1i] = NULL;
+        mtrie3lOccClear(mtrie3lOccL1(p, pl1), l1i);
+        MTRIE3L_PUBLISH(pl1->l1[l1i], NULL);
+        mtrie3lFreeNode(p, pl2);
         --pl1->cnt;
         --p->nL2;
 
         if (pl1->cnt == 0) {
-            FREE_MEM(0, pl1);
-            p->l0[l0i] = NULL;
+            mtrie3lOccClear(mtrie3lOccL0(p), l0i);
+            MTRIE3L_PUBLISH(p->l0[l0i], NULL);
+            mtrie3lFreeNode(p, pl1);
             --p->cnt;
             --p->nL1;
         }
@@ -213,11 +676,13 @@ mtrie3lDelete (mtrie3l* p, u32 index)
 }
 
 void*
-mtrie3lFind (mtrie3l* p, u32 index)
+mtrie3lDelete (mtrie3l* p, u32 index)
 {
-    u16 l0i;
-    u16 l1i;
-    u16 l2i;
+    u16         l0i;
+    u16         l1i;
+    u16         l2i;
+    mtrie3l_l1* pl1;
+    mtrie3l_l2* pl2;
 
     if (!p) {
         return NULL;
@@ -225,95 +690,205 @@ mtrie3lFind (mtrie3l* p, u32 index)
     if (index > mtrie3lGetMaxIndex(p)) {
         return NULL;
     }
+    if (p->flags & MTRIE3L_CONCURRENT) {
+        return mtrie3lDeleteConcurrent(p, index);
+    }
 
     MTRIE3L_GET_INDICES;
 
-    if (!p->l0[l0i]) {
+    pl1 = p->l0[l0i];
+    if (!pl1) {
+        return NULL;
+    }
+    pl2 = pl1->l1[l1i];
+    if (!pl2) {
         return NULL;
     }
-    if (!(p->l0[l0i])->l1[l1i]) {
+    if (!pl2->l2[l2i]) {
         return NULL;
     }
-    return ((p->l0[l0i])->l1[l1i])->l2[l2i];
+    return mtrie3lClearSlot(p, pl1, pl2, l0i, l1i, l2i);
 }
 
 void*
-mtrie3lFindNext (mtrie3l* p, u32* pIndex)
+mtrie3lFind (mtrie3l* p, u32 index)
 {
-    u16         l0n, l1n, l2n;
-    u16         l0i, l1i, l2i;
-    u32         idx, index;
-    u8          cnt[2]; /* # of remaining entries to process at level `i' */
+    u16         l0i;
+    u16         l1i;
+    u16         l2i;
     mtrie3l_l1* pl1;
     mtrie3l_l2* pl2;
+    void*       pEnt = NULL;
 
     if (!p) {
-        goto out;
+        return NULL;
+    }
+    if (index > mtrie3lGetMaxIndex(p)) {
+        return NULL;
     }
-    MTRIE3L_ASSERT(*pIndex <= mtrie3lGetMaxIndex(p));
 
-    l0n   = 1 << p->len[0];     /* # of level 0 entries */
-    l1n   = 1 << p->len[1];     /* # of level 1 entries */
-    l2n   = 1 << p->len[2];     /* # of level 2 entries */
+    MTRIE3L_GET_INDICES;
+
+    MTRIE3L_READ_LOCK(p);
+    pl1 = MTRIE3L_LOAD(p->l0[l0i]);
+    if (pl1) {
+        pl2 = MTRIE3L_LOAD(pl1->l1[l1i]);
+        if (pl2) {
+            pEnt = MTRIE3L_LOAD(pl2->l2[l2i]);
+        }
+    }
+    MTRIE3L_READ_UNLOCK(p);
+    return pEnt;
+}
+
+/*
+ * Look up `n' indices, storing the leaves (or NULL) in `out',
+ * and return the number of leaves found. The lookups proceed
+ * MTRIE3L_FIND_GROUP at a time, one level after another: the
+ * nodes of the next level are prefetched for all the indices
+ * of a group before any of them is read, so that their cache
+ * misses overlap.
+ */
+u32
+mtrie3lFindMany (mtrie3l* p, const u32* idx, void** out, u32 n)
+{
+    u16         l0i, l1i, l2i;
+    u32         i, k, m;
+    u32         index;
+    u32         found = 0;
+    u16         l0[MTRIE3L_FIND_GROUP];
+    u16         l1[MTRIE3L_FIND_GROUP];
+    u16         l2[MTRIE3L_FIND_GROUP];
+    bool        valid[MTRIE3L_FIND_GROUP];
+    mtrie3l_l1* pl1[MTRIE3L_FIND_GROUP];
+    mtrie3l_l2* pl2[MTRIE3L_FIND_GROUP];
+
+    if (!p || !idx || !out) {
+        return 0;
+    }
+    MTRIE3L_READ_LOCK(p);
+    for (i = 0; i < n; i += m) {
+        m = (n - i < MTRIE3L_FIND_GROUP) ? n - i : MTRIE3L_FIND_GROUP;
+        for (k = 0; k < m; ++k) {
+            index    = idx[i + k];
+            valid[k] = (index <= mtrie3lGetMaxIndex(p)) ? TRUE : FALSE;
+            MTRIE3L_GET_INDICES;
+            l0[k] = l0i;
+            l1[k] = l1i;
+            l2[k] = l2i;
+            __builtin_prefetch(&p->l0[l0i]);
+        }
+        for (k = 0; k < m; ++k) {
+            pl1[k] = (valid[k]) ? MTRIE3L_LOAD(p->l0[l0[k]]) : NULL;
+            if (pl1[k]) {
+                __builtin_prefetch(&pl1[k]->l1[l1[k]]);
+            }
+        }
+        for (k = 0; k < m; ++k) {
+            pl2[k] = (pl1[k]) ? MTRIE3L_LOAD(pl1[k]->l1[l1[k]]) : NULL;
+            if (pl2[k]) {
+                __builtin_prefetch(&pl2[k]->l2[l2[k]]);
+            }
+        }
+        for (k = 0; k < m; ++k) {
+            out[i + k] = (pl2[k]) ? MTRIE3L_LOAD(pl2[k]->l2[l2[k]]) : NULL;
+            found += (out[i + k] != NULL);
+        }
+    }
+    MTRIE3L_READ_UNLOCK(p);
+    return found;
+}
+
+static void*
+mtrie3lFindNextInternal (mtrie3l* p, u32* pIndex)
+{
+    u32         l0n, l1n, l2n;
+    u32         l0i, l1i, l2i;
+    u32         i, index;
+    mtrie3l_l1* pl1;
+    mtrie3l_l2* pl2;
+    void*       pEnt;
+
+    l0n   = 1 << p->len[0];     /* # of level 0 entries */
+    l1n   = 1 << p->len[1];     /* # of level 1 entries */
+    l2n   = 1 << p->len[2];     /* # of level 2 entries */
     index = *pIndex;
 
     MTRIE3L_GET_INDICES;
 
-    cnt[0] = p->cnt;
-    for (; l0i < l0n; ++l0i) {
-        if (cnt[0] == 0) {
-            return NULL;
+    /*
+     * The indices at the lower levels restart from 0 once
+     * the search moves to the next element.
+     */
+    for (;;) {
+        i = mtrie3lOccNext(mtrie3lOccL0(p), l0i, l0n);
+        if (i >= l0n) {
+            break;
         }
-        if (!p->l0[l0i]) {
-            continue;
+        if (i != l0i) {
+            l0i = i;
+            l1i = l2i = 0;
         }
-        idx = l0i << (p->len[1] + p->len[2]);
-        pl1 = p->l0[l0i];
-        cnt[0]--;
-        cnt[1] = pl1->cnt;
-        for (; l1i < l1n; ++l1i) {
-            if (cnt[1] == 0) {
+        pl1 = MTRIE3L_LOAD(p->l0[l0i]);
+        while (pl1) {
+            i = mtrie3lOccNext(mtrie3lOccL1(p, pl1), l1i, l1n);
+            if (i >= l1n) {
                 break;
             }
-            if (!pl1->l1[l1i]) {
-                continue;
+            if (i != l1i) {
+                l1i = i;
+                l2i = 0;
             }
-            idx &= ~((1 << (p->len[1] + p->len[2])) - 1);
-            idx |= (l1i << p->len[2]);
-            idx |= l2i;
-            pl2 = pl1->l1[l1i];
-            cnt[1]--;
-            for (; l2i < l2n; ++l2i) {
-                if (pl2->l2[l2i]) {
-                    *pIndex = idx;
-                    return pl2->l2[l2i];
+            pl2 = MTRIE3L_LOAD(pl1->l1[l1i]);
+            if (pl2) {
+                l2i = mtrie3lOccNext(mtrie3lOccL2(p, pl2), l2i, l2n);
+                if (l2i < l2n) {
+                    pEnt = MTRIE3L_LOAD(pl2->l2[l2i]);
+                    if (pEnt) {
+                        *pIndex = (((l0i << p->len[1]) | l1i) << p->len[2]) |
+                                  l2i;
+                        return pEnt;
+                    }
+                    ++l2i;      /* being deleted */
+                    continue;
                 }
-                ++idx;
             }
+            ++l1i;
             l2i = 0;
         }
-        l1i = 0;
+        ++l0i;
+        l1i = l2i = 0;
     }
-out:
     *pIndex = (1 << p->slen);
     return NULL;
 }
 
 void*
-mtrie3lFindPrev (mtrie3l* p, u32* pIndex)
+mtrie3lFindNext (mtrie3l* p, u32* pIndex)
 {
-    u16         l1n, l2n;
-    s32         l0i, l1i, l2i;
-    u32         idx, index;
-    u8          cnt[2]; /* # of remaining entries to process at level `i' */
-    mtrie3l_l1* pl1;
-    mtrie3l_l2* pl2;
-
-    MTRIE3L_ASSERT(*pIndex <= mtrie3lGetMaxIndex(p));
+    void* pEnt;
 
     if (!p) {
-        goto out;
+        return NULL;
     }
+    MTRIE3L_ASSERT(*pIndex <= mtrie3lGetMaxIndex(p));
+
+    MTRIE3L_READ_LOCK(p);
+    pEnt = mtrie3lFindNextInternal(p, pIndex);
+    MTRIE3L_READ_UNLOCK(p);
+    return pEnt;
+}
+
+static void*
+mtrie3lFindPrevInternal (mtrie3l* p, u32* pIndex)
+{
+    s32         l1n, l2n;
+    s32         l0i, l1i, l2i;
+    s32         i;
+    u32         index;
+    mtrie3l_l1* pl1;
+    mtrie3l_l2* pl2;
+    void*       pEnt;
 
     l1n = (1 << p->len[1]) - 1; /* max level 1 index */
     l2n = (1 << p->len[2]) - 1; /* max level 2 index */
@@ -321,136 +896,620 @@ mtrie3lFindPrev (mtrie3l* p, u32* pIndex)
 
     MTRIE3L_GET_INDICES;
 
-    cnt[0] = p->cnt;
-    for (; l0i >= 0; --l0i) {
-        if (cnt[0] == 0) {
-            return NULL;
+    /*
+     * The indices at the lower levels restart from the max
+     * once the search moves to the previous element.
+     */
+    for (;;) {
+        i = mtrie3lOccPrev(mtrie3lOccL0(p), l0i);
+        if (i < 0) {
+            break;
         }
-        if (!p->l0[l0i]) {
-            continue;
+        if (i != l0i) {
+            l0i = i;
+            l1i = l1n;
+            l2i = l2n;
         }
-        idx = l0i << (p->len[1] + p->len[2]);
-        pl1 = p->l0[l0i];
-        cnt[0]--;
-        cnt[1] = pl1->cnt;
-        for (; l1i >= 0; --l1i) {
-            if (cnt[1] == 0) {
+        pl1 = MTRIE3L_LOAD(p->l0[l0i]);
+        while (pl1) {
+            i = mtrie3lOccPrev(mtrie3lOccL1(p, pl1), l1i);
+            if (i < 0) {
                 break;
             }
-            if (!pl1->l1[l1i]) {
-                continue;
+            if (i != l1i) {
+                l1i = i;
+                l2i = l2n;
             }
-            idx &= ~((1 << (p->len[1] + p->len[2])) - 1);
-            idx |= (l1i << p->len[2]);
-            idx |= l2i;
-            pl2 = pl1->l1[l1i];
-            cnt[1]--;
-            for (; l2i >= 0; --l2i) {
-                if (pl2->l2[l2i]) {
-                    *pIndex = idx;
-                    return pl2->l2[l2i];
+            pl2 = MTRIE3L_LOAD(pl1->l1[l1i]);
+            if (pl2) {
+                l2i = mtrie3lOccPrev(mtrie3lOccL2(p, pl2), l2i);
+                if (l2i >= 0) {
+                    pEnt = MTRIE3L_LOAD(pl2->l2[l2i]);
+                    if (pEnt) {
+                        *pIndex = (((l0i << p->len[1]) | l1i) << p->len[2]) |
+                                  l2i;
+                        return pEnt;
+                    }
+                    --l2i;      /* being deleted */
+                    continue;
                 }
-                --idx;
             }
+            --l1i;
             l2i = l2n;
         }
+        --l0i;
         l1i = l1n;
+        l2i = l2n;
     }
-out:
     *pIndex = 0;
     return NULL;
 }
 
+void*
+mtrie3lFindPrev (mtrie3l* p, u32* pIndex)
+{
+    void* pEnt;
+
+    if (!p) {
+        *pIndex = 0;
+        return NULL;
+    }
+    MTRIE3L_ASSERT(*pIndex <= mtrie3lGetMaxIndex(p));
+
+    MTRIE3L_READ_LOCK(p);
+    pEnt = mtrie3lFindPrevInternal(p, pIndex);
+    MTRIE3L_READ_UNLOCK(p);
+    return pEnt;
+}
+
+/*
+ * Move the cursor to the first index of the next element at
+ * the level of which `shift' is the index shift (0: the next leaf).
+ */
+static inline void
+mtrie3lCursorSkip (mtrie3lCursor* c, u32 shift)
+{
+    mtrie3l* p = c->p;
+    u64      next;
+
+    next = ((u64)(c->index >> shift) + 1) << shift;
+    if (next > mtrie3lGetMaxIndex(p)) {
+        c->end = TRUE;
+        return;
+    }
+    c->index = next;
+    if ((next & ((1 << p->len[2]) - 1)) == 0) {
+        c->pl2 = NULL;
+        if ((next & ((1 << (p->len[1] + p->len[2])) - 1)) == 0) {
+            c->pl1 = NULL;
+        }
+    }
+}
+
+/*
+ * Fill `pEnts' with up to `n' leaves from the cursor position.
+ * Must be called in a read-side critical section of an RCU trie.
+ */
+static u32
+mtrie3lCursorFill (mtrie3lCursor* c, mtrie3lEnt* pEnts, u32 n)
+{
+    mtrie3l* p = c->p;
+    u32      l0n, l1n, l2n;
+    u32      l0i, l1i, l2i;
+    u32      i, index;
+    u32      cnt = 0;
+    void*    pEnt;
+
+    l0n = 1 << p->len[0];
+    l1n = 1 << p->len[1];
+    l2n = 1 << p->len[2];
+    while ((cnt < n) && !c->end) {
+        index = c->index;
+        MTRIE3L_GET_INDICES;
+        if (!c->pl1) {
+            i = mtrie3lOccNext(mtrie3lOccL0(p), l0i, l0n);
+            if (i >= l0n) {
+                c->end = TRUE;
+                break;
+            }
+            if (i != l0i) {
+                c->index = i << (p->len[1] + p->len[2]);
+                continue;
+            }
+            c->pl1 = MTRIE3L_LOAD(p->l0[l0i]);
+            if (!c->pl1) {
+                mtrie3lCursorSkip(c, p->len[1] + p->len[2]);
+                continue;
+            }
+        }
+        if (!c->pl2) {
+            i = mtrie3lOccNext(mtrie3lOccL1(p, c->pl1), l1i, l1n);
+            if (i >= l1n) {
+                mtrie3lCursorSkip(c, p->len[1] + p->len[2]);
+                c->pl1 = NULL;
+                continue;
+            }
+            if (i != l1i) {
+                c->index = ((l0i << p->len[1]) | i) << p->len[2];
+                continue;
+            }
+            c->pl2 = MTRIE3L_LOAD(c->pl1->l1[l1i]);
+            if (!c->pl2) {
+                mtrie3lCursorSkip(c, p->len[2]);
+                continue;
+            }
+        }
+        index &= ~(l2n - 1);
+        for (l2i = mtrie3lOccNext(mtrie3lOccL2(p, c->pl2), l2i, l2n);
+             l2i < l2n;
+             l2i = mtrie3lOccNext(mtrie3lOccL2(p, c->pl2), l2i + 1, l2n)) {
+            if (cnt == n) {
+                break;
+            }
+            pEnt = MTRIE3L_LOAD(c->pl2->l2[l2i]);
+            if (pEnt) {
+                pEnts[cnt].index = index | l2i;
+                pEnts[cnt].pEnt  = pEnt;
+                ++cnt;
+            }
+        }
+        if (l2i < l2n) {
+            c->index = index | l2i;
+        } else {
+            c->index = index;
+            mtrie3lCursorSkip(c, p->len[2]);
+        }
+    }
+    return cnt;
+}
+
+void
+mtrie3lCursorSeek (mtrie3lCursor* c, u32 index)
+{
+    c->pl1   = NULL;
+    c->pl2   = NULL;
+    c->index = index;
+    c->end   = (index > mtrie3lGetMaxIndex(c->p)) ? TRUE : FALSE;
+}
+
+void
+mtrie3lCursorInit (mtrie3lCursor* c, mtrie3l* p, u32 index)
+{
+    c->p = p;
+    mtrie3lCursorSeek(c, index);
+}
+
+/*
+ * Fill `pEnts' with the next `n' leaves at most and return
+ * their number; 0 once all the leaves have been visited.
+ */
+u32
+mtrie3lCursorNext (mtrie3lCursor* c, mtrie3lEnt* pEnts, u32 n)
+{
+    u32 cnt;
+
+    if (!c || !c->p || !pEnts) {
+        return 0;
+    }
+    MTRIE3L_READ_LOCK(c->p);
+    cnt = mtrie3lCursorFill(c, pEnts, n);
+    if (c->p->flags & MTRIE3L_RCU) {
+        c->pl1 = NULL;          /* may be freed after the grace period */
+        c->pl2 = NULL;
+    }
+    MTRIE3L_READ_UNLOCK(c->p);
+    return cnt;
+}
+
+/*
+ * Delete the leaf at `index' of the cursor's trie and return it
+ * (NULL if none). The L1 and L2 nodes the cursor is in are used
+ * instead of a descent, so deleting the leaves returned by
+ * mtrie3lCursorNext() costs no descent, and the cursor stays
+ * valid. Also frees a slot returned by mtrie3lFindOrInsertSlot()
+ * before it is filled.
+ */
+void*
+mtrie3lDeleteSlot (mtrie3lCursor* c, u32 index)
+{
+    u16         l0i;
+    u16         l1i;
+    u16         l2i;
+    u32         shift;
+    mtrie3l*    p;
+    mtrie3l_l1* pl1;
+    mtrie3l_l2* pl2;
+
+    if (!c || !c->p || (index > mtrie3lGetMaxIndex(c->p))) {
+        return NULL;
+    }
+    p = c->p;
+
+    MTRIE3L_GET_INDICES;
+
+    shift = p->len[1] + p->len[2];
+    if (c->pl1 && ((index >> shift) == (c->index >> shift))) {
+        pl1 = c->pl1;
+    } else {
+        pl1 = p->l0[l0i];
+        if (!pl1) {
+            return NULL;
+        }
+    }
+    if (c->pl2 && ((index >> p->len[2]) == (c->index >> p->len[2]))) {
+        pl2 = c->pl2;
+    } else {
+        pl2 = pl1->l1[l1i];
+        if (!pl2) {
+            return NULL;
+        }
+    }
+    if (!mtrie3lOccIsSet(mtrie3lOccL2(p, pl2), l2i)) {
+        return NULL;
+    }
+    if (pl2->cnt == 1) {
+        /*
+         * The L2 node, and the L1 node if it has no other
+         * L2 nodes, are to be freed
+         */
+        if (c->pl2 == pl2) {
+            c->pl2 = NULL;
+        }
+        if ((pl1->cnt == 1) && (c->pl1 == pl1)) {
+            c->pl1 = NULL;
+        }
+    }
+    return mtrie3lClearSlot(p, pl1, pl2, l0i, l1i, l2i);
+}
+
 static int
 mtrie3lWalkInternal (mtrie3l* p, void *pData,
                      void (*f)(u32, void*, void*), int free_node)
 {
-    u8    l0i, l0n;
-    u8    l1i, l1n;
-    u8    l2i, l2n;
-    u8    cnt[3]; /* # of remaining entries to process at level `i' */
+    u32   l0i, l0n;
+    u32   l1i, l1n;
+    u32   l2i, l2n;
     u32   idx;
+    u32*  pOcc[3];              /* occupancy bitmaps at level `i' */
     mtrie3l_l1* pl1;
     mtrie3l_l2* pl2;
-
-    if ((!p) || (!f)) {
-        return MTRIE3L_ERR;
-    }
+    void*       pEnt;
 
     l0n = 1 << p->len[0];       /* # of level 0 entries */
     l1n = 1 << p->len[1];       /* # of level 1 entries */
     l2n = 1 << p->len[2];       /* # of level 2 entries */
-    cnt[0] = p->cnt;
-    for (l0i = 0; l0i < l0n; ++l0i) {
-        if (cnt[0] == 0) {
-            if (free_node) {
-                /*
-                 * reset level 0 counters
-                 */
-                p->cnt = 0;
-                p->num = 0;
-            }
-            return MTRIE3L_SUCCESS; /* optimization */
-        }
-        if (!p->l0[l0i]) {
+    pOcc[0] = mtrie3lOccL0(p);
+    for (l0i = mtrie3lOccNext(pOcc[0], 0, l0n); l0i < l0n;
+         l0i = mtrie3lOccNext(pOcc[0], l0i + 1, l0n)) {
+        pl1 = MTRIE3L_LOAD(p->l0[l0i]);
+        if (!pl1) {
             continue;
         }
-        idx = l0i << (p->len[1] + p->len[2]);
-        pl1 = p->l0[l0i];
-        cnt[0]--;
-        cnt[1] = pl1->cnt;
-        for (l1i = 0; l1i < l1n; ++l1i) {
-            if (cnt[1] == 0) {
-                break;
-            }
-            if (!pl1->l1[l1i]) {
+        if (free_node) {
+            /*
+             * Unlink the level 1 node first because readers
+             * of an RCU trie may still be walking it.
+             */
+            mtrie3lOccClear(pOcc[0], l0i);
+            MTRIE3L_PUBLISH(p->l0[l0i], NULL);
+        }
+        pOcc[1] = mtrie3lOccL1(p, pl1);
+        for (l1i = mtrie3lOccNext(pOcc[1], 0, l1n); l1i < l1n;
+             l1i = mtrie3lOccNext(pOcc[1], l1i + 1, l1n)) {
+            pl2 = MTRIE3L_LOAD(pl1->l1[l1i]);
+            if (!pl2) {
                 continue;
             }
-            idx &= ~((1 << (p->len[1] + p->len[2])) - 1);
-            idx |= (l1i << p->len[2]);
-            pl2 = pl1->l1[l1i];
-            cnt[1]--;
-            cnt[2] = pl2->cnt;
-            for (l2i = 0; l2i < l2n; ++l2i) {
-                if (cnt[2] == 0) {
-                    break;
-                }
-                if (pl2->l2[l2i]) {
-                    (*f)(idx, pData, pl2->l2[l2i]);
-                    --cnt[2];
+            idx = ((l0i << p->len[1]) | l1i) << p->len[2];
+            pOcc[2] = mtrie3lOccL2(p, pl2);
+            for (l2i = mtrie3lOccNext(pOcc[2], 0, l2n); l2i < l2n;
+                 l2i = mtrie3lOccNext(pOcc[2], l2i + 1, l2n)) {
+                pEnt = MTRIE3L_LOAD(pl2->l2[l2i]);
+                if (pEnt) {
+                    (*f)(idx | l2i, pData, pEnt);
                 }
-                ++idx;
             }
             if (free_node) {
                 /*
                  * no need to set pl1->l1[l1i] to NULL
                  * since the node is freed anyway.
                  */
-                FREE_MEM(0, pl2);
+                mtrie3lFreeNode(p, pl2);
             }
         }
         if (free_node) {
-            /*
-             * Need to set p->l0[l0i] to NULL because
-             * the trie itself may not be freed.
-             */
-            FREE_MEM(0, pl1);
-            p->l0[l0i] = NULL;
+            mtrie3lFreeNode(p, pl1);
         }
     }
+    if (free_node) {
+        /*
+         * reset level 0 counters
+         */
+        p->cnt = 0;
+        p->num = 0;
+        p->nL1 = 0;
+        p->nL2 = 0;
+    }
     return MTRIE3L_SUCCESS;
 }
 
+
 int
 mtrie3lWalk (mtrie3l* p, void *pData,
              void (*f)(u32 index, void* pData, void* pEnt))
 {
-    return mtrie3lWalkInternal(p, pData, f, MTRIE3L_KEEP_ENT);
+    int rc;
+
+    if ((!p) || (!f)) {
+        return MTRIE3L_ERR;
+    }
+    MTRIE3L_READ_LOCK(p);
+    rc = mtrie3lWalkInternal(p, pData, f, MTRIE3L_KEEP_ENT);
+    MTRIE3L_READ_UNLOCK(p);
+    return rc;
+}
+
+/*
+ * Call `f' for every leaf whose index is in [lo, hi].
+ */
+int
+mtrie3lWalkRange (mtrie3l* p, u32 lo, u32 hi,
+                  void (*f)(u32 index, void* pData, void* pEnt),
+                  void* pData)
+{
+    mtrie3lEnt    ents[64];
+    mtrie3lCursor c;
+    u32           i, n;
+
+    if ((!p) || (!f)) {
+        return MTRIE3L_ERR;
+    }
+    MTRIE3L_READ_LOCK(p);
+    mtrie3lCursorInit(&c, p, lo);
+    while ((n = mtrie3lCursorFill(&c, ents, elementsOf(ents))) != 0) {
+        for (i = 0; i < n; ++i) {
+            if (ents[i].index > hi) {
+                goto done;
+            }
+            (*f)(ents[i].index, pData, ents[i].pEnt);
+        }
+    }
+done:
+    MTRIE3L_READ_UNLOCK(p);
+    return MTRIE3L_SUCCESS;
 }
 
 int
 mtrie3lDeleteAll (mtrie3l* p,
                   void (*delEnt)(u32 index, void* dummy, void* pEnt))
 {
+    if ((!p) || (!delEnt)) {
+        return MTRIE3L_ERR;
+    }
     return mtrie3lWalkInternal(p, NULL, delEnt, MTRIE3L_DEL_ENT);
 }
+
+
+/*
+ * Value leaves (mtrie3l-val.h)
+ */
+static inline void*
+mtrie3lValPtr (mtrie3l* p, mtrie3l_vl2* pl2, u32 l2i, u32 size)
+{
+    return (u8*)pl2 + mtrie3lValOffset(p) + (l2i * size);
+}
+
+/*
+ * Return in `*ppVal' the value of `index' and MTRIE3L_EOCCUPIED
+ * if it exists, or allocate the value (and the nodes on the path)
+ * and return MTRIE3L_SUCCESS.
+ */
+int
+mtrie3lValSlot (mtrie3l* p, u32 index, u32 size, void** ppVal)
+{
+    u16          l0i;
+    u16          l1i;
+    u16          l2i;
+    int          do_free = 0;
+    mtrie3l_l1*  pl1;
+    mtrie3l_vl2* pl2;
+
+    if (!p || !ppVal) {
+        return MTRIE3L_ERR;
+    }
+    if (index > mtrie3lGetMaxIndex(p)) {
+        return MTRIE3L_EINDEX;
+    }
+
+    MTRIE3L_GET_INDICES;
+
+    pl1 = p->l0[l0i];
+    if (!pl1) {
+        pl1 = ALLOC_MEM(0, mtrie3lL1nodeSize(p));
+        if (!pl1) {
+            return MTRIE3L_ENOMEM;
+        }
+        memset(pl1, 0, mtrie3lL1nodeSize(p));
+        p->l0[l0i] = pl1;
+        mtrie3lOccSet(mtrie3lOccL0(p), l0i);
+        ++p->cnt;
+        ++p->nL1;
+        do_free = 1;
+    }
+    pl2 = (mtrie3l_vl2*)pl1->l1[l1i];
+    if (!pl2) {
+        pl2 = ALLOC_MEM(0, mtrie3lValL2nodeSize(p, size));
+        if (!pl2) {
+            if (do_free) {
+                mtrie3lOccClear(mtrie3lOccL0(p), l0i);
+                p->l0[l0i] = NULL;
+                FREE_MEM(0, pl1);
+                --p->cnt;
+                --p->nL1;
+            }
+            return MTRIE3L_ENOMEM;
+        }
+        memset(pl2, 0, mtrie3lValOffset(p));
+        pl1->l1[l1i] = (mtrie3l_l2*)pl2;
+        mtrie3lOccSet(mtrie3lOccL1(p, pl1), l1i);
+        ++pl1->cnt;
+        ++p->nL2;
+    }
+    *ppVal = mtrie3lValPtr(p, pl2, l2i, size);
+    if (mtrie3lOccIsSet(pl2->occ, l2i)) {
+        return MTRIE3L_EOCCUPIED;
+    }
+    mtrie3lOccSet(pl2->occ, l2i);
+    ++pl2->cnt;
+    ++p->num;
+    return MTRIE3L_SUCCESS;
+}
+
+void*
+mtrie3lValFind (mtrie3l* p, u32 index, u32 size)
+{
+    u16          l0i;
+    u16          l1i;
+    u16          l2i;
+    mtrie3l_l1*  pl1;
+    mtrie3l_vl2* pl2;
+
+    if (!p || (index > mtrie3lGetMaxIndex(p))) {
+        return NULL;
+    }
+
+    MTRIE3L_GET_INDICES;
+
+    pl1 = p->l0[l0i];
+    if (!pl1) {
+        return NULL;
+    }
+    pl2 = (mtrie3l_vl2*)pl1->l1[l1i];
+    if (!pl2 || !mtrie3lOccIsSet(pl2->occ, l2i)) {
+        return NULL;
+    }
+    return mtrie3lValPtr(p, pl2, l2i, size);
+}
+
+void*
+mtrie3lValFindNext (mtrie3l* p, u32* pIndex, u32 size)
+{
+    u32          l0n, l1n, l2n;
+    u32          l0i, l1i, l2i;
+    u32          i, index;
+    mtrie3l_l1*  pl1;
+    mtrie3l_vl2* pl2;
+
+    if (!p) {
+        return NULL;
+    }
+    MTRIE3L_ASSERT(*pIndex <= mtrie3lGetMaxIndex(p));
+
+    l0n   = 1 << p->len[0];
+    l1n   = 1 << p->len[1];
+    l2n   = 1 << p->len[2];
+    index = *pIndex;
+
+    MTRIE3L_GET_INDICES;
+
+    for (l0i = mtrie3lOccNext(mtrie3lOccL0(p), l0i, l0n); l0i < l0n;
+         l0i = mtrie3lOccNext(mtrie3lOccL0(p), l0i + 1, l0n)) {
+        if (l0i != (index >> (p->len[1] + p->len[2]))) {
+            l1i = l2i = 0;
+        }
+        pl1 = p->l0[l0i];
+        for (l1i = mtrie3lOccNext(mtrie3lOccL1(p, pl1), l1i, l1n); l1i < l1n;
+             l1i = mtrie3lOccNext(mtrie3lOccL1(p, pl1), l1i + 1, l1n)) {
+            i = (l0i << p->len[1]) | l1i;
+            if (i != (index >> p->len[2])) {
+                l2i = 0;
+            }
+            pl2 = (mtrie3l_vl2*)pl1->l1[l1i];
+            l2i = mtrie3lOccNext(pl2->occ, l2i, l2n);
+            if (l2i < l2n) {
+                *pIndex = (i << p->len[2]) | l2i;
+                return mtrie3lValPtr(p, pl2, l2i, size);
+            }
+        }
+    }
+    *pIndex = (1 << p->slen);
+    return NULL;
+}
+
+int
+mtrie3lValDelete (mtrie3l* p, u32 index, u32 size, void* pVal)
+{
+    u16          l0i;
+    u16          l1i;
+    u16          l2i;
+    mtrie3l_l1*  pl1;
+    mtrie3l_vl2* pl2;
+
+    if (!p) {
+        return MTRIE3L_ERR;
+    }
+    if (index > mtrie3lGetMaxIndex(p)) {
+        return MTRIE3L_EINDEX;
+    }
+
+    MTRIE3L_GET_INDICES;
+
+    pl1 = p->l0[l0i];
+    if (!pl1) {
+        return MTRIE3L_ERR;
+    }
+    pl2 = (mtrie3l_vl2*)pl1->l1[l1i];
+    if (!pl2 || !mtrie3lOccIsSet(pl2->occ, l2i)) {
+        return MTRIE3L_ERR;
+    }
+    if (pVal) {
+        memcpy(pVal, mtrie3lValPtr(p, pl2, l2i, size), size);
+    }
+    --p->num;
+    mtrie3lOccClear(pl2->occ, l2i);
+    if (--pl2->cnt == 0) {
+        mtrie3lOccClear(mtrie3lOccL1(p, pl1), l1i);
+        pl1->l1[l1i] = NULL;
+        FREE_MEM(0, pl2);
+        --pl1->cnt;
+        --p->nL2;
+        if (pl1->cnt == 0) {
+            mtrie3lOccClear(mtrie3lOccL0(p), l0i);
+            p->l0[l0i] = NULL;
+            FREE_MEM(0, pl1);
+            --p->cnt;
+            --p->nL1;
+        }
+    }
+    return MTRIE3L_SUCCESS;
+}
+
+int
+mtrie3lValDeleteAll (mtrie3l* p)
+{
+    u32         l0i, l0n;
+    u32         l1i, l1n;
+    mtrie3l_l1* pl1;
+
+    if (!p) {
+        return MTRIE3L_ERR;
+    }
+    l0n = 1 << p->len[0];
+    l1n = 1 << p->len[1];
+    for (l0i = mtrie3lOccNext(mtrie3lOccL0(p), 0, l0n); l0i < l0n;
+         l0i = mtrie3lOccNext(mtrie3lOccL0(p), l0i + 1, l0n)) {
+        pl1 = p->l0[l0i];
+        for (l1i = mtrie3lOccNext(mtrie3lOccL1(p, pl1), 0, l1n); l1i < l1n;
+             l1i = mtrie3lOccNext(mtrie3lOccL1(p, pl1), l1i + 1, l1n)) {
+            FREE_MEM(0, pl1->l1[l1i]);
+        }
+        FREE_MEM(0, pl1);
+        p->l0[l0i] = NULL;
+    }
+    memset(mtrie3lOccL0(p), 0, mtrie3lOccWords(p->len[0]) * sizeof(u32));
+    p->cnt = 0;
+    p->num = 0;
+    p->nL1 = 0;
+    p->nL2 = 0;
+    return MTRIE3L_SUCCESS;
+}
@@ -30,11 +30,22 @@
  */
 
 #include "local_types.h"
+#include "epoch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 typedef struct mtrie3l_l0_ mtrie3l;
 
 
+/*
+ * Every node of a trie allocated by mtrie3lAlloc() is followed by
+ * an occupancy bitmap with one bit per element of its array
+ * (mtrie3lOccWords() words), set while the element is not NULL.
+ */
+
 /*
  * Level 2 node
  */
@@ -48,6 +59,7 @@ typedef struct mtrie3l_l2_ {
  */
 typedef struct trie3l_l1_ {
     u16         cnt;            /* number of subnodes in this node */
+    u16         ref;            /* # of extra owners (used by tbitmap) */
     mtrie3l_l2* l1[0];          /* array of pointers to L2 nodes */
 } mtrie3l_l1;
 
@@ -62,8 +74,13 @@ struct mtrie3l_l0_ {
     u32         nL2;         /* number of level 2 nodes */
     void*       pPriv;       /* pointer for user's private data */
     u8          len[3];      /* stride length for L0, L1, and L2 */
+    u8          flags;       /* See the enum below */
     mtrie3l_l1* l0[0];       /* array of pointers to L1 nodes */
 };
+enum {
+    MTRIE3L_RCU = 1,    /* bit 0: readers are protected by epochs */
+    MTRIE3L_CONCURRENT = 2, /* bit 1: writers need no lock */
+};
 
 enum {
     MTRIE3L_SUCCESS   =  0,
@@ -75,6 +92,29 @@ enum {
     MTRIE3L_ESLEN     = -6,     /* too large stride length */
 };
 
+/*
+ * Cursor
+ *
+ * A cursor visits the leaves in index order. It keeps the L1 and
+ * L2 nodes it is in between calls to mtrie3lCursorNext(), so the
+ * trie is descended once per L2 node rather than once per leaf.
+ * mtrie3lInsert() and mtrie3lDelete() may free or replace those
+ * nodes: call mtrie3lCursorSeek() after updating the trie. A cursor
+ * of an RCU trie keeps the nodes only during a call.
+ */
+typedef struct mtrie3lEnt_ {
+    u32   index;
+    void* pEnt;
+} mtrie3lEnt;
+
+typedef struct mtrie3lCursor_ {
+    mtrie3l*    p;
+    mtrie3l_l1* pl1;            /* L1 node of `index' or NULL */
+    mtrie3l_l2* pl2;            /* L2 node of `index' or NULL */
+    u32         index;          /* next index to visit */
+    bool        end;            /* no more leaves */
+} mtrie3lCursor;
+
 #define MTRIE3L_GET_INDICES \
 do {\
     l0i = (index >> (p->len[1]+p->len[2])) & ((1 << p->len[0]) - 1);\
@@ -83,10 +123,10 @@ do {\
 } while (0)
 
 #ifndef MTRIE3L_READ_LOCK
-#define MTRIE3L_READ_LOCK(_p_)   /* lock the trie from reading */
+#define MTRIE3L_READ_LOCK(_p_)   mtrie3lReadLock((_p_))
 #endif
 #ifndef MTRIE3L_READ_UNLOCK
-#define MTRIE3L_READ_UNLOCK(_p_) /* unlock the trie from reading */
+#define MTRIE3L_READ_UNLOCK(_p_) mtrie3lReadUnlock((_p_))
 #endif
 
 /*
@@ -95,22 +135,49 @@ do {\
 mtrie3l* mtrie3lAlloc  (u8 sl0,  /* L0 stride length */
                         u8 sl1,  /* L1 stride length */
                         u8 sl2); /* L2 stride length */
+mtrie3l* mtrie3lAllocRcu (u8 sl0, u8 sl1, u8 sl2);
+mtrie3l* mtrie3lAllocConcurrent (u8 sl0, u8 sl1, u8 sl2);
 int   mtrie3lFree      (mtrie3l *p);
 int   mtrie3lInsert    (mtrie3l* p, u32 index, void* pleaf);
 void* mtrie3lDelete    (mtrie3l* p, u32 index);
+void** mtrie3lFindOrInsertSlot (mtrie3l* p, u32 index, bool* pCreated);
+void*  mtrie3lDeleteSlot       (mtrie3lCursor* c, u32 index);
 int   mtrie3lDeleteAll (mtrie3l* p,
                         void (*delEnt)(u32 index, void *dummy, void* pEnt));
 int   mtrie3lWalk      (mtrie3l* p, void *pData,
                         void (*f)(u32 index, void* pData, void* pEnt));
+int   mtrie3lWalkRange (mtrie3l* p, u32 lo, u32 hi,
+                        void (*f)(u32 index, void* pData, void* pEnt),
+                        void* pData);
 void* mtrie3lFind      (mtrie3l* p, u32 index);
+u32   mtrie3lFindMany  (mtrie3l* p, const u32* idx, void** out, u32 n);
 void* mtrie3lFindNext  (mtrie3l* p, u32* pIndex);
 void* mtrie3lFindPrev  (mtrie3l* p, u32* pIndex);
+void  mtrie3lCursorInit (mtrie3lCursor* c, mtrie3l* p, u32 index);
+void  mtrie3lCursorSeek (mtrie3lCursor* c, u32 index);
+u32   mtrie3lCursorNext (mtrie3lCursor* c, mtrie3lEnt* pEnts, u32 n);
 
 const revNum* mtrie3lRevision        (void);
 const char*   mtrie3lCompilationDate (void);
 
 
 
+static inline void
+mtrie3lReadLock (mtrie3l* p)
+{
+    if (p->flags & MTRIE3L_RCU) {
+        epochReadLock();
+    }
+}
+
+static inline void
+mtrie3lReadUnlock (mtrie3l* p)
+{
+    if (p->flags & MTRIE3L_RCU) {
+        epochReadUnlock();
+    }
+}
+
 static inline u32
 mtrie3lGetMaxIndex (mtrie3l* p)
 {
@@ -135,22 +202,31 @@ mtrie3lNumL2 (mtrie3l* p)
     return p->nL2;
 }
 
+static inline u32
+mtrie3lOccWords (u8 len)
+{
+    return ((1 << len) + 31) >> 5;
+}
+
 static inline u32
 mtrie3lL0nodeSize (mtrie3l* p)
 {
-    return sizeof(mtrie3l) + ((1 << p->len[0])*sizeof(mtrie3l_l1*));
+    return sizeof(mtrie3l) + ((1 << p->len[0])*sizeof(mtrie3l_l1*)) +
+        (mtrie3lOccWords(p->len[0])*sizeof(u32));
 }
 
 static inline u32
 mtrie3lL1nodeSize (mtrie3l* p)
 {
-    return sizeof(mtrie3l_l1) + ((1 << p->len[1])*sizeof(mtrie3l_l2*));
+    return sizeof(mtrie3l_l1) + ((1 << p->len[1])*sizeof(mtrie3l_l2*)) +
+        (mtrie3lOccWords(p->len[1])*sizeof(u32));
 }
 
 static inline u32
 mtrie3lL2nodeSize (mtrie3l* p)
 {
-    return sizeof(mtrie3l_l2) + ((1 << p->len[2])*sizeof(void*));
+    return sizeof(mtrie3l_l2) + ((1 << p->len[2])*sizeof(void*)) +
+        (mtrie3lOccWords(p->len[2])*sizeof(u32));
 }
 
 static inline u32
@@ -472,5 +548,53 @@ mtrie3lNbytesL2 (mtrie3l* p)
  *  output:
  *    None.
  *
+ *
+ * 19. RCU trie
+ *
+ * mtrie3l* mtrie3lAllocRcu(u8 sl0, u8 sl1, u8 sl2);
+ *
+ *  Same as mtrie3lAlloc() but lookups (mtrie3lFind(),
+ *  mtrie3lFindNext(), mtrie3lFindPrev() and mtrie3lWalk()) may
+ *  run concurrently with one writer without a lock.
+ *  Readers only announce the current epoch (see epoch.h)
+ *  through MTRIE3L_READ_LOCK(). The writer publishes new nodes
+ *  with release stores and frees L1 and L2 nodes with
+ *  epochRetire().
+ *
+ *  - Writers (mtrie3lInsert(), mtrie3lDelete() and
+ *    mtrie3lDeleteAll()) must still be serialized by the caller.
+ *  - A leaf returned by a lookup is only protected while the
+ *    caller holds epochReadLock(). Free deleted leaves with
+ *    epochRetire() if readers use them after the lookup.
+ *  - (*f)() of mtrie3lWalk() runs in a read-side critical
+ *    section and must not call epochSynchronize().
+ *  - Call epochSynchronize() before mtrie3lFree().
+ *
+ *
+ * 20. Concurrent trie
+ *
+ * mtrie3l* mtrie3lAllocConcurrent(u8 sl0, u8 sl1, u8 sl2);
+ *
+ *  Same as mtrie3lAllocRcu() but any number of threads may also
+ *  call mtrie3lInsert() and mtrie3lDelete() at the same time
+ *  without a lock. New L1 and L2 nodes and leaves are installed
+ *  with compare-and-swap; the loser of a race for a leaf slot
+ *  gets MTRIE3L_EOCCUPIED. Emptied nodes are released with
+ *  epochRetire().
+ *
+ *  - The stride lengths must be less than 16 (NULL otherwise):
+ *    `cnt' of the nodes also counts the writers about to fill
+ *    them, and 0xffff marks a node being unlinked.
+ *  - mtrie3lNumEntries(), mtrie3lNumL1() and mtrie3lNumL2() are
+ *    exact only when no writer is running.
+ *  - mtrie3lFindOrInsertSlot(), mtrie3lDeleteSlot() and
+ *    mtrie3lDeleteAll() must not run with any other writer.
+ *  - Writers retire nodes on the calling thread: call
+ *    epochThreadExit() before a writer thread exits.
+ *
  */
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __MTRIE3L_H__ */
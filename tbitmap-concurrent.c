@@ -0,0 +1,498 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-concurrent.c: lock-free operations on a shared tBitMap
+ *                       (TBITMAP_CONCURRENT)
+ *
+ *  - Leaf bitmaps are updated with atomic fetch-or and fetch-and.
+ *  - L1 and L2 nodes are installed with compare-and-swap on
+ *    p->l0[] and pl1->l1[].
+ *  - An L2 node whose bitmaps become all 0 or all 1 is replaced
+ *    by NULL or TBITMAP_TAG_FULL. The replacing thread freezes the
+ *    L1 entry (TBITMAP_TAG_FROZEN, plus TBITMAP_TAG_FULL if the
+ *    node is to be replaced by TBITMAP_TAG_FULL). Any thread that
+ *    finds the entry frozen, the replacing one included, checks the
+ *    bitmaps again and swaps the entry with the replacement, or
+ *    with a copy of the node if a bitmap has changed (thawL2()).
+ *    The thread whose swap succeeds retires the node with
+ *    epochRetire(). No thread waits for another.
+ *  - An L2 node set or reset as a whole is swapped with
+ *    TBITMAP_TAG_FULL or NULL without freezing it.
+ *  - An updater reads the L1 entry again after its atomic update
+ *    and starts over if the entry has changed meanwhile, so no
+ *    update is lost in a node being replaced.
+ *  - L1 nodes are only freed by tBitMapSetResetAll() and
+ *    tBitMapFree(), which must not run concurrently with others.
+ *  - p->nL1 and p->nL2 are exact. p->num, pl2->cnt and pl2->nSetAll
+ *    are relaxed: they may be slightly off after racing updates.
+ *    cnt and nSetAll are only used as hints to replace a node.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "epoch.h"
+#include "tbitmap-private.h"
+
+#define LOAD(_ptr_)            __atomic_load_n((_ptr_), __ATOMIC_ACQUIRE)
+#define LOAD_SC(_ptr_)         __atomic_load_n((_ptr_), __ATOMIC_SEQ_CST)
+#define STORE(_ptr_, _val_)    __atomic_store_n((_ptr_), (_val_), \
+                                                __ATOMIC_RELEASE)
+#define CAS(_ptr_, _pexp_, _val_) \
+        __atomic_compare_exchange_n((_ptr_), (_pexp_), (_val_), FALSE, \
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define INC(_ptr_, _val_)      __atomic_add_fetch((_ptr_), (_val_), \
+                                                  __ATOMIC_RELAXED)
+#define DEC(_ptr_, _val_)      __atomic_sub_fetch((_ptr_), (_val_), \
+                                                  __ATOMIC_RELAXED)
+
+
+static inline mtrie3l_l2*
+tagPtr (void* ptr, uintptr_t tag)
+{
+    return (mtrie3l_l2*)((uintptr_t)ptr | tag);
+}
+
+static void
+freeL2 (void* ptr)
+{
+    FREE_MEM(MEM_TBITMAP, ptr);
+}
+
+/*
+ * Return the L1 node at p->l0[l0i].
+ * Install a new one if there is none and `alloc' is TRUE.
+ */
+static mtrie3l_l1*
+getL1 (tBitMap* pMap, u32 l0i, bool alloc)
+{
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l1* pl1;
+    mtrie3l_l1* cur = NULL;
+
+    pl1 = LOAD(&p->l0[l0i]);
+    if (pl1 || !alloc) {
+        return pl1;
+    }
+    pl1 = ALLOC_MEM(MEM_TBITMAP, l1NodeSize(p));
+    if (!pl1) {
+        return NULL;
+    }
+    memset(pl1, 0, l1NodeSize(p));
+    if (CAS(&p->l0[l0i], &cur, pl1)) {
+        INC(&p->nL1, 1);
+        TBITMAP_COUNT(pMap, nAllocL1, 1);
+        return pl1;
+    }
+    FREE_MEM(MEM_TBITMAP, pl1);  /* lost the race */
+    return cur;
+}
+
+/*
+ * Finish the replacement of the L2 node frozen at pl1->l1[l1i]
+ * (`ent'): replace it by TBITMAP_TAG_FULL if `ent' is tagged
+ * TBITMAP_TAG_FULL and all its bitmaps are ~0, by NULL if it is not
+ * and they are all 0, or by a copy of it otherwise. The entry never
+ * goes back to the frozen node, so a thread that checked the bitmaps
+ * earlier cannot swap an entry frozen again later.
+ * The caller must hold epochReadLock().
+ */
+static int
+thawL2 (tBitMap* pMap, mtrie3l_l1* pl1, u32 l1i, mtrie3l_l2* ent)
+{
+    mtrie3l*    p    = pMap->pTrie;
+    tBitMapL2*  pl2  = getPtr(tBitMapL2, ent);
+    tBitMapL2*  pNew = NULL;
+    bool        full = (getPtrTag(ent) & TBITMAP_TAG_FULL) != 0;
+    u32         val  = (full) ? ~0 : 0;
+    mtrie3l_l2* repl = (full) ? tagPtr(NULL, TBITMAP_TAG_FULL) : NULL;
+    u32         i, w;
+
+    for (i = 0; i < nL2elm(p); ++i) {
+        if (LOAD_SC(&pl2->bitmap[i]) != val) {
+            break;
+        }
+    }
+    if (i < nL2elm(p)) {
+        pNew = ALLOC_MEM(MEM_TBITMAP, l2NodeSize(p));
+        if (!pNew) {
+            return TBITMAP_ENOMEM;
+        }
+        memset(pNew, 0, sizeof(*pNew));
+        for (i = 0; i < nL2elm(p); ++i) {
+            w = LOAD_SC(&pl2->bitmap[i]);
+            pNew->bitmap[i] = w;
+            pNew->cnt     += (w != 0);
+            pNew->nSetAll += (w == ~0);
+        }
+        repl = (mtrie3l_l2*)pNew;
+    }
+    if (!CAS(&pl1->l1[l1i], &ent, repl)) {
+        if (pNew) {
+            FREE_MEM(MEM_TBITMAP, pNew);
+        }
+        return TBITMAP_SUCCESS; /* someone else did it */
+    }
+    if (pNew) {
+        TBITMAP_COUNT(pMap, nAllocL2, 1);
+    } else {
+        if (full) {
+            TBITMAP_COUNT(pMap, nCompress, 1);
+        } else {
+            DEC(&pl1->cnt, 1);
+        }
+        DEC(&p->nL2, 1);
+    }
+    TBITMAP_COUNT(pMap, nFreeL2, 1);
+    epochRetire(pl2, freeL2);
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Replace the L2 node `pl2' at pl1->l1[l1i] by NULL (val == 0)
+ * or TBITMAP_TAG_FULL (val == ~0) if all its bitmaps are `val'.
+ * If there is no memory to copy the node when they are not, the
+ * entry stays frozen until the next update of the node thaws it.
+ */
+static void
+collapseL2 (tBitMap* pMap, mtrie3l_l1* pl1, u32 l1i, tBitMapL2* pl2, u32 val)
+{
+    mtrie3l_l2* cur = (mtrie3l_l2*)pl2;
+    mtrie3l_l2* frozen;
+
+    frozen = tagPtr(pl2, TBITMAP_TAG_FROZEN | ((val) ? TBITMAP_TAG_FULL : 0));
+    if (!CAS(&pl1->l1[l1i], &cur, frozen)) {
+        return;                 /* someone else did or is doing it */
+    }
+    thawL2(pMap, pl1, l1i, frozen);
+}
+
+/*
+ * Set or reset all the bits in the L2 node at pl1->l1[l1i].
+ */
+static int
+setResetL2 (tBitMap* pMap, mtrie3l_l1* pl1, u32 l1i, bool isSet)
+{
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l2* ent;
+    mtrie3l_l2* repl;
+    tBitMapL2*  pl2;
+    u32         i, nz;
+    int         rt;
+
+    repl = (isSet) ? tagPtr(NULL, TBITMAP_TAG_FULL) : NULL;
+    for (;;) {
+        ent = LOAD_SC(&pl1->l1[l1i]);
+        if (ent == repl) {
+            return TBITMAP_SUCCESS;
+        }
+        if (getPtrTag(ent) & TBITMAP_TAG_FROZEN) {
+            rt = thawL2(pMap, pl1, l1i, ent);
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+            continue;
+        }
+        if (getPtrTag(ent) == TBITMAP_TAG_FULL) {
+            if (CAS(&pl1->l1[l1i], &ent, repl)) {
+                DEC(&p->num, nL2elm(p));
+                DEC(&pl1->cnt, 1);
+                return TBITMAP_SUCCESS;
+            }
+            continue;
+        }
+        if (ent == NULL) {
+            if (CAS(&pl1->l1[l1i], &ent, repl)) {
+                INC(&p->num, nL2elm(p));
+                INC(&pl1->cnt, 1);
+                return TBITMAP_SUCCESS;
+            }
+            continue;
+        }
+        /*
+         * Updaters that still write into pl2 find the entry changed
+         * and do it again on `repl'. pl2 stays readable until the
+         * epoch ends.
+         */
+        pl2 = (tBitMapL2*)ent;
+        if (!CAS(&pl1->l1[l1i], &ent, repl)) {
+            continue;
+        }
+        for (nz = 0, i = 0; i < nL2elm(p); ++i) {
+            if (LOAD_SC(&pl2->bitmap[i])) {
+                ++nz;
+            }
+        }
+        if (isSet) {
+            INC(&p->num, nL2elm(p) - nz);
+            TBITMAP_COUNT(pMap, nCompress, 1);
+        } else {
+            DEC(&p->num, nz);
+            DEC(&pl1->cnt, 1);
+        }
+        DEC(&p->nL2, 1);
+        TBITMAP_COUNT(pMap, nFreeL2, 1);
+        epochRetire(pl2, freeL2);
+        return TBITMAP_SUCCESS;
+    }
+}
+
+/*
+ * Set or reset `bits' of bitmap[l2i] in the L2 node at pl1->l1[l1i].
+ */
+static int
+setResetWord (tBitMap* pMap, mtrie3l_l1* pl1, u32 l1i, u32 l2i,
+              u32 bits, bool isSet)
+{
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l2* ent;
+    tBitMapL2*  pl2;
+    u32         old;
+    u32         new;
+    int         rt;
+
+    for (;;) {
+        ent = LOAD_SC(&pl1->l1[l1i]);
+        if (getPtrTag(ent) & TBITMAP_TAG_FROZEN) {
+            rt = thawL2(pMap, pl1, l1i, ent);
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+            continue;
+        }
+        if (getPtrTag(ent) == TBITMAP_TAG_FULL) {
+            if (isSet) {
+                return TBITMAP_SUCCESS; /* already set */
+            }
+            /*
+             * Uncompress: install a full L2 node with `bits' reset
+             */
+            pl2 = ALLOC_MEM(MEM_TBITMAP, l2NodeSize(p));
+            if (!pl2) {
+                return TBITMAP_ENOMEM;
+            }
+            memset(pl2->bitmap, ~0, nL2elm(p) * sizeof(u32));
+            pl2->ref     = 0;
+            pl2->bitmap[l2i] = ~bits;
+            pl2->cnt     = nL2elm(p) - ((bits == ~0) ? 1 : 0);
+            pl2->nSetAll = nL2elm(p) - 1;
+            if (CAS(&pl1->l1[l1i], &ent, (mtrie3l_l2*)pl2)) {
+                INC(&p->nL2, 1);
+                TBITMAP_COUNT(pMap, nAllocL2, 1);
+                TBITMAP_COUNT(pMap, nDecompress, 1);
+                if (bits == ~0) {
+                    DEC(&p->num, 1);
+                }
+                return TBITMAP_SUCCESS;
+            }
+            FREE_MEM(MEM_TBITMAP, pl2);
+            continue;
+        }
+        if (ent == NULL) {
+            if (!isSet) {
+                return TBITMAP_SUCCESS; /* already reset */
+            }
+            pl2 = ALLOC_MEM(MEM_TBITMAP, l2NodeSize(p));
+            if (!pl2) {
+                return TBITMAP_ENOMEM;
+            }
+            memset(pl2, 0, l2NodeSize(p));
+            pl2->bitmap[l2i] = bits;
+            pl2->cnt     = 1;
+            pl2->nSetAll = (bits == ~0) ? 1 : 0;
+            if (CAS(&pl1->l1[l1i], &ent, (mtrie3l_l2*)pl2)) {
+                INC(&p->nL2, 1);
+                TBITMAP_COUNT(pMap, nAllocL2, 1);
+                INC(&pl1->cnt, 1);
+                INC(&p->num, 1);
+                return TBITMAP_SUCCESS;
+            }
+            FREE_MEM(MEM_TBITMAP, pl2);
+            continue;
+        }
+
+        pl2 = (tBitMapL2*)ent;
+        if (isSet) {
+            old = __atomic_fetch_or(&pl2->bitmap[l2i], bits,
+                                    __ATOMIC_SEQ_CST);
+            new = old | bits;
+        } else {
+            old = __atomic_fetch_and(&pl2->bitmap[l2i], ~bits,
+                                     __ATOMIC_SEQ_CST);
+            new = old & ~bits;
+        }
+        if (LOAD_SC(&pl1->l1[l1i]) != ent) {
+            continue;           /* node is being replaced: do it again */
+        }
+        if (old == new) {
+            return TBITMAP_SUCCESS;
+        }
+        if (old == 0) {
+            INC(&pl2->cnt, 1);
+            INC(&p->num, 1);
+        }
+        if (old == ~0) {
+            DEC(&pl2->nSetAll, 1);
+        }
+        if (new == ~0) {
+            if (INC(&pl2->nSetAll, 1) == nL2elm(p)) {
+                collapseL2(pMap, pl1, l1i, pl2, ~0);
+            }
+        } else if (new == 0) {
+            DEC(&p->num, 1);
+            if (DEC(&pl2->cnt, 1) == 0) {
+                collapseL2(pMap, pl1, l1i, pl2, 0);
+            }
+        }
+        return TBITMAP_SUCCESS;
+    }
+}
+
+static int
+setResetFlat (tBitMap* pMap, u32 start, u32 end, bool isSet)
+{
+    u32  i, last;
+    u32  bits;
+    u32  old;
+    u32* pw = pMap->pFlat;
+    mtrie3l* p = pMap->pTrie;
+
+    last = end >> 5;
+    for (i = start >> 5; i <= last; ++i) {
+        bits = setBits32((i == (start >> 5)) ? getPos(start) : 0,
+                         (i == last) ? getPos(end) : posMask());
+        if (isSet) {
+            old = __atomic_fetch_or(&pw[i], bits, __ATOMIC_RELAXED);
+            if (old == 0) {
+                INC(&p->num, 1);
+            }
+        } else {
+            old = __atomic_fetch_and(&pw[i], ~bits, __ATOMIC_RELAXED);
+            if (old && ((old & ~bits) == 0)) {
+                DEC(&p->num, 1);
+            }
+        }
+    }
+    return TBITMAP_SUCCESS;
+}
+
+bool
+tBitMapIsSetConcurrent (tBitMap* pMap, u32 bitPos)
+{
+    u16 l0i;
+    u16 l1i;
+    u16 l2i;
+    u32 index;
+    bool        rt = FALSE;
+    mtrie3l*    p;
+    mtrie3l_l1* pl1;
+    mtrie3l_l2* ent;
+    tBitMapL2*  pl2;
+
+    if (tBitMapIsFlat(pMap)) {
+        return (__atomic_load_n(&pMap->pFlat[bitPos >> 5],
+                                __ATOMIC_RELAXED) >> getPos(bitPos)) & 1;
+    }
+    index = bitPos >> 5;
+    p = pMap->pTrie;
+    MTRIE3L_GET_INDICES;
+
+    epochReadLock();
+    pl1 = LOAD(&p->l0[l0i]);
+    if (pl1) {
+        ent = LOAD(&pl1->l1[l1i]);
+        if (getPtrTag(ent) == TBITMAP_TAG_FULL) {
+            rt = TRUE;
+        } else {
+            pl2 = getPtr(tBitMapL2, ent);
+            if (pl2) {
+                rt = (__atomic_load_n(&pl2->bitmap[l2i], __ATOMIC_RELAXED) >>
+                      getPos(bitPos)) & 1;
+            }
+        }
+    }
+    epochReadUnlock();
+    return rt;
+}
+
+/*
+ * Set or reset bits from `start' to `end'. L2 nodes entirely
+ * in the range are replaced at once by setResetL2().
+ */
+int
+tBitMapSetResetConcurrent (tBitMap* pMap, u32 start, u32 end, bool isSet)
+{
+    u16 l0i;
+    u16 l1i;
+    u16 l2i;
+    u32 index;
+    u32 first, last;
+    u32 bits;
+    int rt = TBITMAP_SUCCESS;
+    mtrie3l*    p;
+    mtrie3l_l1* pl1;
+
+    if (tBitMapIsFlat(pMap)) {
+        return setResetFlat(pMap, start, end, isSet);
+    }
+    p     = pMap->pTrie;
+    first = start >> 5;
+    last  = end >> 5;
+    for (index = first; index <= last; ) {
+        MTRIE3L_GET_INDICES;
+        epochReadLock();
+        pl1 = getL1(pMap, l0i, isSet);
+        if (!pl1) {
+            epochReadUnlock();
+            if (isSet) {
+                return TBITMAP_ENOMEM;
+            }
+            /* nothing to reset under this L1 node */
+            index = (index | ((nL1elm(p) * nL2elm(p)) - 1)) + 1;
+            continue;
+        }
+        if ((l2i == 0) &&
+            ((index > first) || (getPos(start) == 0)) &&
+            ((index + nL2elm(p) - 1 < last) ||
+             ((index + nL2elm(p) - 1 == last) &&
+              (getPos(end) == posMask())))) {
+            rt = setResetL2(pMap, pl1, l1i, isSet);
+            epochReadUnlock();
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+            index += nL2elm(p);
+            continue;
+        }
+        bits = setBits32((index == first) ? getPos(start) : 0,
+                         (index == last) ? getPos(end) : posMask());
+        rt = setResetWord(pMap, pl1, l1i, l2i, bits, isSet);
+        epochReadUnlock();
+        if (rt != TBITMAP_SUCCESS) {
+            return rt;
+        }
+        ++index;
+    }
+    return rt;
+}
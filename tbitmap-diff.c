@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-diff.c: differences between two tBitMaps as ranges
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "tbitmap-private.h"
+
+enum {
+    TBITMAP_DIFF_MAX_L2 = 1 << 8, /* max # of bitmaps in L2 */
+};
+
+typedef struct diffCtx_ {
+    tBitMapDiffFn f;
+    void*         pArg;
+    int           rt;           /* first non-zero value returned by f */
+    bool          pending;      /* TRUE if [start, end] is not reported */
+    bool          isSet;        /* type of the pending range */
+    u32           start;
+    u32           end;
+    u32           ones[TBITMAP_DIFF_MAX_L2]; /* bitmaps of a full node */
+} diffCtx;
+
+
+static void
+flushRange (diffCtx* c)
+{
+    if (c->pending && (c->rt == TBITMAP_SUCCESS)) {
+        c->rt = (*c->f)(c->pArg, c->start, c->end, c->isSet);
+    }
+    c->pending = FALSE;
+}
+
+/*
+ * Report bits [start, end] as added (isSet) or removed, merging
+ * them into the pending range if adjacent.
+ */
+static void
+addRange (diffCtx* c, u32 start, u32 end, bool isSet)
+{
+    if (c->pending && (c->isSet == isSet) && (c->end + 1 == start)) {
+        c->end = end;
+        return;
+    }
+    flushRange(c);
+    c->pending = TRUE;
+    c->isSet   = isSet;
+    c->start   = start;
+    c->end     = end;
+}
+
+/*
+ * Return the bitmaps of the L2 node at `slot', NULL if they are
+ * all 0, or c->ones if they are all 1.
+ */
+static const u32*
+slotWords (diffCtx* c, tBitMap* pMap, mtrie3l_l1* pl1, u32 slot)
+{
+    mtrie3l* p = pMap->pTrie;
+    u32      l1i;
+
+    if (tBitMapIsFlat(pMap)) {
+        return pMap->pFlat + (slot * nL2elm(p));
+    }
+    if (!pl1) {
+        return NULL;
+    }
+    if (tBitMapIsFullL1(pl1)) {
+        return c->ones;
+    }
+    l1i = slot & (nL1elm(p) - 1);
+    if (getPtrTag(pl1->l1[l1i]) & TBITMAP_TAG_FULL) {
+        return c->ones;
+    }
+    return (pl1->l1[l1i]) ?
+        getPtr(tBitMapL2, pl1->l1[l1i])->bitmap : NULL;
+}
+
+/*
+ * Compare the bitmaps `pa' and `pb' (NULL: all 0) starting
+ * at bit position `base'.
+ */
+static void
+diffWords (diffCtx* c, u32 base, const u32* pa, const u32* pb, u32 n)
+{
+    u32  i;
+    u32  wa, wb;
+    u32  diff, m;
+    u32  s, len;
+    bool isSet;
+
+    if (pa == pb) {
+        return;
+    }
+    if ((!pa && (pb == c->ones)) || (!pb && (pa == c->ones))) {
+        addRange(c, base, base + (n << 5) - 1, pb == c->ones);
+        return;
+    }
+    for (i = 0; i < n; ++i, base += 32) {
+        wa   = (pa) ? pa[i] : 0;
+        wb   = (pb) ? pb[i] : 0;
+        diff = wa ^ wb;
+        while (diff) {
+            s     = __builtin_ctz(diff);
+            isSet = (wb >> s) & 1;
+            m     = ((isSet) ? (diff & wb) : (diff & wa)) >> s;
+            len   = (~m) ? __builtin_ctz(~m) : 32 - s;
+            addRange(c, base + s, base + s + len - 1, isSet);
+            diff &= ~setBits32(s, s + len - 1);
+        }
+    }
+}
+
+int
+tBitMapDiff (tBitMap* pA, tBitMap* pB, tBitMapDiffFn f, void* pArg)
+{
+    u32         l0i, l0n;
+    u32         l1i, l1n;
+    u32         l2n;
+    u32         slot;
+    mtrie3l*    pa;
+    mtrie3l*    pb;
+    mtrie3l_l1* pl1a = NULL;
+    mtrie3l_l1* pl1b = NULL;
+    diffCtx     c;
+
+    if (!pA || !pB || !f) {
+        return TBITMAP_ERR;
+    }
+    pa = pA->pTrie;
+    pb = pB->pTrie;
+    if (memcmp(pa->len, pb->len, sizeof(pa->len)) != 0) {
+        return TBITMAP_ERR;     /* different geometries */
+    }
+    l0n = 1 << pa->len[0];
+    l1n = nL1elm(pa);
+    l2n = nL2elm(pa);
+    if (l2n > TBITMAP_DIFF_MAX_L2) {
+        return TBITMAP_ESLEN;
+    }
+    c.f       = f;
+    c.pArg    = pArg;
+    c.rt      = TBITMAP_SUCCESS;
+    c.pending = FALSE;
+    memset(c.ones, ~0, l2n * sizeof(u32));
+
+    for (l0i = 0; (l0i < l0n) && (c.rt == TBITMAP_SUCCESS); ++l0i) {
+        if (!tBitMapIsFlat(pA)) {
+            pl1a = pa->l0[l0i];
+        }
+        if (!tBitMapIsFlat(pB)) {
+            pl1b = pb->l0[l0i];
+        }
+        if (!tBitMapIsFlat(pA) && !tBitMapIsFlat(pB) && (pl1a == pl1b)) {
+            continue;           /* both empty or shared by a snapshot */
+        }
+        for (l1i = 0; l1i < l1n; ++l1i) {
+            if (pl1a && pl1b && !tBitMapIsFullL1(pl1a) &&
+                !tBitMapIsFullL1(pl1b) && (pl1a->l1[l1i] == pl1b->l1[l1i])) {
+                continue;       /* same L2 node or same tag */
+            }
+            slot = (l0i << pa->len[1]) | l1i;
+            diffWords(&c, slot * (l2n << 5),
+                      slotWords(&c, pA, pl1a, slot),
+                      slotWords(&c, pB, pl1b, slot), l2n);
+        }
+    }
+    flushRange(&c);
+    return c.rt;
+}
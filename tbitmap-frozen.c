@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-frozen.c: read-only tBitMap in one relocatable buffer
+ *
+ * A frozen bitmap is a header followed by the L0, L1 and L2 nodes.
+ * Nodes refer to each other with u32 byte offsets from the start
+ * of the buffer, so it can be written to a file and mmap()ed at
+ * any address by any number of processes. Integers are in the
+ * host byte order; a buffer frozen on a host of the other byte
+ * order is rejected by the magic number.
+ *
+ *  header:  frozenHdr
+ *  L0 node: u32[1 << len[0]]: 0 (empty) or offset of an L1 node
+ *  L1 node: u32[1 << len[1]]: 0 (empty), TBITMAP_TAG_FULL (all the
+ *           bits are set) or offset of an L2 node
+ *  L2 node: u32[1 << len[2]]: bitmaps
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tbitmap-private.h"
+
+enum {
+    TBITMAP_FROZEN_MAGIC   = 0x5a424d54, /* "TMBZ" */
+    TBITMAP_FROZEN_VERSION = 1,
+};
+
+typedef struct frozenHdr_ {
+    u32 magic;                  /* TBITMAP_FROZEN_MAGIC */
+    u16 version;                /* TBITMAP_FROZEN_VERSION */
+    u8  len[3];                 /* stride lengths of L0, L1 and L2 */
+    u8  flags;                  /* TBITMAP_IS_FLIPPED */
+    u32 maxPos;                 /* max bit position */
+    u32 nL1;                    /* number of L1 nodes */
+    u32 nL2;                    /* number of L2 nodes */
+    u32 rsvd;
+    u64 size;                   /* total size in bytes */
+    u64 nBits;                  /* number of set bits */
+} frozenHdr;
+
+struct tBitMapFrozen_ {
+    const u8*        base;      /* start of the buffer */
+    const frozenHdr* pHdr;
+    u64              size;      /* size of the buffer */
+    bool             mapped;    /* TRUE if base is mmap()ed */
+};
+
+static const u32 FullSlot[1];   /* marker of a full L2 node */
+
+
+/*
+ * Return the bitmaps of the L2 node at `slot' ((L0 index << len[1])
+ * | L1 index) of a live bitmap, NULL if they are all 0, or FullSlot
+ * if they are all ~0.
+ */
+static const u32*
+slotWords (tBitMap* pMap, u32 slot)
+{
+    u32         i;
+    u32         n;
+    bool        zero = TRUE;
+    bool        full = TRUE;
+    const u32*  pw;
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l1* pl1;
+    tBitMapL2*  pl2;
+
+    n = nL2elm(p);
+    if (tBitMapIsFlat(pMap)) {
+        pw = pMap->pFlat + (slot * n);
+        for (i = 0; i < n; ++i) {
+            zero = zero && (pw[i] == 0);
+            full = full && (pw[i] == ~0);
+        }
+        return (zero) ? NULL : (full) ? FullSlot : pw;
+    }
+    pl1 = p->l0[slot >> p->len[1]];
+    if (!pl1) {
+        return NULL;
+    }
+    if (tBitMapIsFullL1(pl1) ||
+        (getPtrTag(pl1->l1[slot & (nL1elm(p) - 1)]) & TBITMAP_TAG_FULL)) {
+        return FullSlot;
+    }
+    pl2 = getPtr(tBitMapL2, pl1->l1[slot & (nL1elm(p) - 1)]);
+    return (pl2) ? pl2->bitmap : NULL;
+}
+
+static inline u32*
+at (void* base, u32 off)
+{
+    return (u32*)((u8*)base + off);
+}
+
+int
+tBitMapFreeze (tBitMap* pMap, void** ppBuf, u64* pSize)
+{
+    u32        slot, nSlots;
+    u32        l0i, l1i;
+    u32        l1n, l2n;
+    u32        off;
+    u32        i;
+    u64        size;
+    const u32* pw;
+    frozenHdr* pHdr;
+    mtrie3l*   p;
+    u8*        base;
+    u32        nL1 = 0;
+    u32        nL2 = 0;
+
+    if (!pMap || !ppBuf || !pSize) {
+        return TBITMAP_ERR;
+    }
+    p      = pMap->pTrie;
+    l1n    = nL1elm(p);
+    l2n    = nL2elm(p);
+    nSlots = 1 << (p->len[0] + p->len[1]);
+
+    /*
+     * Pass 1: count the nodes
+     */
+    for (l0i = 0; l0i < (1 << p->len[0]); ++l0i) {
+        for (i = 0, l1i = 0; l1i < l1n; ++l1i) {
+            pw = slotWords(pMap, (l0i << p->len[1]) | l1i);
+            if (pw) {
+                ++i;
+                nL2 += (pw != FullSlot);
+            }
+        }
+        nL1 += (i > 0);
+    }
+    size = sizeof(frozenHdr) + ((1 << p->len[0]) * sizeof(u32)) +
+           ((u64)nL1 * l1n * sizeof(u32)) + ((u64)nL2 * l2n * sizeof(u32));
+    if (size > (u32)~0) {
+        return TBITMAP_ENOMEM;  /* offsets would not fit in u32 */
+    }
+    base = ALLOC_MEM(MEM_TBITMAP, size);
+    if (!base) {
+        return TBITMAP_ENOMEM;
+    }
+    memset(base, 0, size);
+
+    /*
+     * Pass 2: copy the nodes
+     */
+    pHdr = (frozenHdr*)base;
+    pHdr->magic   = TBITMAP_FROZEN_MAGIC;
+    pHdr->version = TBITMAP_FROZEN_VERSION;
+    memcpy(pHdr->len, p->len, sizeof(pHdr->len));
+    pHdr->flags   = pMap->flags & TBITMAP_IS_FLIPPED;
+    pHdr->maxPos  = pMap->maxPos;
+    pHdr->nL1     = nL1;
+    pHdr->nL2     = nL2;
+    pHdr->size    = size;
+    off = sizeof(frozenHdr) + ((1 << p->len[0]) * sizeof(u32));
+    for (slot = 0; slot < nSlots; ++slot) {
+        pw = slotWords(pMap, slot);
+        if (!pw) {
+            continue;
+        }
+        l0i = slot >> p->len[1];
+        l1i = slot & (l1n - 1);
+        if (at(base, sizeof(frozenHdr))[l0i] == 0) {
+            at(base, sizeof(frozenHdr))[l0i] = off;
+            off += l1n * sizeof(u32);
+        }
+        if (pw == FullSlot) {
+            at(base, at(base, sizeof(frozenHdr))[l0i])[l1i] =
+                TBITMAP_TAG_FULL;
+            pHdr->nBits += (u64)l2n << 5;
+            continue;
+        }
+        at(base, at(base, sizeof(frozenHdr))[l0i])[l1i] = off;
+        memcpy(at(base, off), pw, l2n * sizeof(u32));
+        for (i = 0; i < l2n; ++i) {
+            pHdr->nBits += __builtin_popcount(pw[i]);
+        }
+        off += l2n * sizeof(u32);
+    }
+    TBITMAP_ASSERT(off == size);
+    *ppBuf = base;
+    *pSize = size;
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Return TRUE if `off' is a valid offset of a node of `n' u32s.
+ */
+static inline bool
+validNode (tBitMapFrozen* pF, u32 off, u32 n)
+{
+    return ((off & 3) == 0) && (off >= sizeof(frozenHdr)) &&
+           ((u64)off + (n * sizeof(u32)) <= pF->size);
+}
+
+static int
+frozenCheck (tBitMapFrozen* pF)
+{
+    u32        l0i, l1i;
+    u32        l0n, l1n, l2n;
+    const u32* pl0;
+    const u32* pl1;
+    const frozenHdr* pHdr = pF->pHdr;
+
+    if ((pF->size < sizeof(frozenHdr)) ||
+        (pHdr->magic != TBITMAP_FROZEN_MAGIC) ||
+        (pHdr->version != TBITMAP_FROZEN_VERSION) ||
+        (pHdr->size != pF->size) ||
+        (pHdr->len[0] + pHdr->len[1] + pHdr->len[2] + 5 > TBITMAP_MAX_BITS) ||
+        (pHdr->maxPos !=
+         (1 << (pHdr->len[0] + pHdr->len[1] + pHdr->len[2] + 5)) - 1)) {
+        return TBITMAP_ERR;
+    }
+    l0n = 1 << pHdr->len[0];
+    l1n = 1 << pHdr->len[1];
+    l2n = 1 << pHdr->len[2];
+    if (!validNode(pF, sizeof(frozenHdr), l0n)) {
+        return TBITMAP_ERR;
+    }
+    pl0 = (const u32*)(pF->base + sizeof(frozenHdr));
+    for (l0i = 0; l0i < l0n; ++l0i) {
+        if (pl0[l0i] == 0) {
+            continue;
+        }
+        if (!validNode(pF, pl0[l0i], l1n)) {
+            return TBITMAP_ERR;
+        }
+        pl1 = (const u32*)(pF->base + pl0[l0i]);
+        for (l1i = 0; l1i < l1n; ++l1i) {
+            if ((pl1[l1i] > TBITMAP_TAG_FULL) &&
+                !validNode(pF, pl1[l1i], l2n)) {
+                return TBITMAP_ERR;
+            }
+        }
+    }
+    return TBITMAP_SUCCESS;
+}
+
+tBitMapFrozen*
+tBitMapOpenFrozen (const void* pBuf, u64 size)
+{
+    tBitMapFrozen* pF;
+
+    if (!pBuf || ((uintptr_t)pBuf & 7)) {
+        return NULL;
+    }
+    pF = ALLOC_MEM(MEM_TBITMAP, sizeof(*pF));
+    if (!pF) {
+        return NULL;
+    }
+    pF->base   = pBuf;
+    pF->pHdr   = pBuf;
+    pF->size   = size;
+    pF->mapped = FALSE;
+    if (frozenCheck(pF) != TBITMAP_SUCCESS) {
+        FREE_MEM(MEM_TBITMAP, pF);
+        return NULL;
+    }
+    return pF;
+}
+
+tBitMapFrozen*
+tBitMapOpenMapped (const char* path)
+{
+    int            fd;
+    void*          base;
+    struct stat    st;
+    tBitMapFrozen* pF;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(frozenHdr))) {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    pF = tBitMapOpenFrozen(base, st.st_size);
+    if (!pF) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    pF->mapped = TRUE;
+    return pF;
+}
+
+void
+tBitMapCloseFrozen (tBitMapFrozen* pF)
+{
+    if (!pF) {
+        return;
+    }
+    if (pF->mapped) {
+        munmap((void*)pF->base, pF->size);
+    }
+    FREE_MEM(MEM_TBITMAP, pF);
+}
+
+/*
+ * Return the L1 node at L0 index `l0i', or NULL.
+ */
+static inline const u32*
+frozenL1 (const tBitMapFrozen* pF, u32 l0i)
+{
+    u32 off = ((const u32*)(pF->base + sizeof(frozenHdr)))[l0i];
+
+    return (off) ? (const u32*)(pF->base + off) : NULL;
+}
+
+bool
+tBitMapFrozenIsSet (const tBitMapFrozen* pF, u32 bitPos)
+{
+    u32        index;
+    u32        ent;
+    const u32* pl1;
+    const u8*  len = pF->pHdr->len;
+
+    if (bitPos > pF->pHdr->maxPos) {
+        return FALSE;
+    }
+    index = bitPos >> 5;
+    pl1 = frozenL1(pF, index >> (len[1] + len[2]));
+    if (!pl1) {
+        return FALSE;
+    }
+    ent = pl1[(index >> len[2]) & ((1 << len[1]) - 1)];
+    if (ent <= TBITMAP_TAG_FULL) {
+        return (ent == TBITMAP_TAG_FULL);
+    }
+    return (((const u32*)(pF->base + ent))[index & ((1 << len[2]) - 1)] >>
+            getPos(bitPos)) & 1;
+}
+
+bool
+tBitMapFrozenFindNext (const tBitMapFrozen* pF, u32* pBitPos)
+{
+    u32        bitPos = *pBitPos;
+    u32        l0i, l1i, l2i;
+    u32        l0n, l1n, l2n;
+    u32        ent;
+    u32        w;
+    const u32* pl1;
+    const u32* pl2;
+    const u8*  len = pF->pHdr->len;
+
+    if (bitPos > pF->pHdr->maxPos) {
+        return FALSE;
+    }
+    l0n = 1 << len[0];
+    l1n = 1 << len[1];
+    l2n = 1 << len[2];
+    l0i = bitPos >> (len[1] + len[2] + 5);
+    l1i = (bitPos >> (len[2] + 5)) & (l1n - 1);
+    l2i = (bitPos >> 5) & (l2n - 1);
+    w   = ((u32)~0) << getPos(bitPos); /* bits to look at in 1st bitmap */
+    for (; l0i < l0n; ++l0i, l1i = 0) {
+        pl1 = frozenL1(pF, l0i);
+        if (!pl1) {
+            l2i = 0;
+            w   = ~0;
+            continue;
+        }
+        for (; l1i < l1n; ++l1i, l2i = 0, w = ~0) {
+            ent = pl1[l1i];
+            if (ent == 0) {
+                continue;
+            }
+            bitPos = ((((l0i << len[1]) | l1i) << len[2]) | l2i) << 5;
+            if (ent == TBITMAP_TAG_FULL) {
+                *pBitPos = bitPos + __builtin_ctz(w);
+                return TRUE;
+            }
+            pl2 = (const u32*)(pF->base + ent);
+            for (; l2i < l2n; ++l2i, w = ~0, bitPos += 32) {
+                if (pl2[l2i] & w) {
+                    *pBitPos = bitPos + __builtin_ctz(pl2[l2i] & w);
+                    return TRUE;
+                }
+            }
+        }
+    }
+    return FALSE;
+}
+
+u64
+tBitMapFrozenCount (const tBitMapFrozen* pF)
+{
+    return pF->pHdr->nBits;
+}
+
+u32
+tBitMapFrozenMaxPos (const tBitMapFrozen* pF)
+{
+    return pF->pHdr->maxPos;
+}
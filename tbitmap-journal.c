@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-journal.c: journal of the updates of a tBitMap and
+ *                    tracking of the L2 nodes to checkpoint
+ *
+ * A journal record is little endian:
+ *  u32 (op << 30) | start
+ *  u32 end                 (TBITMAP_OP_RESET_BLOCK and
+ *                           TBITMAP_OP_SET_BLOCK only)
+ * tBitMapSetResetAll() is journaled as a block [0, maxPos].
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "tbitmap-private.h"
+
+enum {
+    TBITMAP_OP_RESET       = 0, /* reset bit `start' */
+    TBITMAP_OP_SET         = 1, /* set bit `start' */
+    TBITMAP_OP_RESET_BLOCK = 2, /* reset bits [start, end] */
+    TBITMAP_OP_SET_BLOCK   = 3, /* set bits [start, end] */
+    TBITMAP_OP_SHIFT       = 30,
+};
+
+
+static bool
+isLoggable (tBitMap* pMap)
+{
+    return !(tBitMapIsConcurrent(pMap) || tBitMapIsStriped(pMap) ||
+             tBitMapIsSnapshot(pMap));
+}
+
+int
+tBitMapSetJournal (tBitMap* pMap, tBitMapWriteFn f, void* pArg)
+{
+    if (!pMap || !isLoggable(pMap)) {
+        return TBITMAP_ERR;
+    }
+    pMap->journalFn  = f;
+    pMap->journalArg = (f) ? pArg : NULL;
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Start tracking the updated L2 nodes with no node marked,
+ * or stop it.
+ */
+int
+tBitMapTrackDirty (tBitMap* pMap, bool enable)
+{
+    u32 len;
+
+    if (!pMap || !isLoggable(pMap)) {
+        return TBITMAP_ERR;
+    }
+    if (!enable) {
+        if (pMap->pDirty) {
+            FREE_MEM(MEM_TBITMAP, pMap->pDirty);
+            pMap->pDirty = NULL;
+        }
+        return TBITMAP_SUCCESS;
+    }
+    len = ((tBitMapNumSlots(pMap) + 31) >> 5) * sizeof(u32);
+    if (!pMap->pDirty) {
+        pMap->pDirty = ALLOC_MEM(MEM_TBITMAP, len);
+        if (!pMap->pDirty) {
+            return TBITMAP_ENOMEM;
+        }
+    }
+    memset(pMap->pDirty, 0, len);
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Mark the L2 nodes (slots) [first, last] dirty.
+ */
+static void
+markDirty (u32* pDirty, u32 first, u32 last)
+{
+    u32 i;
+
+    for (i = first >> 5; i <= (last >> 5); ++i) {
+        pDirty[i] |= setBits32((i == (first >> 5)) ? (first & 31) : 0,
+                               (i == (last >> 5)) ? (last & 31) : 31);
+    }
+}
+
+static void
+putLE (u8* p, u32 val)
+{
+    u32 i;
+
+    for (i = 0; i < 4; ++i, val >>= 8) {
+        p[i] = (u8)val;
+    }
+}
+
+static u32
+getLE (const u8* p)
+{
+    return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) |
+           ((u32)p[3] << 24);
+}
+
+/*
+ * Called after a successful update of bits [start, end].
+ */
+int
+tBitMapLog (tBitMap* pMap, u32 start, u32 end, bool isSet)
+{
+    u8  rec[8];
+    u32 op;
+    u32 shift = pMap->pTrie->len[2] + 5;
+
+    if (pMap->pDirty) {
+        markDirty(pMap->pDirty, start >> shift, end >> shift);
+    }
+    if (!pMap->journalFn) {
+        return TBITMAP_SUCCESS;
+    }
+    if (start == end) {
+        op = (isSet) ? TBITMAP_OP_SET : TBITMAP_OP_RESET;
+        putLE(rec, (op << TBITMAP_OP_SHIFT) | start);
+        return (*pMap->journalFn)(pMap->journalArg, rec, 4);
+    }
+    op = (isSet) ? TBITMAP_OP_SET_BLOCK : TBITMAP_OP_RESET_BLOCK;
+    putLE(rec, (op << TBITMAP_OP_SHIFT) | start);
+    putLE(rec + 4, end);
+    return (*pMap->journalFn)(pMap->journalArg, rec, 8);
+}
+
+int
+tBitMapReplay (tBitMap* pMap, const void* pBuf, u64 size)
+{
+    const u8* p = pBuf;
+    u64       off;
+    u32       op;
+    u32       start, end;
+    int       rt;
+
+    if (!pMap || (!pBuf && size)) {
+        return TBITMAP_ERR;
+    }
+    for (off = 0; off + 4 <= size; ) {
+        op    = getLE(p + off) >> TBITMAP_OP_SHIFT;
+        start = getLE(p + off) & ((1 << TBITMAP_OP_SHIFT) - 1);
+        end   = start;
+        if ((op == TBITMAP_OP_RESET_BLOCK) || (op == TBITMAP_OP_SET_BLOCK)) {
+            if (off + 8 > size) {
+                break;          /* torn record */
+            }
+            end  = getLE(p + off + 4);
+            off += 8;
+        } else {
+            off += 4;
+        }
+        rt = tBitMapSetResetBlock(pMap, start, end,
+                                  (op == TBITMAP_OP_SET) ||
+                                  (op == TBITMAP_OP_SET_BLOCK));
+        if (rt != TBITMAP_SUCCESS) {
+            return rt;
+        }
+    }
+    return TBITMAP_SUCCESS;
+}
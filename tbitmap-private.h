@@ -0,0 +1,373 @@
+#ifndef __TBITMAP_PRIVATE_H__
+#define __TBITMAP_PRIVATE_H__
+
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-private.h: definitions shared by the tbitmap sources.
+ *                    Not to be included by users of the library.
+ */
+
+#include "tbitmap.h"
+#ifdef TBITMAP_STATS_LATENCY
+#include <time.h>
+#endif
+
+/*
+ * writePtrTag() produces the following warning:
+ *   warning: dereferencing type-punned pointer will break
+ *   strict-aliasing rules [-Wstrict-aliasing]
+ * but this is intentional.
+ * Suppress -Wunused-function (it is inline)
+ */
+#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+
+#define ALLOC_MEM(_arg0_, _size_) malloc((_size_))
+#define FREE_MEM(_arg0_, _ptr_)   free((_ptr_))
+#define TBITMAP_ASSERT(_exp_)   assert((_exp_))
+
+
+static inline u8
+maxNbits (void)
+{
+    return ((sizeof(((tBitMapL2*)0)->bitmap[0])) << 3);
+}
+static inline u32
+posMask (void)
+{
+    return (u32)(maxNbits() - 1);
+}
+static inline u8
+getPos (u32 bitPos)
+{
+    return (u8)(bitPos & posMask());
+}
+static inline u32
+nL1elm (mtrie3l* p)
+{
+    return (1 << p->len[1]);
+}
+static inline u32
+nL2elm (mtrie3l* p)
+{
+    return (1 << p->len[2]);
+}
+#if 0
+static inline u32
+setBits32 (u32 start, u32 end)
+{
+    return (end < 31) ? (((~0) << start) & (((1 << (end + 1)) - 1))) :
+                        (((~0) << start) & (~0));
+}
+#endif
+static inline u32
+setBits32 (u32 start, u32 end)
+{
+    return (u32)(((~0) << start) & ((((u64)1) << (end + 1)) - 1));
+}
+static inline void
+tBitMapFlip (tBitMap* p)
+{
+    p->flags |=  TBITMAP_IS_FLIPPED;
+}
+static inline void
+tBitMapUnflip (tBitMap* p)
+{
+    p->flags &=  ~TBITMAP_IS_FLIPPED;
+}
+static inline bool
+tBitMapIsFlipped (tBitMap* p)
+{
+    return (p->flags & TBITMAP_IS_FLIPPED) ? TRUE : FALSE;
+}
+static inline bool
+tBitMapIsFlat (tBitMap* p)
+{
+    return (p->flags & TBITMAP_IS_FLAT) ? TRUE : FALSE;
+}
+static inline u32
+nFlatWords (tBitMap* pMap)
+{
+    return (pMap->maxPos >> 5) + 1;
+}
+static inline u32
+l1NodeSize (mtrie3l* p)
+{
+    return sizeof(mtrie3l_l1) + (nL1elm(p) * sizeof(tBitMapL2*));
+}
+static inline u32
+l2NodeSize (mtrie3l* p)
+{
+    return sizeof(tBitMapL2) + (nL2elm(p) * sizeof(u32));
+}
+
+/*
+ * Counters (TBITMAP_STATS). TBITMAP_TSC_DECL(t0) declares and sets
+ * the start time of an API, and TBITMAP_LATENCY() accounts it.
+ */
+#ifdef TBITMAP_STATS
+#define TBITMAP_COUNT(_pMap_, _cnt_, _n_)                               \
+    __atomic_add_fetch(&(_pMap_)->counters._cnt_, (_n_), __ATOMIC_RELAXED)
+#else
+#define TBITMAP_COUNT(_pMap_, _cnt_, _n_)       ((void)0)
+#endif
+
+#ifdef TBITMAP_STATS_LATENCY
+static inline u64
+tBitMapTsc (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000) + ts.tv_nsec;
+#endif
+}
+static inline void
+tBitMapLatency (tBitMap* pMap, u32 api, u64 t0)
+{
+    u64 d = tBitMapTsc() - t0;
+    u32 i = (d) ? 63 - __builtin_clzll(d) : 0;
+
+    if (i >= TBITMAP_HIST_BUCKETS) {
+        i = TBITMAP_HIST_BUCKETS - 1;
+    }
+    __atomic_add_fetch(&pMap->counters.hist[api][i], 1, __ATOMIC_RELAXED);
+}
+#define TBITMAP_TSC_DECL(_t0_)  u64 _t0_ = tBitMapTsc()
+#define TBITMAP_LATENCY(_pMap_, _api_, _t0_)                            \
+    tBitMapLatency((_pMap_), (_api_), (_t0_))
+#else
+#define TBITMAP_TSC_DECL(_t0_)
+#define TBITMAP_LATENCY(_pMap_, _api_, _t0_)    ((void)0)
+#endif
+
+/*
+ * Trace (TBITMAP_TRACE). tBitMapTraceOn is only a hint read without
+ * the lock; tBitMapTrace() checks again.
+ */
+#ifdef TBITMAP_TRACE
+extern bool tBitMapTraceOn;
+void tBitMapTrace (tBitMap* pMap, u32 op, u32 a, u32 b, u32 result);
+#define TBITMAP_TRACE_OP(_pMap_, _op_, _a_, _b_, _res_)                 \
+    do {                                                                \
+        if (__atomic_load_n(&tBitMapTraceOn, __ATOMIC_RELAXED)) {       \
+            tBitMapTrace((_pMap_), (_op_), (_a_), (_b_), (_res_));      \
+        }                                                               \
+    } while (0)
+#else
+#define TBITMAP_TRACE_OP(_pMap_, _op_, _a_, _b_, _res_) ((void)0)
+#endif
+
+enum {
+    TBITMAP_MIN_BITS = 12,      /* min bit length for a bitmap */
+    TBITMAP_MAX_BITS = 29,      /* max bit length for a bitmap  */
+    TBITMAP_FLAT_BITS = 15,     /* max bit length for a flat bitmap */
+};
+
+/*
+ * Tags of the L1 node entries (pl1->l1[]) and, TBITMAP_TAG_FULL only,
+ * of the L0 node entries (p->l0[]) of non-concurrent bitmaps
+ */
+enum {
+    TBITMAP_TAG_FULL   = 1,     /* all bits in the L2 (L1) node are set */
+    TBITMAP_TAG_FROZEN = 2,     /* L2 node is being replaced (by
+                                   TBITMAP_TAG_FULL if also tagged
+                                   TBITMAP_TAG_FULL, NULL otherwise) */
+};
+
+/*
+ * TRUE if `pl1' (p->l0[l0i]) is the tag of a full L1 node
+ */
+static inline bool
+tBitMapIsFullL1 (mtrie3l_l1* pl1)
+{
+    return (getPtrTag(pl1) == TBITMAP_TAG_FULL) ? TRUE : FALSE;
+}
+
+static inline bool
+tBitMapIsConcurrent (tBitMap* p)
+{
+    return (p->flags & TBITMAP_CONCURRENT) ? TRUE : FALSE;
+}
+
+/*
+ * Lock and counters of a stripe (TBITMAP_STRIPED).
+ * Padded to a cache line so that stripes do not share one.
+ */
+enum {
+    TBITMAP_CACHE_LINE = 64,
+};
+typedef struct tBitMapStripe_ {
+    u32 lock;                   /* spin lock: 0 unlocked, 1 locked */
+    u32 num;                    /* pTrie->num of this stripe */
+    u32 nL1;                    /* pTrie->nL1 of this stripe */
+    u32 nL2;                    /* pTrie->nL2 of this stripe */
+    u8  pad[TBITMAP_CACHE_LINE - (4 * sizeof(u32))];
+} tBitMapStripe;
+
+static inline bool
+tBitMapIsStriped (tBitMap* p)
+{
+    return (p->flags & TBITMAP_STRIPED) ? TRUE : FALSE;
+}
+static inline void
+cpuRelax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+static inline void
+tBitMapStripeLock (tBitMap* pMap, u32 l0i)
+{
+    u32* pLock;
+
+    if (!tBitMapIsStriped(pMap)) {
+        return;
+    }
+    pLock = &pMap->pStripes[l0i >> pMap->stripeShift].lock;
+    while (__atomic_exchange_n(pLock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(pLock, __ATOMIC_RELAXED)) {
+            cpuRelax();
+        }
+    }
+}
+static inline void
+tBitMapStripeUnlock (tBitMap* pMap, u32 l0i)
+{
+    if (tBitMapIsStriped(pMap)) {
+        __atomic_store_n(&pMap->pStripes[l0i >> pMap->stripeShift].lock, 0,
+                         __ATOMIC_RELEASE);
+    }
+}
+/*
+ * Counters to update for L0 index `l0i': those of its stripe
+ * if the bitmap is striped, or those of the trie otherwise.
+ */
+static inline u32*
+cntNum (tBitMap* pMap, u32 l0i)
+{
+    return (tBitMapIsStriped(pMap)) ?
+        &pMap->pStripes[l0i >> pMap->stripeShift].num : &pMap->pTrie->num;
+}
+static inline u32*
+cntL1 (tBitMap* pMap, u32 l0i)
+{
+    return (tBitMapIsStriped(pMap)) ?
+        &pMap->pStripes[l0i >> pMap->stripeShift].nL1 : &pMap->pTrie->nL1;
+}
+static inline u32*
+cntL2 (tBitMap* pMap, u32 l0i)
+{
+    return (tBitMapIsStriped(pMap)) ?
+        &pMap->pStripes[l0i >> pMap->stripeShift].nL2 : &pMap->pTrie->nL2;
+}
+
+static inline bool
+tBitMapIsSnapshot (tBitMap* p)
+{
+    return (p->flags & TBITMAP_SNAPSHOT) ? TRUE : FALSE;
+}
+
+
+/*
+ * tbitmap.c
+ */
+void tBitMapAutoSwitch (tBitMap* pMap);
+bool tBitMapStrideLens (u32 maxBitPos, u8* pLen);
+mtrie3l_l1* tBitMapUnfoldL1 (tBitMap* pMap, u16 l0i);
+void tBitMapFoldL1 (tBitMap* pMap, u16 l0i);
+
+/*
+ * tbitmap-snapshot.c
+ */
+void        tBitMapReleaseL1 (mtrie3l* p, mtrie3l_l1* pl1);
+void        tBitMapReleaseL2 (tBitMapL2* pl2);
+mtrie3l_l1* tBitMapCopyL1 (tBitMap* pMap, u16 l0i);
+tBitMapL2*  tBitMapCopyL2 (tBitMap* pMap, mtrie3l_l1* pl1, u16 l1i);
+
+/*
+ * Return the L1 node at l0[l0i] or the L2 node at pl1->l1[l1i]
+ * after copying it if it is shared with a snapshot, or after
+ * unfolding it if l0[l0i] is TBITMAP_TAG_FULL.
+ * NULL if there is no memory.
+ */
+static inline mtrie3l_l1*
+tBitMapOwnL1 (tBitMap* pMap, u16 l0i)
+{
+    mtrie3l_l1* pl1 = pMap->pTrie->l0[l0i];
+
+    if (tBitMapIsFullL1(pl1)) {
+        return tBitMapUnfoldL1(pMap, l0i);
+    }
+    if (__atomic_load_n(&pl1->ref, __ATOMIC_ACQUIRE) == 0) {
+        return pl1;
+    }
+    return tBitMapCopyL1(pMap, l0i);
+}
+static inline tBitMapL2*
+tBitMapOwnL2 (tBitMap* pMap, mtrie3l_l1* pl1, u16 l1i)
+{
+    tBitMapL2* pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
+
+    if (__atomic_load_n(&pl2->ref, __ATOMIC_ACQUIRE) == 0) {
+        return pl2;
+    }
+    return tBitMapCopyL2(pMap, pl1, l1i);
+}
+
+
+/*
+ * tbitmap-journal.c
+ */
+int  tBitMapLog (tBitMap* pMap, u32 start, u32 end, bool isSet);
+
+/*
+ * TRUE if updates of the bitmap are journaled or tracked
+ */
+static inline bool
+tBitMapIsLogged (tBitMap* p)
+{
+    return (p->journalFn || p->pDirty) ? TRUE : FALSE;
+}
+static inline u32
+tBitMapNumSlots (tBitMap* p)
+{
+    return 1 << (p->pTrie->len[0] + p->pTrie->len[1]);
+}
+
+/*
+ * tbitmap-concurrent.c
+ */
+bool tBitMapIsSetConcurrent (tBitMap* pMap, u32 bitPos);
+int  tBitMapSetResetConcurrent (tBitMap* pMap, u32 start, u32 end,
+                                bool isSet);
+
+#endif /* __TBITMAP_PRIVATE_H__ */
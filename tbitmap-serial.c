@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-serial.c: byte stream format of a tBitMap
+ *
+ * All the integers are little endian.
+ *
+ *  header:  u32 magic (TBITMAP_SERIAL_MAGIC)
+ *           u16 version (TBITMAP_SERIAL_VERSION)
+ *           u16 flags (TBITMAP_IS_FLIPPED, TBITMAP_SERIAL_DELTA)
+ *           u8  len[3] (stride lengths of L0, L1 and L2)
+ *           u8  reserved (0)
+ *  records: u32 (type << 24) | slot
+ *           slot: (L0 index << len[1]) | L1 index of an L2 node.
+ *           Slots are in ascending order.
+ *     FULL:   all the bits of the L2 node are set. No payload.
+ *     SPARSE: u16 n, followed by n pairs of u8 L2 index and
+ *             u32 bitmap. Bitmaps not listed are 0.
+ *     DENSE:  (1 << len[2]) u32 bitmaps.
+ *     EMPTY:  all the bits of the L2 node are reset. No payload.
+ *     END:    slot is 0, followed by u32 number of the bitmaps
+ *             wherein at least one bit is set.
+ *
+ * L2 nodes whose bitmaps are all 0 are not written. A flat bitmap
+ * is written as if it were a trie.
+ *
+ * A checkpoint (TBITMAP_SERIAL_DELTA) only has the records of the
+ * L2 nodes updated since the previous checkpoint, which replace
+ * them. Updated L2 nodes whose bitmaps are all 0 are written as
+ * EMPTY. The number in END is that of the whole bitmap.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "tbitmap-private.h"
+
+enum {
+    TBITMAP_SERIAL_MAGIC   = 0x504d4254, /* "TBMP" */
+    TBITMAP_SERIAL_VERSION = 1,
+    TBITMAP_SERIAL_BUFSZ   = 4096,       /* writer's buffer size */
+    TBITMAP_SERIAL_MAX_L2  = 1 << 8,     /* max # of bitmaps in L2 */
+    TBITMAP_SERIAL_DELTA   = 0x8000,     /* flags: checkpoint */
+};
+
+enum {
+    TBITMAP_REC_END    = 0,
+    TBITMAP_REC_FULL   = 1,
+    TBITMAP_REC_SPARSE = 2,
+    TBITMAP_REC_DENSE  = 3,
+    TBITMAP_REC_EMPTY  = 4,
+};
+
+typedef struct serialWriter_ {
+    tBitMapWriteFn f;
+    void*          pArg;
+    u32            len;         /* # of bytes in buf[] */
+    int            rt;          /* first error returned by f */
+    u8             buf[TBITMAP_SERIAL_BUFSZ];
+} serialWriter;
+
+
+static void
+flush (serialWriter* w)
+{
+    if ((w->len > 0) && (w->rt == TBITMAP_SUCCESS)) {
+        w->rt = (*w->f)(w->pArg, w->buf, w->len);
+    }
+    w->len = 0;
+}
+
+static void
+put (serialWriter* w, u32 val, u32 nbytes)
+{
+    if (w->len + nbytes > sizeof(w->buf)) {
+        flush(w);
+    }
+    for (; nbytes > 0; --nbytes, val >>= 8) {
+        w->buf[w->len++] = (u8)val;
+    }
+}
+
+static u32
+getLE (const u8* p, u32 nbytes)
+{
+    u32 val = 0;
+
+    while (nbytes > 0) {
+        --nbytes;
+        val = (val << 8) | p[nbytes];
+    }
+    return val;
+}
+
+/*
+ * Write the record of the L2 node at `slot' whose bitmaps are `pw'.
+ * Return the number of bitmaps wherein at least one bit is set.
+ */
+static u32
+putL2 (serialWriter* w, u32 slot, const u32* pw, u32 n)
+{
+    u32 i;
+    u32 nz = 0;
+    u32 nfull = 0;
+
+    for (i = 0; i < n; ++i) {
+        if (pw[i]) {
+            ++nz;
+            if (pw[i] == ~0) {
+                ++nfull;
+            }
+        }
+    }
+    if (nz == 0) {
+        return 0;
+    }
+    if (nfull == n) {
+        put(w, (TBITMAP_REC_FULL << 24) | slot, 4);
+    } else if (2 + (5 * nz) < 4 * n) {
+        put(w, (TBITMAP_REC_SPARSE << 24) | slot, 4);
+        put(w, nz, 2);
+        for (i = 0; i < n; ++i) {
+            if (pw[i]) {
+                put(w, i, 1);
+                put(w, pw[i], 4);
+            }
+        }
+    } else {
+        put(w, (TBITMAP_REC_DENSE << 24) | slot, 4);
+        for (i = 0; i < n; ++i) {
+            put(w, pw[i], 4);
+        }
+    }
+    return nz;
+}
+
+/*
+ * Write the record of the L2 node at `slot' unless it is all 0.
+ * Return the number of bitmaps wherein at least one bit is set.
+ */
+static u32
+putSlot (serialWriter* w, tBitMap* pMap, u32 slot)
+{
+    mtrie3l*    p   = pMap->pTrie;
+    u32         l1n = nL1elm(p);
+    u32         l2n = nL2elm(p);
+    mtrie3l_l1* pl1;
+    tBitMapL2*  pl2;
+
+    if (tBitMapIsFlat(pMap)) {
+        return putL2(w, slot, pMap->pFlat + (slot * l2n), l2n);
+    }
+    pl1 = p->l0[slot / l1n];
+    if (!pl1) {
+        return 0;
+    }
+    if (tBitMapIsFullL1(pl1) ||
+        (getPtrTag(pl1->l1[slot % l1n]) & TBITMAP_TAG_FULL)) {
+        put(w, (TBITMAP_REC_FULL << 24) | slot, 4);
+        return l2n;
+    }
+    pl2 = getPtr(tBitMapL2, pl1->l1[slot % l1n]);
+    return (pl2) ? putL2(w, slot, pl2->bitmap, l2n) : 0;
+}
+
+static void
+putHeader (serialWriter* w, tBitMap* pMap, u32 flags)
+{
+    mtrie3l* p = pMap->pTrie;
+
+    put(w, TBITMAP_SERIAL_MAGIC, 4);
+    put(w, TBITMAP_SERIAL_VERSION, 2);
+    put(w, (pMap->flags & TBITMAP_IS_FLIPPED) | flags, 2);
+    put(w, p->len[0], 1);
+    put(w, p->len[1], 1);
+    put(w, p->len[2], 1);
+    put(w, 0, 1);
+}
+
+int
+tBitMapSerialize (tBitMap* pMap, tBitMapWriteFn f, void* pArg)
+{
+    u32          slot, nSlots;
+    u32          l1n;
+    u32          num = 0;
+    mtrie3l*     p;
+    serialWriter w;
+
+    if (!pMap || !f) {
+        return TBITMAP_ERR;
+    }
+    p      = pMap->pTrie;
+    if (nL2elm(p) > TBITMAP_SERIAL_MAX_L2) {
+        return TBITMAP_ESLEN;
+    }
+    l1n    = nL1elm(p);
+    nSlots = tBitMapNumSlots(pMap);
+    w.f    = f;
+    w.pArg = pArg;
+    w.len  = 0;
+    w.rt   = TBITMAP_SUCCESS;
+
+    putHeader(&w, pMap, 0);
+    for (slot = 0; (slot < nSlots) && (w.rt == TBITMAP_SUCCESS); ++slot) {
+        if (!tBitMapIsFlat(pMap) && !p->l0[slot / l1n]) {
+            slot += l1n - 1;    /* skip the L1 node */
+            continue;
+        }
+        num += putSlot(&w, pMap, slot);
+    }
+    put(&w, TBITMAP_REC_END << 24, 4);
+    put(&w, num, 4);
+    flush(&w);
+    return w.rt;
+}
+
+int
+tBitMapCheckpoint (tBitMap* pMap, tBitMapWriteFn f, void* pArg)
+{
+    u32          i, n;
+    u32          slot;
+    u32          word;
+    serialWriter w;
+
+    if (!pMap || !f || !pMap->pDirty) {
+        return TBITMAP_ERR;
+    }
+    if (nL2elm(pMap->pTrie) > TBITMAP_SERIAL_MAX_L2) {
+        return TBITMAP_ESLEN;
+    }
+    n      = (tBitMapNumSlots(pMap) + 31) >> 5;
+    w.f    = f;
+    w.pArg = pArg;
+    w.len  = 0;
+    w.rt   = TBITMAP_SUCCESS;
+
+    putHeader(&w, pMap, TBITMAP_SERIAL_DELTA);
+    for (i = 0; (i < n) && (w.rt == TBITMAP_SUCCESS); ++i) {
+        for (word = pMap->pDirty[i]; word; word &= word - 1) {
+            slot = (i << 5) + __builtin_ctz(word);
+            if (putSlot(&w, pMap, slot) == 0) {
+                put(&w, (TBITMAP_REC_EMPTY << 24) | slot, 4);
+            }
+        }
+    }
+    put(&w, TBITMAP_REC_END << 24, 4);
+    put(&w, tBitMapNumWords(pMap), 4);
+    flush(&w);
+    if (w.rt == TBITMAP_SUCCESS) {
+        memset(pMap->pDirty, 0, n * sizeof(u32));
+    }
+    return w.rt;
+}
+
+/*
+ * Store the bitmaps `pw' of the L2 node at `slot'.
+ * Return the number of bitmaps wherein at least one bit is set,
+ * or -1 if there is no memory.
+ */
+static int
+loadL2 (tBitMap* pMap, u32 slot, const u32* pw, u32 n)
+{
+    u32         i;
+    u32         nz = 0;
+    u32         nfull = 0;
+    u32         l0i, l1i;
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l1* pl1;
+    tBitMapL2*  pl2;
+
+    for (i = 0; i < n; ++i) {
+        if (pw[i]) {
+            ++nz;
+            if (pw[i] == ~0) {
+                ++nfull;
+            }
+        }
+    }
+    if (nz == 0) {
+        return 0;
+    }
+    p->num += nz;
+    if (tBitMapIsFlat(pMap)) {
+        memcpy(pMap->pFlat + (slot * n), pw, n * sizeof(u32));
+        return nz;
+    }
+    l0i = slot >> p->len[1];
+    l1i = slot & (nL1elm(p) - 1);
+    pl1 = p->l0[l0i];
+    if (pl1) {
+        pl1 = tBitMapOwnL1(pMap, l0i); /* shared with a snapshot */
+        if (!pl1) {
+            return -1;
+        }
+    } else {
+        pl1 = ALLOC_MEM(MEM_TBITMAP, l1NodeSize(p));
+        if (!pl1) {
+            return -1;
+        }
+        memset(pl1, 0, l1NodeSize(p));
+        p->l0[l0i] = pl1;
+        ++p->nL1;
+    }
+    if (nfull == n) {
+        writePtrTag(&pl1->l1[l1i], TBITMAP_TAG_FULL);
+        ++pl1->cnt;
+        tBitMapFoldL1(pMap, l0i);
+        return nz;
+    } else {
+        pl2 = ALLOC_MEM(MEM_TBITMAP, l2NodeSize(p));
+        if (!pl2) {
+            return -1;
+        }
+        pl2->cnt     = nz;
+        pl2->nSetAll = nfull;
+        pl2->ref     = 0;
+        memcpy(pl2->bitmap, pw, n * sizeof(u32));
+        pl1->l1[l1i] = (mtrie3l_l2*)pl2;
+        ++p->nL2;
+    }
+    ++pl1->cnt;
+    return nz;
+}
+
+/*
+ * Read the records following the header into `pMap'.
+ * Records of a checkpoint (`delta') replace the L2 nodes.
+ */
+static int
+loadRecords (tBitMap* pMap, tBitMapReadFn f, void* pArg, bool delta)
+{
+    u8   buf[8];
+    u32  pw[TBITMAP_SERIAL_MAX_L2];
+    u32  hdr, type, slot;
+    u32  i, n, l2i;
+    u32  nSlots;
+    u32  l2n;
+    u32  shift;
+    u32  num = 0;
+    u32  next = 0;              /* min slot of the next record */
+    int  nz;
+    int  rt;
+    mtrie3l* p = pMap->pTrie;
+
+    l2n    = nL2elm(p);
+    nSlots = tBitMapNumSlots(pMap);
+    shift  = p->len[2] + 5;
+    for (;;) {
+        rt = (*f)(pArg, buf, 4);
+        if (rt != TBITMAP_SUCCESS) {
+            return rt;
+        }
+        hdr  = getLE(buf, 4);
+        type = hdr >> 24;
+        slot = hdr & ((1 << 24) - 1);
+        if (type == TBITMAP_REC_END) {
+            break;
+        }
+        if ((slot < next) || (slot >= nSlots)) {
+            return TBITMAP_ERR;
+        }
+        next = slot + 1;
+        switch (type) {
+        case TBITMAP_REC_FULL:
+            memset(pw, ~0, l2n * sizeof(u32));
+            break;
+        case TBITMAP_REC_SPARSE:
+            rt = (*f)(pArg, buf, 2);
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+            n = getLE(buf, 2);
+            if (n > l2n) {
+                return TBITMAP_ERR;
+            }
+            memset(pw, 0, l2n * sizeof(u32));
+            for (i = 0; i < n; ++i) {
+                rt = (*f)(pArg, buf, 5);
+                if (rt != TBITMAP_SUCCESS) {
+                    return rt;
+                }
+                l2i = buf[0];
+                if (l2i >= l2n) {
+                    return TBITMAP_ERR;
+                }
+                pw[l2i] = getLE(buf + 1, 4);
+            }
+            break;
+        case TBITMAP_REC_DENSE:
+            rt = (*f)(pArg, pw, l2n * sizeof(u32));
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+            for (i = 0; i < l2n; ++i) {
+                pw[i] = getLE((u8*)&pw[i], 4);
+            }
+            break;
+        case TBITMAP_REC_EMPTY:
+            if (!delta) {
+                return TBITMAP_ERR;
+            }
+            memset(pw, 0, l2n * sizeof(u32));
+            break;
+        default:
+            return TBITMAP_ERR;
+        }
+        if (delta) {
+            rt = tBitMapSetResetBlock(pMap, slot << shift,
+                                      ((slot + 1) << shift) - 1, FALSE);
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+        }
+        nz = loadL2(pMap, slot, pw, l2n);
+        if (nz < 0) {
+            return TBITMAP_ENOMEM;
+        }
+        num += nz;
+    }
+    if (slot != 0) {
+        return TBITMAP_ERR;
+    }
+    rt = (*f)(pArg, buf, 4);
+    if (rt != TBITMAP_SUCCESS) {
+        return rt;
+    }
+    if (delta) {
+        num = tBitMapNumWords(pMap);
+    }
+    return (getLE(buf, 4) == num) ? TBITMAP_SUCCESS : TBITMAP_ERR;
+}
+
+int
+tBitMapDeserialize (tBitMap** ppMap, tBitMapReadFn f, void* pArg)
+{
+    u8       buf[12];
+    int      rt;
+    tBitMap* pMap;
+
+    if (!ppMap || !f) {
+        return TBITMAP_ERR;
+    }
+    *ppMap = NULL;
+    rt = (*f)(pArg, buf, sizeof(buf));
+    if (rt != TBITMAP_SUCCESS) {
+        return rt;
+    }
+    if ((getLE(buf, 4) != TBITMAP_SERIAL_MAGIC) ||
+        (getLE(buf + 4, 2) != TBITMAP_SERIAL_VERSION) ||
+        (getLE(buf + 6, 2) & TBITMAP_SERIAL_DELTA)) {
+        return TBITMAP_ERR;
+    }
+    if ((1 << buf[10]) > TBITMAP_SERIAL_MAX_L2) {
+        return TBITMAP_ESLEN;
+    }
+    pMap = tBitMapAllocStrides(buf[8], buf[9], buf[10]);
+    if (!pMap) {
+        return TBITMAP_ESLEN;
+    }
+    if (pMap->maxPos < (1 << TBITMAP_FLAT_BITS)) {
+        tBitMapFlatten(pMap);   /* keep the trie if no memory */
+    }
+    pMap->flags |= getLE(buf + 6, 2) & TBITMAP_IS_FLIPPED;
+    rt = loadRecords(pMap, f, pArg, FALSE);
+    if (rt != TBITMAP_SUCCESS) {
+        tBitMapFree(pMap);
+        return rt;
+    }
+    tBitMapAutoSwitch(pMap);
+    *ppMap = pMap;
+    return TBITMAP_SUCCESS;
+}
+
+int
+tBitMapApplyCheckpoint (tBitMap* pMap, tBitMapReadFn f, void* pArg)
+{
+    u8             buf[12];
+    int            rt;
+    mtrie3l*       p;
+    tBitMapWriteFn journalFn;
+
+    if (!pMap || !f || tBitMapIsConcurrent(pMap) ||
+        tBitMapIsStriped(pMap) || tBitMapIsSnapshot(pMap)) {
+        return TBITMAP_ERR;
+    }
+    p  = pMap->pTrie;
+    rt = (*f)(pArg, buf, sizeof(buf));
+    if (rt != TBITMAP_SUCCESS) {
+        return rt;
+    }
+    if ((getLE(buf, 4) != TBITMAP_SERIAL_MAGIC) ||
+        (getLE(buf + 4, 2) != TBITMAP_SERIAL_VERSION) ||
+        !(getLE(buf + 6, 2) & TBITMAP_SERIAL_DELTA) ||
+        (buf[8] != p->len[0]) || (buf[9] != p->len[1]) ||
+        (buf[10] != p->len[2])) {
+        return TBITMAP_ERR;
+    }
+    /*
+     * Applying a checkpoint is not an update to journal,
+     * but the replaced L2 nodes are still marked dirty.
+     */
+    journalFn       = pMap->journalFn;
+    pMap->journalFn = NULL;
+    rt = loadRecords(pMap, f, pArg, TRUE);
+    pMap->journalFn = journalFn;
+    tBitMapAutoSwitch(pMap);
+    return rt;
+}
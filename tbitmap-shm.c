@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-shm.c: tBitMap in a shared memory region
+ *
+ * The whole bitmap, including its counters and free node lists,
+ * lives in a region given by the caller (e.g. shm_open() + mmap()
+ * or mmap(MAP_SHARED | MAP_ANONYMOUS) before fork()). Nodes refer
+ * to each other with u32 byte offsets from the start of the region,
+ * so each process may map it at a different address. All the
+ * shared words are updated with lock-free __atomic builtins, which
+ * are address-free and therefore work across processes.
+ *
+ *  header:  shmHdr
+ *  L0 node: u32[1 << len[0]]: 0 (empty) or offset of an L1 node
+ *  L1 node: u32[1 << len[1]]: 0 (empty), TBITMAP_TAG_FULL (all the
+ *           bits are set) or offset of an L2 node
+ *  L2 node: u32[1 << len[2]]: bitmaps
+ *
+ * Nodes are carved out of the region after the L0 node and kept
+ * in one free list per level once released. While the bitmap is in
+ * use, an L0 entry only moves from 0 to an L1 node, and an L1 entry
+ * from 0 to TBITMAP_TAG_FULL or an L2 node, or from TBITMAP_TAG_FULL
+ * to 0 or an L2 node. A linked node thus stays in the trie, and no
+ * process touches a released node. Only tBitMapShmCompact() unlinks
+ * empty and full nodes.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "tbitmap-private.h"
+
+enum {
+    TBITMAP_SHM_MAGIC   = 0x53424d54, /* "TMBS" */
+    TBITMAP_SHM_VERSION = 1,
+    TBITMAP_SHM_MAX_SIZE = 0xfffffff0, /* offsets are u32 */
+};
+
+typedef struct shmHdr_ {
+    u32 magic;                  /* TBITMAP_SHM_MAGIC */
+    u16 version;                /* TBITMAP_SHM_VERSION */
+    u8  len[3];                 /* stride lengths of L0, L1 and L2 */
+    u8  rsvd;
+    u32 maxPos;                 /* max bit position */
+    u32 size;                   /* usable size of the region */
+    u32 num;                    /* number of non-zero bitmaps */
+    u32 nL1;                    /* number of L1 nodes */
+    u32 nL2;                    /* number of L2 nodes */
+    u32 brk;                    /* offset of the unused space */
+    u64 freeL1;                 /* free L1 nodes: (ABA tag << 32) | offset */
+    u64 freeL2;                 /* free L2 nodes: (ABA tag << 32) | offset */
+} shmHdr;
+
+struct tBitMapShm_ {
+    u8*     base;               /* start of the region in this process */
+    shmHdr* pHdr;
+};
+
+#define SHM_LOAD(_p_)          __atomic_load_n((_p_), __ATOMIC_ACQUIRE)
+#define SHM_CAS(_p_, _pOld_, _new_)                                    \
+    __atomic_compare_exchange_n((_p_), (_pOld_), (_new_), FALSE,       \
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+
+static inline u32*
+at (tBitMapShm* pS, u32 off)
+{
+    return (u32*)(pS->base + off);
+}
+static inline u32
+l0Off (void)
+{
+    return sizeof(shmHdr);
+}
+static inline u32
+nShmL1elm (const shmHdr* h)
+{
+    return (1 << h->len[1]);
+}
+static inline u32
+nShmL2elm (const shmHdr* h)
+{
+    return (1 << h->len[2]);
+}
+static inline u32
+slotBits (const shmHdr* h)
+{
+    return (h->len[2] + 5);
+}
+
+/*
+ * Lock-free free list of nodes. The first word of a free node holds
+ * the offset of the next one. The tag in the upper 32 bits of the
+ * head is incremented on every change to avoid the ABA problem.
+ */
+static void
+shmPush (tBitMapShm* pS, u64* pHead, u32 off)
+{
+    u64 old = SHM_LOAD(pHead);
+    u64 new;
+
+    do {
+        __atomic_store_n(at(pS, off), (u32)old, __ATOMIC_RELAXED);
+        new = ((((old >> 32) + 1)) << 32) | off;
+    } while (!SHM_CAS(pHead, &old, new));
+}
+static u32
+shmPop (tBitMapShm* pS, u64* pHead)
+{
+    u64 old = SHM_LOAD(pHead);
+    u64 new;
+    u32 next;
+
+    do {
+        if ((u32)old == 0) {
+            return 0;
+        }
+        /*
+         * The node may be popped and reused by another process
+         * meanwhile; the CAS fails in that case.
+         */
+        next = __atomic_load_n(at(pS, (u32)old), __ATOMIC_RELAXED);
+        new  = ((((old >> 32) + 1)) << 32) | next;
+    } while (!SHM_CAS(pHead, &old, new));
+
+    return (u32)old;
+}
+
+/*
+ * Allocate a node of `size' bytes with all the words set to `fill'.
+ * 0 if the region is exhausted.
+ */
+static u32
+shmAllocNode (tBitMapShm* pS, u64* pHead, u32 size, u32 fill)
+{
+    shmHdr* h = pS->pHdr;
+    u32     off;
+    u32     i;
+    u32*    pw;
+
+    off = shmPop(pS, pHead);
+    if (off == 0) {
+        off = SHM_LOAD(&h->brk);
+        do {
+            if (off + size > h->size) {
+                return 0;
+            }
+        } while (!SHM_CAS(&h->brk, &off, off + size));
+    }
+    pw = at(pS, off);
+    for (i = 0; i < (size >> 2); ++i) {
+        __atomic_store_n(&pw[i], fill, __ATOMIC_RELAXED);
+    }
+    return off;
+}
+
+int
+tBitMapShmFormat (void* pRegion, u64 size, u32 maxBitPos)
+{
+    shmHdr* h = pRegion;
+    u8      len[3];
+    u32     l0Size;
+
+    if (!pRegion || ((uintptr_t)pRegion & 7)) {
+        return TBITMAP_ERR;
+    }
+    if (!tBitMapStrideLens(maxBitPos, len)) {
+        return TBITMAP_EBITPOS;
+    }
+    if (size > TBITMAP_SHM_MAX_SIZE) {
+        size = TBITMAP_SHM_MAX_SIZE;
+    }
+    l0Size = (1 << len[0]) * sizeof(u32);
+    if (size < l0Off() + l0Size) {
+        return TBITMAP_ENOMEM;
+    }
+    memset(pRegion, 0, l0Off() + l0Size);
+    h->version = TBITMAP_SHM_VERSION;
+    memcpy(h->len, len, sizeof(h->len));
+    h->maxPos  = (1 << (len[0] + len[1] + len[2] + 5)) - 1;
+    h->size    = (u32)size;
+    h->brk     = l0Off() + l0Size;
+    /*
+     * Publish the magic number last so that a process attaching
+     * at the same time does not see a half formatted header.
+     */
+    __atomic_store_n(&h->magic, TBITMAP_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return TBITMAP_SUCCESS;
+}
+
+tBitMapShm*
+tBitMapShmAttach (void* pRegion, u64 size)
+{
+    shmHdr*     h = pRegion;
+    tBitMapShm* pS;
+
+    if (!pRegion || ((uintptr_t)pRegion & 7) || (size < sizeof(shmHdr))) {
+        return NULL;
+    }
+    if ((SHM_LOAD(&h->magic) != TBITMAP_SHM_MAGIC) ||
+        (h->version != TBITMAP_SHM_VERSION)) {
+        return NULL;
+    }
+    if ((h->size > size) ||
+        ((u32)(h->len[0] + h->len[1] + h->len[2]) > TBITMAP_MAX_BITS - 5) ||
+        (h->len[1] < 1) || (h->len[2] < 1) ||
+        (h->maxPos != (1 << (h->len[0] + h->len[1] + h->len[2] + 5)) - 1) ||
+        (l0Off() + ((1 << h->len[0]) * sizeof(u32)) > h->brk) ||
+        (h->brk > h->size)) {
+        return NULL;
+    }
+    pS = ALLOC_MEM(NULL, sizeof(*pS));
+    if (!pS) {
+        return NULL;
+    }
+    pS->base = pRegion;
+    pS->pHdr = h;
+
+    return pS;
+}
+
+void
+tBitMapShmDetach (tBitMapShm* pS)
+{
+    if (pS) {
+        FREE_MEM(NULL, pS);
+    }
+}
+
+/*
+ * Return the L1 entry of `slot' ((L0 index << len[1]) | L1 index),
+ * allocating the L1 node if `alloc' is TRUE.
+ * NULL if there is no L1 node (or no room for one).
+ */
+static u32*
+shmL1ent (tBitMapShm* pS, u32 slot, bool alloc)
+{
+    shmHdr* h   = pS->pHdr;
+    u32*    pl0 = at(pS, l0Off()) + (slot >> h->len[1]);
+    u32     off = SHM_LOAD(pl0);
+    u32     new;
+
+    if (off == 0) {
+        if (!alloc) {
+            return NULL;
+        }
+        new = shmAllocNode(pS, &h->freeL1, nShmL1elm(h) * sizeof(u32), 0);
+        if (new == 0) {
+            return NULL;
+        }
+        if (SHM_CAS(pl0, &off, new)) {
+            off = new;
+            __atomic_add_fetch(&h->nL1, 1, __ATOMIC_RELAXED);
+        } else {
+            shmPush(pS, &h->freeL1, new); /* lost the race: use `off' */
+        }
+    }
+    return at(pS, off) + (slot & (nShmL1elm(h) - 1));
+}
+
+/*
+ * Set or reset the bits [lo, hi] (relative to the start of the slot)
+ * of the L2 node of `slot'.
+ */
+static int
+shmSetResetSlot (tBitMapShm* pS, u32 slot, u32 lo, u32 hi, bool isSet)
+{
+    shmHdr* h    = pS->pHdr;
+    u32     l2n  = nShmL2elm(h);
+    bool    full = (lo == 0) && (hi == (1 << slotBits(h)) - 1);
+    u32*    pent;
+    u32*    pw;
+    u32     ent;
+    u32     new;
+    u32     old;
+    u32     mask;
+    u32     i;
+    int     delta;
+
+    pent = shmL1ent(pS, slot, isSet);
+    if (!pent) {
+        return (isSet) ? TBITMAP_ENOMEM : TBITMAP_SUCCESS;
+    }
+    ent = SHM_LOAD(pent);
+    for (;;) {
+        if ((ent == 0) || (ent == TBITMAP_TAG_FULL)) {
+            if ((ent == TBITMAP_TAG_FULL) == isSet) {
+                return TBITMAP_SUCCESS; /* nothing to do */
+            }
+            if (full) {
+                new = (isSet) ? TBITMAP_TAG_FULL : 0;
+                if (SHM_CAS(pent, &ent, new)) {
+                    __atomic_add_fetch(&h->num, (isSet) ? l2n : -l2n,
+                                       __ATOMIC_RELAXED);
+                    return TBITMAP_SUCCESS;
+                }
+                continue;       /* `ent' has been reloaded */
+            }
+            /*
+             * Install an L2 node equivalent to the entry and
+             * update its bitmaps below.
+             */
+            new = shmAllocNode(pS, &h->freeL2, l2n * sizeof(u32),
+                               (ent == TBITMAP_TAG_FULL) ? ~0 : 0);
+            if (new == 0) {
+                return TBITMAP_ENOMEM;
+            }
+            if (!SHM_CAS(pent, &ent, new)) {
+                shmPush(pS, &h->freeL2, new);
+                continue;
+            }
+            __atomic_add_fetch(&h->nL2, 1, __ATOMIC_RELAXED);
+            ent = new;
+        }
+        break;
+    }
+
+    pw    = at(pS, ent);
+    delta = 0;
+    for (i = lo >> 5; i <= (hi >> 5); ++i) {
+        mask = setBits32((i == (lo >> 5)) ? (lo & 31) : 0,
+                         (i == (hi >> 5)) ? (hi & 31) : 31);
+        if (isSet) {
+            old = __atomic_fetch_or(&pw[i], mask, __ATOMIC_RELAXED);
+            delta += (old == 0);
+        } else {
+            old = __atomic_fetch_and(&pw[i], ~mask, __ATOMIC_RELAXED);
+            delta -= ((old != 0) && ((old & ~mask) == 0));
+        }
+    }
+    if (delta) {
+        __atomic_add_fetch(&h->num, delta, __ATOMIC_RELAXED);
+    }
+    return TBITMAP_SUCCESS;
+}
+
+int
+tBitMapShmSetResetBlock (tBitMapShm* pS, u32 start, u32 end, bool isSet)
+{
+    shmHdr* h;
+    u32     shift;
+    u32     slot;
+    u32     lo, hi;
+    int     rt;
+
+    if (!pS) {
+        return TBITMAP_ERR;
+    }
+    h = pS->pHdr;
+    if ((end > h->maxPos) || (start > end)) {
+        return TBITMAP_EINDEX;
+    }
+    shift = slotBits(h);
+    for (slot = start >> shift; slot <= (end >> shift); ++slot) {
+        lo = (slot == (start >> shift)) ? (start & ((1 << shift) - 1)) : 0;
+        hi = (slot == (end >> shift)) ? (end & ((1 << shift) - 1)) :
+                                        (1 << shift) - 1;
+        rt = shmSetResetSlot(pS, slot, lo, hi, isSet);
+        if (rt != TBITMAP_SUCCESS) {
+            return rt;
+        }
+    }
+    return TBITMAP_SUCCESS;
+}
+
+int
+tBitMapShmSetReset (tBitMapShm* pS, u32 bitPos, bool isSet)
+{
+    return tBitMapShmSetResetBlock(pS, bitPos, bitPos, isSet);
+}
+
+bool
+tBitMapShmIsSet (tBitMapShm* pS, u32 bitPos)
+{
+    shmHdr* h;
+    u32*    pent;
+    u32     ent;
+    u32     shift;
+
+    if (!pS || (bitPos > pS->pHdr->maxPos)) {
+        return FALSE;
+    }
+    h     = pS->pHdr;
+    shift = slotBits(h);
+    pent  = shmL1ent(pS, bitPos >> shift, FALSE);
+    if (!pent) {
+        return FALSE;
+    }
+    ent = SHM_LOAD(pent);
+    if ((ent == 0) || (ent == TBITMAP_TAG_FULL)) {
+        return (ent == TBITMAP_TAG_FULL);
+    }
+    bitPos &= (1 << shift) - 1;
+    return (SHM_LOAD(at(pS, ent) + (bitPos >> 5)) &
+            (1U << (bitPos & 31))) ? TRUE : FALSE;
+}
+
+int
+tBitMapShmCompact (tBitMapShm* pS)
+{
+    shmHdr* h;
+    u32*    pl0;
+    u32*    pl1;
+    u32*    pw;
+    u32     l0i, l1i;
+    u32     i;
+    u32     n;
+    bool    zero, full;
+
+    if (!pS) {
+        return TBITMAP_ERR;
+    }
+    h   = pS->pHdr;
+    pl0 = at(pS, l0Off());
+    for (l0i = 0; l0i < (1 << h->len[0]); ++l0i) {
+        if (pl0[l0i] == 0) {
+            continue;
+        }
+        pl1 = at(pS, pl0[l0i]);
+        n   = 0;
+        for (l1i = 0; l1i < nShmL1elm(h); ++l1i) {
+            if ((pl1[l1i] == 0) || (pl1[l1i] == TBITMAP_TAG_FULL)) {
+                n += (pl1[l1i] != 0);
+                continue;
+            }
+            pw   = at(pS, pl1[l1i]);
+            zero = full = TRUE;
+            for (i = 0; i < nShmL2elm(h); ++i) {
+                zero = zero && (pw[i] == 0);
+                full = full && (pw[i] == ~0);
+            }
+            if (zero || full) {
+                shmPush(pS, &h->freeL2, pl1[l1i]);
+                pl1[l1i] = (full) ? TBITMAP_TAG_FULL : 0;
+                --h->nL2;
+            }
+            n += (pl1[l1i] != 0);
+        }
+        if (n == 0) {
+            shmPush(pS, &h->freeL1, pl0[l0i]);
+            pl0[l0i] = 0;
+            --h->nL1;
+        }
+    }
+    return TBITMAP_SUCCESS;
+}
+
+u32
+tBitMapShmMaxPos (tBitMapShm* pS)
+{
+    return (pS) ? pS->pHdr->maxPos : 0;
+}
+
+u32
+tBitMapShmNumWords (tBitMapShm* pS)
+{
+    return (pS) ? __atomic_load_n(&pS->pHdr->num, __ATOMIC_RELAXED) : 0;
+}
+
+u32
+tBitMapShmNumL1 (tBitMapShm* pS)
+{
+    return (pS) ? __atomic_load_n(&pS->pHdr->nL1, __ATOMIC_RELAXED) : 0;
+}
+
+u32
+tBitMapShmNumL2 (tBitMapShm* pS)
+{
+    return (pS) ? __atomic_load_n(&pS->pHdr->nL2, __ATOMIC_RELAXED) : 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-snapshot.c: copy-on-write snapshots of a tBitMap
+ *
+ *  - A snapshot has its own L0 node and shares all the L1 and L2
+ *    nodes with the bitmap it was taken from.
+ *  - pl1->ref and pl2->ref count the extra owners of a node.
+ *    0 means the node is owned by one bitmap only and can be
+ *    modified in place.
+ *  - A writer copies a shared L1 node before modifying it; the
+ *    copy takes a reference to each of its L2 nodes. Then it
+ *    copies the shared L2 node, if any, that it modifies.
+ *  - Owners release nodes with an atomic decrement, so a snapshot
+ *    may be freed by another thread while the bitmap is updated.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "tbitmap-private.h"
+
+enum {
+    TBITMAP_MAX_REF = 0xffff,   /* max # of extra owners of a node */
+};
+
+
+/*
+ * Drop an owner of a node. Return TRUE if it was the last one.
+ */
+static inline bool
+unref (u16* pRef)
+{
+    if (__atomic_load_n(pRef, __ATOMIC_ACQUIRE) == 0) {
+        return TRUE;
+    }
+    return (__atomic_fetch_sub(pRef, 1, __ATOMIC_ACQ_REL) == 0);
+}
+
+void
+tBitMapReleaseL2 (tBitMapL2* pl2)
+{
+    if (unref(&pl2->ref)) {
+        FREE_MEM(MEM_TBITMAP, pl2);
+    }
+}
+
+void
+tBitMapReleaseL1 (mtrie3l* p, mtrie3l_l1* pl1)
+{
+    u32        l1i;
+    tBitMapL2* pl2;
+
+    if (tBitMapIsFullL1(pl1) || !unref(&pl1->ref)) {
+        return;
+    }
+    for (l1i = 0; l1i < nL1elm(p); ++l1i) {
+        pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
+        if (pl2) {
+            tBitMapReleaseL2(pl2);
+        }
+    }
+    FREE_MEM(MEM_TBITMAP, pl1);
+}
+
+/*
+ * Replace the shared L1 node at p->l0[l0i] by a private copy.
+ * NULL if there is no memory or an L2 node of it already has
+ * TBITMAP_MAX_REF extra owners.
+ */
+mtrie3l_l1*
+tBitMapCopyL1 (tBitMap* pMap, u16 l0i)
+{
+    u32         l1i;
+    mtrie3l*    p   = pMap->pTrie;
+    mtrie3l_l1* pl1 = p->l0[l0i];
+    mtrie3l_l1* pNew;
+    tBitMapL2*  pl2;
+
+    for (l1i = 0; l1i < nL1elm(p); ++l1i) {
+        pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
+        if (pl2 && (__atomic_load_n(&pl2->ref, __ATOMIC_RELAXED) ==
+                    TBITMAP_MAX_REF)) {
+            return NULL;
+        }
+    }
+    pNew = ALLOC_MEM(MEM_TBITMAP, l1NodeSize(p));
+    if (!pNew) {
+        return NULL;
+    }
+    memcpy(pNew, pl1, l1NodeSize(p));
+    pNew->ref = 0;
+    for (l1i = 0; l1i < nL1elm(p); ++l1i) {
+        pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
+        if (pl2) {
+            __atomic_add_fetch(&pl2->ref, 1, __ATOMIC_RELAXED);
+        }
+    }
+    p->l0[l0i] = pNew;
+    tBitMapReleaseL1(p, pl1);
+    TBITMAP_COUNT(pMap, nAllocL1, 1);
+    TBITMAP_COUNT(pMap, nFreeL1, 1);
+    return pNew;
+}
+
+/*
+ * Replace the shared L2 node at pl1->l1[l1i] by a private copy.
+ * pl1 must be private.
+ */
+tBitMapL2*
+tBitMapCopyL2 (tBitMap* pMap, mtrie3l_l1* pl1, u16 l1i)
+{
+    mtrie3l*   p   = pMap->pTrie;
+    tBitMapL2* pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
+    tBitMapL2* pNew;
+
+    pNew = ALLOC_MEM(MEM_TBITMAP, l2NodeSize(p));
+    if (!pNew) {
+        return NULL;
+    }
+    memcpy(pNew, pl2, l2NodeSize(p));
+    pNew->ref = 0;
+    pl1->l1[l1i] = (mtrie3l_l2*)pNew;
+    tBitMapReleaseL2(pl2);
+    TBITMAP_COUNT(pMap, nAllocL2, 1);
+    TBITMAP_COUNT(pMap, nFreeL2, 1);
+    return pNew;
+}
+
+/*
+ * Return a read-only copy of `pMap' sharing its L1 and L2 nodes.
+ * Copying the flat bit vector of a large bitmap would take up to
+ * 64 MB, so such a bitmap switches to the trie for good
+ * (TBITMAP_KEEP_TRIE) before it is shared. Only the vector of
+ * a bitmap allocated flat (at most 4 KB) is copied.
+ */
+tBitMap*
+tBitMapSnapshot (tBitMap* pMap)
+{
+    u32         l0i, l0n;
+    u32         len;
+    mtrie3l*    p;
+    mtrie3l_l1* pl1;
+    tBitMap*    pSnap;
+
+    if (!pMap || tBitMapIsConcurrent(pMap) || tBitMapIsStriped(pMap)) {
+        return NULL;
+    }
+    if (tBitMapIsFlat(pMap) && (pMap->maxPos >= (1 << TBITMAP_FLAT_BITS)) &&
+        (tBitMapKeepTrie(pMap, TRUE) != TBITMAP_SUCCESS)) {
+        return NULL;
+    }
+    p   = pMap->pTrie;
+    l0n = 1 << p->len[0];
+    for (l0i = 0; l0i < l0n; ++l0i) {
+        pl1 = p->l0[l0i];
+        if (pl1 && !tBitMapIsFullL1(pl1) &&
+            (__atomic_load_n(&pl1->ref, __ATOMIC_RELAXED) ==
+             TBITMAP_MAX_REF)) {
+            return NULL;        /* too many snapshots */
+        }
+    }
+
+    pSnap = ALLOC_MEM(MEM_TBITMAP, sizeof(*pSnap));
+    if (!pSnap) {
+        return NULL;
+    }
+    *pSnap = *pMap;
+    pSnap->pDirty     = NULL;
+    pSnap->journalFn  = NULL;
+    pSnap->journalArg = NULL;
+#ifdef TBITMAP_STATS
+    memset(&pSnap->counters, 0, sizeof(pSnap->counters));
+#endif
+#ifdef TBITMAP_TRACE
+    pSnap->traceGen = 0;
+    pSnap->traceId  = 0;
+#endif
+    pSnap->pTrie = mtrie3lAlloc(p->len[0], p->len[1], p->len[2]);
+    if (!pSnap->pTrie) {
+        FREE_MEM(MEM_TBITMAP, pSnap);
+        return NULL;
+    }
+    if (tBitMapIsFlat(pMap)) {
+        len = nFlatWords(pMap) * sizeof(u32);
+        pSnap->pFlat = ALLOC_MEM(MEM_TBITMAP, len);
+        if (!pSnap->pFlat) {
+            mtrie3lFree(pSnap->pTrie);
+            FREE_MEM(MEM_TBITMAP, pSnap);
+            return NULL;
+        }
+        memcpy(pSnap->pFlat, pMap->pFlat, len);
+    }
+    memcpy(pSnap->pTrie, p, mtrie3lL0nodeSize(p));
+    for (l0i = 0; l0i < l0n; ++l0i) {
+        pl1 = p->l0[l0i];
+        if (pl1 && !tBitMapIsFullL1(pl1)) {
+            __atomic_add_fetch(&pl1->ref, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pSnap->flags |= TBITMAP_SNAPSHOT;
+    return pSnap;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-stats.c: memory usage and shape of a tBitMap, and
+ *                  counters of its operations (TBITMAP_STATS)
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "epoch.h"
+#include "tbitmap-private.h"
+
+enum {
+    TBITMAP_MALLOC_HDR   = 8,   /* estimated malloc() header size */
+    TBITMAP_MALLOC_ALIGN = 16,  /* estimated malloc() alignment */
+};
+
+/*
+ * Estimated bytes wasted by malloc() for a block of `size' bytes.
+ */
+static inline u64
+mallocWaste (u64 size)
+{
+    return ((size + TBITMAP_MALLOC_HDR + TBITMAP_MALLOC_ALIGN - 1) &
+            ~(u64)(TBITMAP_MALLOC_ALIGN - 1)) - size;
+}
+
+/*
+ * Account the L1 node at l0[l0i] and its L2 nodes.
+ */
+static void
+statsL1 (tBitMap* pMap, mtrie3l_l1* pl1, tBitMapUsage* s)
+{
+    mtrie3l*    p   = pMap->pTrie;
+    u32         l1n = nL1elm(p);
+    u32         l2n = nL2elm(p);
+    u32         l1i;
+    u32         cnt;
+    u32         nEnt = 0;
+    mtrie3l_l2* ent;
+    tBitMapL2*  pl2;
+
+    ++s->nL1;
+    s->nShared += (__atomic_load_n(&pl1->ref, __ATOMIC_RELAXED) != 0);
+    for (l1i = 0; l1i < l1n; ++l1i) {
+        ent = __atomic_load_n(&pl1->l1[l1i], __ATOMIC_ACQUIRE);
+        if (!ent) {
+            continue;
+        }
+        ++nEnt;
+        if (getPtrTag(ent) & TBITMAP_TAG_FULL) {
+            ++s->nFull;
+            continue;
+        }
+        pl2 = getPtr(tBitMapL2, ent);
+        cnt = __atomic_load_n(&pl2->cnt, __ATOMIC_RELAXED);
+        if (cnt > l2n) {
+            cnt = l2n;          /* a hint only (TBITMAP_CONCURRENT) */
+        }
+        ++s->nL2;
+        s->nShared += (__atomic_load_n(&pl2->ref, __ATOMIC_RELAXED) != 0);
+        if (cnt) {
+            s->fill[((cnt * TBITMAP_FILL_BUCKETS) - 1) / l2n]++;
+        }
+        s->nBytesWasted += ((l2n - cnt) * sizeof(u32)) +
+                           mallocWaste(l2NodeSize(p));
+    }
+    s->nBytesWasted += ((l1n - nEnt) * sizeof(pl1->l1[0])) +
+                       mallocWaste(l1NodeSize(p));
+}
+
+int
+tBitMapStats (tBitMap* pMap, tBitMapUsage* s)
+{
+    u32         l0i, l0n;
+    u64         len;
+    mtrie3l*    p;
+    mtrie3l_l1* pl1;
+
+    if (!pMap || !s) {
+        return TBITMAP_ERR;
+    }
+    memset(s, 0, sizeof(*s));
+    p = pMap->pTrie;
+    s->nBytesMap = sizeof(*pMap) + mtrie3lL0nodeSize(p);
+    s->nBytesWasted = mallocWaste(sizeof(*pMap)) +
+                      mallocWaste(mtrie3lL0nodeSize(p));
+    if (pMap->pStripes) {
+        len = (u64)(1 << (p->len[0] - pMap->stripeShift)) *
+              sizeof(tBitMapStripe);
+        s->nBytesMap    += len;
+        s->nBytesWasted += mallocWaste(len);
+    }
+    if (pMap->pDirty) {
+        len = ((tBitMapNumSlots(pMap) + 31) >> 5) * sizeof(u32);
+        s->nBytesMap    += len;
+        s->nBytesWasted += mallocWaste(len);
+    }
+    s->nWords = tBitMapNumWords(pMap);
+
+    if (tBitMapIsFlat(pMap)) {
+        s->nBytesFlat    = nFlatWords(pMap) * sizeof(u32);
+        s->nBytesWasted += ((u64)(nFlatWords(pMap) - s->nWords) *
+                            sizeof(u32)) + mallocWaste(s->nBytesFlat);
+    } else {
+        l0n = 1 << p->len[0];
+        for (l0i = 0; l0i < l0n; ++l0i) {
+            /*
+             * Keep the nodes from being freed while they are read
+             */
+            if (tBitMapIsConcurrent(pMap)) {
+                epochReadLock();
+            }
+            tBitMapStripeLock(pMap, l0i);
+            pl1 = __atomic_load_n(&p->l0[l0i], __ATOMIC_ACQUIRE);
+            if (tBitMapIsFullL1(pl1)) {
+                s->nFull += nL1elm(p);
+            } else if (pl1) {
+                statsL1(pMap, pl1, s);
+            } else {
+                s->nBytesWasted += sizeof(p->l0[0]);
+            }
+            tBitMapStripeUnlock(pMap, l0i);
+            if (tBitMapIsConcurrent(pMap)) {
+                epochReadUnlock();
+            }
+        }
+        s->nBytesL1 = (u64)s->nL1 * l1NodeSize(p);
+        s->nBytesL2 = (u64)s->nL2 * l2NodeSize(p);
+    }
+    s->nBytes = s->nBytesMap + s->nBytesL1 + s->nBytesL2 + s->nBytesFlat;
+    return TBITMAP_SUCCESS;
+}
+
+#ifdef TBITMAP_STATS
+void
+tBitMapGetCounters (tBitMap* pMap, tBitMapCounters* pCnt)
+{
+    const u64* src = (const u64*)&pMap->counters;
+    u64*       dst = (u64*)pCnt;
+    u32        i;
+
+    for (i = 0; i < sizeof(*pCnt) / sizeof(u64); ++i) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+void
+tBitMapClearCounters (tBitMap* pMap)
+{
+    u64* pw = (u64*)&pMap->counters;
+    u32  i;
+
+    for (i = 0; i < sizeof(pMap->counters) / sizeof(u64); ++i) {
+        __atomic_store_n(&pw[i], 0, __ATOMIC_RELAXED);
+    }
+}
+#endif /* TBITMAP_STATS */
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap-trace.c: trace of the tBitMap API calls
+ *
+ * A trace starts with a header:
+ *  u32 TRACE_MAGIC     (little endian)
+ *  u32 TRACE_VERSION   (little endian)
+ * followed by records:
+ *  u8     op | (result << 7)
+ *  varint bitmap ID
+ *  varint ns since the previous record
+ *  varint a            (all but TBITMAP_TRACE_FREE and *_ALL)
+ *  varint b            (TBITMAP_TRACE_NEW and *_BLOCK only)
+ * A varint is 7 bits per byte, least significant group first, with
+ * bit 7 set in all the bytes but the last one.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include "tbitmap-private.h"
+
+enum {
+    TRACE_MAGIC   = 0x52544254, /* "TBTR" */
+    TRACE_VERSION = 1,
+    TRACE_HDR_LEN = 8,
+    TRACE_REC_MAX = 1 + (4 * 5) + 10, /* longest record */
+};
+
+
+static void
+putLE (u8* p, u32 val)
+{
+    u32 i;
+
+    for (i = 0; i < 4; ++i, val >>= 8) {
+        p[i] = (u8)val;
+    }
+}
+
+static u32
+getLE (const u8* p)
+{
+    return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) |
+           ((u32)p[3] << 24);
+}
+
+static inline u32
+putVarint (u8* p, u64 val)
+{
+    u32 n = 0;
+
+    while (val >= 0x80) {
+        p[n++] = (u8)val | 0x80;
+        val >>= 7;
+    }
+    p[n++] = (u8)val;
+    return n;
+}
+
+static bool
+getVarint (const u8* p, u64 size, u64* pOff, u64* pVal)
+{
+    u64 val = 0;
+    u32 shift;
+
+    for (shift = 0; (*pOff < size) && (shift < 64); shift += 7) {
+        val |= (u64)(p[*pOff] & 0x7f) << shift;
+        if ((p[(*pOff)++] & 0x80) == 0) {
+            *pVal = val;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static inline bool
+hasA (u32 op)
+{
+    return (op != TBITMAP_TRACE_FREE) && (op != TBITMAP_TRACE_SET_ALL) &&
+           (op != TBITMAP_TRACE_RESET_ALL);
+}
+
+static inline bool
+hasB (u32 op)
+{
+    return (op == TBITMAP_TRACE_NEW) || (op == TBITMAP_TRACE_SET_BLOCK) ||
+           (op == TBITMAP_TRACE_RESET_BLOCK);
+}
+
+bool
+tBitMapTraceNext (const void* pBuf, u64 size, u64* pOff,
+                  tBitMapTraceRec* pRec)
+{
+    const u8* p = pBuf;
+    u64       off, id, dt, a = 0, b = 0;
+    u8        op;
+
+    assert(pBuf && pOff && pRec);
+
+    off = *pOff;
+    if (off == 0) {
+        if ((size < TRACE_HDR_LEN) || (getLE(p) != TRACE_MAGIC) ||
+            (getLE(p + 4) != TRACE_VERSION)) {
+            return FALSE;
+        }
+        off = TRACE_HDR_LEN;
+        pRec->ns = 0;
+    }
+    if (off >= size) {
+        return FALSE;
+    }
+    op = p[off++];
+    if (((op & 0x7f) >= TBITMAP_TRACE_OP_MAX) ||
+        !getVarint(p, size, &off, &id) || !getVarint(p, size, &off, &dt) ||
+        (hasA(op & 0x7f) && !getVarint(p, size, &off, &a)) ||
+        (hasB(op & 0x7f) && !getVarint(p, size, &off, &b))) {
+        return FALSE;
+    }
+    pRec->op     = op & 0x7f;
+    pRec->result = op >> 7;
+    pRec->id     = (u32)id;
+    pRec->ns     = (*pOff == 0) ? dt : pRec->ns + dt;
+    pRec->a      = (u32)a;
+    pRec->b      = (u32)b;
+    *pOff = off;
+    return TRUE;
+}
+
+#ifdef TBITMAP_TRACE
+
+bool tBitMapTraceOn = FALSE;
+
+static pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static tBitMapWriteFn  TraceFn;
+static void*           TraceArg;
+static int             TraceErr;    /* first error returned by TraceFn */
+static u32             TraceGen;    /* incremented by tBitMapTraceStart() */
+static u32             TraceNextId;
+static u64             TraceLast;   /* time of the last record */
+static u32             TraceLen;
+static u8              TraceBuf[TBITMAP_TRACE_BUFSIZE];
+
+
+static inline u64
+traceNsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void
+traceFlush (void)
+{
+    int rt;
+
+    if (TraceLen == 0) {
+        return;
+    }
+    rt = (*TraceFn)(TraceArg, TraceBuf, TraceLen);
+    if ((rt != TBITMAP_SUCCESS) && (TraceErr == TBITMAP_SUCCESS)) {
+        TraceErr = rt;
+    }
+    TraceLen = 0;
+}
+
+static void
+tracePut (u32 op, u32 id, u64 now, u32 a, u32 b, u32 result)
+{
+    u8* p;
+
+    if (TraceLen + TRACE_REC_MAX > sizeof(TraceBuf)) {
+        traceFlush();
+    }
+    p = TraceBuf + TraceLen;
+    *p++ = (u8)(op | ((result != 0) << 7));
+    p += putVarint(p, id);
+    p += putVarint(p, now - TraceLast);
+    if (hasA(op)) {
+        p += putVarint(p, a);
+    }
+    if (hasB(op)) {
+        p += putVarint(p, b);
+    }
+    TraceLen  = p - TraceBuf;
+    TraceLast = now;
+}
+
+int
+tBitMapTraceStart (tBitMapWriteFn f, void* pArg)
+{
+    if (!f) {
+        return TBITMAP_ERR;
+    }
+    pthread_mutex_lock(&TraceLock);
+    if (TraceFn) {
+        pthread_mutex_unlock(&TraceLock);
+        return TBITMAP_ERR;     /* already tracing */
+    }
+    TraceFn     = f;
+    TraceArg    = pArg;
+    TraceErr    = TBITMAP_SUCCESS;
+    TraceNextId = 1;
+    TraceLast   = traceNsec();
+    if (++TraceGen == 0) {
+        TraceGen = 1;           /* 0: never traced */
+    }
+    putLE(TraceBuf, TRACE_MAGIC);
+    putLE(TraceBuf + 4, TRACE_VERSION);
+    TraceLen = TRACE_HDR_LEN;
+    __atomic_store_n(&tBitMapTraceOn, TRUE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&TraceLock);
+    return TBITMAP_SUCCESS;
+}
+
+int
+tBitMapTraceStop (void)
+{
+    int rt;
+
+    pthread_mutex_lock(&TraceLock);
+    if (!TraceFn) {
+        pthread_mutex_unlock(&TraceLock);
+        return TBITMAP_ERR;
+    }
+    __atomic_store_n(&tBitMapTraceOn, FALSE, __ATOMIC_RELAXED);
+    traceFlush();
+    rt = TraceErr;
+    TraceFn  = NULL;
+    TraceArg = NULL;
+    pthread_mutex_unlock(&TraceLock);
+    return rt;
+}
+
+bool
+tBitMapTracing (void)
+{
+    return __atomic_load_n(&tBitMapTraceOn, __ATOMIC_RELAXED);
+}
+
+/*
+ * Append the record of an API call on pMap,
+ * introducing pMap first if it is new to the trace.
+ */
+void
+tBitMapTrace (tBitMap* pMap, u32 op, u32 a, u32 b, u32 result)
+{
+    mtrie3l* p = pMap->pTrie;
+    u64      now;
+
+    pthread_mutex_lock(&TraceLock);
+    if (!TraceFn) {
+        pthread_mutex_unlock(&TraceLock);
+        return;
+    }
+    now = traceNsec();
+    if (pMap->traceGen != TraceGen) {
+        if (op == TBITMAP_TRACE_FREE) {
+            pthread_mutex_unlock(&TraceLock);
+            return;             /* never used while tracing */
+        }
+        pMap->traceGen = TraceGen;
+        pMap->traceId  = TraceNextId++;
+        tracePut(TBITMAP_TRACE_NEW, pMap->traceId, now, pMap->maxPos,
+                 p->len[0] | (p->len[1] << 8) | (p->len[2] << 16) |
+                 ((pMap->flags & 0xff) << 24), 1);
+    }
+    tracePut(op, pMap->traceId, now, a, b, result);
+    pthread_mutex_unlock(&TraceLock);
+}
+
+#else /* !TBITMAP_TRACE */
+
+int
+tBitMapTraceStart (tBitMapWriteFn f, void* pArg)
+{
+    return TBITMAP_ERR;
+}
+
+int
+tBitMapTraceStop (void)
+{
+    return TBITMAP_ERR;
+}
+
+bool
+tBitMapTracing (void)
+{
+    return FALSE;
+}
+
+#endif /* TBITMAP_TRACE */
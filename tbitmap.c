@@ -28,22 +28,7 @@
 
 #include <assert.h>
 #include <string.h>
-#include "tbitmap.h"
-
-/*
- * writePtrTag() produces the following warning:
- *   warning: dereferencing type-punned pointer will break
- *   strict-aliasing rules [-Wstrict-aliasing]
- * but this is intentional.
- * Suppress -Wunused-function (it is inline)
- */
-#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-#pragma GCC diagnostic ignored "-Wunused-function"
-
-
-#define ALLOC_MEM(_arg0_, _size_) malloc((_size_))
-#define FREE_MEM(_arg0_, _ptr_)   free((_ptr_))
-#define TBITMAP_ASSERT(_exp_)   assert((_exp_))
+#include "tbitmap-private.h"
 
 typedef struct strideLen_ {
     u8 sl0;
@@ -52,60 +37,6 @@ typedef struct strideLen_ {
 } strideLen;
 
 
-static inline u8
-maxNbits (void)
-{
-    return ((sizeof(((tBitMapL2*)0)->bitmap[0])) << 3);
-}
-static inline u32
-posMask (void)
-{
-    return (u32)(maxNbits() - 1);
-}
-static inline u8
-getPos (u32 bitPos)
-{
-    return (u8)(bitPos & posMask());
-}
-static inline u32
-nL1elm (mtrie3l* p)
-{
-    return (1 << p->len[1]);
-}
-static inline u32
-nL2elm (mtrie3l* p)
-{
-    return (1 << p->len[2]);
-}
-#if 0
-static inline u32
-setBits32 (u32 start, u32 end)
-{
-    return (end < 31) ? (((~0) << start) & (((1 << (end + 1)) - 1))) :
-                        (((~0) << start) & (~0));
-}
-#endif
-static inline u32
-setBits32 (u32 start, u32 end)
-{
-    return (u32)(((~0) << start) & ((((u64)1) << (end + 1)) - 1));
-}
-static inline void
-tBitMapFlip (tBitMap* p)
-{
-    p->flags |=  TBITMAP_IS_FLIPPED;
-}
-static inline void
-tBitMapUnflip (tBitMap* p)
-{
-    p->flags &=  ~TBITMAP_IS_FLIPPED;
-}
-static inline bool
-tBitMapIsFlipped (tBitMap* p)
-{
-    return (p->flags & TBITMAP_IS_FLIPPED) ? TRUE : FALSE;
-}
-
 /*
  * Array of stride length for trie.
  *
@@ -133,10 +64,6 @@ static strideLen Strides[] = {
     {8, 8, 7},                 /* 16: index: 23 bits, bit-pos: 28 bits */
     {8, 8, 8},                 /* 17: index: 24 bits, bit-pos: 29 bits */
 };
-enum {
-    TBITMAP_MIN_BITS = 12,      /* min bit length for a bitmap */
-    TBITMAP_MAX_BITS = 29,      /* max bit length for a bitmap  */
-};
 
 
 /*
@@ -160,16 +87,35 @@ tBitMapAllocRaw (u8 sl0,  /* L0 stride length */
     }
     pMap->pTrie = mtrie3lAlloc(sl0, sl1, sl2);
     if (!pMap->pTrie) {
+        FREE_MEM(MEM_TBITMAP, pMap);
         return NULL;
     }
     pMap->flags  = 0;
     pMap->maxPos = (1 << (sl0 + sl1 + sl2 + 5)) - 1;
+    pMap->pFlat  = NULL;
+    pMap->pStripes    = NULL;
+    pMap->stripeShift = 0;
+    pMap->pDirty      = NULL;
+    pMap->journalFn   = NULL;
+    pMap->journalArg  = NULL;
+#ifdef TBITMAP_STATS
+    memset(&pMap->counters, 0, sizeof(pMap->counters));
+#endif
+#ifdef TBITMAP_TRACE
+    pMap->traceGen = 0;
+    pMap->traceId  = 0;
+#endif
 
     return pMap;
 }
 
-tBitMap*
-tBitMapAlloc (u32 maxBitPos)
+/*
+ * Store the stride lengths of L0, L1 and L2 for a bitmap whose
+ * max bit position is maxBitPos in pLen[0..2].
+ * FALSE if maxBitPos is too large.
+ */
+bool
+tBitMapStrideLens (u32 maxBitPos, u8* pLen)
 {
     strideLen* p;
     u32 mask;
@@ -180,30 +126,180 @@ tBitMapAlloc (u32 maxBitPos)
      */
     for (mask = 1 << 31; mask >= (1 << TBITMAP_MAX_BITS); mask >>= 1) {
         if (mask & maxBitPos) {
-            return NULL; /* maxBitPos too large */
+            return FALSE;
         }
     }
     /*
      * Find most significant set bit in maxBitPos.
      */
-    for (i = elementsOf(Strides) - 1; i > 0; mask >>= 1) {
+    for (i = elementsOf(Strides) - 1; i > 0; --i, mask >>= 1) {
         if (mask & maxBitPos) {
             break;
         }
     }
     p = Strides + i;
-    return tBitMapAllocRaw(p->sl0, p->sl1, p->sl2);
+    pLen[0] = p->sl0;
+    pLen[1] = p->sl1;
+    pLen[2] = p->sl2;
+    return TRUE;
+}
+
+/*
+ * Small bitmaps (up to 2^TBITMAP_FLAT_BITS bits) are allocated
+ * as a flat bit vector. The trie is still allocated to keep
+ * the stride lengths.
+ */
+tBitMap*
+tBitMapAlloc (u32 maxBitPos)
+{
+    u8       len[3];
+    tBitMap* pMap;
+
+    if (!tBitMapStrideLens(maxBitPos, len)) {
+        return NULL; /* maxBitPos too large */
+    }
+    pMap = tBitMapAllocRaw(len[0], len[1], len[2]);
+    if (pMap && (pMap->maxPos < (1 << TBITMAP_FLAT_BITS))) {
+        tBitMapFlatten(pMap);   /* keep the trie if no memory */
+    }
+    return pMap;
+}
+
+/*
+ * Allocate a bitmap with the given stride lengths
+ * instead of looking up Strides[] by max bit position.
+ */
+tBitMap*
+tBitMapAllocStrides (u8 sl0, u8 sl1, u8 sl2)
+{
+    u32 nbits = sl0 + sl1 + sl2 + 5;
+
+    if ((nbits < TBITMAP_MIN_BITS) || (nbits > TBITMAP_MAX_BITS)) {
+        return NULL;
+    }
+    return tBitMapAllocRaw(sl0, sl1, sl2);
+}
+
+/*
+ * Allocate a bitmap shared by threads without a lock.
+ * See tbitmap-concurrent.c.
+ */
+tBitMap*
+tBitMapAllocConcurrent (u32 maxBitPos)
+{
+    tBitMap* pMap;
+
+    pMap = tBitMapAlloc(maxBitPos);
+    if (pMap) {
+        pMap->flags |= TBITMAP_CONCURRENT;
+    }
+    return pMap;
+}
+
+/*
+ * Allocate a bitmap updated by threads holding per stripe locks.
+ * nStripes is rounded down to a power of 2. 0 or more than
+ * the number of L0 indices gives one stripe per L0 index.
+ */
+tBitMap*
+tBitMapAllocStriped (u32 maxBitPos, u32 nStripes)
+{
+    tBitMap* pMap;
+    u32      sl0;
+    u32      shift;
+    u32      len;
+
+    pMap = tBitMapAlloc(maxBitPos);
+    if (!pMap) {
+        return NULL;
+    }
+    if (tBitMapUnflatten(pMap) != TBITMAP_SUCCESS) {
+        tBitMapFree(pMap);
+        return NULL;
+    }
+    sl0 = pMap->pTrie->len[0];
+    for (shift = sl0; (shift > 0) && ((1 << (sl0 - shift + 1)) <= nStripes);
+         --shift) {
+        ;
+    }
+    if (nStripes == 0) {
+        shift = 0;
+    }
+    len = (1 << (sl0 - shift)) * sizeof(tBitMapStripe);
+    pMap->pStripes = ALLOC_MEM(MEM_TBITMAP, len);
+    if (!pMap->pStripes) {
+        tBitMapFree(pMap);
+        return NULL;
+    }
+    memset(pMap->pStripes, 0, len);
+    pMap->stripeShift = shift;
+    pMap->flags |= TBITMAP_STRIPED;
+    return pMap;
+}
+
+/*
+ * Number of the bitmaps (32 bit words) wherein at least one bit
+ * is set, and number of the L1 and L2 nodes. Sums of the stripes'
+ * counters if the bitmap is striped.
+ */
+static inline u32
+nStripes (tBitMap* pMap)
+{
+    return (1 << (pMap->pTrie->len[0] - pMap->stripeShift));
 }
 
+u32
+tBitMapNumWords (tBitMap* pMap)
+{
+    u32 i, n;
+
+    if (!tBitMapIsStriped(pMap)) {
+        return pMap->pTrie->num;
+    }
+    for (i = n = 0; i < nStripes(pMap); ++i) {
+        n += __atomic_load_n(&pMap->pStripes[i].num, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+u32
+tBitMapNumL1 (tBitMap* pMap)
+{
+    u32 i, n;
+
+    if (!tBitMapIsStriped(pMap)) {
+        return pMap->pTrie->nL1;
+    }
+    for (i = n = 0; i < nStripes(pMap); ++i) {
+        n += __atomic_load_n(&pMap->pStripes[i].nL1, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+u32
+tBitMapNumL2 (tBitMap* pMap)
+{
+    u32 i, n;
+
+    if (!tBitMapIsStriped(pMap)) {
+        return pMap->pTrie->nL2;
+    }
+    for (i = n = 0; i < nStripes(pMap); ++i) {
+        n += __atomic_load_n(&pMap->pStripes[i].nL2, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/*
+ * Free all the L1 and L2 nodes and empty the trie.
+ * Nodes shared with snapshots are only released.
+ * The flat bit vector is not touched.
+ */
 static int
 tBitMapDestroy (tBitMap* pMap)
 {
-    u8    l0i, l0n;
-    u8    l1i, l1n;
-    u8    cnt[2]; /* # of remaining entries to process at level `i' */
+    u32   l0i, l0n;
     mtrie3l*    p;
-    mtrie3l_l1* pl1;
-    tBitMapL2*  pl2;
 
     if (!pMap) {
         return TBITMAP_ERR;
@@ -211,30 +307,18 @@ tBitMapDestroy (tBitMap* pMap)
 
     p   = pMap->pTrie;
     l0n = 1 << p->len[0];       /* # of level 0 entries */
-    l1n = 1 << p->len[1];       /* # of level 1 entries */
-    cnt[0] = p->nL1 + p->nL2;
     for (l0i = 0; l0i < l0n; ++l0i) {
-        if (cnt[0] == 0) {
-            return TBITMAP_SUCCESS; /* optimization */
-        }
         if (!p->l0[l0i]) {
             continue;
         }
-        pl1    = p->l0[l0i];
-        cnt[1] = pl1->cnt;  /* # of L2 nodes incl. compressed nodes */
-        for (l1i = 0; l1i < l1n; ++l1i) {
-            if (cnt[1] == 0) {
-                break;          /* optimization */
-            }
-            pl2 = getPtr(tBitMapL2, pl1->l1[l1i]); 
-            if (!pl2) {
-                continue;
-            }
-            cnt[1]--;
-            FREE_MEM(MEM_TBITMAP, pl2);
-        }
-        cnt[0]--;
-        FREE_MEM(MEM_TBITMAP, pl1);
+        tBitMapReleaseL1(p, p->l0[l0i]); /* no-op for a full tag */
+        p->l0[l0i] = NULL;
+    }
+    p->num = 0;
+    p->nL1 = 0;
+    p->nL2 = 0;
+    if (tBitMapIsStriped(pMap)) {
+        memset(pMap->pStripes, 0, nStripes(pMap) * sizeof(tBitMapStripe));
     }
     return TBITMAP_SUCCESS;
 }
@@ -247,154 +331,484 @@ tBitMapFree (tBitMap* pMap)
     if (!pMap) {
         return TBITMAP_ERR;
     }
+    TBITMAP_TRACE_OP(pMap, TBITMAP_TRACE_FREE, 0, 0, 1);
     rt = tBitMapDestroy(pMap);
+    if (pMap->pFlat) {
+        FREE_MEM(MEM_TBITMAP, pMap->pFlat);
+    }
+    if (pMap->pStripes) {
+        FREE_MEM(MEM_TBITMAP, pMap->pStripes);
+    }
+    if (pMap->pDirty) {
+        FREE_MEM(MEM_TBITMAP, pMap->pDirty);
+    }
+    mtrie3lFree(pMap->pTrie);
     FREE_MEM(MEM_TBITMAP, pMap);
     return rt;
 }
 
 /*
- * Reset (unset) bits between bit position `pos' and `endPos'
- * of the entry in the level 2 node.
+ * Copy the trie into a flat bit vector and free the trie nodes.
+ * pTrie->num keeps counting the bitmaps (32 bit words) wherein
+ * at least one bit is set.
  */
-static int
-tBitMapResetL2ent (tBitMap* pMap,
-                   u16 l0i, u16 l1i, u16 l2i,
-                   u8 pos, u8 endPos)
+int
+tBitMapFlatten (tBitMap* pMap)
 {
-    u32 bits;
-    u32 bitmap;
-    int len;
+    u32   l0i, l0n;
+    u32   l1i, l1n;
+    u32   idx;
+    u32   num;
+    u32*  pFlat;
     mtrie3l*    p;
     mtrie3l_l1* pl1;
     tBitMapL2*  pl2;
 
-
-    if (!pMap) {
+    if (!pMap || tBitMapIsConcurrent(pMap) || tBitMapIsStriped(pMap) ||
+        tBitMapIsSnapshot(pMap)) {
         return TBITMAP_ERR;
     }
-    if (endPos >= maxNbits())  {
-        return TBITMAP_EINDEX;
+    if (tBitMapIsFlat(pMap)) {
+        return TBITMAP_SUCCESS;
     }
-    if (pos >= maxNbits())  {
-        return TBITMAP_EINDEX;
+    pFlat = ALLOC_MEM(MEM_TBITMAP, nFlatWords(pMap) * sizeof(u32));
+    if (!pFlat) {
+        return TBITMAP_ENOMEM;
     }
+    memset(pFlat, 0, nFlatWords(pMap) * sizeof(u32));
 
     p   = pMap->pTrie;
-    pl1 = p->l0[l0i];    /* level 1 node pointer */
-    if (!pl1) {
-        return TBITMAP_SUCCESS; /* already unset */
-    }
-    pl2 = getPtr(tBitMapL2, pl1->l1[l1i]); /* level 2 node pointer */
-    if (pl2) {
-        bitmap = pl2->bitmap[l2i];
-    } else {        
-        if (getPtrTag(pl1->l1[l1i]) == 0) {
-            return TBITMAP_SUCCESS; /* already unset */
+    l0n = 1 << p->len[0];
+    l1n = nL1elm(p);
+    for (l0i = 0; l0i < l0n; ++l0i) {
+        pl1 = p->l0[l0i];
+        if (!pl1) {
+            continue;
         }
-        len = (1 << p->len[2]) * sizeof(u32);
-        pl2 = ALLOC_MEM(MEM_TBITMAP, len + sizeof(tBitMapL2));
-        if (!pl2) {
-            return TBITMAP_ENOMEM;
+        if (tBitMapIsFullL1(pl1)) {
+            idx = l0i << (p->len[1] + p->len[2]);
+            memset(pFlat + idx, ~0, l1n * nL2elm(p) * sizeof(u32));
+            continue;
         }
-        pl2->cnt     = nL2elm(p);
-        pl2->nSetAll = nL2elm(p);
-        memset(pl2->bitmap, ~0, len);
-        pl1->l1[l1i] = (mtrie3l_l2*)pl2;
-        ++p->nL2;
-        bitmap = ~0;
-    }
-
-    /*
-     * Reset bit positions from pos to endPos
-     */
-    bits = setBits32(pos, endPos);
-
-    if ((bits & (~bitmap)) == bits) {
-        return TBITMAP_SUCCESS; /* All bits are already reset */
-    }
-    if (bitmap == ~0) {
-        --pl2->nSetAll;
-    }
-    bitmap &= ~bits;
-    if (bitmap == 0) {
-        --pl2->cnt;           /* # of bitmaps at least 1 bit is set */
-        TBITMAP_ASSERT(p->num);
-        --p->num;       /* total # of bitmaps at least 1 bit is set */
-    }
-    if (pl2->cnt == 0) {
-        FREE_MEM(MEM_TBITMAP, pl2);
-        pl1->l1[l1i] = NULL;
-        --pl1->cnt;             /* # of L2 nodes incl. compressed nodes */
-        TBITMAP_ASSERT(p->nL2 > 0);
-        --p->nL2;               /* total # of L2 nodes */
-
-        if (pl1->cnt == 0) {
-            FREE_MEM(MEM_TBITMAP, pl1);
-            p->l0[l0i] = NULL;
-            --p->nL1;           /* total # of L1 nodes */
+        for (l1i = 0; l1i < l1n; ++l1i) {
+            idx = ((l0i << p->len[1]) | l1i) << p->len[2];
+            if (getPtrTag(pl1->l1[l1i])) {
+                memset(pFlat + idx, ~0, nL2elm(p) * sizeof(u32));
+                continue;
+            }
+            pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
+            if (pl2) {
+                memcpy(pFlat + idx, pl2->bitmap, nL2elm(p) * sizeof(u32));
+            }
         }
-    } else {
-        pl2->bitmap[l2i] = bitmap;
     }
+    num = p->num;
+    tBitMapDestroy(pMap);
+    p->num = num;
+    pMap->pFlat  = pFlat;
+    pMap->flags |= TBITMAP_IS_FLAT;
     return TBITMAP_SUCCESS;
 }
 
 /*
- * Set bits between bit position `pos' and `endPos'
- * of the entry in the level 2 node.
+ * Rebuild the trie from the flat bit vector and free it.
  */
-static int
-tBitMapSetL2ent (tBitMap* pMap,
-                 u16 l0i, u16 l1i, u16 l2i,
-                 u8 pos, u8 endPos)
+int
+tBitMapUnflatten (tBitMap* pMap)
 {
-    u32 bits;
-    u32 bitmap;
-    int do_free = 0;
-    int len;
+    u32   l0i, l0n;
+    u32   l1i, l1n;
+    u32   i, nz, nfull;
+    u32   num;
+    u32*  pw;
     mtrie3l*    p;
     mtrie3l_l1* pl1;
     tBitMapL2*  pl2;
 
-    if (!pMap) {
+    if (!pMap || tBitMapIsConcurrent(pMap) || tBitMapIsSnapshot(pMap)) {
         return TBITMAP_ERR;
     }
-    if (endPos >= maxNbits())  {
-        return TBITMAP_EINDEX;
-    }
-    if (pos >= maxNbits())  {
-        return TBITMAP_EINDEX;
+    if (!tBitMapIsFlat(pMap)) {
+        return TBITMAP_SUCCESS;
     }
 
     p   = pMap->pTrie;
-    pl1 = p->l0[l0i];        /* level 1 node pointer */
-    if (pl1) {
-        if (getPtrTag(pl1->l1[l1i])) {
-            return TBITMAP_SUCCESS;            /* already set */
+    num = p->num;
+    l0n = 1 << p->len[0];
+    l1n = nL1elm(p);
+    pw  = pMap->pFlat;
+    for (l0i = 0; l0i < l0n; ++l0i) {
+        for (l1i = 0; l1i < l1n; ++l1i, pw += nL2elm(p)) {
+            nz    = 0;
+            nfull = 0;
+            for (i = 0; i < nL2elm(p); ++i) {
+                if (pw[i]) {
+                    ++nz;
+                    if (pw[i] == ~0) {
+                        ++nfull;
+                    }
+                }
+            }
+            if (nz == 0) {
+                continue;
+            }
+            pl1 = p->l0[l0i];
+            if (!pl1) {
+                pl1 = ALLOC_MEM(MEM_TBITMAP, l1NodeSize(p));
+                if (!pl1) {
+                    goto nomem;
+                }
+                memset(pl1, 0, l1NodeSize(p));
+                p->l0[l0i] = pl1;
+                ++p->nL1;
+            }
+            if (nfull == nL2elm(p)) {
+                writePtrTag(&pl1->l1[l1i], 1);
+            } else {
+                pl2 = ALLOC_MEM(MEM_TBITMAP, l2NodeSize(p));
+                if (!pl2) {
+                    goto nomem;
+                }
+                pl2->cnt     = nz;
+                pl2->nSetAll = nfull;
+                pl2->ref     = 0;
+                memcpy(pl2->bitmap, pw, nL2elm(p) * sizeof(u32));
+                pl1->l1[l1i] = (mtrie3l_l2*)pl2;
+                ++p->nL2;
+            }
+            ++pl1->cnt;
         }
-        pl2 = getPtr(tBitMapL2, pl1->l1[l1i]); /* level 2 node pointer */
-    } else {
-        len = sizeof(mtrie3l_l1) + ((1 << p->len[1]) * sizeof(tBitMapL2*));
-        pl1 = ALLOC_MEM(MEM_TBITMAP, len);
-        if (!pl1) {
-            return TBITMAP_ENOMEM;
+        if (p->l0[l0i]) {
+            tBitMapFoldL1(pMap, l0i);
         }
-        memset(pl1, 0, len);
-        p->l0[l0i] = pl1;
-        ++p->nL1;               /* total number of L1 nodes */
-        do_free = 1;
-        pl2 = NULL;
     }
+    FREE_MEM(MEM_TBITMAP, pMap->pFlat);
+    pMap->pFlat  = NULL;
+    pMap->flags &= ~TBITMAP_IS_FLAT;
+    p->num = num;
+    return TBITMAP_SUCCESS;
 
-    bits = setBits32(pos, endPos);
-    if (pl2) {
-        bitmap = pl2->bitmap[l2i];
-        if (bitmap & bits) {
-            return TBITMAP_SUCCESS; /* already set */
+nomem:
+    tBitMapDestroy(pMap);
+    p->num = num;
+    return TBITMAP_ENOMEM;
+}
+
+/*
+ * Switch to the flat bit vector once the trie nodes take as much
+ * memory as the flat bit vector would, and back to the trie once
+ * the trie would take less than a quarter of it even if every
+ * non-zero bitmap had its own L1 and L2 node. The gap keeps a
+ * bitmap from switching back and forth around one size. Bitmaps
+ * allocated flat (up to 2^TBITMAP_FLAT_BITS bits) stay flat.
+ */
+void
+tBitMapAutoSwitch (tBitMap* pMap)
+{
+    u64      nbytes;
+    u64      nFlat = (u64)nFlatWords(pMap) * sizeof(u32);
+    mtrie3l* p     = pMap->pTrie;
+
+    if (pMap->flags & TBITMAP_KEEP_TRIE) {
+        return;
+    }
+    if (tBitMapIsFlat(pMap)) {
+        if (pMap->maxPos < (1 << TBITMAP_FLAT_BITS)) {
+            return;
         }
-        if (bitmap == 0) {
-            ++pl2->cnt; /* at least one bit will be set in bitmap[l2i] */
-            ++p->num;   /* total # of bitmaps at least 1 bit is set */
+        nbytes = (u64)p->num * (l1NodeSize(p) + l2NodeSize(p));
+        if (nbytes < (nFlat >> 2)) {
+            tBitMapUnflatten(pMap); /* stay flat if no memory */
+        }
+        return;
+    }
+    nbytes  = (u64)p->nL1 * l1NodeSize(p);
+    nbytes += (u64)p->nL2 * l2NodeSize(p);
+    if (nbytes >= nFlat) {
+        tBitMapFlatten(pMap);   /* keep the trie if no memory */
+    }
+}
+
+/*
+ * Keep the bitmap a trie (keep == TRUE), or let it switch
+ * between the trie and the flat bit vector again.
+ */
+int
+tBitMapKeepTrie (tBitMap* pMap, bool keep)
+{
+    int rt;
+
+    if (!pMap) {
+        return TBITMAP_ERR;
+    }
+    if (!keep) {
+        pMap->flags &= ~TBITMAP_KEEP_TRIE;
+        return TBITMAP_SUCCESS;
+    }
+    rt = tBitMapUnflatten(pMap);
+    if (rt == TBITMAP_SUCCESS) {
+        pMap->flags |= TBITMAP_KEEP_TRIE;
+    }
+    return rt;
+}
+
+/*
+ * Replace the full tag at p->l0[l0i] by an L1 node
+ * whose entries are all full tags. NULL if no memory.
+ */
+mtrie3l_l1*
+tBitMapUnfoldL1 (tBitMap* pMap, u16 l0i)
+{
+    u32         l1i;
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l1* pl1;
+
+    pl1 = ALLOC_MEM(MEM_TBITMAP, l1NodeSize(p));
+    if (!pl1) {
+        return NULL;
+    }
+    pl1->cnt = nL1elm(p);
+    pl1->ref = 0;
+    for (l1i = 0; l1i < nL1elm(p); ++l1i) {
+        writePtrTag(&pl1->l1[l1i], TBITMAP_TAG_FULL);
+    }
+    p->l0[l0i] = pl1;
+    ++*cntL1(pMap, l0i);
+    TBITMAP_COUNT(pMap, nAllocL1, 1);
+    return pl1;
+}
+
+/*
+ * Replace the L1 node at p->l0[l0i] by a full tag if all its
+ * entries are full tags. The node must not be shared.
+ */
+void
+tBitMapFoldL1 (tBitMap* pMap, u16 l0i)
+{
+    u32         l1i;
+    mtrie3l*    p   = pMap->pTrie;
+    mtrie3l_l1* pl1 = p->l0[l0i];
+
+    if (pl1->cnt != nL1elm(p)) {
+        return;                 /* optimization */
+    }
+    for (l1i = 0; l1i < nL1elm(p); ++l1i) {
+        if (getPtrTag(pl1->l1[l1i]) != TBITMAP_TAG_FULL) {
+            return;
+        }
+    }
+    FREE_MEM(MEM_TBITMAP, pl1);
+    writePtrTag(&p->l0[l0i], TBITMAP_TAG_FULL);
+    TBITMAP_ASSERT(*cntL1(pMap, l0i) > 0);
+    --*cntL1(pMap, l0i);
+    TBITMAP_COUNT(pMap, nFreeL1, 1);
+}
+
+/*
+ * Set or reset bits from `start' to `end' in the flat bit vector.
+ */
+static int
+tBitMapSetResetFlat (tBitMap* pMap, u32 start, u32 end, bool isSet)
+{
+    u32  i, last;
+    u32  bits;
+    u32  bitmap;
+    u32* pw = pMap->pFlat;
+    mtrie3l* p = pMap->pTrie;
+
+    last = end >> 5;
+    for (i = start >> 5; i <= last; ++i) {
+        bits = setBits32((i == (start >> 5)) ? getPos(start) : 0,
+                         (i == last) ? getPos(end) : posMask());
+        bitmap = pw[i];
+        if (isSet) {
+            if (bitmap == 0) {
+                ++p->num;
+            }
+            pw[i] = bitmap | bits;
+        } else if (bitmap) {
+            bitmap &= ~bits;
+            if (bitmap == 0) {
+                --p->num;
+            }
+            pw[i] = bitmap;
+        }
+    }
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Reset (unset) bits between bit position `pos' and `endPos'
+ * of the entry in the level 2 node.
+ */
+static int
+tBitMapResetL2ent (tBitMap* pMap,
+                   u16 l0i, u16 l1i, u16 l2i,
+                   u8 pos, u8 endPos)
+{
+    u32 bits;
+    u32 bitmap;
+    int len;
+    mtrie3l*    p;
+    mtrie3l_l1* pl1;
+    tBitMapL2*  pl2;
+
+
+    if (!pMap) {
+        return TBITMAP_ERR;
+    }
+    if (endPos >= maxNbits())  {
+        return TBITMAP_EINDEX;
+    }
+    if (pos >= maxNbits())  {
+        return TBITMAP_EINDEX;
+    }
+
+    /*
+     * Reset bit positions from pos to endPos
+     */
+    bits = setBits32(pos, endPos);
+
+    p   = pMap->pTrie;
+    pl1 = p->l0[l0i];    /* level 1 node pointer */
+    if (!pl1) {
+        return TBITMAP_SUCCESS; /* already unset */
+    }
+    if (tBitMapIsFullL1(pl1)) {
+        pl2 = NULL;             /* unfolded by tBitMapOwnL1() */
+    } else {
+        pl2 = getPtr(tBitMapL2, pl1->l1[l1i]); /* level 2 node pointer */
+        if (pl2) {
+            if ((bits & (~pl2->bitmap[l2i])) == bits) {
+                return TBITMAP_SUCCESS; /* All bits are already reset */
+            }
+        } else if (getPtrTag(pl1->l1[l1i]) == 0) {
+            return TBITMAP_SUCCESS; /* already unset */
+        }
+    }
+    pl1 = tBitMapOwnL1(pMap, l0i);
+    if (!pl1) {
+        return TBITMAP_ENOMEM;
+    }
+    if (pl2) {
+        pl2 = tBitMapOwnL2(pMap, pl1, l1i);
+        if (!pl2) {
+            return TBITMAP_ENOMEM;
+        }
+        bitmap = pl2->bitmap[l2i];
+    } else {        
+        len = (1 << p->len[2]) * sizeof(u32);
+        pl2 = ALLOC_MEM(MEM_TBITMAP, len + sizeof(tBitMapL2));
+        if (!pl2) {
+            return TBITMAP_ENOMEM;
+        }
+        pl2->cnt     = nL2elm(p);
+        pl2->nSetAll = nL2elm(p);
+        pl2->ref     = 0;
+        memset(pl2->bitmap, ~0, len);
+        pl1->l1[l1i] = (mtrie3l_l2*)pl2;
+        ++*cntL2(pMap, l0i);
+        TBITMAP_COUNT(pMap, nAllocL2, 1);
+        TBITMAP_COUNT(pMap, nDecompress, 1);
+        bitmap = ~0;
+    }
+
+    if (bitmap == ~0) {
+        --pl2->nSetAll;
+    }
+    bitmap &= ~bits;
+    if (bitmap == 0) {
+        --pl2->cnt;           /* # of bitmaps at least 1 bit is set */
+        TBITMAP_ASSERT(*cntNum(pMap, l0i));
+        --*cntNum(pMap, l0i); /* total # of bitmaps at least 1 bit is set */
+    }
+    if (pl2->cnt == 0) {
+        FREE_MEM(MEM_TBITMAP, pl2);
+        pl1->l1[l1i] = NULL;
+        --pl1->cnt;             /* # of L2 nodes incl. compressed nodes */
+        TBITMAP_ASSERT(*cntL2(pMap, l0i) > 0);
+        --*cntL2(pMap, l0i);    /* total # of L2 nodes */
+        TBITMAP_COUNT(pMap, nFreeL2, 1);
+
+        if (pl1->cnt == 0) {
+            FREE_MEM(MEM_TBITMAP, pl1);
+            p->l0[l0i] = NULL;
+            --*cntL1(pMap, l0i); /* total # of L1 nodes */
+            TBITMAP_COUNT(pMap, nFreeL1, 1);
+        }
+    } else {
+        pl2->bitmap[l2i] = bitmap;
+    }
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Set bits between bit position `pos' and `endPos'
+ * of the entry in the level 2 node.
+ */
+static int
+tBitMapSetL2ent (tBitMap* pMap,
+                 u16 l0i, u16 l1i, u16 l2i,
+                 u8 pos, u8 endPos)
+{
+    u32 bits;
+    u32 bitmap;
+    int do_free = 0;
+    int len;
+    mtrie3l*    p;
+    mtrie3l_l1* pl1;
+    tBitMapL2*  pl2;
+
+    if (!pMap) {
+        return TBITMAP_ERR;
+    }
+    if (endPos >= maxNbits())  {
+        return TBITMAP_EINDEX;
+    }
+    if (pos >= maxNbits())  {
+        return TBITMAP_EINDEX;
+    }
+
+    bits = setBits32(pos, endPos);
+    p   = pMap->pTrie;
+    pl1 = p->l0[l0i];        /* level 1 node pointer */
+    if (pl1) {
+        if (tBitMapIsFullL1(pl1) || getPtrTag(pl1->l1[l1i])) {
+            return TBITMAP_SUCCESS;            /* already set */
+        }
+        pl2 = getPtr(tBitMapL2, pl1->l1[l1i]); /* level 2 node pointer */
+        if (pl2 && ((pl2->bitmap[l2i] & bits) == bits)) {
+            return TBITMAP_SUCCESS;            /* already set */
+        }
+        pl1 = tBitMapOwnL1(pMap, l0i);
+        if (!pl1) {
+            return TBITMAP_ENOMEM;
+        }
+        if (pl2) {
+            pl2 = tBitMapOwnL2(pMap, pl1, l1i);
+            if (!pl2) {
+                return TBITMAP_ENOMEM;
+            }
+        }
+    } else {
+        len = sizeof(mtrie3l_l1) + ((1 << p->len[1]) * sizeof(tBitMapL2*));
+        pl1 = ALLOC_MEM(MEM_TBITMAP, len);
+        if (!pl1) {
+            return TBITMAP_ENOMEM;
+        }
+        memset(pl1, 0, len);
+        p->l0[l0i] = pl1;
+        ++*cntL1(pMap, l0i);    /* total number of L1 nodes */
+        TBITMAP_COUNT(pMap, nAllocL1, 1);
+        do_free = 1;
+        pl2 = NULL;
+    }
+
+    if (pl2) {
+        bitmap = pl2->bitmap[l2i];
+        if (bitmap == 0) {
+            ++pl2->cnt; /* at least one bit will be set in bitmap[l2i] */
+            ++*cntNum(pMap, l0i); /* total # of bitmaps >= 1 bit is set */
         }
         bitmap |= bits;
         if (bitmap == ~0) {
@@ -408,8 +822,11 @@ tBitMapSetL2ent (tBitMap* pMap,
         if (pl2->nSetAll == nL2elm(p)) {
             FREE_MEM(MEM_TBITMAP, pl2);
             writePtrTag(&pl1->l1[l1i], 1);
-            TBITMAP_ASSERT(p->nL2 > 0);
-            --p->nL2;           /* total # of L2 nodes */
+            TBITMAP_ASSERT(*cntL2(pMap, l0i) > 0);
+            --*cntL2(pMap, l0i); /* total # of L2 nodes */
+            TBITMAP_COUNT(pMap, nFreeL2, 1);
+            TBITMAP_COUNT(pMap, nCompress, 1);
+            tBitMapFoldL1(pMap, l0i);
         } else {
             pl2->bitmap[l2i] = bitmap;
         }
@@ -420,33 +837,36 @@ tBitMapSetL2ent (tBitMap* pMap,
             if (do_free) {
                 FREE_MEM(MEM_TBITMAP, pl1);
                 p->l0[l0i] = NULL;
-                --p->nL1;       /* total # of L1 nodes */
+                --*cntL1(pMap, l0i); /* total # of L1 nodes */
+                TBITMAP_COUNT(pMap, nFreeL1, 1);
             }
             return TBITMAP_ENOMEM;
         }
         memset(pl2, 0, len);
         pl1->l1[l1i] = (mtrie3l_l2*)pl2;
         ++pl1->cnt;             /* # of L2 nodes incl. compressed nodes */
-        ++p->nL2;               /* total # of L2 nodes */
+        ++*cntL2(pMap, l0i);    /* total # of L2 nodes */
+        TBITMAP_COUNT(pMap, nAllocL2, 1);
         pl2->bitmap[l2i] = bits;
         if (bits == ~0) {
             ++pl2->nSetAll;     /* # of bitmaps all bits are set */
         }
         ++pl2->cnt;     /* at least one bit is set in bitmap[l2i] */
-        ++p->num;       /* total # of bitmaps at least 1 bit is set */
+        ++*cntNum(pMap, l0i); /* total # of bitmaps at least 1 bit is set */
     }
 
     return TBITMAP_SUCCESS;
 }
 
-bool
-tBitMapIsSet (tBitMap* pMap, u32 bitPos)
+static inline bool
+tBitMapIsSetRaw (tBitMap* pMap, u32 bitPos)
 {
     u16 l0i;
     u16 l1i;
     u16 l2i;
     u32 index;
     u32 pos;
+    bool isSet = FALSE;
     mtrie3l*    p;
     mtrie3l_l1* pl1;
     tBitMapL2*  pl2;
@@ -458,44 +878,379 @@ tBitMapIsSet (tBitMap* pMap, u32 bitPos)
         return TBITMAP_EINDEX;
     }
 
+    if (tBitMapIsConcurrent(pMap)) {
+        return tBitMapIsSetConcurrent(pMap, bitPos);
+    }
+    if (tBitMapIsFlat(pMap)) {
+        return (pMap->pFlat[bitPos >> 5] >> getPos(bitPos)) & 1;
+    }
     index = bitPos >> 5;
     p = pMap->pTrie;
     MTRIE3L_GET_INDICES;
+    pos = bitPos & (~(((u32)(~0)) << 5));
+    pos = 1 << pos;
 
+    tBitMapStripeLock(pMap, l0i);
     pl1 = p->l0[l0i];    /* level 1 node pointer */
-    if (!pl1) {
-        return FALSE;
+    if (pl1) {
+        if (tBitMapIsFullL1(pl1) || getPtrTag(pl1->l1[l1i])) {
+            isSet = TRUE;   /* all bits in p->l0[l0i] or pl1->l1[l1i] */
+        } else {
+            pl2 = getPtr(tBitMapL2, pl1->l1[l1i]); /* L2 node pointer */
+            if (pl2 && (pl2->bitmap[l2i] & pos)) {
+                isSet = TRUE;
+            }
+        }
+    }
+    tBitMapStripeUnlock(pMap, l0i);
+    return isSet;
+}
+
+bool
+tBitMapIsSet (tBitMap* pMap, u32 bitPos)
+{
+    bool isSet;
+    TBITMAP_TSC_DECL(t0);
+
+    isSet = tBitMapIsSetRaw(pMap, bitPos);
+    if (pMap) {
+        TBITMAP_COUNT(pMap, nLookup, 1);
+        TBITMAP_LATENCY(pMap, TBITMAP_API_ISSET, t0);
+        TBITMAP_TRACE_OP(pMap, TBITMAP_TRACE_ISSET, bitPos, 0, isSet);
+    }
+    return isSet;
+}
+
+/*
+ * TRUE if all the bits of the range (see tBitMapSetResetL2range())
+ * in bitmaps pw[l2i..l2n] are already `isSet'.
+ */
+static bool
+tBitMapL2rangeIs (const u32* pw, u16 l2i, u16 l2n,
+                  u32 first, u32 last, bool isSet)
+{
+    u32 i;
+    u32 acc;
+
+    if (isSet) {
+        acc = ~(pw[l2i] & first) & first;
+        if (l2n > l2i) {
+            acc |= ~(pw[l2n] & last) & last;
+        }
+        for (i = l2i + 1; i < l2n; ++i) {
+            acc |= ~pw[i];
+        }
+    } else {
+        acc = pw[l2i] & first;
+        if (l2n > l2i) {
+            acc |= pw[l2n] & last;
+        }
+        for (i = l2i + 1; i < l2n; ++i) {
+            acc |= pw[i];
+        }
     }
-    if (getPtrTag(pl1->l1[l1i])) {
-        return TRUE;        /* all bits in pl1->l2[l1i] are set */
+    return (acc == 0);
+}
+
+/*
+ * Set or reset the bits from `pos' of bitmap[l2i] to `endPos' of
+ * bitmap[l2n] of the L2 node at L0[l0i], L1[l1i]. The L1 and L2 nodes
+ * are looked up (and copied if shared with a snapshot) once, the
+ * bitmaps between the first and the last one are filled with memset()
+ * and the counters are updated once per node.
+ */
+static int
+tBitMapSetResetL2range (tBitMap* pMap, u16 l0i, u16 l1i,
+                        u16 l2i, u16 l2n, u8 pos, u8 endPos, bool isSet)
+{
+    u32  first;                 /* bits of bitmap[l2i] */
+    u32  last;                  /* bits of bitmap[l2n] */
+    u32  nInner;                /* # of bitmaps between l2i and l2n */
+    u32  nz, nzNew;             /* # of bitmaps != 0 in the range */
+    u32  full, fullNew;         /* # of bitmaps == ~0 in the range */
+    u32  i;
+    u32* pw;
+    bool doFree = FALSE;
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l1* pl1;
+    tBitMapL2*  pl2;
+
+    first  = setBits32(pos, (l2i == l2n) ? endPos : posMask());
+    last   = setBits32((l2i == l2n) ? pos : 0, endPos);
+    nInner = (l2n > l2i) ? l2n - l2i - 1 : 0;
+
+    pl1 = p->l0[l0i];
+    if (!pl1) {
+        if (!isSet) {
+            return TBITMAP_SUCCESS;     /* already reset */
+        }
+        pl1 = ALLOC_MEM(MEM_TBITMAP, l1NodeSize(p));
+        if (!pl1) {
+            return TBITMAP_ENOMEM;
+        }
+        memset(pl1, 0, l1NodeSize(p));
+        p->l0[l0i] = pl1;
+        ++*cntL1(pMap, l0i);
+        TBITMAP_COUNT(pMap, nAllocL1, 1);
+        doFree = TRUE;
+        pl2 = NULL;
+    } else {
+        if (tBitMapIsFullL1(pl1) || getPtrTag(pl1->l1[l1i])) {
+            if (isSet) {
+                return TBITMAP_SUCCESS; /* already set */
+            }
+            pl2 = NULL;         /* tBitMapOwnL1() unfolds a full L1 */
+        } else {
+            pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
+            if (!pl2) {
+                if (!isSet) {
+                    return TBITMAP_SUCCESS; /* already reset */
+                }
+            } else if (tBitMapL2rangeIs(pl2->bitmap, l2i, l2n,
+                                        first, last, isSet)) {
+                return TBITMAP_SUCCESS;
+            }
+        }
+        pl1 = tBitMapOwnL1(pMap, l0i);
+        if (!pl1) {
+            return TBITMAP_ENOMEM;
+        }
+        if (pl2) {
+            pl2 = tBitMapOwnL2(pMap, pl1, l1i);
+            if (!pl2) {
+                return TBITMAP_ENOMEM;
+            }
+        }
     }
-    pl2 = getPtr(tBitMapL2, pl1->l1[l1i]); /* level 2 node pointer */
+
     if (!pl2) {
-        return FALSE;
+        /*
+         * New empty node to set bits in, or decompression
+         * of a full node to reset bits in.
+         */
+        pl2 = ALLOC_MEM(MEM_TBITMAP, l2NodeSize(p));
+        if (!pl2) {
+            if (doFree) {
+                FREE_MEM(MEM_TBITMAP, pl1);
+                p->l0[l0i] = NULL;
+                --*cntL1(pMap, l0i);
+                TBITMAP_COUNT(pMap, nFreeL1, 1);
+            }
+            return TBITMAP_ENOMEM;
+        }
+        pl2->ref = 0;
+        if (isSet) {
+            pl2->cnt     = 0;
+            pl2->nSetAll = 0;
+            memset(pl2->bitmap, 0, nL2elm(p) * sizeof(u32));
+            ++pl1->cnt;         /* # of L2 nodes incl. compressed nodes */
+        } else {
+            pl2->cnt     = nL2elm(p);
+            pl2->nSetAll = nL2elm(p);
+            memset(pl2->bitmap, ~0, nL2elm(p) * sizeof(u32));
+            TBITMAP_COUNT(pMap, nDecompress, 1);
+        }
+        pl1->l1[l1i] = (mtrie3l_l2*)pl2;
+        ++*cntL2(pMap, l0i);
+        TBITMAP_COUNT(pMap, nAllocL2, 1);
     }
-    pos = bitPos & (~(((u32)(~0)) << 5));
-    pos = 1 << pos;
-    if (pl2->bitmap[l2i] & pos) {
-        return TRUE;
+
+    pw   = pl2->bitmap;
+    nz   = 0;
+    full = 0;
+    for (i = l2i; i <= l2n; ++i) {
+        nz   += (pw[i] != 0);
+        full += (pw[i] == ~0U);
+    }
+    if (isSet) {
+        pw[l2i] |= first;
+        if (l2n > l2i) {
+            memset(&pw[l2i + 1], ~0, nInner * sizeof(u32));
+            pw[l2n] |= last;
+        }
+        nzNew   = nInner;
+        fullNew = nInner;
+    } else {
+        pw[l2i] &= ~first;
+        if (l2n > l2i) {
+            memset(&pw[l2i + 1], 0, nInner * sizeof(u32));
+            pw[l2n] &= ~last;
+        }
+        nzNew   = 0;
+        fullNew = 0;
     }
-    return FALSE;
+    nzNew   += (pw[l2i] != 0)   + ((l2n > l2i) && (pw[l2n] != 0));
+    fullNew += (pw[l2i] == ~0U) + ((l2n > l2i) && (pw[l2n] == ~0U));
+    pl2->cnt     = pl2->cnt + nzNew - nz;
+    pl2->nSetAll = pl2->nSetAll + fullNew - full;
+    if (isSet) {
+        *cntNum(pMap, l0i) += nzNew - nz;
+    } else {
+        TBITMAP_ASSERT(*cntNum(pMap, l0i) >= nz - nzNew);
+        *cntNum(pMap, l0i) -= nz - nzNew;
+    }
+
+    if (isSet && (pl2->nSetAll == nL2elm(p))) {
+        /*
+         * Compression
+         */
+        FREE_MEM(MEM_TBITMAP, pl2);
+        writePtrTag(&pl1->l1[l1i], 1);
+        TBITMAP_ASSERT(*cntL2(pMap, l0i) > 0);
+        --*cntL2(pMap, l0i);
+        TBITMAP_COUNT(pMap, nFreeL2, 1);
+        TBITMAP_COUNT(pMap, nCompress, 1);
+        tBitMapFoldL1(pMap, l0i);
+    } else if (!isSet && (pl2->cnt == 0)) {
+        FREE_MEM(MEM_TBITMAP, pl2);
+        pl1->l1[l1i] = NULL;
+        --pl1->cnt;             /* # of L2 nodes incl. compressed nodes */
+        TBITMAP_ASSERT(*cntL2(pMap, l0i) > 0);
+        --*cntL2(pMap, l0i);
+        TBITMAP_COUNT(pMap, nFreeL2, 1);
+        if (pl1->cnt == 0) {
+            FREE_MEM(MEM_TBITMAP, pl1);
+            p->l0[l0i] = NULL;
+            --*cntL1(pMap, l0i);
+            TBITMAP_COUNT(pMap, nFreeL1, 1);
+        }
+    }
+    return TBITMAP_SUCCESS;
 }
 
-int
-tBitMapSetResetBlock (tBitMap* pMap, u32 start, u32 end, bool isSet)
+/*
+ * tBitMapSetResetL2range() holding the lock of the stripe of `l0i'
+ * (TBITMAP_STRIPED). A range within one bitmap goes to the cheaper
+ * tBitMapSetL2ent() or tBitMapResetL2ent().
+ */
+static int
+tBitMapSetResetL2rangeLocked (tBitMap* pMap, u16 l0i, u16 l1i,
+                              u16 l2i, u16 l2n, u8 pos, u8 endPos,
+                              bool isSet)
+{
+    int rt;
+
+    tBitMapStripeLock(pMap, l0i);
+    if (l2i != l2n) {
+        rt = tBitMapSetResetL2range(pMap, l0i, l1i, l2i, l2n, pos, endPos,
+                                    isSet);
+    } else if (isSet) {
+        rt = tBitMapSetL2ent(pMap, l0i, l1i, l2i, pos, endPos);
+    } else {
+        rt = tBitMapResetL2ent(pMap, l0i, l1i, l2i, pos, endPos);
+    }
+    tBitMapStripeUnlock(pMap, l0i);
+    return rt;
+}
+
+/*
+ * Set or reset all the bits of the L2 nodes from `l1i' to `l1n'
+ * of the L1 node at `l0i'.
+ */
+static int
+tBitMapSetResetL1ent (tBitMap* pMap, u16 l0i, u16 l1i, u16 l1n, bool isSet)
+{
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l1* pl1;
+    tBitMapL2*  pl2;
+    bool        whole = (l1i == 0) && (l1n == nL1elm(p) - 1);
+
+    pl1 = p->l0[l0i];
+    if (whole && (isSet ? !pl1 : tBitMapIsFullL1(pl1))) {
+        /*
+         * Fill or empty the whole L1 node with a full tag
+         * without allocating it
+         */
+        if (isSet) {
+            writePtrTag(&p->l0[l0i], TBITMAP_TAG_FULL);
+            *cntNum(pMap, l0i) += nL1elm(p) * nL2elm(p);
+        } else {
+            p->l0[l0i] = NULL;
+            *cntNum(pMap, l0i) -= nL1elm(p) * nL2elm(p);
+        }
+        return TBITMAP_SUCCESS;
+    }
+    if (pl1) {
+        if (isSet && tBitMapIsFullL1(pl1)) {
+            return TBITMAP_SUCCESS;
+        }
+        pl1 = tBitMapOwnL1(pMap, l0i);
+        if (!pl1) {
+            return TBITMAP_ENOMEM;
+        }
+    } else {
+        if (!isSet) {
+            return TBITMAP_SUCCESS;
+        }
+        pl1 = ALLOC_MEM(MEM_TBITMAP, l1NodeSize(p));
+        if (!pl1) {
+            return TBITMAP_ENOMEM;
+        }
+        memset(pl1, 0, l1NodeSize(p));
+        p->l0[l0i] = pl1;
+        ++*cntL1(pMap, l0i);
+        TBITMAP_COUNT(pMap, nAllocL1, 1);
+    }
+    for (; l1i <= l1n; ++l1i) {
+        pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
+        if (pl2) {
+            if (isSet) {
+                /*
+                 * Mark `*pl2' is full.
+                 */
+                writePtrTag(&pl1->l1[l1i], 1);
+                *cntNum(pMap, l0i) += (nL2elm(p) - pl2->cnt);
+                TBITMAP_COUNT(pMap, nCompress, 1);
+            } else {
+                pl1->l1[l1i]  = NULL;
+                *cntNum(pMap, l0i) -= pl2->cnt;
+                --pl1->cnt; /* # of L2 nodes incl. compressed nodes */
+            }
+            tBitMapReleaseL2(pl2);
+            TBITMAP_ASSERT(*cntL2(pMap, l0i) > 0);
+            --*cntL2(pMap, l0i);
+            TBITMAP_COUNT(pMap, nFreeL2, 1);
+        } else {
+            if (isSet) {
+                if (getPtrTag(pl1->l1[l1i]) == 1) {
+                    continue;   /* already full */
+                }
+                writePtrTag(&pl1->l1[l1i], 1);
+                *cntNum(pMap, l0i) += nL2elm(p);
+                ++pl1->cnt; /* # of L2 nodes incl. compressed nodes */
+            } else {
+                if (getPtrTag(pl1->l1[l1i]) == 1) {
+                    *cntNum(pMap, l0i) -= nL2elm(p);
+                    pl1->l1[l1i] = NULL;
+                    --pl1->cnt; /* # of L2 nodes incl. compressed nodes */
+                }
+            }
+        }
+        if ((!isSet) && (pl1->cnt == 0)) {
+            FREE_MEM(MEM_TBITMAP, pl1);
+            p->l0[l0i] = NULL;
+            --*cntL1(pMap, l0i);
+            TBITMAP_COUNT(pMap, nFreeL1, 1);
+            break;   /* no more L1 nodes */
+        }
+    }
+    if (isSet) {
+        tBitMapFoldL1(pMap, l0i);
+    }
+    return TBITMAP_SUCCESS;
+}
+
+static int
+tBitMapSetResetBlockTrie (tBitMap* pMap, u32 start, u32 end, bool isSet)
 {
     u16 l0i, l0j;
     u16 l1i, l1j, l1n, l1nMax;
-    u16 l2i, l2j, l2n, l2nMax;
+    u16 l2i, l2j, l2nMax;
     u32 index;
     u8  pos;
     u8  endPos;
-    int len;
     int rt;
     mtrie3l*    p;
-    mtrie3l_l1* pl1;
-    tBitMapL2*  pl2;
-    static int (*f)(tBitMap*, u16, u16, u16, u8, u8);
 
     if (!pMap) {
         return TBITMAP_ERR;
@@ -506,7 +1261,6 @@ tBitMapSetResetBlock (tBitMap* pMap, u32 start, u32 end, bool isSet)
     if (start > end) {
         return TBITMAP_EINDEX;
     }
-    f = (isSet) ? tBitMapSetL2ent : tBitMapResetL2ent;
 
     p = pMap->pTrie;
     index = end >> 5;
@@ -523,56 +1277,22 @@ tBitMapSetResetBlock (tBitMap* pMap, u32 start, u32 end, bool isSet)
     endPos = getPos(end);
     l2nMax = nL2elm(p) - 1;
     if ((l0i == l0j) && (l1i == l1j)) {
-        if (l2i == l2j) {
-            /*
-             * Call tBitMapSetL2ent() or tBitMapResetL2ent() and return
-             * if only one L2 node needs to be processed.
-             */
-            return (*f)(pMap, l0i, l1i, l2i, pos, endPos);
-        }
-        l2n = l2j;
-    } else {
-        l2n = l2nMax;
+        /*
+         * Only one L2 node to process
+         */
+        return tBitMapSetResetL2rangeLocked(pMap, l0i, l1i, l2i, l2j,
+                                            pos, endPos, isSet);
     }
     /*
-     * Process first index (l2i) in the 1st L2 node
+     * Process from bitmap[l2i] to the end of the 1st L2 node
      */
-    rt = (*f)(pMap, l0i, l1i, l2i, pos, maxNbits() - 1);
+    rt = tBitMapSetResetL2rangeLocked(pMap, l0i, l1i, l2i, l2nMax,
+                                      pos, posMask(), isSet);
     if (rt != TBITMAP_SUCCESS) {
         return rt;
     }
     /*
-     * Process the indices from l2i+1 to l2n-1 in the 1st L2 node
-     */
-    for (++l2i; l2i < l2n; ++l2i) {
-        rt = (*f)(pMap, l0i, l1i, l2i, 0, maxNbits() - 1);
-        if (rt != TBITMAP_SUCCESS) {
-            return rt;
-        }
-    }
-    /*
-     * Process the last indice (l2n) in the 1st L2 node
-     */
-    if ((l0i == l0j) && (l1i == l1j)) {
-        /*
-         * Last node to process. Set end position to endPos.
-         */
-        return (*f)(pMap, l0i, l1i, l2i, 0, endPos);
-    } else {
-        /*
-         * If l2i > l2n, initial value of l2i was l2n.
-         * In this case, index l2i is already processed above
-         * so that we can skip this.
-         */
-        if (l2i == l2n) {
-            rt = (*f)(pMap, l0i, l1i, l2i, 0, maxNbits() - 1);
-            if (rt != TBITMAP_SUCCESS) {
-                return rt;
-            }
-        }
-    }
-    /*
-     * Process: from: L0[l0i], L1[l1i],   L2[0]
+     * Process: from: L0[l0i], L1[l1i+1], L2[0:l2nMax]
      *          to:   L0[l0j], L1[l1j-1], L2[0:l2nMax]
      */   
     l1nMax = nL1elm(p) - 1;
@@ -582,25 +1302,10 @@ tBitMapSetResetBlock (tBitMap* pMap, u32 start, u32 end, bool isSet)
     } else {
         ++l1i;
     }
-    len = sizeof(mtrie3l_l1) + ((1 << p->len[1]) * sizeof(tBitMapL2*));
-    for (; l0i <= l0j; ++l0i) {
-        if (p->num == 0) {
+    for (; l0i <= l0j; ++l0i, l1i = 0) {
+        if (!tBitMapIsStriped(pMap) && (p->num == 0)) {
             return TBITMAP_SUCCESS;
         }
-        pl1 = p->l0[l0i];
-        if (pl1 == NULL) {
-            if (isSet) {
-                pl1 = ALLOC_MEM(MEM_TBITMAP, len);
-                if (!pl1) {
-                    return TBITMAP_ENOMEM;
-                }
-                memset(pl1, 0, len);
-                p->l0[l0i] = pl1;
-                ++p->nL1;
-            } else {
-                continue;
-            }
-        }
         if (l0i == l0j) {
             if (l1j == 0) {
                 break;
@@ -609,72 +1314,87 @@ tBitMapSetResetBlock (tBitMap* pMap, u32 start, u32 end, bool isSet)
         } else {
             l1n = l1nMax;
         }
-        for (; l1i <= l1n; ++l1i) {
-            pl2 = getPtr(tBitMapL2, pl1->l1[l1i]);
-            if (pl2) {
-                if (isSet) {
-                    /*
-                     * Mark `*pl2' is full.
-                     */
-                    writePtrTag(&pl1->l1[l1i], 1);
-                    p->num += (nL2elm(p) - pl2->cnt);
-                } else {
-                    pl1->l1[l1i]  = NULL;
-                    p->num       -= pl2->cnt;
-                    --pl1->cnt; /* # of L2 nodes incl. compressed nodes */
-                }
-                FREE_MEM(MEM_TBITMAP, pl2);
-                TBITMAP_ASSERT(p->nL2 > 0);
-                --p->nL2;
-            } else {
-                if (isSet) {
-                    writePtrTag(&pl1->l1[l1i], 1);
-                    p->num += nL2elm(p);
-                    ++pl1->cnt; /* # of L2 nodes incl. compressed nodes */
-                } else {
-                    if (getPtrTag(pl1->l1[l1i]) == 1) {
-                        p->num -= nL2elm(p);
-                        pl1->l1[l1i] = NULL;
-                        --pl1->cnt; /* # of L2 nodes incl. compressed nodes */
-                    }
-                }
-            }
-            if ((!isSet) && (pl1->cnt == 0)) {
-                FREE_MEM(MEM_TBITMAP, pl1);
-                p->l0[l0i] = NULL;
-                --p->nL1;
-                break;   /* no more L1 nodes. Process next L0 index */
-            }
+        if (l1i > l1n) {
+            continue;
         }
-        if (l0i == l0j) {
-            /*
-             * Reached the last L1 node, i.e. L0[l0j], L1[l1j].
-             * Break and process the remaining L2 nodes.
-             */
-            break;
+        tBitMapStripeLock(pMap, l0i);
+        rt = tBitMapSetResetL1ent(pMap, l0i, l1i, l1n, isSet);
+        tBitMapStripeUnlock(pMap, l0i);
+        if (rt != TBITMAP_SUCCESS) {
+            return rt;
         }
-        l1i = 0;
     }
     /*
-     * Process the indices from 0 to l2j-1 in the last L2 node
+     * Process from the beginning of the last L2 node,
+     * i.e. L0[l0j], L1[l1j], to bitmap[l2j]
      */
-    for (l2i = 0; l2i < l2j; ++l2i) {
-        rt = (*f)(pMap, l0i, l1i, l2i, 0, maxNbits() - 1);
-        if (rt != TBITMAP_SUCCESS) {
-            return rt;
-        }
+    return tBitMapSetResetL2rangeLocked(pMap, l0j, l1j, 0, l2j,
+                                        0, endPos, isSet);
+}
+
+static inline int
+tBitMapSetResetBlockRaw (tBitMap* pMap, u32 start, u32 end, bool isSet)
+{
+    int rt;
+
+    if (!pMap) {
+        return TBITMAP_ERR;
+    }
+    if (end > pMap->maxPos) {
+        return TBITMAP_EINDEX;
+    }
+    if (start > end) {
+        return TBITMAP_EINDEX;
     }
-    return (*f)(pMap, l0i, l1i, l2i, 0, endPos);
+    if (tBitMapIsSnapshot(pMap)) {
+        return TBITMAP_ERR;     /* read-only */
+    }
+    if (tBitMapIsConcurrent(pMap)) {
+        return tBitMapSetResetConcurrent(pMap, start, end, isSet);
+    }
+    if (tBitMapIsFlat(pMap)) {
+        rt = tBitMapSetResetFlat(pMap, start, end, isSet);
+    } else {
+        rt = tBitMapSetResetBlockTrie(pMap, start, end, isSet);
+    }
+    if ((rt == TBITMAP_SUCCESS) && !tBitMapIsStriped(pMap)) {
+        tBitMapAutoSwitch(pMap);
+    }
+    if ((rt == TBITMAP_SUCCESS) && tBitMapIsLogged(pMap)) {
+        rt = tBitMapLog(pMap, start, end, isSet);
+    }
+    return rt;
 }
 
 int
-tBitMapSetReset (tBitMap* pMap, u32 bitPos, bool isSet)
+tBitMapSetResetBlock (tBitMap* pMap, u32 start, u32 end, bool isSet)
+{
+    int rt;
+    TBITMAP_TSC_DECL(t0);
+
+    rt = tBitMapSetResetBlockRaw(pMap, start, end, isSet);
+    if (pMap) {
+        TBITMAP_COUNT(pMap, nBlock, 1);
+        if (rt == TBITMAP_ENOMEM) {
+            TBITMAP_COUNT(pMap, nENOMEM, 1);
+        }
+        TBITMAP_LATENCY(pMap, TBITMAP_API_BLOCK, t0);
+        TBITMAP_TRACE_OP(pMap, (isSet) ? TBITMAP_TRACE_SET_BLOCK :
+                                         TBITMAP_TRACE_RESET_BLOCK,
+                         start, end, rt == TBITMAP_SUCCESS);
+    }
+    return rt;
+}
+
+static inline int
+tBitMapSetResetRaw (tBitMap* pMap, u32 bitPos, bool isSet)
 {
     u16 l0i;
     u16 l1i;
     u16 l2i;
     u32 index;
     u8  pos;
+    int rt;
     mtrie3l*    p;
 
     if (!pMap) {
@@ -683,30 +1403,143 @@ tBitMapSetReset (tBitMap* pMap, u32 bitPos, bool isSet)
     if (bitPos > pMap->maxPos) {
         return TBITMAP_EINDEX;
     }
+    if (tBitMapIsSnapshot(pMap)) {
+        return TBITMAP_ERR;     /* read-only */
+    }
+    if (tBitMapIsConcurrent(pMap)) {
+        return tBitMapSetResetConcurrent(pMap, bitPos, bitPos, isSet);
+    }
+    if (tBitMapIsFlat(pMap)) {
+        rt = tBitMapSetResetFlat(pMap, bitPos, bitPos, isSet);
+        if (rt == TBITMAP_SUCCESS) {
+            tBitMapAutoSwitch(pMap);
+        }
+        if ((rt == TBITMAP_SUCCESS) && tBitMapIsLogged(pMap)) {
+            rt = tBitMapLog(pMap, bitPos, bitPos, isSet);
+        }
+        return rt;
+    }
     p = pMap->pTrie;
     index = bitPos >> 5;
     MTRIE3L_GET_INDICES;
     pos = getPos(bitPos);
 
+    tBitMapStripeLock(pMap, l0i);
     if (isSet) {
-        return tBitMapSetL2ent (pMap, l0i, l1i, l2i, pos, pos);
+        rt = tBitMapSetL2ent (pMap, l0i, l1i, l2i, pos, pos);
+    } else {
+        rt = tBitMapResetL2ent (pMap, l0i, l1i, l2i, pos, pos);
+    }
+    tBitMapStripeUnlock(pMap, l0i);
+    if ((rt == TBITMAP_SUCCESS) && !tBitMapIsStriped(pMap)) {
+        tBitMapAutoSwitch(pMap);
+    }
+    if ((rt == TBITMAP_SUCCESS) && tBitMapIsLogged(pMap)) {
+        rt = tBitMapLog(pMap, bitPos, bitPos, isSet);
     }
-    return tBitMapResetL2ent (pMap, l0i, l1i, l2i, pos, pos);
+    return rt;
 }
 
 int
-tBitMapSetResetAll (tBitMap* pMap, bool isSet)
+tBitMapSetReset (tBitMap* pMap, u32 bitPos, bool isSet)
 {
     int rt;
+    TBITMAP_TSC_DECL(t0);
 
-    rt = tBitMapDestroy(pMap);
-    if (rt != TBITMAP_SUCCESS) {
-        return rt;
+    rt = tBitMapSetResetRaw(pMap, bitPos, isSet);
+    if (pMap) {
+        if (isSet) {
+            TBITMAP_COUNT(pMap, nSet, 1);
+        } else {
+            TBITMAP_COUNT(pMap, nReset, 1);
+        }
+        if (rt == TBITMAP_ENOMEM) {
+            TBITMAP_COUNT(pMap, nENOMEM, 1);
+        }
+        TBITMAP_LATENCY(pMap, TBITMAP_API_SETRESET, t0);
+        TBITMAP_TRACE_OP(pMap, (isSet) ? TBITMAP_TRACE_SET :
+                                         TBITMAP_TRACE_RESET,
+                         bitPos, 0, rt == TBITMAP_SUCCESS);
     }
-    if (isSet) {
-        tBitMapFlip(pMap);
+    return rt;
+}
+
+/*
+ * Set all the bits of an empty trie: a full tag in every L0 entry,
+ * or an L1 node of full tags for a concurrent bitmap, which does not
+ * know full L0 tags.
+ */
+static int
+tBitMapFillTrie (tBitMap* pMap)
+{
+    u32         l0i, l1i;
+    mtrie3l*    p = pMap->pTrie;
+    mtrie3l_l1* pl1;
+
+    for (l0i = 0; l0i < (1 << p->len[0]); ++l0i) {
+        if (tBitMapIsConcurrent(pMap)) {
+            pl1 = ALLOC_MEM(MEM_TBITMAP, l1NodeSize(p));
+            if (!pl1) {
+                tBitMapDestroy(pMap);
+                return TBITMAP_ENOMEM;
+            }
+            pl1->cnt = nL1elm(p);
+            pl1->ref = 0;
+            for (l1i = 0; l1i < nL1elm(p); ++l1i) {
+                writePtrTag(&pl1->l1[l1i], TBITMAP_TAG_FULL);
+            }
+            p->l0[l0i] = pl1;
+            ++p->nL1;
+        } else {
+            writePtrTag(&p->l0[l0i], TBITMAP_TAG_FULL);
+        }
+        *cntNum(pMap, l0i) += nL1elm(p) * nL2elm(p);
+    }
+    return TBITMAP_SUCCESS;
+}
+
+static int
+tBitMapSetResetAllRaw (tBitMap* pMap, bool isSet)
+{
+    int rt;
+
+    if (pMap && tBitMapIsSnapshot(pMap)) {
+        return TBITMAP_ERR;     /* read-only */
+    }
+    if (pMap && tBitMapIsFlat(pMap)) {
+        memset(pMap->pFlat, (isSet) ? ~0 : 0, nFlatWords(pMap) * sizeof(u32));
+        pMap->pTrie->num = (isSet) ? nFlatWords(pMap) : 0;
+        if (!tBitMapIsConcurrent(pMap)) {
+            tBitMapAutoSwitch(pMap);
+        }
     } else {
-        tBitMapUnflip(pMap);
+        rt = tBitMapDestroy(pMap);
+        if (rt != TBITMAP_SUCCESS) {
+            return rt;
+        }
+        if (isSet) {
+            rt = tBitMapFillTrie(pMap);
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+        }
+    }
+    if (tBitMapIsLogged(pMap)) {
+        return tBitMapLog(pMap, 0, pMap->maxPos, isSet);
     }
     return TBITMAP_SUCCESS;
 }
+
+int
+tBitMapSetResetAll (tBitMap* pMap, bool isSet)
+{
+    int rt;
+
+    rt = tBitMapSetResetAllRaw(pMap, isSet);
+    if (pMap) {
+        TBITMAP_TRACE_OP(pMap, (isSet) ? TBITMAP_TRACE_SET_ALL :
+                                         TBITMAP_TRACE_RESET_ALL,
+                         0, 0, rt == TBITMAP_SUCCESS);
+    }
+    return rt;
+}
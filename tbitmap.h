@@ -31,6 +31,55 @@
 
 #include "mtrie3l.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counters (TBITMAP_STATS)
+ *
+ * If the library is built with -DTBITMAP_STATS, every bitmap counts
+ * its lookups, updates, node allocations and frees, compressions
+ * (L2 nodes replaced by TBITMAP_TAG_FULL), decompressions (L2 nodes
+ * allocated for a full L1 entry) and TBITMAP_ENOMEM returns. With
+ * -DTBITMAP_STATS_LATENCY, which implies TBITMAP_STATS, it also keeps
+ * a histogram of the CPU cycles (rdtsc) taken by tBitMapIsSet(),
+ * tBitMapSetReset() and tBitMapSetResetBlock(): hist[api][i] is the
+ * number of calls that took [2^i, 2^(i+1)) cycles. Only the nodes
+ * allocated and freed by set and reset operations are counted, not
+ * those of tBitMapFree(), tBitMapSetResetAll(), tBitMapFlatten()
+ * and tBitMapUnflatten(). Read the counters with
+ * tBitMapGetCounters(). Users of the library must be
+ * built with the same defines, which change the size of tBitMap.
+ * Without them, no code is added to the library.
+ */
+#if defined(TBITMAP_STATS_LATENCY) && !defined(TBITMAP_STATS)
+#define TBITMAP_STATS
+#endif
+#ifdef TBITMAP_STATS
+enum {
+    TBITMAP_API_ISSET    = 0,   /* tBitMapIsSet() */
+    TBITMAP_API_SETRESET = 1,   /* tBitMapSetReset() */
+    TBITMAP_API_BLOCK    = 2,   /* tBitMapSetResetBlock() */
+    TBITMAP_API_MAX      = 3,
+    TBITMAP_HIST_BUCKETS = 32,
+};
+typedef struct tBitMapCounters_ {
+    u64 nLookup;                /* tBitMapIsSet() */
+    u64 nSet;                   /* tBitMapSetReset(pMap, bitPos, TRUE) */
+    u64 nReset;                 /* tBitMapSetReset(pMap, bitPos, FALSE) */
+    u64 nBlock;                 /* tBitMapSetResetBlock() */
+    u64 nAllocL1;               /* L1 nodes allocated */
+    u64 nFreeL1;                /* L1 nodes freed */
+    u64 nAllocL2;               /* L2 nodes allocated */
+    u64 nFreeL2;                /* L2 nodes freed */
+    u64 nCompress;              /* L2 nodes replaced by a full tag */
+    u64 nDecompress;            /* L2 nodes allocated for a full tag */
+    u64 nENOMEM;                /* updates returning TBITMAP_ENOMEM */
+    u64 hist[TBITMAP_API_MAX][TBITMAP_HIST_BUCKETS]; /* latency */
+} tBitMapCounters;
+#endif
+
 /*
  * Trie bitmap definition
  */
@@ -38,9 +87,28 @@ typedef struct tBitMap_ {
     u32      flags;             /* See the enum below */
     u32      maxPos;            /* max bit position */
     mtrie3l* pTrie;
+    u32*     pFlat;             /* flat bit vector (TBITMAP_IS_FLAT) */
+    struct tBitMapStripe_* pStripes; /* locks and counters (TBITMAP_STRIPED) */
+    u32      stripeShift;       /* L0 index >> stripeShift: stripe index */
+    u32*     pDirty;            /* bit per L2 node updated since the last
+                                   checkpoint (tBitMapTrackDirty()) */
+    int    (*journalFn)(void* pArg, const void* pBuf, u32 len);
+    void*    journalArg;        /* argument of journalFn */
+#ifdef TBITMAP_STATS
+    tBitMapCounters counters;
+#endif
+#ifdef TBITMAP_TRACE
+    u32      traceGen;          /* trace in which traceId is valid */
+    u32      traceId;           /* bitmap ID in the trace */
+#endif
 } tBitMap;
 enum {
     TBITMAP_IS_FLIPPED = 1, /* bit 0: set if bitmap is inverted (flipped) */
+    TBITMAP_IS_FLAT    = 2, /* bit 1: set if bitmap is a flat bit vector */
+    TBITMAP_CONCURRENT = 4, /* bit 2: set if bitmap is lock-free */
+    TBITMAP_STRIPED    = 8, /* bit 3: set if bitmap has per L0 locks */
+    TBITMAP_SNAPSHOT   = 16,/* bit 4: set if bitmap is a read-only snapshot */
+    TBITMAP_KEEP_TRIE  = 32,/* bit 5: set if never switched to flat */
 };
 
 /*
@@ -49,6 +117,7 @@ enum {
 typedef struct tBitMapL2_ {
     u16 cnt;       /* number of bitmaps wherein at least one bit is set */
     u16 nSetAll;   /* number of bitmaps wherein all bits are set */
+    u16 ref;       /* number of extra owners (snapshots) */
     u32 bitmap[0]; /* bitmaps */
 } tBitMapL2;
 
@@ -64,15 +133,312 @@ enum {
 };
 
 
+/*
+ * Flat bit vector
+ *
+ * tBitMapAlloc() allocates bitmaps of up to 2^15 bits as a flat
+ * bit vector (TBITMAP_IS_FLAT), which they stay. Larger bitmaps
+ * switch to the flat bit vector when an update makes the trie nodes
+ * as large as the vector would be, and back to the trie when an
+ * update leaves so few non-zero bitmaps that the trie would take
+ * less than a quarter of the vector. tBitMapFlatten() and
+ * tBitMapUnflatten() switch at once. tBitMapKeepTrie(pMap, TRUE)
+ * switches to the trie and keeps it there; tBitMapKeepTrie(pMap,
+ * FALSE) lets the bitmap switch again. Striped bitmaps are never
+ * flattened.
+ */
+
+/*
+ * Concurrent bitmap
+ *
+ * A bitmap allocated by tBitMapAllocConcurrent() can be set, reset
+ * and looked up by many threads at the same time without a lock.
+ * A thread that stalls while it replaces a node does not block the
+ * others; they finish the replacement themselves.
+ * tBitMapSetResetAll(), tBitMapFree(), tBitMapFlatten() and
+ * tBitMapUnflatten() are not thread safe (the latter two return
+ * TBITMAP_ERR). Freed nodes are released through epoch.h, so a
+ * thread should call epochThreadExit() before it exits.
+ */
+
+/*
+ * Striped bitmap
+ *
+ * A bitmap allocated by tBitMapAllocStriped() has nStripes spin
+ * locks. Stripe `i' covers the L0 indices whose upper bits are `i',
+ * i.e. a contiguous range of bit positions. tBitMapSetReset(),
+ * tBitMapSetResetBlock() and tBitMapIsSet() only take the locks
+ * of the stripes they touch, one at a time, so threads updating
+ * different ranges do not contend. The number of bitmaps and nodes
+ * are counted per stripe; use tBitMapNumWords(), tBitMapNumL1()
+ * and tBitMapNumL2() to read the totals. A striped bitmap is never
+ * flattened. tBitMapSetResetAll() and tBitMapFree() are not thread
+ * safe.
+ */
+
+/*
+ * Snapshot
+ *
+ * tBitMapSnapshot() returns a read-only, point-in-time copy of
+ * a bitmap in O(number of L0 indices). The copy shares all the L1
+ * and L2 nodes with the bitmap; a shared node is copied when
+ * either side modifies it, which is at most one L1 node and one
+ * L2 node per updated word. tBitMapIsSet() works on a snapshot;
+ * updating one returns TBITMAP_ERR. Release it with tBitMapFree().
+ * An update of the bitmap returns TBITMAP_ENOMEM if it would share
+ * an L2 node with more than 0xffff copies of an L1 node.
+ * Taking a snapshot must not run concurrently with updates of the
+ * bitmap, but a snapshot can be read and freed by another thread
+ * while the bitmap is being updated. Concurrent and striped
+ * bitmaps are not supported. A snapshot of a flat bitmap larger
+ * than 2^15 bits first switches the bitmap to the trie and keeps it
+ * there (see tBitMapKeepTrie()) instead of copying the vector.
+ */
+
+/*
+ * Serialization
+ *
+ * tBitMapSerialize() writes a bitmap as a versioned, little endian
+ * byte stream (see tbitmap-serial.c) through (*f)(pArg, pBuf, len)
+ * in chunks of up to 4 KB. Full L2 nodes take 4 bytes, and L2 nodes
+ * with few non-zero bitmaps are written as (index, bitmap) lists.
+ * tBitMapDeserialize() rebuilds the bitmap into *ppMap, asking
+ * (*f)(pArg, pBuf, len) for exactly `len' bytes at a time. Neither
+ * keeps more than one L2 node in memory besides the bitmap itself.
+ * Both callbacks return TBITMAP_SUCCESS or an error code, which is
+ * returned to the caller. The bitmap must not be updated while it
+ * is serialized; serialize a snapshot of a bitmap being updated.
+ */
+typedef int (*tBitMapWriteFn)(void* pArg, const void* pBuf, u32 len);
+typedef int (*tBitMapReadFn)(void* pArg, void* pBuf, u32 len);
+
+/*
+ * Frozen bitmap
+ *
+ * tBitMapFreeze() packs a bitmap into one buffer (*ppBuf, *pSize
+ * bytes, released with free()) whose nodes refer to each other by
+ * offsets, keeping full L2 nodes as a tag. Write it to a file and
+ * open it with tBitMapOpenMapped(), which mmap()s the file read-only
+ * so that all the processes opening it share the page cache.
+ * tBitMapOpenFrozen() uses a buffer in memory instead, which must be
+ * 8 byte aligned and outlive the handle. Only the L0 and L1 nodes
+ * are checked when a frozen bitmap is opened.
+ *
+ * tBitMapFrozenFindNext() stores the first set bit position at or
+ * after *pBitPos in *pBitPos and returns TRUE, or returns FALSE if
+ * there is none. tBitMapFrozenCount() returns the number of set
+ * bits in O(1).
+ */
+typedef struct tBitMapFrozen_ tBitMapFrozen;
+
+/*
+ * Journal and checkpoints
+ *
+ * After tBitMapSetJournal(pMap, f, pArg), every successful update
+ * by tBitMapSetReset(), tBitMapSetResetBlock() and
+ * tBitMapSetResetAll() is passed to (*f)(pArg, pBuf, len) as one
+ * record of 4 bytes (a bit) or 8 bytes (a block) before the update
+ * returns; an error returned by f is returned by the update, which
+ * has been done nevertheless. tBitMapSetJournal(pMap, NULL, NULL)
+ * stops journaling. tBitMapReplay() applies the records in the `size'
+ * bytes at pBuf in order and ignores a truncated record at the end,
+ * e.g. one torn by a crash.
+ *
+ * tBitMapTrackDirty(pMap, TRUE) makes the bitmap remember the L2
+ * nodes updated from then on. tBitMapCheckpoint() writes them in the
+ * serialization format (see tbitmap-serial.c) and forgets them, so
+ * each checkpoint only costs the nodes changed since the previous
+ * one. tBitMapApplyCheckpoint() applies a checkpoint to a bitmap
+ * having the contents of the previous one. To recover, deserialize
+ * the last full serialization, apply the checkpoints taken since in
+ * order and replay the journal written since the last checkpoint.
+ * Replaying records older than the checkpoint is harmless, so the
+ * journal may be truncated any time after a checkpoint.
+ *
+ * Concurrent, striped and snapshot bitmaps are not supported.
+ */
+
+/*
+ * Diff
+ *
+ * tBitMapDiff(pA, pB, f, pArg) calls (*f)(pArg, start, end, isSet)
+ * for each maximal range of bits [start, end] set in pB but not in
+ * pA (isSet is TRUE) or set in pA but not in pB (isSet is FALSE),
+ * in ascending order, i.e. the updates turning pA into pB. The
+ * bitmaps must have the same stride lengths. L1 and L2 nodes shared
+ * by a bitmap and its snapshot, as well as two full L2 nodes, are
+ * skipped without being looked into; other L2 nodes are compared
+ * word by word. If f returns a value other than TBITMAP_SUCCESS,
+ * tBitMapDiff() stops and returns it. Neither bitmap may be updated
+ * meanwhile.
+ */
+typedef int (*tBitMapDiffFn)(void* pArg, u32 start, u32 end, bool isSet);
+
+/*
+ * Statistics
+ *
+ * tBitMapStats() fills in a tBitMapUsage with the memory used by
+ * a bitmap and the shape of its trie. It reads the L1 nodes and the
+ * headers of the L2 nodes but no bitmaps, and can be called while
+ * a concurrent or striped bitmap is updated. Use it instead of
+ * mtrie3lNbytesL1() and mtrie3lNbytesL2(), which do not know the
+ * size of tBitMapL2. Nodes shared with snapshots are counted in
+ * full by every bitmap sharing them. nBytesWasted estimates the
+ * bytes allocated but not holding information: empty L0 and L1
+ * entries, zero bitmaps in L2 nodes and flat bit vectors, and
+ * malloc() overhead.
+ */
+enum {
+    TBITMAP_FILL_BUCKETS = 8,
+};
+typedef struct tBitMapUsage_ {
+    u64 nBytes;                 /* total bytes of the following */
+    u64 nBytesMap;              /* tBitMap, L0 node, locks and dirty bits */
+    u64 nBytesL1;               /* L1 nodes */
+    u64 nBytesL2;               /* L2 nodes */
+    u64 nBytesFlat;             /* flat bit vector */
+    u64 nBytesWasted;           /* estimated bytes wasted */
+    u32 nWords;                 /* bitmaps wherein at least one bit is set */
+    u32 nL1;                    /* number of L1 nodes */
+    u32 nL2;                    /* number of L2 nodes */
+    u32 nFull;                  /* L2 slots tagged full (no L2 node) */
+    u32 nShared;                /* L1 and L2 nodes shared with snapshots */
+    /*
+     * fill[i]: number of L2 nodes wherein the number of non-zero
+     * bitmaps is in (i, i + 1] * (bitmaps per L2 node) / 8.
+     * Empty L2 nodes, which only a concurrent bitmap may have for
+     * a moment, are in no bucket.
+     */
+    u32 fill[TBITMAP_FILL_BUCKETS];
+} tBitMapUsage;
+
+/*
+ * Shared memory bitmap
+ *
+ * tBitMapShmFormat() builds an empty bitmap in a region of `size'
+ * bytes given by the caller, e.g. a shm_open()ed file mmap()ed with
+ * MAP_SHARED. The region must be 8 byte aligned; up to 4 GB of it
+ * are used. Every process then calls tBitMapShmAttach() for its own
+ * handle, which may map the region at any address. The nodes, the
+ * counters and the free node lists are all in the region and are
+ * updated lock-free, so any number of processes and threads can
+ * set, reset and look up bits at the same time. A block setting all
+ * the bits of an L2 node takes no memory. An update returns
+ * TBITMAP_ENOMEM when the region is full. Nodes are not released
+ * while the bitmap is in use: tBitMapShmCompact() releases empty
+ * L1 and L2 nodes and full L2 nodes, and must run while no other
+ * process or thread uses the bitmap.
+ */
+typedef struct tBitMapShm_ tBitMapShm;
+
+/*
+ * Trace (TBITMAP_TRACE)
+ *
+ * If the library is built with -DTBITMAP_TRACE, tBitMapTraceStart()
+ * makes every call of tBitMapIsSet(), tBitMapSetReset(),
+ * tBitMapSetResetBlock(), tBitMapSetResetAll() and tBitMapFree() on
+ * any bitmap append a record (operation, arguments, result and time)
+ * to a compact binary trace, which is passed to (*f)(pArg, pBuf, len)
+ * in chunks of at most TBITMAP_TRACE_BUFSIZE bytes. The first time a
+ * bitmap is used after tBitMapTraceStart(), a TBITMAP_TRACE_NEW
+ * record gives it an ID and records its max bit position, stride
+ * lengths and flags; the bits set before are not in the trace.
+ * tBitMapTraceStop() passes the rest of the trace to f, stops, and
+ * returns the first error returned by f. The calls are serialized
+ * while tracing. tBitMapTracing() returns TRUE between the two.
+ * Without -DTBITMAP_TRACE, tBitMapTraceStart() returns TBITMAP_ERR,
+ * tBitMapTracing() returns FALSE and no code is added to the API.
+ *
+ * tBitMapTraceNext() decodes the record at offset *pOff of the trace
+ * in the `size' bytes at pBuf into *pRec and advances *pOff. Start
+ * with *pOff = 0. It returns FALSE at the end of the trace, at a
+ * truncated record or if the trace is broken. pRec->ns is the sum
+ * of the previous one and the delta in the record, so pass the same
+ * *pRec all the way. It is available in every build, e.g. to replay
+ * a trace against another configuration (bench/tbitmap-replay).
+ */
+enum {
+    TBITMAP_TRACE_NEW         = 0, /* a: max bit position,
+                                      b: sl0 | sl1 << 8 | sl2 << 16 |
+                                         (flags & 0xff) << 24 */
+    TBITMAP_TRACE_FREE        = 1,
+    TBITMAP_TRACE_ISSET       = 2, /* a: bit position */
+    TBITMAP_TRACE_SET         = 3, /* a: bit position */
+    TBITMAP_TRACE_RESET       = 4, /* a: bit position */
+    TBITMAP_TRACE_SET_BLOCK   = 5, /* a: start, b: end */
+    TBITMAP_TRACE_RESET_BLOCK = 6, /* a: start, b: end */
+    TBITMAP_TRACE_SET_ALL     = 7,
+    TBITMAP_TRACE_RESET_ALL   = 8,
+    TBITMAP_TRACE_OP_MAX      = 9,
+    TBITMAP_TRACE_BUFSIZE     = 65536,
+};
+typedef struct tBitMapTraceRec_ {
+    u8  op;                     /* TBITMAP_TRACE_* */
+    u8  result;                 /* ISSET: the bit, others: 1 if the call
+                                   returned TBITMAP_SUCCESS */
+    u32 id;                     /* bitmap ID (1, 2, ...) */
+    u64 ns;                     /* time since tBitMapTraceStart() */
+    u32 a;
+    u32 b;
+} tBitMapTraceRec;
+
 /*
  * Function prototypes
  */
 tBitMap* tBitMapAlloc (u32 maxitPos);
+tBitMap* tBitMapAllocStrides (u8 sl0, u8 sl1, u8 sl2);
+tBitMap* tBitMapAllocConcurrent (u32 maxBitPos);
+tBitMap* tBitMapAllocStriped (u32 maxBitPos, u32 nStripes);
+tBitMap* tBitMapSnapshot (tBitMap* pMap);
+int      tBitMapSerialize (tBitMap* pMap, tBitMapWriteFn f, void* pArg);
+int      tBitMapDeserialize (tBitMap** ppMap, tBitMapReadFn f, void* pArg);
+int      tBitMapFreeze (tBitMap* pMap, void** ppBuf, u64* pSize);
+tBitMapFrozen* tBitMapOpenMapped (const char* path);
+tBitMapFrozen* tBitMapOpenFrozen (const void* pBuf, u64 size);
+void     tBitMapCloseFrozen (tBitMapFrozen* pF);
+bool     tBitMapFrozenIsSet (const tBitMapFrozen* pF, u32 bitPos);
+bool     tBitMapFrozenFindNext (const tBitMapFrozen* pF, u32* pBitPos);
+u64      tBitMapFrozenCount (const tBitMapFrozen* pF);
+u32      tBitMapFrozenMaxPos (const tBitMapFrozen* pF);
+int      tBitMapSetJournal (tBitMap* pMap, tBitMapWriteFn f, void* pArg);
+int      tBitMapReplay (tBitMap* pMap, const void* pBuf, u64 size);
+int      tBitMapTrackDirty (tBitMap* pMap, bool enable);
+int      tBitMapCheckpoint (tBitMap* pMap, tBitMapWriteFn f, void* pArg);
+int      tBitMapApplyCheckpoint (tBitMap* pMap, tBitMapReadFn f, void* pArg);
+int      tBitMapStats (tBitMap* pMap, tBitMapUsage* pUsage);
+int      tBitMapDiff (tBitMap* pA, tBitMap* pB, tBitMapDiffFn f, void* pArg);
+int      tBitMapShmFormat (void* pRegion, u64 size, u32 maxBitPos);
+tBitMapShm* tBitMapShmAttach (void* pRegion, u64 size);
+void     tBitMapShmDetach (tBitMapShm* pS);
+int      tBitMapShmSetResetBlock (tBitMapShm* pS, u32 start, u32 end,
+                                  bool isSet);
+int      tBitMapShmSetReset (tBitMapShm* pS, u32 bitPos, bool isSet);
+bool     tBitMapShmIsSet (tBitMapShm* pS, u32 bitPos);
+int      tBitMapShmCompact (tBitMapShm* pS);
+u32      tBitMapShmMaxPos (tBitMapShm* pS);
+u32      tBitMapShmNumWords (tBitMapShm* pS);
+u32      tBitMapShmNumL1 (tBitMapShm* pS);
+u32      tBitMapShmNumL2 (tBitMapShm* pS);
 int      tBitMapFree (tBitMap* pMap);
 int      tBitMapSetResetBlock (tBitMap* pMap, u32 start, u32 end, bool isSet);
 int      tBitMapSetReset (tBitMap* pMap, u32 bitPos, bool isSet);
 int      tBitMapSetResetAll (tBitMap* pMap, bool isSet);
 bool     tBitMapIsSet (tBitMap* pMap, u32 bitPos);
+int      tBitMapFlatten (tBitMap* pMap);
+int      tBitMapUnflatten (tBitMap* pMap);
+int      tBitMapKeepTrie (tBitMap* pMap, bool keep);
+u32      tBitMapNumWords (tBitMap* pMap);
+u32      tBitMapNumL1 (tBitMap* pMap);
+u32      tBitMapNumL2 (tBitMap* pMap);
+#ifdef TBITMAP_STATS
+void     tBitMapGetCounters (tBitMap* pMap, tBitMapCounters* pCnt);
+void     tBitMapClearCounters (tBitMap* pMap);
+#endif
+int      tBitMapTraceStart (tBitMapWriteFn f, void* pArg);
+int      tBitMapTraceStop (void);
+bool     tBitMapTracing (void);
+bool     tBitMapTraceNext (const void* pBuf, u64 size, u64* pOff,
+                           tBitMapTraceRec* pRec);
 const revNum* tBitMapRevision (void);
 const char*   tBitMapCompilationDate (void);
 
@@ -110,5 +476,19 @@ tBitMapResetAll (tBitMap* pMap)
 {
     return tBitMapSetResetAll(pMap, FALSE);
 }
+static inline int
+tBitMapShmSet (tBitMapShm* pS, u32 bitPos)
+{
+    return tBitMapShmSetReset(pS, bitPos, TRUE);
+}
+static inline int
+tBitMapShmReset (tBitMapShm* pS, u32 bitPos)
+{
+    return tBitMapShmSetReset(pS, bitPos, FALSE);
+}
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* __TBITMAP_H__ */
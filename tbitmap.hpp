@@ -0,0 +1,226 @@
+#ifndef __TBITMAP_HPP__
+#define __TBITMAP_HPP__
+
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * tbitmap.hpp: compile-time specialized front end of tbitmap
+ *
+ * tbitmap<SL0, SL1, SL2> owns an ordinary tBitMap whose stride
+ * lengths are fixed at compile time. All the shifts and masks
+ * of MTRIE3L_GET_INDICES become constants, and the nodes are
+ * accessed through fixed-size views of mtrie3l_l1 and tBitMapL2.
+ * isSet() and the common cases of set() and reset() are inlined;
+ * everything that allocates, frees, compresses or uncompresses
+ * a node, touches a flat bitmap (TBITMAP_IS_FLAT) or has to be
+ * journaled or traced is delegated to the C library, so the bitmap
+ * can also be passed to any tBitMap*() function through get().
+ */
+
+#include <new>
+#include "tbitmap.h"
+
+
+template <u8 SL0, u8 SL1, u8 SL2, typename Word = u32>
+class tbitmap {
+public:
+    static_assert(sizeof(Word) == sizeof(((tBitMapL2*)0)->bitmap[0]),
+                  "Word must be the leaf bitmap type of tBitMapL2");
+    static_assert(SL0 + SL1 + SL2 + 5 <= 29,
+                  "too large stride length");
+
+    static const u32 posBits = 5;            /* log2(bits per Word) */
+    static const u32 posMask = (1 << posBits) - 1;
+    static const u32 l0Shift = SL1 + SL2 + posBits;
+    static const u32 l1Shift = SL2 + posBits;
+    static const u32 l2Shift = posBits;
+    static const u32 l0Mask  = (1 << SL0) - 1;
+    static const u32 l1Mask  = (1 << SL1) - 1;
+    static const u32 l2Mask  = (1 << SL2) - 1;
+    static const u32 maxPos  = (1 << (SL0 + SL1 + SL2 + posBits)) - 1;
+
+    /*
+     * Fixed-size views of the C nodes
+     */
+    struct L2 {
+        u16  cnt;
+        u16  nSetAll;
+        u16  ref;
+        Word bitmap[1 << SL2];
+    };
+    struct L1 {
+        u16  cnt;
+        u16  ref;
+        L2*  l1[1 << SL1];
+    };
+
+    tbitmap () : pMap(tBitMapAllocStrides(SL0, SL1, SL2))
+    {
+        static_assert(offsetof(L1, l1) == offsetof(mtrie3l_l1, l1),
+                      "L1 does not match mtrie3l_l1");
+        static_assert(offsetof(L1, ref) == offsetof(mtrie3l_l1, ref),
+                      "L1 does not match mtrie3l_l1");
+        static_assert(offsetof(L2, ref) == offsetof(tBitMapL2, ref),
+                      "L2 does not match tBitMapL2");
+        static_assert(offsetof(L2, bitmap) == offsetof(tBitMapL2, bitmap),
+                      "L2 does not match tBitMapL2");
+        if (!pMap) {
+            throw std::bad_alloc();
+        }
+        l0 = reinterpret_cast<L1**>(pMap->pTrie->l0);
+    }
+    ~tbitmap ()
+    {
+        tBitMapFree(pMap);
+    }
+    tbitmap (const tbitmap&) = delete;
+    tbitmap& operator= (const tbitmap&) = delete;
+
+    tBitMap* get () const
+    {
+        return pMap;
+    }
+
+    bool isSet (u32 bitPos) const
+    {
+        const L1* pl1;
+        const L2* pl2;
+        uintptr_t ent;
+
+        if (bitPos > maxPos) {
+            return false;
+        }
+        if (pMap->pFlat) {
+            return (pMap->pFlat[bitPos >> posBits] >> (bitPos & posMask)) & 1;
+        }
+        pl1 = l0[bitPos >> l0Shift];
+        if (!pl1) {
+            return false;
+        }
+        if (reinterpret_cast<uintptr_t>(pl1) & 3) {
+            return true;        /* full L1 node: all bits are set */
+        }
+        ent = reinterpret_cast<uintptr_t>(pl1->l1[(bitPos >> l1Shift) &
+                                                  l1Mask]);
+        if (ent & 3) {
+            return true;        /* compressed: all bits are set */
+        }
+        pl2 = reinterpret_cast<const L2*>(ent);
+        if (!pl2) {
+            return false;
+        }
+        return (pl2->bitmap[(bitPos >> l2Shift) & l2Mask] >>
+                (bitPos & posMask)) & 1;
+    }
+
+    /*
+     * set() and reset() update the leaf word in place only if
+     * neither cnt nor nSetAll of the L2 node changes. Otherwise
+     * they fall back to tBitMapSetReset().
+     */
+    int set (u32 bitPos)
+    {
+        Word* pw = leafWord(bitPos);
+        Word  bit;
+
+        if (pw) {
+            bit = ((Word)1) << (bitPos & posMask);
+            if (*pw & bit) {
+                return TBITMAP_SUCCESS;
+            }
+            if ((*pw != 0) && ((*pw | bit) != (Word)~0)) {
+                *pw |= bit;
+                return TBITMAP_SUCCESS;
+            }
+        }
+        return tBitMapSetReset(pMap, bitPos, TRUE);
+    }
+    int reset (u32 bitPos)
+    {
+        Word* pw = leafWord(bitPos);
+        Word  bit;
+
+        if (pw) {
+            bit = ((Word)1) << (bitPos & posMask);
+            if ((*pw & bit) == 0) {
+                return TBITMAP_SUCCESS;
+            }
+            if ((*pw != (Word)~0) && ((*pw & ~bit) != 0)) {
+                *pw &= ~bit;
+                return TBITMAP_SUCCESS;
+            }
+        }
+        return tBitMapSetReset(pMap, bitPos, FALSE);
+    }
+    int setBlock (u32 start, u32 end)
+    {
+        return tBitMapSetResetBlock(pMap, start, end, TRUE);
+    }
+    int resetBlock (u32 start, u32 end)
+    {
+        return tBitMapSetResetBlock(pMap, start, end, FALSE);
+    }
+
+private:
+    /*
+     * Return the leaf word of bitPos if it lives in an uncompressed
+     * L2 node under an uncompressed L1 node, neither shared with a
+     * snapshot, or NULL otherwise. Return NULL also while the bitmap
+     * is journaled or tracks dirty L2 nodes (tBitMapSetJournal(),
+     * tBitMapTrackDirty()) or the library is tracing
+     * (tBitMapTracing()) so that every update goes through them.
+     */
+    Word* leafWord (u32 bitPos) const
+    {
+        L1*       pl1;
+        L2*       pl2;
+        uintptr_t ent;
+
+        if ((bitPos > maxPos) || pMap->pFlat ||
+            pMap->journalFn || pMap->pDirty || tBitMapTracing()) {
+            return NULL;        /* the update must be logged */
+        }
+        pl1 = l0[bitPos >> l0Shift];
+        if (!pl1 || (reinterpret_cast<uintptr_t>(pl1) & 3) ||
+            __atomic_load_n(&pl1->ref, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        ent = reinterpret_cast<uintptr_t>(pl1->l1[(bitPos >> l1Shift) &
+                                                  l1Mask]);
+        if ((ent == 0) || (ent & 3)) {
+            return NULL;
+        }
+        pl2 = reinterpret_cast<L2*>(ent);
+        if (__atomic_load_n(&pl2->ref, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        return &pl2->bitmap[(bitPos >> l2Shift) & l2Mask];
+    }
+
+    tBitMap* pMap;
+    L1**     l0;               /* pMap->pTrie->l0[] */
+};
+
+#endif /* __TBITMAP_HPP__ */
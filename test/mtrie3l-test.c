@@ -0,0 +1,906 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * mtrie3l-test.c: make a command to test mtrie3l,
+ *                 a 3 level multibit trie
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include "epoch.h"
+#include "mtrie3l.h"
+#include "mtrie3l-val.h"
+#include "mtrie3l-lpm.h"
+
+enum {
+    ENT_MAGIC    = 0x6d743365,
+    ENT_DEAD     = 0xdeadbeef,
+    NREADERS     = 4,
+    RCU_ENTRIES  = 1 << 16,
+    RCU_ROUNDS   = 8,
+    CONC_WRITERS = 4,
+    CONC_OPS     = 200000,
+};
+
+typedef struct testEnt_ {
+    u32 magic;
+    u32 index;
+} testEnt;
+
+static testEnt*
+entAlloc (u32 index)
+{
+    testEnt* pEnt = malloc(sizeof(*pEnt));
+
+    assert(pEnt);
+    pEnt->magic = ENT_MAGIC;
+    pEnt->index = index;
+    return pEnt;
+}
+
+static void
+entFree (void* ptr)
+{
+    testEnt* pEnt = ptr;
+
+    assert(pEnt->magic == ENT_MAGIC);
+    pEnt->magic = ENT_DEAD;
+    free(pEnt);
+}
+
+static void
+entDelete (u32 index, void* dummy, void* pEnt)
+{
+    assert(((testEnt*)pEnt)->index == index);
+    entFree(pEnt);
+}
+
+static void
+entCount (u32 index, void* pData, void* pEnt)
+{
+    assert(((testEnt*)pEnt)->index == index);
+    ++*(u32*)pData;
+}
+
+/*
+ * Insert, find, walk and delete every 3rd index of
+ * a trie with 8 bit strides.
+ */
+int
+basicTest (void)
+{
+    mtrie3l* p;
+    testEnt* pEnt;
+    testEnt* ents[100];
+    u32      keys[100];
+    u32      i;
+    u32      idx;
+    u32      n;
+    int      rt;
+
+    p = mtrie3lAlloc(8, 8, 8);
+    assert(p);
+    for (i = 0; i <= mtrie3lGetMaxIndex(p); i += 3 * 997) {
+        rt = mtrie3lInsert(p, i, entAlloc(i));
+        assert(rt == MTRIE3L_SUCCESS);
+    }
+    rt = mtrie3lInsert(p, 0, p);
+    assert(rt == MTRIE3L_EOCCUPIED);
+    rt = mtrie3lInsert(p, mtrie3lGetMaxIndex(p) + 1, p);
+    assert(rt == MTRIE3L_EINDEX);
+
+    n = 0;
+    for (i = 0; i <= mtrie3lGetMaxIndex(p); i += 997) {
+        pEnt = mtrie3lFind(p, i);
+        if ((i % 3) == 0) {
+            assert(pEnt && (pEnt->index == i));
+            ++n;
+        } else {
+            assert(pEnt == NULL);
+        }
+    }
+    assert(n == mtrie3lNumEntries(p));
+
+    /*
+     * Batched lookups, including an index out of range
+     */
+    for (i = 0; i < elementsOf(keys); ++i) {
+        keys[i] = (i * 997) % (mtrie3lGetMaxIndex(p) + 2);
+    }
+    keys[5] = mtrie3lGetMaxIndex(p) + 1;
+    n = mtrie3lFindMany(p, keys, (void**)ents, elementsOf(keys));
+    for (i = 0; i < elementsOf(keys); ++i) {
+        assert(ents[i] == mtrie3lFind(p, keys[i]));
+        n -= (ents[i] != NULL);
+    }
+    assert(n == 0);
+
+    idx = 1;
+    pEnt = mtrie3lFindNext(p, &idx);
+    assert(pEnt && (idx == 3 * 997) && (pEnt->index == idx));
+    idx = mtrie3lGetMaxIndex(p);
+    pEnt = mtrie3lFindPrev(p, &idx);
+    assert(pEnt && (pEnt->index == idx) && ((idx % (3 * 997)) == 0));
+
+    n = 0;
+    rt = mtrie3lWalk(p, &n, entCount);
+    assert((rt == MTRIE3L_SUCCESS) && (n == mtrie3lNumEntries(p)));
+
+    pEnt = mtrie3lDelete(p, 3 * 997);
+    assert(pEnt && (pEnt->index == 3 * 997));
+    entFree(pEnt);
+    assert(mtrie3lFind(p, 3 * 997) == NULL);
+
+    rt = mtrie3lDeleteAll(p, entDelete);
+    assert(rt == MTRIE3L_SUCCESS);
+    assert(mtrie3lNumEntries(p) == 0);
+    assert((mtrie3lNumL1(p) == 0) && (mtrie3lNumL2(p) == 0));
+    rt = mtrie3lFree(p);
+    assert(rt == MTRIE3L_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * FindNext and FindPrev of every index of a sparse trie,
+ * compared with a linear search of the inserted indices.
+ */
+int
+findTest (void)
+{
+    mtrie3l* p;
+    testEnt* pEnt;
+    u8*      inserted;
+    u32      i, j, x = 1;
+    u32      idx, n;
+    int      rt;
+
+    p = mtrie3lAlloc(4, 6, 6);
+    inserted = calloc(1, mtrie3lGetMaxIndex(p) + 1);
+    assert(p && inserted);
+    for (i = 0; i < 300; ++i) {
+        x = x * 1103515245 + 12345;
+        j = (x >> 8) & mtrie3lGetMaxIndex(p);
+        if ((j & 0xf000) == 0x3000) {
+            continue;           /* keep L0[3] empty */
+        }
+        if (!inserted[j]) {
+            rt = mtrie3lInsert(p, j, entAlloc(j));
+            assert(rt == MTRIE3L_SUCCESS);
+            inserted[j] = 1;
+        }
+    }
+    for (i = 0; i <= mtrie3lGetMaxIndex(p); ++i) {
+        for (j = i; (j <= mtrie3lGetMaxIndex(p)) && !inserted[j]; ++j) {
+            ;
+        }
+        idx = i;
+        pEnt = mtrie3lFindNext(p, &idx);
+        assert(idx == j);
+        assert((pEnt == NULL) == (j > mtrie3lGetMaxIndex(p)));
+        assert(!pEnt || (pEnt->index == j));
+
+        for (j = i; (j > 0) && !inserted[j]; --j) {
+            ;
+        }
+        idx = i;
+        pEnt = mtrie3lFindPrev(p, &idx);
+        if (inserted[j]) {
+            assert(pEnt && (pEnt->index == j) && (idx == j));
+        } else {
+            assert((pEnt == NULL) && (idx == 0));
+        }
+    }
+    rt = mtrie3lDeleteAll(p, entDelete);
+    assert(rt == MTRIE3L_SUCCESS);
+    rt = mtrie3lFree(p);
+    assert(rt == MTRIE3L_SUCCESS);
+    free(inserted);
+
+    /*
+     * A node with 2^16 elements
+     */
+    p = mtrie3lAlloc(1, 1, 16);
+    assert(p);
+    for (i = 0; i < (1 << 16); ++i) {
+        rt = mtrie3lInsert(p, i, entAlloc(i));
+        assert(rt == MTRIE3L_SUCCESS);
+    }
+    n = 0;
+    rt = mtrie3lWalk(p, &n, entCount);
+    assert((rt == MTRIE3L_SUCCESS) && (n == (1 << 16)));
+    idx = 1 << 16;
+    assert(mtrie3lFindPrev(p, &idx) && (idx == (1 << 16) - 1));
+    rt = mtrie3lDeleteAll(p, entDelete);
+    assert(rt == MTRIE3L_SUCCESS);
+    rt = mtrie3lFree(p);
+    assert(rt == MTRIE3L_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * Cursors with several batch sizes and range walks must visit
+ * the same leaves as FindNext.
+ */
+typedef struct rangeSum_ {
+    u32 n;
+    u32 sum;
+} rangeSum;
+
+static void
+entSum (u32 index, void* pData, void* pEnt)
+{
+    rangeSum* r = pData;
+
+    assert(((testEnt*)pEnt)->index == index);
+    ++r->n;
+    r->sum += index;
+}
+
+int
+cursorTest (void)
+{
+    static const u32 batch[] = { 1, 7, 64 };
+    mtrie3l*      p;
+    mtrie3lCursor c;
+    mtrie3lEnt    ents[64];
+    rangeSum      r, e;
+    testEnt*      pEnt;
+    u32           i, j, k, n, x = 7;
+    u32           idx, lo, hi;
+    int           rt;
+
+    p = mtrie3lAlloc(8, 8, 8);
+    assert(p);
+    for (i = 0; i < 5000; ++i) {
+        x = x * 1103515245 + 12345;
+        j = (x >> 4) & mtrie3lGetMaxIndex(p);
+        if (i & 1) {
+            j &= 0xff00ff;      /* some dense L2 nodes */
+        }
+        if (!mtrie3lFind(p, j)) {
+            rt = mtrie3lInsert(p, j, entAlloc(j));
+            assert(rt == MTRIE3L_SUCCESS);
+        }
+    }
+    idx = mtrie3lGetMaxIndex(p);
+    rt  = mtrie3lInsert(p, idx, entAlloc(idx));
+    assert(rt == MTRIE3L_SUCCESS);
+
+    for (k = 0; k < elementsOf(batch); ++k) {
+        mtrie3lCursorInit(&c, p, 0);
+        idx = 0;
+        j   = 0;
+        while ((n = mtrie3lCursorNext(&c, ents, batch[k])) != 0) {
+            assert(n <= batch[k]);
+            for (i = 0; i < n; ++i, ++j) {
+                pEnt = mtrie3lFindNext(p, &idx);
+                assert(pEnt && (ents[i].pEnt == pEnt));
+                assert(ents[i].index == idx);
+                ++idx;
+            }
+        }
+        assert(j == mtrie3lNumEntries(p));
+        assert(mtrie3lCursorNext(&c, ents, batch[k]) == 0);
+    }
+
+    /*
+     * Seek, and seek again after a deletion.
+     */
+    mtrie3lCursorInit(&c, p, 0);
+    for (i = 0; i < 100; ++i) {
+        x = x * 1103515245 + 12345;
+        lo = (x >> 4) & mtrie3lGetMaxIndex(p);
+        mtrie3lCursorSeek(&c, lo);
+        idx = lo;
+        pEnt = mtrie3lFindNext(p, &idx);
+        n = mtrie3lCursorNext(&c, ents, 1);
+        assert((n == 1) && (ents[0].pEnt == pEnt) && (ents[0].index == idx));
+        if (i & 1) {
+            entFree(mtrie3lDelete(p, idx));
+            mtrie3lCursorSeek(&c, idx);
+            n = mtrie3lCursorNext(&c, ents, 1);
+            ++idx;
+            pEnt = mtrie3lFindNext(p, &idx);
+            assert((n == (pEnt != NULL)) && (!n || (ents[0].pEnt == pEnt)));
+        }
+    }
+    mtrie3lCursorSeek(&c, mtrie3lGetMaxIndex(p) + 1);
+    assert(mtrie3lCursorNext(&c, ents, 1) == 0);
+
+    for (i = 0; i < 100; ++i) {
+        x = x * 1103515245 + 12345;
+        lo = (x >> 4) & mtrie3lGetMaxIndex(p);
+        x = x * 1103515245 + 12345;
+        hi = lo + ((x >> 4) & ((i & 1) ? 0xff : 0xfffff));
+        memset(&r, 0, sizeof(r));
+        rt = mtrie3lWalkRange(p, lo, hi, entSum, &r);
+        assert(rt == MTRIE3L_SUCCESS);
+        memset(&e, 0, sizeof(e));
+        for (idx = lo; mtrie3lFindNext(p, &idx) && (idx <= hi); ++idx) {
+            ++e.n;
+            e.sum += idx;
+            if (idx == mtrie3lGetMaxIndex(p)) {
+                break;
+            }
+        }
+        assert((r.n == e.n) && (r.sum == e.sum));
+    }
+    memset(&r, 0, sizeof(r));
+    rt = mtrie3lWalkRange(p, 0, ~0, entSum, &r);
+    assert((rt == MTRIE3L_SUCCESS) && (r.n == mtrie3lNumEntries(p)));
+
+    rt = mtrie3lDeleteAll(p, entDelete);
+    assert(rt == MTRIE3L_SUCCESS);
+    rt = mtrie3lFree(p);
+    assert(rt == MTRIE3L_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * Upserts through the leaf slots, and deletions while iterating
+ * with a cursor.
+ */
+int
+slotTest (void)
+{
+    mtrie3l*      p;
+    mtrie3lCursor c;
+    mtrie3lEnt    ents[16];
+    void**        ppEnt;
+    bool          created;
+    u32           i, j, n;
+    int           rt;
+
+    p = mtrie3lAlloc(4, 4, 4);
+    assert(p);
+    ppEnt = mtrie3lFindOrInsertSlot(p, 1234, &created);
+    assert(ppEnt && created && (*ppEnt == NULL));
+    assert(mtrie3lNumEntries(p) == 1);
+    *ppEnt = entAlloc(1234);
+    ppEnt = mtrie3lFindOrInsertSlot(p, 1234, &created);
+    assert(ppEnt && !created && (*ppEnt == mtrie3lFind(p, 1234)));
+    assert(mtrie3lInsert(p, 1234, p) == MTRIE3L_EOCCUPIED);
+    assert(mtrie3lFindOrInsertSlot(p, mtrie3lGetMaxIndex(p) + 1,
+                                   &created) == NULL);
+
+    /*
+     * A slot released before it is filled
+     */
+    ppEnt = mtrie3lFindOrInsertSlot(p, 4000, &created);
+    assert(ppEnt && created && (mtrie3lNumL1(p) == 2));
+    mtrie3lCursorInit(&c, p, 0);
+    assert(mtrie3lDeleteSlot(&c, 4000) == NULL);
+    assert((mtrie3lNumEntries(p) == 1) && (mtrie3lNumL1(p) == 1));
+    assert(mtrie3lDeleteSlot(&c, 4000) == NULL);
+    entFree(mtrie3lDeleteSlot(&c, 1234));
+    assert((mtrie3lNumEntries(p) == 0) && (mtrie3lNumL2(p) == 0));
+
+    /*
+     * Delete every other leaf while iterating
+     */
+    for (i = 0; i <= mtrie3lGetMaxIndex(p); i += 3) {
+        ppEnt = mtrie3lFindOrInsertSlot(p, i, &created);
+        assert(ppEnt && created);
+        *ppEnt = entAlloc(i);
+    }
+    mtrie3lCursorInit(&c, p, 0);
+    j = 0;
+    while ((n = mtrie3lCursorNext(&c, ents, elementsOf(ents))) != 0) {
+        for (i = 0; i < n; ++i, ++j) {
+            assert(ents[i].index == 3 * j);
+            if (j & 1) {
+                assert(mtrie3lDeleteSlot(&c, ents[i].index) == ents[i].pEnt);
+                entFree(ents[i].pEnt);
+            }
+        }
+    }
+    for (i = 0; i <= mtrie3lGetMaxIndex(p); ++i) {
+        assert((mtrie3lFind(p, i) != NULL) == ((i % 6) == 0));
+    }
+
+    /*
+     * Then delete all of them the same way
+     */
+    mtrie3lCursorInit(&c, p, 0);
+    while ((n = mtrie3lCursorNext(&c, ents, elementsOf(ents))) != 0) {
+        for (i = 0; i < n; ++i) {
+            assert(mtrie3lDeleteSlot(&c, ents[i].index) == ents[i].pEnt);
+            entFree(ents[i].pEnt);
+        }
+    }
+    assert(mtrie3lNumEntries(p) == 0);
+    assert((mtrie3lNumL1(p) == 0) && (mtrie3lNumL2(p) == 0));
+    rt = mtrie3lFree(p);
+    assert(rt == MTRIE3L_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * Tries of values: u32 values and small structures
+ */
+typedef struct smallVal_ {
+    u16 port;
+    u8  proto;
+} smallVal;
+
+MTRIE3L_VAL_DEFINE(u32Tbl, u32)
+MTRIE3L_VAL_DEFINE(svTbl, smallVal)
+
+int
+valTest (void)
+{
+    mtrie3l*  p;
+    mtrie3l*  q;
+    u32*      pv;
+    u32       v;
+    u32       i, n;
+    u32       idx;
+    smallVal  sv;
+    smallVal* psv;
+    int       rt;
+
+    p = u32TblAlloc(8, 8, 8);
+    assert(p);
+    for (i = 0; i <= mtrie3lGetMaxIndex(p); i += 1009) {
+        rt = u32TblInsert(p, i, i * 3);
+        assert(rt == MTRIE3L_SUCCESS);
+    }
+    n = mtrie3lNumEntries(p);
+    assert(u32TblInsert(p, 1009, 0) == MTRIE3L_EOCCUPIED);
+    assert(u32TblInsert(p, mtrie3lGetMaxIndex(p) + 1, 0) == MTRIE3L_EINDEX);
+    assert(u32TblSet(p, 1009, 0) == MTRIE3L_SUCCESS);
+    assert(mtrie3lNumEntries(p) == n);
+    pv = u32TblFind(p, 1009);
+    assert(pv && (*pv == 0));           /* 0 is a value */
+    assert(u32TblFind(p, 1010) == NULL);
+    pv = u32TblFind(p, 2018);
+    assert(pv && (*pv == 2018 * 3));
+
+    idx = 1;
+    for (i = 0; (pv = u32TblFindNext(p, &idx)) != NULL; ++i) {
+        assert(idx == (i + 1) * 1009);
+        assert(*pv == ((idx == 1009) ? 0 : idx * 3));
+        if (idx == mtrie3lGetMaxIndex(p)) {
+            break;
+        }
+        ++idx;
+    }
+    assert(i == n - 1);
+
+    rt = u32TblDelete(p, 2018, &v);
+    assert((rt == MTRIE3L_SUCCESS) && (v == 2018 * 3));
+    assert(u32TblDelete(p, 2018, &v) == MTRIE3L_ERR);
+    assert(u32TblFind(p, 2018) == NULL);
+    for (i = 0; i <= mtrie3lGetMaxIndex(p); i += 1009) {
+        u32TblDelete(p, i, NULL);
+    }
+    assert(mtrie3lNumEntries(p) == 0);
+    assert((mtrie3lNumL1(p) == 0) && (mtrie3lNumL2(p) == 0));
+    rt = u32TblFree(p);
+    assert(rt == MTRIE3L_SUCCESS);
+
+    q = svTblAlloc(4, 4, 4);
+    assert(q);
+    for (i = 0; i < 100; ++i) {
+        sv.port  = i;
+        sv.proto = 6;
+        rt = svTblInsert(q, i * 37, sv);
+        assert(rt == MTRIE3L_SUCCESS);
+    }
+    for (i = 0; i < 100; ++i) {
+        psv = svTblFind(q, i * 37);
+        assert(psv && (psv->port == i) && (psv->proto == 6));
+    }
+    assert(mtrie3lValL2nodeSize(q, sizeof(smallVal)) ==
+           8 + 16 * sizeof(smallVal));
+    rt = svTblDeleteAll(q);
+    assert((rt == MTRIE3L_SUCCESS) && (mtrie3lNumEntries(q) == 0));
+    assert(svTblFind(q, 37) == NULL);
+    rt = svTblFree(q);
+    assert(rt == MTRIE3L_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * Longest prefix match: random prefixes inserted and deleted,
+ * compared with a linear search of the prefixes.
+ */
+enum {
+    LPM_PFX  = 400,
+    LPM_ADDR = 4000,
+};
+
+typedef struct lpmRoute_ {
+    ipv4a prefix;
+    u8    len;
+    bool  used;
+    u32   nh;
+} lpmRoute;
+
+static u32
+lpmLinear (lpmRoute* r, ipv4a addr)
+{
+    u32 i;
+    s32 best = -1;
+    u32 nh = MTRIE3L_LPM_NO_ROUTE;
+
+    for (i = 0; i < LPM_PFX; ++i) {
+        if (!r[i].used || ((s32)r[i].len <= best)) {
+            continue;
+        }
+        if ((r[i].len == 0) ||
+            (((addr ^ r[i].prefix) >> (32 - r[i].len)) == 0)) {
+            best = r[i].len;
+            nh   = r[i].nh;
+        }
+    }
+    return nh;
+}
+
+int
+lpmTest (void)
+{
+    mtrie3lLpm* t;
+    lpmRoute*   r;
+    ipv4a*      addr;
+    u32*        nh;
+    u32         i, j, k, x = 99, nPfx = 0;
+    u32         v;
+    int         rt;
+
+    t    = mtrie3lLpmAlloc();
+    r    = calloc(LPM_PFX, sizeof(*r));
+    addr = malloc(LPM_ADDR * sizeof(*addr));
+    nh   = malloc(LPM_ADDR * sizeof(*nh));
+    assert(t && r && addr && nh);
+    assert(mtrie3lLpmLookup(t, 0x0a000001) == MTRIE3L_LPM_NO_ROUTE);
+
+    for (k = 0; k < 4 * LPM_PFX; ++k) {
+        x = x * 1103515245 + 12345;
+        i = (x >> 8) % LPM_PFX;
+        if (r[i].used && (k & 1)) {
+            rt = mtrie3lLpmDelete(t, r[i].prefix, r[i].len);
+            assert(rt == MTRIE3L_SUCCESS);
+            r[i].used = FALSE;
+            --nPfx;
+        } else if (!r[i].used) {
+            x = x * 1103515245 + 12345;
+            r[i].len = (i == 0) ? 0 : 8 + ((x >> 8) % 25);
+            x = x * 1103515245 + 12345;
+            /*
+             * Prefixes under 10.0.0.0/8 overlap each other
+             */
+            r[i].prefix = (0x0a000000 | ((x >> 4) & 0x00ffffff)) &
+                          ((r[i].len) ? ~0U << (32 - r[i].len) : 0);
+            for (j = 0; j < LPM_PFX; ++j) {
+                if (r[j].used && (r[j].len == r[i].len) &&
+                    (r[j].prefix == r[i].prefix)) {
+                    break;
+                }
+            }
+            if (j < LPM_PFX) {
+                continue;       /* already there */
+            }
+            r[i].nh   = i;
+            r[i].used = TRUE;
+            rt = mtrie3lLpmInsert(t, r[i].prefix, r[i].len, r[i].nh);
+            assert(rt == MTRIE3L_SUCCESS);
+            ++nPfx;
+        }
+        if ((k % 200) != 199) {
+            continue;
+        }
+        assert(mtrie3lLpmNumPrefixes(t) == nPfx);
+        for (j = 0; j < LPM_ADDR; ++j) {
+            x = x * 1103515245 + 12345;
+            addr[j] = (j & 1) ? (0x0a000000 | (x >> 8)) : x;
+            if ((j & 3) == 2) {
+                addr[j] = r[x % LPM_PFX].prefix - (x & 1);
+            }
+        }
+        v = mtrie3lLpmLookupMany(t, addr, nh, LPM_ADDR);
+        for (j = 0; j < LPM_ADDR; ++j) {
+            assert(nh[j] == lpmLinear(r, addr[j]));
+            assert(nh[j] == mtrie3lLpmLookup(t, addr[j]));
+            v -= (nh[j] != MTRIE3L_LPM_NO_ROUTE);
+        }
+        assert(v == 0);
+    }
+
+    /*
+     * Changing the next hop, errors, and deleting everything
+     */
+    for (i = 0; (i < LPM_PFX) && !r[i].used; ++i) {
+        ;
+    }
+    assert(i < LPM_PFX);
+    rt = mtrie3lLpmInsert(t, r[i].prefix, r[i].len, 12345);
+    assert((rt == MTRIE3L_SUCCESS) && (mtrie3lLpmNumPrefixes(t) == nPfx));
+    assert(mtrie3lLpmFind(t, r[i].prefix, r[i].len, &v) == MTRIE3L_SUCCESS);
+    assert(v == 12345);
+    assert(mtrie3lLpmInsert(t, 0, 33, 1) == MTRIE3L_EINDEX);
+    assert(mtrie3lLpmInsert(t, 0, 8, MTRIE3L_LPM_NO_ROUTE) ==
+           MTRIE3L_EINDEX);
+    assert(mtrie3lLpmDelete(t, 0xc0a80000, 16) == MTRIE3L_ERR);
+    for (i = 0; i < LPM_PFX; ++i) {
+        if (r[i].used) {
+            rt = mtrie3lLpmDelete(t, r[i].prefix, r[i].len);
+            assert(rt == MTRIE3L_SUCCESS);
+        }
+    }
+    assert(mtrie3lLpmNumPrefixes(t) == 0);
+    assert(mtrie3lLpmNumNodes(t) == 0);
+    assert(mtrie3lLpmLookup(t, 0x0a000001) == MTRIE3L_LPM_NO_ROUTE);
+
+    mtrie3lLpmFree(t);
+    free(nh);
+    free(addr);
+    free(r);
+
+    return MTRIE3L_SUCCESS;
+}
+
+/*
+ * RCU trie: one writer inserts and deletes [0, RCU_ENTRIES)
+ * RCU_ROUNDS times while NREADERS readers look them up.
+ * A reader must never see an entry that was already released.
+ */
+static volatile u32 RcuDone;
+
+static void*
+rcuReader (void* arg)
+{
+    mtrie3l*      p = arg;
+    testEnt*      pEnt;
+    mtrie3lCursor c;
+    mtrie3lEnt    ents[8];
+    u32           i = 0;
+    u32           j, n;
+    u32           idx;
+
+    while (!__atomic_load_n(&RcuDone, __ATOMIC_ACQUIRE)) {
+        i = (i * 1103515245 + 12345) & mtrie3lGetMaxIndex(p);
+        epochReadLock();
+        pEnt = mtrie3lFind(p, i);
+        if (pEnt) {
+            assert((pEnt->magic == ENT_MAGIC) && (pEnt->index == i));
+        }
+        idx = i;
+        pEnt = mtrie3lFindNext(p, &idx);
+        if (pEnt) {
+            assert((pEnt->magic == ENT_MAGIC) && (pEnt->index == idx));
+        }
+        mtrie3lCursorInit(&c, p, i);
+        n = mtrie3lCursorNext(&c, ents, elementsOf(ents));
+        for (j = 0; j < n; ++j) {
+            pEnt = ents[j].pEnt;
+            assert((pEnt->magic == ENT_MAGIC) &&
+                   (pEnt->index == ents[j].index));
+        }
+        epochReadUnlock();
+    }
+    epochThreadExit();
+    return NULL;
+}
+
+int
+rcuTest (void)
+{
+    mtrie3l*  p;
+    pthread_t th[NREADERS];
+    testEnt*  pEnt;
+    u32       i;
+    u32       j;
+    int       rt;
+
+    p = mtrie3lAllocRcu(4, 6, 6);
+    assert(p);
+    for (i = 0; i < NREADERS; ++i) {
+        rt = pthread_create(&th[i], NULL, rcuReader, p);
+        assert(rt == 0);
+    }
+    for (j = 0; j < RCU_ROUNDS; ++j) {
+        for (i = j & 1; i < RCU_ENTRIES; i += 2) {
+            rt = mtrie3lInsert(p, i, entAlloc(i));
+            assert(rt == MTRIE3L_SUCCESS);
+        }
+        for (i = j & 1; i < RCU_ENTRIES; i += 2) {
+            pEnt = mtrie3lDelete(p, i);
+            assert(pEnt && (pEnt->index == i));
+            epochRetire(pEnt, entFree);
+        }
+    }
+    __atomic_store_n(&RcuDone, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < NREADERS; ++i) {
+        pthread_join(th[i], NULL);
+    }
+    assert(mtrie3lNumEntries(p) == 0);
+    assert((mtrie3lNumL1(p) == 0) && (mtrie3lNumL2(p) == 0));
+    epochSynchronize();
+    rt = mtrie3lFree(p);
+    assert(rt == MTRIE3L_SUCCESS);
+    epochThreadExit();
+
+    return rt;
+}
+
+
+/*
+ * Concurrent trie: CONC_WRITERS writers insert and delete random
+ * indices of a 1024 entry trie with 16 leaves per L2 node, so that
+ * they race for the same leaves and for creating and freeing the
+ * same nodes, while NREADERS readers look them up.
+ */
+typedef struct concArg_ {
+    mtrie3l* p;
+    u32      seed;
+    s32      num;               /* # of inserts - # of deletes */
+} concArg;
+
+static void*
+concWriter (void* arg)
+{
+    concArg* a = arg;
+    testEnt* pEnt;
+    u32      i, k;
+    u32      x = a->seed;
+    int      rt;
+
+    for (k = 0; k < CONC_OPS; ++k) {
+        x = x * 1103515245 + 12345;
+        i = (x >> 8) & mtrie3lGetMaxIndex(a->p);
+        if (x & (1 << 20)) {
+            pEnt = entAlloc(i);
+            rt = mtrie3lInsert(a->p, i, pEnt);
+            if (rt == MTRIE3L_SUCCESS) {
+                ++a->num;
+            } else {
+                assert(rt == MTRIE3L_EOCCUPIED);
+                entFree(pEnt);
+            }
+        } else {
+            pEnt = mtrie3lDelete(a->p, i);
+            if (pEnt) {
+                assert((pEnt->magic == ENT_MAGIC) && (pEnt->index == i));
+                --a->num;
+                epochRetire(pEnt, entFree);
+            }
+        }
+    }
+    epochThreadExit();
+    return NULL;
+}
+
+int
+concurrentTest (void)
+{
+    mtrie3l*      p;
+    pthread_t     th[NREADERS + CONC_WRITERS];
+    concArg       arg[CONC_WRITERS];
+    testEnt*      pEnt;
+    mtrie3lCursor c;
+    mtrie3lEnt    ent;
+    u32           i;
+    s32           num = 0;
+    int           rt;
+
+    assert(mtrie3lAllocConcurrent(16, 4, 4) == NULL);
+    p = mtrie3lAllocConcurrent(2, 4, 4);
+    assert(p);
+    __atomic_store_n(&RcuDone, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < NREADERS; ++i) {
+        rt = pthread_create(&th[i], NULL, rcuReader, p);
+        assert(rt == 0);
+    }
+    for (i = 0; i < CONC_WRITERS; ++i) {
+        arg[i].p    = p;
+        arg[i].seed = i + 1;
+        arg[i].num  = 0;
+        rt = pthread_create(&th[NREADERS + i], NULL, concWriter, &arg[i]);
+        assert(rt == 0);
+    }
+    for (i = 0; i < CONC_WRITERS; ++i) {
+        pthread_join(th[NREADERS + i], NULL);
+        num += arg[i].num;
+    }
+    __atomic_store_n(&RcuDone, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < NREADERS; ++i) {
+        pthread_join(th[i], NULL);
+    }
+
+    /*
+     * The counters and the bitmaps agree with the leaves
+     */
+    assert(mtrie3lNumEntries(p) == (u32)num);
+    mtrie3lCursorInit(&c, p, 0);
+    for (i = 0; mtrie3lCursorNext(&c, &ent, 1); ++i) {
+        pEnt = ent.pEnt;
+        assert((pEnt->magic == ENT_MAGIC) && (pEnt->index == ent.index));
+    }
+    assert(i == (u32)num);
+    for (i = 0; i <= mtrie3lGetMaxIndex(p); ++i) {
+        pEnt = mtrie3lDelete(p, i);
+        if (pEnt) {
+            assert(pEnt->index == i);
+            epochRetire(pEnt, entFree);
+            --num;
+        }
+    }
+    assert(num == 0);
+    assert(mtrie3lNumEntries(p) == 0);
+    assert((mtrie3lNumL1(p) == 0) && (mtrie3lNumL2(p) == 0));
+    epochSynchronize();
+    rt = mtrie3lFree(p);
+    assert(rt == MTRIE3L_SUCCESS);
+    epochThreadExit();
+
+    return rt;
+}
+
+int
+main (int argc, char* argv[])
+{
+    int rt;
+
+    rt = basicTest();
+    if (rt != MTRIE3L_SUCCESS) {
+        printf("Error: %d: basicTest()\n", rt);
+    }
+    rt = findTest();
+    if (rt != MTRIE3L_SUCCESS) {
+        printf("Error: %d: findTest()\n", rt);
+    }
+    rt = cursorTest();
+    if (rt != MTRIE3L_SUCCESS) {
+        printf("Error: %d: cursorTest()\n", rt);
+    }
+    rt = slotTest();
+    if (rt != MTRIE3L_SUCCESS) {
+        printf("Error: %d: slotTest()\n", rt);
+    }
+    rt = valTest();
+    if (rt != MTRIE3L_SUCCESS) {
+        printf("Error: %d: valTest()\n", rt);
+    }
+    rt = lpmTest();
+    if (rt != MTRIE3L_SUCCESS) {
+        printf("Error: %d: lpmTest()\n", rt);
+    }
+    rt = rcuTest();
+    if (rt != MTRIE3L_SUCCESS) {
+        printf("Error: %d: rcuTest()\n", rt);
+    }
+    rt = concurrentTest();
+    if (rt != MTRIE3L_SUCCESS) {
+        printf("Error: %d: concurrentTest()\n", rt);
+    }
+    exit(0);
+    return 0;
+}
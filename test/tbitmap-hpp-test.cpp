@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2017 Yoichi Hariguchi
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ *
+ * tbitmap-hpp-test.cpp: make a command to test tbitmap.hpp against
+ *                       the C library
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <vector>
+#include "tbitmap.hpp"
+
+typedef tbitmap<4, 4, 3> hppMap;        /* 64K bits, 256-bit L2 nodes */
+
+static const u32 L2Bits = 1 << (3 + 5);
+static const u32 L1Bits = 1 << (4 + 3 + 5);
+
+
+/*
+ * Check that tbitmap::isSet() and tBitMapIsSet() agree with the
+ * model on every bit
+ */
+static void
+hppCompare (const hppMap& b, const std::vector<u8>& model)
+{
+    u32 i;
+
+    for (i = 0; i <= hppMap::maxPos; ++i) {
+        assert(b.isSet(i) == (model[i] != 0));
+        assert(tBitMapIsSet(b.get(), i) == (model[i] != 0));
+    }
+    assert(!b.isSet(hppMap::maxPos + 1));
+}
+
+/*
+ * Set or reset `n' random bits in [start, end] through set() and
+ * reset(), checking each one with tBitMapIsSet()
+ */
+static void
+hppUpdate (hppMap& b, std::vector<u8>& model,
+           u32 start, u32 end, u32 n, u32* pSeed)
+{
+    u32 pos;
+    int rt;
+
+    while (n--) {
+        *pSeed = *pSeed * 1103515245 + 12345;
+        pos = start + (*pSeed >> 8) % (end - start + 1);
+        if (*pSeed & 0x80000000) {
+            rt = b.set(pos);
+            model[pos] = 1;
+        } else {
+            rt = b.reset(pos);
+            model[pos] = 0;
+        }
+        assert(rt == TBITMAP_SUCCESS);
+        assert(tBitMapIsSet(b.get(), pos) == (model[pos] != 0));
+    }
+}
+
+struct hppBuf {
+    std::vector<u8> buf;
+    u64             pos;
+};
+
+static int
+hppWrite (void* pArg, const void* pBuf, u32 len)
+{
+    hppBuf*   hb = static_cast<hppBuf*>(pArg);
+    const u8* p  = static_cast<const u8*>(pBuf);
+
+    hb->buf.insert(hb->buf.end(), p, p + len);
+    return TBITMAP_SUCCESS;
+}
+
+static int
+hppRead (void* pArg, void* pBuf, u32 len)
+{
+    hppBuf* hb = static_cast<hppBuf*>(pArg);
+
+    if (hb->pos + len > hb->buf.size()) {
+        return TBITMAP_ERR;
+    }
+    memcpy(pBuf, &hb->buf[hb->pos], len);
+    hb->pos += len;
+    return TBITMAP_SUCCESS;
+}
+
+int
+trieHppTest (void)
+{
+    hppMap          b;
+    std::vector<u8> model(hppMap::maxPos + 1);
+    u32             seed = 1;
+
+    assert(tBitMapKeepTrie(b.get(), TRUE) == TBITMAP_SUCCESS);
+    hppCompare(b, model);
+    hppUpdate(b, model, 0, hppMap::maxPos, 20000, &seed);
+    hppCompare(b, model);
+    hppUpdate(b, model, 1000, 1100, 2000, &seed);
+    hppCompare(b, model);
+    assert((b.get()->flags & TBITMAP_IS_FLAT) == 0);
+    return TBITMAP_SUCCESS;
+}
+
+int
+flatHppTest (void)
+{
+    hppMap          b;
+    std::vector<u8> model(hppMap::maxPos + 1);
+    u32             seed = 2;
+
+    hppUpdate(b, model, 0, hppMap::maxPos, 40000, &seed);
+    assert(b.get()->flags & TBITMAP_IS_FLAT);
+    hppCompare(b, model);
+    hppUpdate(b, model, 0, hppMap::maxPos, 20000, &seed);
+    assert(b.get()->flags & TBITMAP_IS_FLAT);
+    hppCompare(b, model);
+    return TBITMAP_SUCCESS;
+}
+
+int
+fullL2HppTest (void)
+{
+    hppMap          b;
+    std::vector<u8> model(hppMap::maxPos + 1);
+    u32             seed = 3;
+    u32             i;
+
+    assert(tBitMapKeepTrie(b.get(), TRUE) == TBITMAP_SUCCESS);
+    assert(b.setBlock(L2Bits, 4 * L2Bits - 1) == TBITMAP_SUCCESS);
+    for (i = L2Bits; i < 4 * L2Bits; ++i) {
+        model[i] = 1;
+    }
+    assert(b.set(L2Bits + 10) == TBITMAP_SUCCESS);
+    hppCompare(b, model);
+    hppUpdate(b, model, L2Bits, 2 * L2Bits - 1, 300, &seed);
+    hppCompare(b, model);
+    hppUpdate(b, model, 3 * L2Bits - 40, 3 * L2Bits + 40, 300, &seed);
+    hppCompare(b, model);
+    return TBITMAP_SUCCESS;
+}
+
+int
+fullL1HppTest (void)
+{
+    hppMap          b;
+    std::vector<u8> model(hppMap::maxPos + 1);
+    u32             seed = 5;
+    u32             i;
+
+    assert(tBitMapKeepTrie(b.get(), TRUE) == TBITMAP_SUCCESS);
+    assert(b.setBlock(L1Bits, 3 * L1Bits - 1) == TBITMAP_SUCCESS);
+    for (i = L1Bits; i < 3 * L1Bits; ++i) {
+        model[i] = 1;
+    }
+    hppCompare(b, model);
+    assert(b.set(L1Bits + 7) == TBITMAP_SUCCESS);
+    hppUpdate(b, model, L1Bits, 2 * L1Bits - 1, 300, &seed);
+    hppCompare(b, model);
+    hppUpdate(b, model, 3 * L1Bits - 20, 3 * L1Bits + 20, 100, &seed);
+    hppCompare(b, model);
+
+    assert(tBitMapSetAll(b.get()) == TBITMAP_SUCCESS);
+    for (i = 0; i <= hppMap::maxPos; ++i) {
+        model[i] = 1;
+    }
+    hppCompare(b, model);
+    hppUpdate(b, model, 0, hppMap::maxPos, 2000, &seed);
+    hppCompare(b, model);
+    return TBITMAP_SUCCESS;
+}
+
+int
+snapshotHppTest (void)
+{
+    hppMap          b;
+    std::vector<u8> model(hppMap::maxPos + 1);
+    std::vector<u8> snapModel;
+    tBitMap*        pSnap;
+    u32             seed = 4;
+    u32             i;
+
+    assert(tBitMapKeepTrie(b.get(), TRUE) == TBITMAP_SUCCESS);
+    hppUpdate(b, model, 0, hppMap::maxPos, 20000, &seed);
+    pSnap = tBitMapSnapshot(b.get());
+    assert(pSnap);
+    snapModel = model;
+    hppUpdate(b, model, 0, hppMap::maxPos, 20000, &seed);
+    hppCompare(b, model);
+    for (i = 0; i <= hppMap::maxPos; ++i) {
+        assert(tBitMapIsSet(pSnap, i) == (snapModel[i] != 0));
+    }
+    tBitMapFree(pSnap);
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Updates through set() and reset() reach the journal and the
+ * dirty L2 node map
+ */
+int
+journalHppTest (void)
+{
+    hppMap          b;
+    std::vector<u8> model(hppMap::maxPos + 1);
+    hppBuf          jr = hppBuf();
+    hppBuf          cp = hppBuf();
+    tBitMap*        pNew;
+    u32             seed = 6;
+    u32             i;
+    int             rt;
+
+    assert(tBitMapKeepTrie(b.get(), TRUE) == TBITMAP_SUCCESS);
+    rt = tBitMapSetJournal(b.get(), hppWrite, &jr);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapTrackDirty(b.get(), TRUE);
+    assert(rt == TBITMAP_SUCCESS);
+    hppUpdate(b, model, 0, hppMap::maxPos, 20000, &seed);
+    hppUpdate(b, model, 5000, 5100, 2000, &seed);
+    hppCompare(b, model);
+
+    pNew = tBitMapAllocStrides(4, 4, 3);
+    assert(pNew);
+    rt = tBitMapReplay(pNew, &jr.buf[0], jr.buf.size());
+    assert(rt == TBITMAP_SUCCESS);
+    for (i = 0; i <= hppMap::maxPos; ++i) {
+        assert(tBitMapIsSet(pNew, i) == (model[i] != 0));
+    }
+    tBitMapFree(pNew);
+
+    rt = tBitMapCheckpoint(b.get(), hppWrite, &cp);
+    assert(rt == TBITMAP_SUCCESS);
+    pNew = tBitMapAllocStrides(4, 4, 3);
+    assert(pNew);
+    rt = tBitMapApplyCheckpoint(pNew, hppRead, &cp);
+    assert(rt == TBITMAP_SUCCESS);
+    for (i = 0; i <= hppMap::maxPos; ++i) {
+        assert(tBitMapIsSet(pNew, i) == (model[i] != 0));
+    }
+    tBitMapFree(pNew);
+    tBitMapSetJournal(b.get(), NULL, NULL);
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Updates through set() and reset() are traced; replaying the trace
+ * rebuilds the bitmap
+ */
+int
+traceHppTest (void)
+{
+#ifdef TBITMAP_TRACE
+    hppMap          b;
+    std::vector<u8> model(hppMap::maxPos + 1);
+    hppBuf          tr = hppBuf();
+    tBitMapTraceRec rec;
+    tBitMap*        pNew = NULL;
+    u64             off = 0;
+    u32             seed = 7;
+    u32             i;
+    int             rt;
+
+    assert(tBitMapKeepTrie(b.get(), TRUE) == TBITMAP_SUCCESS);
+    rt = tBitMapTraceStart(hppWrite, &tr);
+    assert((rt == TBITMAP_SUCCESS) && tBitMapTracing());
+    hppUpdate(b, model, 0, hppMap::maxPos, 20000, &seed);
+    hppUpdate(b, model, 5000, 5100, 2000, &seed);
+    rt = tBitMapTraceStop();
+    assert((rt == TBITMAP_SUCCESS) && !tBitMapTracing());
+
+    memset(&rec, 0, sizeof(rec));
+    while (tBitMapTraceNext(&tr.buf[0], tr.buf.size(), &off, &rec)) {
+        assert(rec.id == 1);
+        switch (rec.op) {
+        case TBITMAP_TRACE_NEW:
+            assert(!pNew);
+            pNew = tBitMapAllocStrides(rec.b & 0xff, (rec.b >> 8) & 0xff,
+                                       (rec.b >> 16) & 0xff);
+            assert(pNew);
+            break;
+        case TBITMAP_TRACE_SET:
+        case TBITMAP_TRACE_RESET:
+            rt = tBitMapSetReset(pNew, rec.a, rec.op == TBITMAP_TRACE_SET);
+            assert(rt == TBITMAP_SUCCESS);
+            break;
+        case TBITMAP_TRACE_ISSET:
+            break;
+        default:
+            assert(0);
+        }
+    }
+    assert(pNew && (off == tr.buf.size()));
+    for (i = 0; i <= hppMap::maxPos; ++i) {
+        assert(tBitMapIsSet(pNew, i) == (model[i] != 0));
+    }
+    tBitMapFree(pNew);
+#else
+    assert(!tBitMapTracing());
+#endif
+    return TBITMAP_SUCCESS;
+}
+
+int
+main (int argc, char* argv[])
+{
+    int rt;
+
+    rt = trieHppTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: trieHppTest()\n", rt);
+    }
+    rt = flatHppTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: flatHppTest()\n", rt);
+    }
+    rt = fullL2HppTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: fullL2HppTest()\n", rt);
+    }
+    rt = fullL1HppTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: fullL1HppTest()\n", rt);
+    }
+    rt = snapshotHppTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: snapshotHppTest()\n", rt);
+    }
+    rt = journalHppTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: journalHppTest()\n", rt);
+    }
+    rt = traceHppTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: traceHppTest()\n", rt);
+    }
+    return 0;
+}
@@ -28,6 +28,11 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "epoch.h"
 #include "tbitmap.h"
 
 /*
@@ -282,17 +287,13 @@ setResetTest (void)
      */
     rt = tBitMapSetBlock(p, 4194302, 8388609);
     assert(rt == TBITMAP_SUCCESS);
-    assert(p->pTrie->nL1 == 4);
+    assert(p->pTrie->nL1 == 2);  /* L0[2] and L0[3] are tagged full */
     assert(p->pTrie->nL2 == 2);
     assert(p->pTrie->num == 131074);
     assert(p->pTrie->l0[1]->cnt == 1);
-    assert(p->pTrie->l0[2]->cnt == 256);
-    assert(p->pTrie->l0[3]->cnt == 256);
+    assert(getPtrTag(p->pTrie->l0[2]) == 1);
+    assert(getPtrTag(p->pTrie->l0[3]) == 1);
     assert(p->pTrie->l0[4]->cnt == 1);
-    for (i = 0; i < 256; ++i) {
-        assert(getPtrTag(p->pTrie->l0[2]->l1[i]) == 1);
-        assert(getPtrTag(p->pTrie->l0[3]->l1[i]) == 1);
-    }
     pL2 = getPtr(tBitMapL2, p->pTrie->l0[1]->l1[255]);
     assert(pL2);
     assert(pL2->nSetAll == 0);
@@ -353,15 +354,1671 @@ setResetTest (void)
     return rt;
 }
 
+/*
+ * Setting a block must set all the bits even if some of them
+ * in the same bitmap are already set.
+ */
+int
+overlapBlockTest (void)
+{
+    tBitMap *p;
+    u32     i;
+    int     rt;
+
+    p = tBitMapAllocStrides(4, 4, 4);
+    assert(p);
+    rt = tBitMapSet(p, 200);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapSetBlock(p, 100, 70000);
+    assert(rt == TBITMAP_SUCCESS);
+    for (i = 100; i <= 70000; ++i) {
+        if (!tBitMapIsSet(p, i)) {
+            printf("%s: Error: bit %d is wrongly unset.\n", __FUNCTION__, i);
+            assert(0);
+        }
+    }
+    assert(!tBitMapIsSet(p, 99));
+    assert(!tBitMapIsSet(p, 70001));
+
+    rt = tBitMapFree(p);
+    assert(rt == TBITMAP_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * Random blocks set and reset in the first RB_BITS bits of a trie
+ * bitmap, a striped bitmap and a snapshot, compared with a model.
+ */
+enum {
+    RB_BITS = 1 << 19,
+    RB_OPS  = 2000,
+};
+
+static void
+randomBlockCheck (tBitMap* p, const u8* model)
+{
+    u32 i, n;
+
+    for (i = n = 0; i < RB_BITS; ++i) {
+        assert(tBitMapIsSet(p, i) == ((model[i >> 3] >> (i & 7)) & 1));
+    }
+    for (i = 0; i < RB_BITS / 32; ++i) {
+        n += (((u32*)model)[i] != 0);
+    }
+    assert(tBitMapNumWords(p) == n);
+}
 
 int
-main (int argc, char* argv[])
+randomBlockTest (void)
+{
+    tBitMap* p;
+    tBitMap* pStriped;
+    tBitMap* pSnap = NULL;
+    u8*      model;
+    u8*      modelSnap;
+    u32      i, j, start, end, x = 12345;
+    bool     isSet;
+    int      rt;
+
+    p        = tBitMapAlloc((1 << 24) - 1);
+    pStriped = tBitMapAllocStriped((1 << 24) - 1, 8);
+    model     = calloc(1, RB_BITS / 8);
+    modelSnap = malloc(RB_BITS / 8);
+    assert(p && pStriped && model && modelSnap);
+
+    for (i = 0; i < RB_OPS; ++i) {
+        x = x * 1103515245 + 12345;
+        start = (x >> 8) & (RB_BITS - 1);
+        x = x * 1103515245 + 12345;
+        end = start + ((x >> 8) & ((i & 1) ? 0x3f : 0x3fff));
+        if (end >= RB_BITS) {
+            end = RB_BITS - 1;
+        }
+        isSet = ((x >> 30) & 3) != 0;
+        rt = tBitMapSetResetBlock(p, start, end, isSet);
+        assert(rt == TBITMAP_SUCCESS);
+        rt = tBitMapSetResetBlock(pStriped, start, end, isSet);
+        assert(rt == TBITMAP_SUCCESS);
+        for (j = start; j <= end; ++j) {
+            if (isSet) {
+                model[j >> 3] |= 1 << (j & 7);
+            } else {
+                model[j >> 3] &= ~(1 << (j & 7));
+            }
+        }
+        if (i == RB_OPS / 4) {
+            pSnap = tBitMapSnapshot(p);
+            assert(pSnap);
+            memcpy(modelSnap, model, RB_BITS / 8);
+        }
+        if ((i % 500) == 499) {
+            assert(!(p->flags & TBITMAP_IS_FLAT));
+            randomBlockCheck(p, model);
+            randomBlockCheck(pStriped, model);
+        }
+    }
+    randomBlockCheck(pSnap, modelSnap);
+    rt = tBitMapResetBlock(p, 0, RB_BITS - 1);
+    assert((rt == TBITMAP_SUCCESS) && (tBitMapNumL1(p) == 0));
+    assert((tBitMapNumL2(p) == 0) && (tBitMapNumWords(p) == 0));
+    rt = tBitMapSetBlock(pStriped, 0, RB_BITS - 1);
+    assert((rt == TBITMAP_SUCCESS) && (tBitMapNumL2(pStriped) == 0));
+    assert(tBitMapNumWords(pStriped) == RB_BITS / 32);
+
+    tBitMapFree(pSnap);
+    tBitMapFree(pStriped);
+    tBitMapFree(p);
+    free(modelSnap);
+    free(model);
+
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Small bitmaps are flat. Larger bitmaps switch to the flat bit
+ * vector once the trie nodes become as large as the bit vector,
+ * and back once few bitmaps are left.
+ */
+int
+flatTest (void)
+{
+    tBitMap *p;
+    u32     i, j;
+    int     rt;
+
+    p = tBitMapAlloc(4095);
+    assert(p);
+    assert(p->flags & TBITMAP_IS_FLAT);
+    assert(p->maxPos == 4095);
+    rt = tBitMapSetBlock(p, 30, 100);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapSet(p, 4095);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(p->pTrie->num == 5);
+    rt = tBitMapReset(p, 64);
+    assert(rt == TBITMAP_SUCCESS);
+    for (i = 0; i <= p->maxPos; ++i) {
+        assert(tBitMapIsSet(p, i) ==
+               (((i >= 30) && (i <= 100) && (i != 64)) || (i == 4095)));
+    }
+
+    /*
+     * Back to the trie: bits 32-63 make a full bitmap.
+     */
+    rt = tBitMapUnflatten(p);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(!(p->flags & TBITMAP_IS_FLAT));
+    assert(p->pTrie->num == 5);
+    assert(p->pTrie->nL1 == 2);
+    assert(p->pTrie->nL2 == 2);
+    for (i = 0; i <= p->maxPos; ++i) {
+        assert(tBitMapIsSet(p, i) ==
+               (((i >= 30) && (i <= 100) && (i != 64)) || (i == 4095)));
+    }
+    rt = tBitMapFree(p);
+    assert(rt == TBITMAP_SUCCESS);
+
+    /*
+     * 2^16 bits: strides 4, 4, 3. Setting one bit per L2 node
+     * makes the trie larger than the 8KB bit vector.
+     */
+    p = tBitMapAlloc(65535);
+    assert(p);
+    assert(!(p->flags & TBITMAP_IS_FLAT));
+    for (i = 0; i <= p->maxPos; i += 256) {
+        rt = tBitMapSet(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    assert(p->flags & TBITMAP_IS_FLAT);
+    assert(p->pTrie->num == 256);
+    assert(p->pTrie->nL1 == 0);
+    assert(p->pTrie->nL2 == 0);
+    for (i = 0; i <= p->maxPos; ++i) {
+        assert(tBitMapIsSet(p, i) == ((i & 255) == 0));
+    }
+    rt = tBitMapResetAll(p);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(p->pTrie->num == 0);
+    assert(!tBitMapIsSet(p, 0));
+    assert(!(p->flags & TBITMAP_IS_FLAT));
+
+    /*
+     * Back to the trie once few bitmaps are left, which takes many
+     * fewer than the switch to the flat bit vector did.
+     */
+    for (i = 0; i <= p->maxPos; i += 256) {
+        rt = tBitMapSet(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    assert(p->flags & TBITMAP_IS_FLAT);
+    for (i = 0; (i <= p->maxPos) && (p->flags & TBITMAP_IS_FLAT);
+         i += 256) {
+        rt = tBitMapReset(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    assert(!(p->flags & TBITMAP_IS_FLAT));
+    assert(p->pTrie->num < 64);
+    assert(p->pTrie->num == tBitMapNumL2(p));
+    for (j = 0; j <= p->maxPos; ++j) {
+        assert(tBitMapIsSet(p, j) == (((j & 255) == 0) && (j >= i)));
+    }
+
+    /*
+     * tBitMapKeepTrie()
+     */
+    rt = tBitMapFlatten(p);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapKeepTrie(p, TRUE);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(!(p->flags & TBITMAP_IS_FLAT));
+    for (i = 0; i <= p->maxPos; i += 64) {
+        rt = tBitMapSet(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    assert(!(p->flags & TBITMAP_IS_FLAT));
+    rt = tBitMapKeepTrie(p, FALSE);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapSet(p, 1);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(p->flags & TBITMAP_IS_FLAT);
+    rt = tBitMapFree(p);
+    assert(rt == TBITMAP_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * tBitMapSetAll() and tBitMapResetAll() mean the same for a flat
+ * bitmap and for tries: full L0 tags, or L1 nodes of full tags for a
+ * concurrent bitmap.
+ */
+int
+setAllTest (void)
+{
+    tBitMap* p[4];
+    u32      i, j;
+    int      rt;
+
+    p[0] = tBitMapAlloc((1 << 12) - 1);
+    p[1] = tBitMapAlloc((1 << 24) - 1);
+    p[2] = tBitMapAllocConcurrent((1 << 20) - 1);
+    p[3] = tBitMapAllocStriped((1 << 20) - 1, 4);
+    assert(p[0] && p[1] && p[2] && p[3]);
+    assert((p[0]->flags & TBITMAP_IS_FLAT) &&
+           !(p[1]->flags & TBITMAP_IS_FLAT));
+    for (j = 0; j < elementsOf(p); ++j) {
+        rt = tBitMapSet(p[j], 100);
+        assert(rt == TBITMAP_SUCCESS);
+        rt = tBitMapSetAll(p[j]);
+        assert(rt == TBITMAP_SUCCESS);
+        assert(tBitMapNumWords(p[j]) == (p[j]->maxPos >> 5) + 1);
+        for (i = 0; i <= p[j]->maxPos; i += 4093) {
+            assert(tBitMapIsSet(p[j], i));
+        }
+        assert(tBitMapIsSet(p[j], 5) && tBitMapIsSet(p[j], p[j]->maxPos));
+        rt = tBitMapReset(p[j], 5);
+        assert(rt == TBITMAP_SUCCESS);
+        assert(!tBitMapIsSet(p[j], 5));
+        assert(tBitMapIsSet(p[j], 4) && tBitMapIsSet(p[j], 6));
+        rt = tBitMapResetAll(p[j]);
+        assert(rt == TBITMAP_SUCCESS);
+        assert(tBitMapNumWords(p[j]) == 0);
+        assert((tBitMapNumL1(p[j]) == 0) && (tBitMapNumL2(p[j]) == 0));
+        for (i = 0; i <= p[j]->maxPos; i += 4093) {
+            assert(!tBitMapIsSet(p[j], i));
+        }
+        rt = tBitMapFree(p[j]);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    epochSynchronize();
+
+    return rt;
+}
+
+/*
+ * Concurrent bitmap: NTHREADS threads set the bits (i % NTHREADS)
+ * == id in [0, CONC_RANGE) and then reset the bits (i % 64) == id.
+ * Meanwhile all of them reset [base + 100, base + 9999] and set
+ * [base + 10000, base + 16383] of the preset range starting at
+ * base = CONC_RANGE + (j << 14).
+ */
+enum {
+    NTHREADS   = 8,
+    CONC_RANGE = 1 << 20,
+};
+
+static void*
+concurrentWorker (void* arg)
+{
+    tBitMap* p  = ((void**)arg)[0];
+    u32      id = (u32)(uintptr_t)((void**)arg)[1];
+    u32      i;
+    u32      base;
+    int      rt;
+
+    for (i = id; i < CONC_RANGE; i += NTHREADS) {
+        rt = tBitMapSet(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+        if ((i & 0xfff) == id) {
+            base = CONC_RANGE + ((i >> 12) << 14);
+            rt = tBitMapResetBlock(p, base + 100, base + 9999);
+            assert(rt == TBITMAP_SUCCESS);
+            rt = tBitMapSetBlock(p, base + 10000, base + 16383);
+            assert(rt == TBITMAP_SUCCESS);
+        }
+    }
+    for (i = id; i < CONC_RANGE; i += 64) {
+        rt = tBitMapReset(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    epochThreadExit();
+    return NULL;
+}
+
+int
+concurrentTest (void)
+{
+    tBitMap*  p;
+    pthread_t th[NTHREADS];
+    void*     arg[NTHREADS][2];
+    u32       i;
+    u32       off;
+    int       rt;
+
+    p = tBitMapAllocConcurrent(8 * CONC_RANGE - 1);
+    assert(p);
+    assert(p->flags & TBITMAP_CONCURRENT);
+    rt = tBitMapSetBlock(p, CONC_RANGE, 5 * CONC_RANGE - 1);
+    assert(rt == TBITMAP_SUCCESS);
+    for (i = 0; i < NTHREADS; ++i) {
+        arg[i][0] = p;
+        arg[i][1] = (void*)(uintptr_t)i;
+        rt = pthread_create(&th[i], NULL, concurrentWorker, arg[i]);
+        assert(rt == 0);
+    }
+    for (i = 0; i < NTHREADS; ++i) {
+        pthread_join(th[i], NULL);
+    }
+
+    for (i = 0; i < CONC_RANGE; ++i) {
+        assert(tBitMapIsSet(p, i) == ((i % 64) >= NTHREADS));
+    }
+    for (i = CONC_RANGE; i < 6 * CONC_RANGE; ++i) {
+        off = (i - CONC_RANGE) & 0x3fff;
+        assert(tBitMapIsSet(p, i) ==
+               ((i < 5 * CONC_RANGE) && ((off < 100) || (off > 9999))));
+    }
+    rt = tBitMapFree(p);
+    assert(rt == TBITMAP_SUCCESS);
+    epochThreadExit();
+
+    return rt;
+}
+
+/*
+ * Striped bitmap: thread `id' owns [id * STRIPE_RANGE,
+ * (id + 1) * STRIPE_RANGE). It sets every 3rd bit of it, sets a block
+ * crossing the end of its range and resets the bits (i % 6) == 0.
+ * The blocks of the neighbours overlap at the range boundaries.
+ */
+enum {
+    STRIPE_RANGE = 1 << 20,
+    STRIPE_EDGE  = 6000,         /* multiple of 6 */
+};
+
+static void*
+stripedWorker (void* arg)
+{
+    tBitMap* p  = ((void**)arg)[0];
+    u32      id = (u32)(uintptr_t)((void**)arg)[1];
+    u32      base = id * STRIPE_RANGE;
+    u32      i;
+    int      rt;
+
+    for (i = base; i < base + STRIPE_RANGE; i += 3) {
+        rt = tBitMapSet(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    rt = tBitMapSetBlock(p, base + STRIPE_RANGE - STRIPE_EDGE,
+                         base + STRIPE_RANGE + STRIPE_EDGE - 1);
+    assert(rt == TBITMAP_SUCCESS);
+    for (i = base + STRIPE_EDGE; i < base + STRIPE_RANGE - STRIPE_EDGE;
+         i += 6) {
+        rt = tBitMapReset(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    return NULL;
+}
+
+static bool
+stripedExpect (u32 i)
+{
+    u32 off = i % STRIPE_RANGE;
+
+    if (i >= NTHREADS * STRIPE_RANGE) {
+        return (i < NTHREADS * STRIPE_RANGE + STRIPE_EDGE) ? TRUE : FALSE;
+    }
+    if ((off >= STRIPE_RANGE - STRIPE_EDGE) ||
+        ((off < STRIPE_EDGE) && (i >= STRIPE_RANGE))) {
+        return TRUE;            /* set by a block */
+    }
+    if (off % 3) {
+        return FALSE;
+    }
+    return ((off % 6) != 0) || (off < STRIPE_EDGE);
+}
+
+int
+stripedTest (void)
+{
+    tBitMap*  p;
+    pthread_t th[NTHREADS];
+    void*     arg[NTHREADS][2];
+    u32       i;
+    u32       nw;
+    u32       w;
+    int       rt;
+
+    p = tBitMapAllocStriped(2 * NTHREADS * STRIPE_RANGE - 1, NTHREADS * 2);
+    assert(p);
+    assert((p->flags & TBITMAP_STRIPED) && !(p->flags & TBITMAP_IS_FLAT));
+    for (i = 0; i < NTHREADS; ++i) {
+        arg[i][0] = p;
+        arg[i][1] = (void*)(uintptr_t)i;
+        rt = pthread_create(&th[i], NULL, stripedWorker, arg[i]);
+        assert(rt == 0);
+    }
+    for (i = 0; i < NTHREADS; ++i) {
+        pthread_join(th[i], NULL);
+    }
+
+    nw = 0;
+    w  = 0;
+    for (i = 0; i <= p->maxPos; ++i) {
+        assert(tBitMapIsSet(p, i) == stripedExpect(i));
+        w |= stripedExpect(i);
+        if ((i & 31) == 31) {
+            nw += (w != 0);
+            w   = 0;
+        }
+    }
+    assert(tBitMapNumWords(p) == nw);
+    assert(tBitMapNumL1(p) > 0);
+    assert(tBitMapNumL2(p) > 0);
+    assert(tBitMapFlatten(p) == TBITMAP_ERR);
+
+    rt = tBitMapResetBlock(p, 0, p->maxPos);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(tBitMapNumWords(p) == 0);
+    assert((tBitMapNumL1(p) == 0) && (tBitMapNumL2(p) == 0));
+    rt = tBitMapFree(p);
+    assert(rt == TBITMAP_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * Snapshots: compare bitmaps and their snapshots against plain
+ * byte arrays while the bitmaps keep being updated.
+ */
+enum {
+    SNAP_BITS = 1 << 20,
+    SNAP_MANY = 1 << 16,
+};
+
+static void
+snapUpdate (tBitMap* p, u8* ref, u32 seed)
 {
+    u32 i, j, k;
     int rt;
 
-    rt = setResetTest();
-    if (rt != TBITMAP_SUCCESS) {
-        printf("Error: %d: singleSetResetTest()\n", rt);
+    for (i = 0, k = seed; i < 20000; ++i) {
+        k = k * 1103515245 + 12345;
+        j = (k >> 4) % SNAP_BITS;
+        rt = tBitMapSetReset(p, j, (k >> 2) & 1);
+        assert(rt == TBITMAP_SUCCESS);
+        ref[j] = (k >> 2) & 1;
+    }
+    j = (seed * 7919) % (SNAP_BITS - 70000);
+    rt = tBitMapSetResetBlock(p, j, j + 65536, seed & 1);
+    assert(rt == TBITMAP_SUCCESS);
+    memset(ref + j, seed & 1, 65537);
+}
+
+static void
+snapCheck (tBitMap* p, u8* ref)
+{
+    u32 i;
+
+    for (i = 0; i < SNAP_BITS; ++i) {
+        assert(tBitMapIsSet(p, i) == ref[i]);
+    }
+}
+
+int
+snapshotTest (void)
+{
+    tBitMap* p;
+    tBitMap* pSnap[2];
+    tBitMap** pMany;
+    u8*      ref[3];
+    u32      i, j;
+    int      rt;
+
+    for (i = 0; i < elementsOf(ref); ++i) {
+        ref[i] = calloc(SNAP_BITS, 1);
+        assert(ref[i]);
+    }
+    p = tBitMapAllocStrides(5, 5, 5);
+    assert(p && !(p->flags & TBITMAP_IS_FLAT));
+    snapUpdate(p, ref[0], 1);
+    snapUpdate(p, ref[0], 2);
+
+    pSnap[0] = tBitMapSnapshot(p);
+    assert(pSnap[0] && (pSnap[0]->flags & TBITMAP_SNAPSHOT));
+    memcpy(ref[1], ref[0], SNAP_BITS);
+    assert(tBitMapSet(pSnap[0], 0) == TBITMAP_ERR);
+    assert(tBitMapResetAll(pSnap[0]) == TBITMAP_ERR);
+
+    snapUpdate(p, ref[0], 3);
+    snapCheck(p, ref[0]);
+    snapCheck(pSnap[0], ref[1]);
+
+    pSnap[1] = tBitMapSnapshot(p);
+    assert(pSnap[1]);
+    memcpy(ref[2], ref[0], SNAP_BITS);
+    snapUpdate(p, ref[0], 4);
+    rt = tBitMapFree(pSnap[0]);
+    assert(rt == TBITMAP_SUCCESS);
+    snapUpdate(p, ref[0], 5);
+    snapCheck(p, ref[0]);
+    snapCheck(pSnap[1], ref[2]);
+
+    /*
+     * The snapshot outlives the bitmap
+     */
+    rt = tBitMapFree(p);
+    assert(rt == TBITMAP_SUCCESS);
+    snapCheck(pSnap[1], ref[2]);
+    rt = tBitMapFree(pSnap[1]);
+    assert(rt == TBITMAP_SUCCESS);
+
+    /*
+     * Flat bitmap
+     */
+    p = tBitMapAlloc(1000);
+    assert(p && (p->flags & TBITMAP_IS_FLAT));
+    tBitMapSetBlock(p, 10, 500);
+    pSnap[0] = tBitMapSnapshot(p);
+    assert(pSnap[0]);
+    tBitMapResetAll(p);
+    for (i = 0; i <= 1000; ++i) {
+        assert(tBitMapIsSet(pSnap[0], i) == ((i >= 10) && (i <= 500)));
+        assert(tBitMapIsSet(p, i) == FALSE);
+    }
+    tBitMapFree(pSnap[0]);
+    tBitMapFree(p);
+
+    /*
+     * A large flat bitmap is switched to the trie, not copied
+     */
+    memset(ref[0], 0, SNAP_BITS);
+    p = tBitMapAllocStrides(5, 5, 5);
+    assert(p);
+    snapUpdate(p, ref[0], 6);
+    rt = tBitMapFlatten(p);
+    assert((rt == TBITMAP_SUCCESS) && (p->flags & TBITMAP_IS_FLAT));
+    pSnap[0] = tBitMapSnapshot(p);
+    assert(pSnap[0] && !pSnap[0]->pFlat);
+    assert(!(p->flags & TBITMAP_IS_FLAT) && (p->flags & TBITMAP_KEEP_TRIE));
+    memcpy(ref[1], ref[0], SNAP_BITS);
+    snapUpdate(p, ref[0], 7);
+    snapCheck(p, ref[0]);
+    snapCheck(pSnap[0], ref[1]);
+    assert(!(p->flags & TBITMAP_IS_FLAT));
+    tBitMapFree(pSnap[0]);
+    rt = tBitMapKeepTrie(p, FALSE);
+    assert(rt == TBITMAP_SUCCESS);
+    tBitMapFree(p);
+
+    /*
+     * Each snapshot followed by an update of bit 0 copies the L1
+     * node and adds an owner to the L2 node of bit 300. The update
+     * fails once that L2 node has 0xffff extra owners.
+     */
+    p = tBitMapAllocStrides(4, 4, 3);
+    assert(p && (tBitMapKeepTrie(p, TRUE) == TBITMAP_SUCCESS));
+    tBitMapSet(p, 300);
+    pMany = calloc(SNAP_MANY, sizeof(tBitMap*));
+    assert(pMany);
+    for (i = 0; i < SNAP_MANY; ++i) {
+        pMany[i] = tBitMapSnapshot(p);
+        assert(pMany[i]);
+        rt = tBitMapSetReset(p, 0, !(i & 1));
+        if (rt != TBITMAP_SUCCESS) {
+            break;
+        }
+    }
+    assert((i == 0xffff) && (rt == TBITMAP_ENOMEM));
+    assert(tBitMapIsSet(p, 0) == !((i - 1) & 1));
+    for (j = 0; j <= i; ++j) {
+        assert(tBitMapIsSet(pMany[j], 300));
+        assert(tBitMapIsSet(pMany[j], 0) == ((j > 0) && !((j - 1) & 1)));
+        tBitMapFree(pMany[j]);
+    }
+    free(pMany);
+    rt = tBitMapSetReset(p, 0, !(i & 1));
+    assert(rt == TBITMAP_SUCCESS);
+    assert(tBitMapIsSet(p, 300));
+    tBitMapFree(p);
+
+    for (i = 0; i < elementsOf(ref); ++i) {
+        free(ref[i]);
+    }
+    return rt;
+}
+
+/*
+ * Serialization: write bitmaps to a memory buffer, read them back
+ * and compare.
+ */
+typedef struct serialBuf_ {
+    u8* buf;
+    u32 len;                    /* # of bytes written */
+    u32 pos;                    /* read position */
+    u32 size;
+} serialBuf;
+
+static int
+serialWrite (void* pArg, const void* pBuf, u32 len)
+{
+    serialBuf* sb = pArg;
+
+    assert(len <= 4096);
+    if (sb->len + len > sb->size) {
+        sb->size = 2 * (sb->len + len);
+        sb->buf  = realloc(sb->buf, sb->size);
+        assert(sb->buf);
+    }
+    memcpy(sb->buf + sb->len, pBuf, len);
+    sb->len += len;
+    return TBITMAP_SUCCESS;
+}
+
+static int
+serialRead (void* pArg, void* pBuf, u32 len)
+{
+    serialBuf* sb = pArg;
+
+    if (sb->pos + len > sb->len) {
+        return TBITMAP_ERR;
+    }
+    memcpy(pBuf, sb->buf + sb->pos, len);
+    sb->pos += len;
+    return TBITMAP_SUCCESS;
+}
+
+static int
+serialRoundTrip (tBitMap* p)
+{
+    serialBuf sb;
+    tBitMap*  pNew;
+    u32       i;
+    int       rt;
+
+    memset(&sb, 0, sizeof(sb));
+    rt = tBitMapSerialize(p, serialWrite, &sb);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapDeserialize(&pNew, serialRead, &sb);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(sb.pos == sb.len);
+    assert(pNew->maxPos == p->maxPos);
+    assert(tBitMapNumWords(pNew) == tBitMapNumWords(p));
+    for (i = 0; i <= p->maxPos; ++i) {
+        assert(tBitMapIsSet(pNew, i) == tBitMapIsSet(p, i));
+    }
+    tBitMapFree(pNew);
+
+    /*
+     * Truncated and corrupted streams
+     */
+    sb.pos = 0;
+    sb.len -= 4;
+    rt = tBitMapDeserialize(&pNew, serialRead, &sb);
+    assert((rt == TBITMAP_ERR) && (pNew == NULL));
+    sb.pos = 0;
+    sb.len += 4;
+    sb.buf[sb.len - 1] ^= 1;
+    rt = tBitMapDeserialize(&pNew, serialRead, &sb);
+    assert((rt == TBITMAP_ERR) && (pNew == NULL));
+    sb.pos = 0;
+    sb.buf[0] ^= 1;
+    rt = tBitMapDeserialize(&pNew, serialRead, &sb);
+    assert((rt == TBITMAP_ERR) && (pNew == NULL));
+    free(sb.buf);
+
+    return TBITMAP_SUCCESS;
+}
+
+int
+serialTest (void)
+{
+    tBitMap* p;
+    u32      i;
+    int      rt;
+
+    p = tBitMapAlloc((1 << 22) - 1);
+    assert(p);
+    for (i = 0; i < elementsOf(Fib); ++i) {
+        if (Fib[i] <= p->maxPos) {
+            tBitMapSet(p, Fib[i]);      /* sparse L2 nodes */
+        }
+    }
+    for (i = 1 << 20; i < (1 << 20) + 50000; i += 7) {
+        tBitMapSet(p, i);               /* dense L2 nodes */
+    }
+    tBitMapSetBlock(p, 3 << 20, (3 << 20) + 100000); /* full L2 nodes */
+    rt = serialRoundTrip(p);
+    tBitMapFree(p);
+    if (rt != TBITMAP_SUCCESS) {
+        return rt;
+    }
+
+    p = tBitMapAlloc(5000);
+    assert(p && (p->flags & TBITMAP_IS_FLAT));
+    tBitMapSetBlock(p, 100, 2000);
+    tBitMapSet(p, 4999);
+    rt = serialRoundTrip(p);
+    tBitMapFree(p);
+
+    return rt;
+}
+
+/*
+ * A block covering whole L1 nodes costs no node: the L0 entries
+ * are tagged full, unfolded on reset and folded back on set.
+ */
+int
+fullL1Test (void)
+{
+    tBitMap* p;
+    tBitMap* pSnap;
+    u32      i;
+    int      rt;
+
+    p = tBitMapAllocStrides(4, 4, 4);
+    assert(p);
+    rt = tBitMapSetBlock(p, 0, p->maxPos);
+    assert(rt == TBITMAP_SUCCESS);
+    assert((tBitMapNumL1(p) == 0) && (tBitMapNumL2(p) == 0));
+    assert(tBitMapNumWords(p) == (1 << 12));
+    for (i = 0; i < 16; ++i) {
+        assert(getPtrTag(p->pTrie->l0[i]) == 1);
+    }
+    assert(tBitMapIsSet(p, 0) && tBitMapIsSet(p, p->maxPos));
+
+    pSnap = tBitMapSnapshot(p);
+    assert(pSnap);
+    rt = tBitMapReset(p, 5000);
+    assert(rt == TBITMAP_SUCCESS);
+    assert((tBitMapNumL1(p) == 1) && (tBitMapNumL2(p) == 1));
+    assert(tBitMapNumWords(p) == (1 << 12));
+    assert(!tBitMapIsSet(p, 5000) && tBitMapIsSet(p, 5001));
+    assert(tBitMapIsSet(pSnap, 5000));
+    rt = tBitMapSet(p, 5000);
+    assert(rt == TBITMAP_SUCCESS);
+    assert((tBitMapNumL1(p) == 0) && (tBitMapNumL2(p) == 0));
+    rt = tBitMapResetBlock(p, 1 << 13, (2 << 13) - 1);
+    assert(rt == TBITMAP_SUCCESS);
+    assert((tBitMapNumL1(p) == 0) && (tBitMapNumL2(p) == 0));
+    assert(tBitMapNumWords(p) == (1 << 12) - (1 << 8));
+    assert(!tBitMapIsSet(p, 1 << 13) && tBitMapIsSet(p, (1 << 13) - 1));
+    assert(tBitMapNumWords(pSnap) == (1 << 12));
+    tBitMapFree(pSnap);
+
+    serialRoundTrip(p);
+    rt = tBitMapFlatten(p);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapUnflatten(p);
+    assert(rt == TBITMAP_SUCCESS);
+    assert((tBitMapNumL1(p) == 0) && (tBitMapNumL2(p) == 0));
+    assert(tBitMapNumWords(p) == (1 << 12) - (1 << 8));
+    rt = tBitMapResetBlock(p, 0, p->maxPos);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(tBitMapNumWords(p) == 0);
+
+    rt = tBitMapFree(p);
+    assert(rt == TBITMAP_SUCCESS);
+
+    return rt;
+}
+
+/*
+ * Frozen bitmaps: freeze, write to a file, mmap() it and compare
+ * with the live bitmap.
+ */
+static int
+frozenCheckMap (tBitMap* p)
+{
+    void*          pBuf;
+    u64            size;
+    u64            nBits;
+    u32            i;
+    u32            next;
+    int            fd;
+    int            rt;
+    char           path[] = "/tmp/tbitmap-frozen-XXXXXX";
+    tBitMapFrozen* pF;
+
+    rt = tBitMapFreeze(p, &pBuf, &size);
+    assert(rt == TBITMAP_SUCCESS);
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, pBuf, size) == size);
+    close(fd);
+    pF = tBitMapOpenMapped(path);
+    unlink(path);
+    assert(pF);
+    assert(tBitMapFrozenMaxPos(pF) == p->maxPos);
+
+    nBits = 0;
+    next  = 0;
+    for (i = 0; i <= p->maxPos; ++i) {
+        assert(tBitMapFrozenIsSet(pF, i) == tBitMapIsSet(p, i));
+        if (tBitMapIsSet(p, i)) {
+            ++nBits;
+            assert(tBitMapFrozenFindNext(pF, &next) && (next == i));
+            ++next;
+        }
+    }
+    assert((next > p->maxPos) || !tBitMapFrozenFindNext(pF, &next));
+    assert(tBitMapFrozenCount(pF) == nBits);
+    tBitMapCloseFrozen(pF);
+
+    pF = tBitMapOpenFrozen(pBuf, size - 4);
+    assert(pF == NULL);
+    ((u32*)pBuf)[0] ^= 1;
+    pF = tBitMapOpenFrozen(pBuf, size);
+    assert(pF == NULL);
+    ((u32*)pBuf)[0] ^= 1;
+
+    /*
+     * maxPos (the 4th u32 of the header) must match the stride
+     * lengths, or tBitMapFrozenIsSet() would read past the L0 node.
+     */
+    ((u32*)pBuf)[3] = 2 * p->maxPos + 1;
+    pF = tBitMapOpenFrozen(pBuf, size);
+    assert(pF == NULL);
+    ((u32*)pBuf)[3] = p->maxPos - 1;
+    pF = tBitMapOpenFrozen(pBuf, size);
+    assert(pF == NULL);
+    ((u32*)pBuf)[3] = p->maxPos;
+    pF = tBitMapOpenFrozen(pBuf, size);
+    assert(pF);
+    tBitMapCloseFrozen(pF);
+    free(pBuf);
+
+    return TBITMAP_SUCCESS;
+}
+
+int
+frozenTest (void)
+{
+    tBitMap* p;
+    u32      i;
+    int      rt;
+
+    p = tBitMapAlloc((1 << 22) - 1);
+    assert(p);
+    for (i = 0; i < elementsOf(Fib); ++i) {
+        if (Fib[i] <= p->maxPos) {
+            tBitMapSet(p, Fib[i]);
+        }
+    }
+    for (i = 1 << 20; i < (1 << 20) + 50000; i += 7) {
+        tBitMapSet(p, i);
+    }
+    tBitMapSetBlock(p, (3 << 20) + 5, (3 << 20) + 100000);
+    tBitMapSet(p, p->maxPos);
+    rt = frozenCheckMap(p);
+    tBitMapFree(p);
+    if (rt != TBITMAP_SUCCESS) {
+        return rt;
+    }
+
+    p = tBitMapAlloc(5000);
+    assert(p && (p->flags & TBITMAP_IS_FLAT));
+    tBitMapSetBlock(p, 100, 2000);
+    tBitMapSet(p, 4999);
+    rt = frozenCheckMap(p);
+    tBitMapFree(p);
+
+    return rt;
+}
+
+/*
+ * Shared memory bitmap: NPROCS child processes attach to the region
+ * and set the bits (i % NPROCS) == id in [0, CONC_RANGE), reset
+ * [base + 100, base + 9999] and set [base + 10000, base + 16383]
+ * of the preset range starting at base = CONC_RANGE + (j << 14),
+ * and then reset the bits (i % 64) == id.
+ */
+enum {
+    NPROCS    = 4,
+    SHM_SIZE  = 16 << 20,
+};
+
+static int
+shmWorker (void* pRegion, u32 id)
+{
+    tBitMapShm* pS;
+    u32         i;
+    u32         base;
+    int         rt;
+
+    pS = tBitMapShmAttach(pRegion, SHM_SIZE);
+    if (!pS) {
+        return TBITMAP_ERR;
+    }
+    for (i = id; i < CONC_RANGE; i += NPROCS) {
+        rt = tBitMapShmSet(pS, i);
+        if (rt != TBITMAP_SUCCESS) {
+            return rt;
+        }
+        if ((i & 0xfff) == id) {
+            base = CONC_RANGE + ((i >> 12) << 14);
+            rt = tBitMapShmSetResetBlock(pS, base + 100, base + 9999, FALSE);
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+            rt = tBitMapShmSetResetBlock(pS, base + 10000, base + 16383,
+                                         TRUE);
+            if (rt != TBITMAP_SUCCESS) {
+                return rt;
+            }
+        }
+    }
+    for (i = id; i < CONC_RANGE; i += 64) {
+        rt = tBitMapShmReset(pS, i);
+        if (rt != TBITMAP_SUCCESS) {
+            return rt;
+        }
+    }
+    tBitMapShmDetach(pS);
+    return TBITMAP_SUCCESS;
+}
+
+int
+shmTest (void)
+{
+    tBitMapShm* pS;
+    void*       pRegion;
+    pid_t       pid[NPROCS];
+    u32         i;
+    u32         off;
+    u32         num;
+    int         status;
+    int         rt;
+
+    pRegion = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(pRegion != MAP_FAILED);
+    assert(tBitMapShmAttach(pRegion, SHM_SIZE) == NULL);
+    rt = tBitMapShmFormat(pRegion, SHM_SIZE, 1 << 30);
+    assert(rt == TBITMAP_EBITPOS);
+    rt = tBitMapShmFormat(pRegion, SHM_SIZE, 8 * CONC_RANGE - 1);
+    assert(rt == TBITMAP_SUCCESS);
+    pS = tBitMapShmAttach(pRegion, SHM_SIZE);
+    assert(pS);
+    assert(tBitMapShmMaxPos(pS) == 8 * CONC_RANGE - 1);
+    rt = tBitMapShmSetResetBlock(pS, CONC_RANGE, 5 * CONC_RANGE - 1, TRUE);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(tBitMapShmNumWords(pS) == (4 * CONC_RANGE) >> 5);
+    assert(tBitMapShmNumL2(pS) == 0);
+
+    for (i = 0; i < NPROCS; ++i) {
+        pid[i] = fork();
+        assert(pid[i] >= 0);
+        if (pid[i] == 0) {
+            _exit((shmWorker(pRegion, i) == TBITMAP_SUCCESS) ? 0 : 1);
+        }
+    }
+    for (i = 0; i < NPROCS; ++i) {
+        waitpid(pid[i], &status, 0);
+        assert(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+    }
+
+    num = 0;
+    for (i = 0; i < CONC_RANGE; ++i) {
+        assert(tBitMapShmIsSet(pS, i) == ((i % 64) >= NPROCS));
+    }
+    for (i = CONC_RANGE; i < 6 * CONC_RANGE; ++i) {
+        off = (i - CONC_RANGE) & 0x3fff;
+        assert(tBitMapShmIsSet(pS, i) ==
+               ((i < 5 * CONC_RANGE) && ((off < 100) || (off > 9999))));
+    }
+    for (i = 0; i < 6 * CONC_RANGE; i += 32) {
+        for (off = 0; (off < 32) && !tBitMapShmIsSet(pS, i + off); ++off) {
+            ;
+        }
+        num += (off < 32);
+    }
+    assert(tBitMapShmNumWords(pS) == num);
+
+    /*
+     * Reset everything: compaction releases all the nodes,
+     * which are then reused.
+     */
+    rt = tBitMapShmSetResetBlock(pS, 0, 8 * CONC_RANGE - 1, FALSE);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(tBitMapShmNumWords(pS) == 0);
+    assert(tBitMapShmNumL2(pS) > 0);
+    rt = tBitMapShmCompact(pS);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(tBitMapShmNumL1(pS) == 0);
+    assert(tBitMapShmNumL2(pS) == 0);
+    for (i = 0; i < 8 * CONC_RANGE; i += 37) {
+        rt = tBitMapShmSet(pS, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    for (i = 0; i < 8 * CONC_RANGE; ++i) {
+        assert(tBitMapShmIsSet(pS, i) == ((i % 37) == 0));
+    }
+    tBitMapShmDetach(pS);
+    munmap(pRegion, SHM_SIZE);
+
+    /*
+     * Region too small for all the L2 nodes
+     */
+    pRegion = mmap(NULL, 1 << 16, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(pRegion != MAP_FAILED);
+    rt = tBitMapShmFormat(pRegion, 1 << 16, (1 << 20) - 1);
+    assert(rt == TBITMAP_SUCCESS);
+    pS = tBitMapShmAttach(pRegion, 1 << 16);
+    assert(pS);
+    rt = tBitMapShmSetResetBlock(pS, 0, (1 << 20) - 1, TRUE);
+    assert(rt == TBITMAP_SUCCESS);
+    for (i = 0; i < (1 << 20); i += 2) {
+        rt = tBitMapShmReset(pS, i);
+        if (rt != TBITMAP_SUCCESS) {
+            break;
+        }
+    }
+    assert(rt == TBITMAP_ENOMEM);
+    assert(!tBitMapShmIsSet(pS, 0) && tBitMapShmIsSet(pS, 1));
+    assert(tBitMapShmIsSet(pS, (1 << 20) - 2));
+    tBitMapShmDetach(pS);
+    munmap(pRegion, 1 << 16);
+
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Journal and checkpoints: serialize a bitmap, update it while
+ * journaling and taking a checkpoint, and recover it from the
+ * serialization, the checkpoint and the journal whose last record
+ * is torn. Then replay a journal with tBitMapSetAll() and
+ * tBitMapResetAll() in it.
+ */
+static void
+journalCompare (tBitMap* p, tBitMap* pRef)
+{
+    u32 i;
+
+    assert(tBitMapNumWords(p) == tBitMapNumWords(pRef));
+    for (i = 0; i <= pRef->maxPos; ++i) {
+        assert(tBitMapIsSet(p, i) == tBitMapIsSet(pRef, i));
+    }
+}
+
+int
+journalTest (void)
+{
+    tBitMap*  p;
+    tBitMap*  pNew;
+    tBitMap*  pRef;
+    serialBuf base, cp, jr;
+    u32       i;
+    int       rt;
+
+    memset(&base, 0, sizeof(base));
+    memset(&cp, 0, sizeof(cp));
+    memset(&jr, 0, sizeof(jr));
+    p = tBitMapAlloc((1 << 22) - 1);
+    assert(p);
+    for (i = 0; i < (1 << 22); i += 97) {
+        tBitMapSet(p, i);
+    }
+    tBitMapSetBlock(p, 3 << 20, (3 << 20) + 100000);
+    rt = tBitMapSerialize(p, serialWrite, &base);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapTrackDirty(p, TRUE);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapSetJournal(p, serialWrite, &jr);
+    assert(rt == TBITMAP_SUCCESS);
+
+    /*
+     * Updates before the checkpoint: bits, a block emptying
+     * L2 nodes and one filling them
+     */
+    for (i = 5; i < (1 << 22); i += 65536) {
+        rt = tBitMapSet(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    rt = tBitMapResetBlock(p, 1 << 20, (1 << 20) + 20000);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapSetBlock(p, (2 << 20) + 3, (2 << 20) + 4000);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapCheckpoint(p, serialWrite, &cp);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(cp.len < base.len / 10);
+
+    /*
+     * Updates after the checkpoint. The last one is lost.
+     */
+    for (i = 0; i < (1 << 22); i += 97 * 1024) {
+        rt = tBitMapReset(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    rt = tBitMapResetBlock(p, (3 << 20) + 50, (3 << 20) + 60);
+    assert(rt == TBITMAP_SUCCESS);
+    pRef = tBitMapSnapshot(p);
+    assert(pRef);
+    rt = tBitMapSetBlock(p, 0, 1000);
+    assert(rt == TBITMAP_SUCCESS);
+    jr.len -= 2;
+
+    rt = tBitMapDeserialize(&pNew, serialRead, &cp);
+    assert(rt == TBITMAP_ERR);
+    cp.pos = 0;
+    rt = tBitMapDeserialize(&pNew, serialRead, &base);
+    assert(rt == TBITMAP_SUCCESS);
+    base.pos = 0;
+    rt = tBitMapApplyCheckpoint(pNew, serialRead, &base);
+    assert(rt == TBITMAP_ERR);
+    rt = tBitMapApplyCheckpoint(pNew, serialRead, &cp);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(cp.pos == cp.len);
+    rt = tBitMapReplay(pNew, jr.buf, jr.len);
+    assert(rt == TBITMAP_SUCCESS);
+    journalCompare(pNew, pRef);
+
+    rt = tBitMapSetJournal(pRef, serialWrite, &jr);
+    assert(rt == TBITMAP_ERR);
+    tBitMapFree(pRef);
+    tBitMapFree(pNew);
+    tBitMapFree(p);
+
+    /*
+     * Replaying tBitMapSetAll() and tBitMapResetAll() rebuilds
+     * the same trie
+     */
+    jr.len = 0;
+    p    = tBitMapAlloc((1 << 22) - 1);
+    pNew = tBitMapAlloc((1 << 22) - 1);
+    assert(p && pNew);
+    rt = tBitMapSetJournal(p, serialWrite, &jr);
+    assert(rt == TBITMAP_SUCCESS);
+    tBitMapSet(p, 12345);
+    rt = tBitMapSetAll(p);
+    assert(rt == TBITMAP_SUCCESS);
+    tBitMapReset(p, 5);
+    tBitMapResetBlock(p, 1 << 20, (1 << 21) - 1);
+    rt = tBitMapReplay(pNew, jr.buf, jr.len);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(!tBitMapIsSet(p, 5) && tBitMapIsSet(p, 6));
+    journalCompare(pNew, p);
+    rt = tBitMapResetAll(p);
+    assert(rt == TBITMAP_SUCCESS);
+    tBitMapSet(p, 77);
+    rt = tBitMapReplay(pNew, jr.buf, jr.len);
+    assert(rt == TBITMAP_SUCCESS);
+    journalCompare(pNew, p);
+    tBitMapFree(pNew);
+    tBitMapFree(p);
+
+    free(base.buf);
+    free(cp.buf);
+    free(jr.buf);
+
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Diff: apply the ranges reported by tBitMapDiff() to another
+ * bitmap and compare.
+ */
+typedef struct diffState_ {
+    tBitMap* p;                 /* bitmap to apply the ranges to */
+    u32      n;                 /* number of ranges */
+    u32      end;               /* end of the last range */
+    bool     isSet;             /* type of the last range */
+} diffState;
+
+static int
+diffApply (void* pArg, u32 start, u32 end, bool isSet)
+{
+    diffState* ds = pArg;
+
+    assert(start <= end);
+    if (ds->n > 0) {
+        assert(start > ds->end);
+        assert((start > ds->end + 1) || (isSet != ds->isSet));
+    }
+    ++ds->n;
+    ds->end   = end;
+    ds->isSet = isSet;
+    return tBitMapSetResetBlock(ds->p, start, end, isSet);
+}
+
+static void
+diffCheck (tBitMap* pA, tBitMap* pB, tBitMap* pDst)
+{
+    diffState ds;
+    u32       i;
+    int       rt;
+
+    memset(&ds, 0, sizeof(ds));
+    ds.p = pDst;
+    rt = tBitMapDiff(pA, pB, diffApply, &ds);
+    assert(rt == TBITMAP_SUCCESS);
+    for (i = 0; i <= pB->maxPos; ++i) {
+        assert(tBitMapIsSet(pDst, i) == tBitMapIsSet(pB, i));
+    }
+    memset(&ds, 0, sizeof(ds));
+    ds.p = pDst;
+    rt = tBitMapDiff(pDst, pB, diffApply, &ds);
+    assert((rt == TBITMAP_SUCCESS) && (ds.n == 0));
+}
+
+int
+diffTest (void)
+{
+    tBitMap* p;
+    tBitMap* pSnap;
+    tBitMap* pEmpty;
+    tBitMap* pDst;
+    u32      i;
+
+    p = tBitMapAlloc((1 << 22) - 1);
+    pEmpty = tBitMapAlloc((1 << 22) - 1);
+    pDst = tBitMapAlloc((1 << 22) - 1);
+    assert(p && pEmpty && pDst);
+    for (i = 0; i < elementsOf(Fib); ++i) {
+        if (Fib[i] <= p->maxPos) {
+            tBitMapSet(p, Fib[i]);
+        }
+    }
+    for (i = 1 << 20; i < (1 << 20) + 50000; i += 7) {
+        tBitMapSet(p, i);
+    }
+    tBitMapSetBlock(p, 3 << 20, (3 << 20) + 100000);
+    pSnap = tBitMapSnapshot(p);
+    assert(pSnap);
+    diffCheck(pEmpty, pSnap, pDst);
+
+    tBitMapResetBlock(p, (3 << 20) + 5000, (3 << 20) + 5100);
+    tBitMapSetBlock(p, (1 << 20) + 10, (1 << 20) + 40000);
+    tBitMapSetBlock(p, 5 << 20, (5 << 20) + 70000);
+    for (i = 0; i < elementsOf(Fib); ++i) {
+        if (Fib[i] <= p->maxPos) {
+            tBitMapReset(p, Fib[i]);
+        }
+    }
+    tBitMapSet(p, p->maxPos);
+    diffCheck(pSnap, p, pDst);
+    diffCheck(p, pEmpty, pDst);
+    tBitMapFree(pSnap);
+    tBitMapFree(pDst);
+    tBitMapFree(pEmpty);
+
+    /*
+     * Flat bitmap against a trie of the same geometry
+     */
+    pSnap = tBitMapAlloc(5000);
+    pDst  = tBitMapAllocStrides(p->pTrie->len[0], p->pTrie->len[1],
+                                p->pTrie->len[2]);
+    assert(pSnap && pDst && (pSnap->flags & TBITMAP_IS_FLAT));
+    assert(tBitMapDiff(pSnap, p, diffApply, NULL) == TBITMAP_ERR);
+    tBitMapFree(pSnap);
+    pEmpty = tBitMapAllocStrides(p->pTrie->len[0], p->pTrie->len[1],
+                                 p->pTrie->len[2]);
+    assert(pEmpty && (tBitMapFlatten(pEmpty) == TBITMAP_SUCCESS));
+    tBitMapSetBlock(pEmpty, 1000, 300000);
+    tBitMapSetBlock(pDst, 1000, 300000);
+    assert(pEmpty->flags & TBITMAP_IS_FLAT);
+    diffCheck(pEmpty, p, pDst);
+    tBitMapFree(pEmpty);
+    tBitMapFree(pDst);
+    tBitMapFree(p);
+
+    return TBITMAP_SUCCESS;
+}
+
+/*
+ * Statistics: node counts and sizes against the trie's counters
+ */
+int
+statsTest (void)
+{
+    tBitMap*     p;
+    tBitMap*     pSnap;
+    tBitMapL2*   pl2;
+    tBitMapUsage st;
+    u32          i, n;
+    u32          shift;
+    int          rt;
+
+    p = tBitMapAlloc((1 << 22) - 1);
+    assert(p);
+    for (i = 0; i < elementsOf(Fib); ++i) {
+        if (Fib[i] <= p->maxPos) {
+            tBitMapSet(p, Fib[i]);
+        }
+    }
+    for (i = 1 << 20; i < (1 << 20) + 50000; i += 7) {
+        tBitMapSet(p, i);
+    }
+    shift = p->pTrie->len[2] + 5;
+    tBitMapSetBlock(p, 3 << 20, ((3 << 20) + (10 << shift)) - 1);
+    rt = tBitMapStats(p, &st);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(st.nL1 == tBitMapNumL1(p));
+    assert(st.nL2 == tBitMapNumL2(p));
+    assert(st.nWords == tBitMapNumWords(p));
+    assert(st.nFull == 10);
+    assert(st.nShared == 0);
+    for (i = n = 0; i < TBITMAP_FILL_BUCKETS; ++i) {
+        n += st.fill[i];
+    }
+    assert(n == st.nL2);
+    assert(st.fill[TBITMAP_FILL_BUCKETS - 1] > 0);
+    assert(st.nBytesL2 > st.nL2 * (1 << (shift - 3)));
+    assert(st.nBytesFlat == 0);
+    assert(st.nBytes ==
+           st.nBytesMap + st.nBytesL1 + st.nBytesL2 + st.nBytesFlat);
+    assert(st.nBytesWasted < st.nBytes);
+
+    pSnap = tBitMapSnapshot(p);
+    assert(pSnap);
+    rt = tBitMapStats(p, &st);
+    assert((rt == TBITMAP_SUCCESS) && (st.nShared == st.nL1));
+    tBitMapFree(pSnap);
+    tBitMapFree(p);
+
+    /*
+     * An empty L2 node (as a racing concurrent update can leave)
+     * is in no bucket
+     */
+    p = tBitMapAllocStrides(4, 4, 3);
+    assert(p && (tBitMapKeepTrie(p, TRUE) == TBITMAP_SUCCESS));
+    tBitMapSet(p, 0);
+    tBitMapSet(p, 300);
+    pl2 = (tBitMapL2*)p->pTrie->l0[0]->l1[0];
+    pl2->bitmap[0] = 0;
+    pl2->cnt = 0;
+    rt = tBitMapStats(p, &st);
+    assert((rt == TBITMAP_SUCCESS) && (st.nL2 == 2));
+    for (i = n = 0; i < TBITMAP_FILL_BUCKETS; ++i) {
+        n += st.fill[i];
+    }
+    assert((n == 1) && (st.fill[0] == 1));
+    tBitMapFree(p);
+
+    p = tBitMapAlloc(5000);
+    assert(p && (p->flags & TBITMAP_IS_FLAT));
+    tBitMapSetBlock(p, 0, 999);
+    rt = tBitMapStats(p, &st);
+    assert(rt == TBITMAP_SUCCESS);
+    assert((st.nL1 == 0) && (st.nL2 == 0));
+    assert(st.nBytesFlat == ((p->maxPos >> 5) + 1) * sizeof(u32));
+    assert(st.nWords == (1000 + 31) >> 5);
+    tBitMapFree(p);
+
+    return TBITMAP_SUCCESS;
+}
+
+#ifdef TBITMAP_STATS
+/*
+ * Counters: fill an L2 node bit by bit until it is compressed,
+ * then decompress it and empty it.
+ */
+int
+countersTest (void)
+{
+    tBitMap*        p;
+    tBitMapCounters c;
+    u32             i, n;
+    u32             nBits;
+    int             rt;
+
+    p = tBitMapAlloc((1 << 22) - 1);
+    assert(p);
+    nBits = 1 << (p->pTrie->len[2] + 5);
+    for (i = 0; i < nBits; ++i) {
+        rt = tBitMapSet(p, i);
+        assert(rt == TBITMAP_SUCCESS);
+    }
+    assert(tBitMapIsSet(p, 0));
+    rt = tBitMapReset(p, 0);
+    assert(rt == TBITMAP_SUCCESS);
+    rt = tBitMapResetBlock(p, 1, nBits - 1);
+    assert(rt == TBITMAP_SUCCESS);
+
+    tBitMapGetCounters(p, &c);
+    assert((c.nSet == nBits) && (c.nReset == 1) && (c.nBlock == 1));
+    assert(c.nLookup == 1);
+    assert((c.nAllocL1 == 1) && (c.nFreeL1 == 1));
+    assert((c.nAllocL2 == 2) && (c.nFreeL2 == 2));
+    assert((c.nCompress == 1) && (c.nDecompress == 1));
+    assert(c.nENOMEM == 0);
+#ifdef TBITMAP_STATS_LATENCY
+    for (i = n = 0; i < TBITMAP_HIST_BUCKETS; ++i) {
+        n += c.hist[TBITMAP_API_SETRESET][i];
+    }
+    assert(n == nBits + 1);
+#endif
+    tBitMapClearCounters(p);
+    tBitMapGetCounters(p, &c);
+    assert((c.nSet == 0) && (c.hist[TBITMAP_API_ISSET][0] == 0));
+    (void)n;
+    tBitMapFree(p);
+
+    return TBITMAP_SUCCESS;
+}
+#endif
+
+/*
+ * Trace: trace the calls on a few bitmaps, replay the trace into
+ * new bitmaps and compare them.
+ */
+static int
+traceWrite (void* pArg, const void* pBuf, u32 len)
+{
+    serialBuf* sb = pArg;
+
+    assert(len <= TBITMAP_TRACE_BUFSIZE);
+    if (sb->len + len > sb->size) {
+        sb->size = 2 * (sb->len + len);
+        sb->buf  = realloc(sb->buf, sb->size);
+        assert(sb->buf);
+    }
+    memcpy(sb->buf + sb->len, pBuf, len);
+    sb->len += len;
+    return TBITMAP_SUCCESS;
+}
+
+#ifdef TBITMAP_TRACE
+static int
+traceCountDiff (void* pArg, u32 start, u32 end, bool isSet)
+{
+    ++*(u32*)pArg;
+    return TBITMAP_SUCCESS;
+}
+#endif
+
+int
+traceTest (void)
+{
+#ifdef TBITMAP_TRACE
+    serialBuf       sb;
+    tBitMapTraceRec rec;
+    tBitMap*        p[2];
+    tBitMap*        pNew[4];
+    tBitMap*        pTmp;
+    u64             off, ns;
+    u32             i, n, nFree, nDiff;
+    int             rt;
+
+    p[0] = tBitMapAlloc((1 << 20) - 1);
+    p[1] = tBitMapAlloc(5000);  /* flat */
+    assert(p[0] && p[1]);
+    tBitMapSet(p[0], 7);        /* not in the trace */
+
+    memset(&sb, 0, sizeof(sb));
+    rt = tBitMapTraceStart(traceWrite, &sb);
+    assert(rt == TBITMAP_SUCCESS);
+    assert(tBitMapTraceStart(traceWrite, &sb) == TBITMAP_ERR);
+    for (i = 0; i < 20000; ++i) {    /* more than a buffer */
+        tBitMapSet(p[0], (i * 2654435761U) & p[0]->maxPos);
+    }
+    tBitMapSetBlock(p[0], 1000, 70000);
+    tBitMapResetBlock(p[0], 2000, 3000);
+    tBitMapReset(p[0], 1000);
+    assert(tBitMapIsSet(p[0], 1001) && !tBitMapIsSet(p[0], 1000));
+    tBitMapResetAll(p[1]);
+    tBitMapSetBlock(p[1], 0, p[1]->maxPos);
+    tBitMapReset(p[1], 17);
+    assert(tBitMapSet(p[1], p[1]->maxPos + 1) == TBITMAP_EINDEX);
+    pTmp = tBitMapAlloc((1 << 16) - 1);
+    assert(pTmp);
+    tBitMapSet(pTmp, 3);
+    tBitMapFree(pTmp);
+    rt = tBitMapTraceStop();
+    assert(rt == TBITMAP_SUCCESS);
+    assert(tBitMapTraceStop() == TBITMAP_ERR);
+    tBitMapSet(p[0], 8);        /* not in the trace */
+    tBitMapReset(p[0], 8);
+
+    /*
+     * Replay
+     */
+    memset(pNew, 0, sizeof(pNew));
+    off = ns = 0;
+    n = nFree = 0;
+    while (tBitMapTraceNext(sb.buf, sb.len, &off, &rec)) {
+        assert((rec.id >= 1) && (rec.id <= 3) && (rec.ns >= ns));
+        ns = rec.ns;
+        ++n;
+        switch (rec.op) {
+        case TBITMAP_TRACE_NEW:
+            assert(!pNew[rec.id]);
+            pNew[rec.id] = tBitMapAllocStrides(rec.b & 0xff,
+                                               (rec.b >> 8) & 0xff,
+                                               (rec.b >> 16) & 0xff);
+            assert(pNew[rec.id]);
+            break;
+        case TBITMAP_TRACE_FREE:
+            tBitMapFree(pNew[rec.id]);
+            pNew[rec.id] = NULL;
+            ++nFree;
+            break;
+        case TBITMAP_TRACE_ISSET:
+            assert(tBitMapIsSet(pNew[rec.id], rec.a) == rec.result);
+            break;
+        case TBITMAP_TRACE_SET:
+        case TBITMAP_TRACE_RESET:
+            rt = tBitMapSetReset(pNew[rec.id], rec.a,
+                                 rec.op == TBITMAP_TRACE_SET);
+            assert((rt == TBITMAP_SUCCESS) == rec.result);
+            break;
+        case TBITMAP_TRACE_SET_BLOCK:
+        case TBITMAP_TRACE_RESET_BLOCK:
+            rt = tBitMapSetResetBlock(pNew[rec.id], rec.a, rec.b,
+                                      rec.op == TBITMAP_TRACE_SET_BLOCK);
+            assert((rt == TBITMAP_SUCCESS) == rec.result);
+            break;
+        default:
+            rt = tBitMapSetResetAll(pNew[rec.id],
+                                    rec.op == TBITMAP_TRACE_SET_ALL);
+            assert((rt == TBITMAP_SUCCESS) == rec.result);
+            break;
+        }
+    }
+    assert(off == sb.len);
+    assert(n == 1 + 20000 + 3 + 2 + 5 + 3);
+    assert((nFree == 1) && !pNew[3]);
+
+    tBitMapReset(p[0], 7);
+    nDiff = 0;
+    tBitMapDiff(p[0], pNew[1], traceCountDiff, &nDiff);
+    assert(nDiff == 0);
+    tBitMapUnflatten(p[1]);
+    tBitMapDiff(p[1], pNew[2], traceCountDiff, &nDiff);
+    assert(nDiff == 0);
+
+    /*
+     * Truncated and broken traces
+     */
+    off = n = 0;
+    while (tBitMapTraceNext(sb.buf, sb.len - 1, &off, &rec)) {
+        ++n;
+    }
+    assert((n == 1 + 20000 + 3 + 2 + 5 + 2) && (off < sb.len - 1));
+    off = 0;
+    sb.buf[0] ^= 1;
+    assert(!tBitMapTraceNext(sb.buf, sb.len, &off, &rec) && (off == 0));
+
+    free(sb.buf);
+    tBitMapFree(p[0]);
+    tBitMapFree(p[1]);
+    tBitMapFree(pNew[1]);
+    tBitMapFree(pNew[2]);
+#else
+    assert(tBitMapTraceStart(traceWrite, NULL) == TBITMAP_ERR);
+    assert(tBitMapTraceStop() == TBITMAP_ERR);
+#endif
+
+    return TBITMAP_SUCCESS;
+}
+
+
+int
+main (int argc, char* argv[])
+{
+    int rt;
+
+    rt = setResetTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: singleSetResetTest()\n", rt);
+    }
+    rt = overlapBlockTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: overlapBlockTest()\n", rt);
+    }
+    rt = randomBlockTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: randomBlockTest()\n", rt);
+    }
+    rt = flatTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: flatTest()\n", rt);
+    }
+    rt = setAllTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: setAllTest()\n", rt);
+    }
+    rt = concurrentTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: concurrentTest()\n", rt);
+    }
+    rt = stripedTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: stripedTest()\n", rt);
+    }
+    rt = snapshotTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: snapshotTest()\n", rt);
+    }
+    rt = serialTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: serialTest()\n", rt);
+    }
+    rt = fullL1Test();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: fullL1Test()\n", rt);
+    }
+    rt = frozenTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: frozenTest()\n", rt);
+    }
+    rt = shmTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: shmTest()\n", rt);
+    }
+    rt = journalTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: journalTest()\n", rt);
+    }
+    rt = diffTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: diffTest()\n", rt);
+    }
+    rt = statsTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: statsTest()\n", rt);
+    }
+#ifdef TBITMAP_STATS
+    rt = countersTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: countersTest()\n", rt);
+    }
+#endif
+    rt = traceTest();
+    if (rt != TBITMAP_SUCCESS) {
+        printf("Error: %d: traceTest()\n", rt);
     }
     exit(0);
     return 0;